@@ -32,6 +32,8 @@
 #include "quazaaglobals.h"
 
 #include <QDir>
+#include <QtEndian>
+#include <QElapsedTimer>
 
 #include "hostcache.h"
 
@@ -47,10 +49,8 @@ CHostCache::CHostCache():
 
 CHostCache::~CHostCache()
 {
-	while( !m_lHosts.isEmpty() )
-	{
-		delete m_lHosts.takeFirst();
-	}
+	m_oWriter.wait();
+	qDeleteAll( m_lHosts );
 }
 
 CHostCacheHost* CHostCache::add(CEndPoint host, const QDateTime& ts)
@@ -83,7 +83,7 @@ CHostCacheHost* CHostCache::add(CEndPoint host, quint32 tTimeStamp)
 		int nMax = m_nMaxCacheHosts / 2;
 		while ( m_lHosts.size() > nMax )
 		{
-			delete m_lHosts.takeLast();
+			removeOldest();
 		}
 
 		save( tNow );
@@ -96,37 +96,122 @@ CHostCacheHost* CHostCache::add(CEndPoint host, quint32 tTimeStamp)
 		tTimeStamp = tNow - 60 ;
 	}
 
-	CHostCacheIterator itPrev = find( host );
+	CHostCacheHost* pPrev = m_lByAddress.value( host );
 
-	if ( itPrev != m_lHosts.end() )
+	if ( pPrev )
 	{
-		return update( itPrev, tTimeStamp );
+		return update( pPrev->m_itTimestamp, tTimeStamp );
 	}
 
-	CHostCacheHost* pNew = new CHostCacheHost( host, tTimeStamp );
+	return insert( host, tTimeStamp );
+}
 
-	CHostCacheIterator it = qLowerBound( m_lHosts.begin(), m_lHosts.end(),
-										 pNew, qLess<CHostCacheHost*>() );
-	m_lHosts.insert( it, pNew );
+/**
+  * Adds a host known not to be in the cache yet, without any checks.
+  * Requires Locking: RW
+  */
+CHostCacheHost* CHostCache::insert(const CEndPoint& oHost, quint32 tTimeStamp, quint32 nFailures,
+								   quint32 tLastConnect)
+{
+	CHostCacheHost* pNew = new CHostCacheHost( oHost, tTimeStamp );
+	pNew->m_nFailures    = nFailures;
+	pNew->m_tLastConnect = tLastConnect;
+	pNew->m_sCountry     = geoIP.findCountryCode( oHost );
+
+	m_lByAddress.insert( oHost, pNew );
+	link( pNew );
 
 	return pNew;
 }
 
 CHostCacheIterator CHostCache::find(CEndPoint oHost)
 {
-	for ( CHostCacheIterator it = m_lHosts.begin(); it != m_lHosts.end(); ++it )
+	CHostCacheHost* pHost = m_lByAddress.value( oHost );
+	return pHost ? pHost->m_itTimestamp : m_lHosts.end();
+}
+
+CHostCacheIterator CHostCache::find(CHostCacheHost *pHost)
+{
+	if ( pHost && m_lByAddress.value( pHost->m_oAddress ) == pHost )
+		return pHost->m_itTimestamp;
+
+	return m_lHosts.end();
+}
+
+/**
+  * Inserts pHost into the timestamp index and into the waiting list of its failure bucket,
+  * promote() moves it on once its connect throttle has passed.
+  * Requires Locking: RW
+  */
+void CHostCache::link(CHostCacheHost* pHost)
+{
+	Q_ASSERT( pHost->m_nFailures <= (quint32)qMax( quazaaSettings.Connection.FailureLimit, 0 ) );
+
+	if ( (quint32)m_lFailures.size() <= pHost->m_nFailures )
 	{
-		if ( (*it)->m_oAddress == oHost )
-			return it;
+		m_lFailures.resize( pHost->m_nFailures + 1 );
 	}
 
-	return m_lHosts.end();
+	quint32 tConnectable = 0;
+	if ( pHost->m_tLastConnect )
+	{
+		tConnectable = pHost->m_tLastConnect + quazaaSettings.Gnutella.ConnectThrottle +
+					   pHost->m_nFailures * quazaaSettings.Connection.FailurePenalty + 1;
+	}
+
+	pHost->m_itTimestamp = m_lHosts.insertMulti( ~pHost->m_tTimestamp, pHost );
+	pHost->m_itFailures  = m_lFailures[pHost->m_nFailures].lWaiting.insertMulti( tConnectable, pHost );
+	pHost->m_bReady      = false;
 }
 
-CHostCacheIterator CHostCache::find(CHostCacheHost *pHost)
+/**
+  * Removes pHost from the timestamp and failure indexes, the address index is left alone.
+  * Requires Locking: RW
+  */
+void CHostCache::unlink(CHostCacheHost* pHost)
+{
+	CHostCacheBucket& oBucket = m_lFailures[pHost->m_nFailures];
+
+	m_lHosts.erase( pHost->m_itTimestamp );
+
+	if ( pHost->m_bReady )
+	{
+		oBucket.lReady.erase( pHost->m_itFailures );
+
+		QHash<QString, CHostCacheIndex>::iterator itCountry = oBucket.lCountries.find( pHost->m_sCountry );
+		itCountry->erase( pHost->m_itCountry );
+		if ( itCountry->isEmpty() )
+		{
+			oBucket.lCountries.erase( itCountry );
+		}
+	}
+	else
+	{
+		oBucket.lWaiting.erase( pHost->m_itFailures );
+	}
+}
+
+/**
+  * Moves the hosts whose connect throttle has passed from the waiting list to the ready indexes.
+  * Requires Locking: RW
+  */
+void CHostCache::promote(CHostCacheBucket& oBucket, const quint32 tNow)
 {
-	CHostCacheIterator it = qFind( m_lHosts.begin(), m_lHosts.end(), pHost );
-	return it;
+	while ( !oBucket.lWaiting.isEmpty() && oBucket.lWaiting.begin().key() <= tNow )
+	{
+		CHostCacheHost* pHost = *oBucket.lWaiting.begin();
+		oBucket.lWaiting.erase( oBucket.lWaiting.begin() );
+
+		pHost->m_itFailures = oBucket.lReady.insertMulti( ~pHost->m_tTimestamp, pHost );
+		pHost->m_itCountry  = oBucket.lCountries[pHost->m_sCountry].insertMulti( ~pHost->m_tTimestamp, pHost );
+		pHost->m_bReady     = true;
+	}
+}
+
+void CHostCache::removeOldest()
+{
+	CHostCacheIterator it = m_lHosts.end();
+	remove( *(--it) );
 }
 
 CHostCacheHost* CHostCache::update(CEndPoint oHost, const quint32 tTimeStamp)
@@ -152,9 +237,9 @@ CHostCacheHost* CHostCache::update(CHostCacheHost* pHost, const quint32 tTimeSta
 CHostCacheHost* CHostCache::update(CHostCacheIterator itHost, const quint32 tTimeStamp)
 {
 	CHostCacheHost* pHost = *itHost;
-	m_lHosts.erase( itHost );
+	unlink( pHost );
 	pHost->m_tTimestamp = tTimeStamp;
-	m_lHosts.prepend( pHost );
+	link( pHost );
 	return pHost;
 }
 
@@ -164,7 +249,8 @@ void CHostCache::remove(CHostCacheHost* pRemove)
 
 	if ( it != m_lHosts.end() )
 	{
-		m_lHosts.erase( it );
+		unlink( pRemove );
+		m_lByAddress.remove( pRemove->m_oAddress );
 	}
 
 	delete pRemove;
@@ -172,15 +258,52 @@ void CHostCache::remove(CHostCacheHost* pRemove)
 
 void CHostCache::remove(CEndPoint oHost)
 {
-	CHostCacheIterator it = find( oHost );
+	CHostCacheHost* pHost = m_lByAddress.take( oHost );
 
-	if ( it != m_lHosts.end() )
+	if ( pHost )
 	{
-		delete *it;
-		m_lHosts.erase( it );
+		unlink( pHost );
+		delete pHost;
 	}
 }
 
+/**
+  * Moves pHost to the failure bucket of nFailures, hosts not in the cache are just updated.
+  * Requires Locking: RW
+  */
+void CHostCache::setFailures(CHostCacheHost* pHost, quint32 nFailures)
+{
+	if ( pHost->m_nFailures == nFailures )
+		return;
+
+	if ( find( pHost ) == m_lHosts.end() )
+	{
+		pHost->m_nFailures = nFailures;
+		return;
+	}
+
+	unlink( pHost );
+	pHost->m_nFailures = nFailures;
+	link( pHost );
+}
+
+/**
+  * Records a connection attempt, the host is not connectable again until its throttle has passed.
+  * Requires Locking: RW
+  */
+void CHostCache::setLastConnect(CHostCacheHost* pHost, quint32 tLastConnect)
+{
+	if ( find( pHost ) == m_lHosts.end() )
+	{
+		pHost->m_tLastConnect = tLastConnect;
+		return;
+	}
+
+	unlink( pHost );
+	pHost->m_tLastConnect = tLastConnect;
+	link( pHost );
+}
+
 void CHostCache::addXTry(QString& sHeader)
 {
 	// X-Try-Hubs: 86.141.203.14:6346 2010-02-23T16:17Z,91.78.12.117:1164 2010-02-23T16:17Z,89.74.83
@@ -260,13 +383,17 @@ QString CHostCache::getXTry()
 
 void CHostCache::onFailure(CEndPoint addr)
 {
-	CHostCacheIterator itHost = find( addr );
+	CHostCacheHost* pHost = m_lByAddress.value( addr );
 
-	if ( itHost != m_lHosts.end() )
+	if ( pHost )
 	{
-		if ( (int)(++(*itHost)->m_nFailures) > quazaaSettings.Connection.FailureLimit )
+		if ( (int)(pHost->m_nFailures + 1) > quazaaSettings.Connection.FailureLimit )
+		{
+			remove( pHost );
+		}
+		else
 		{
-			remove( addr );
+			setFailures( pHost, pHost->m_nFailures + 1 );
 		}
 	}
 }
@@ -281,128 +408,232 @@ CHostCacheHost* CHostCache::get()
 	}
 
 	pHost = m_lHosts.first();
-	m_lHosts.removeFirst();
+	unlink( pHost );
+	m_lByAddress.remove( pHost->m_oAddress );
 
 	return pHost;
 }
 
-CHostCacheHost* CHostCache::getConnectable(const quint32 tNow, QList<CHostCacheHost*> oExcept,
-										   QString sCountry)
+CHostCacheHost* CHostCache::getConnectable(const quint32 tNow, const QSet<CHostCacheHost*>& oExcept,
+										   const QString& sCountry)
 {
-	// TODO: getConnectable should return things with m_tLastConnect either null or when "expired"
-
+	QList<CHostCacheHost*> lHosts;
+	return getConnectable( lHosts, 1, tNow, oExcept, sCountry ) ? lHosts.first() : NULL;
+}
 
-	bool bCountry = ( sCountry != "ZZ" );
+/**
+  * Appends up to nCount connectable hosts not in oExcept to lHosts and returns how many were
+  * found. Untested and working hosts come first, then the failed ones to increase the chances
+  * of a successful connection; newest first within each failure count.
+  * Requires Locking: RW
+  */
+int CHostCache::getConnectable(QList<CHostCacheHost*>& lHosts, int nCount, const quint32 tNow,
+							   const QSet<CHostCacheHost*>& oExcept, const QString& sCountry)
+{
+	const bool bCountry = ( sCountry != "ZZ" );
+	const int  nLimit   = qMin( quazaaSettings.Connection.FailureLimit, m_lFailures.size() );
+	int nFound = 0;
 
-	if ( m_lHosts.isEmpty() )
+	for ( int nFailures = 0; nFailures < nLimit && nFound < nCount; ++nFailures )
 	{
-		return NULL;
-	}
+		CHostCacheBucket& oBucket = m_lFailures[nFailures];
+		promote( oBucket, tNow );
 
-	// First try untested or working hosts, then fall back to failed hosts to increase chances for
-	// successful connection
-	for ( int nFailures = 0; nFailures < quazaaSettings.Connection.FailureLimit; ++nFailures )
-	{
-		foreach ( CHostCacheHost * pHost, m_lHosts )
+		const CHostCacheIndex* pIndex = &oBucket.lReady;
+
+		if ( bCountry )
 		{
-			if ( nFailures != pHost->m_nFailures )
+			QHash<QString, CHostCacheIndex>::const_iterator itCountry = oBucket.lCountries.constFind( sCountry );
+			if ( itCountry == oBucket.lCountries.constEnd() )
 				continue;
 
-			if ( bCountry && geoIP.findCountryCode(pHost->m_oAddress.toIPv4Address()) != sCountry )
-			{
-				continue;
-			}
+			pIndex = &*itCountry;
+		}
 
-			if ( tNow - pHost->m_tLastConnect > ( quazaaSettings.Gnutella.ConnectThrottle +
-												  pHost->m_nFailures * quazaaSettings.Connection.FailurePenalty ) )
+		for ( CHostCacheIndex::const_iterator it = pIndex->constBegin(); it != pIndex->constEnd() && nFound < nCount; ++it )
+		{
+			if ( !oExcept.contains( *it ) )
 			{
-				if ( !oExcept.contains( pHost ) )
-					return pHost;
+				lHosts.append( *it );
+				++nFound;
 			}
 		}
 	}
 
-	return NULL;
+	return nFound;
 }
 
+/**
+  * Hands a snapshot of the cache to the writer thread, the file is written without the lock.
+  * Requires Locking: R
+  */
 bool CHostCache::save(const quint32 tNow)
 {
 	ASSUME_LOCK( hostCache.m_pSection );
 
-	bool bReturn;
+	m_oWriter.write( snapshot(), m_sMessage );
+	m_tLastSave = tNow;
 
-	quint32 nCount = common::securedSaveFile( CQuazaaGlobals::DATA_PATH(), "hostcache.dat", m_sMessage,
-											   this, &CHostCache::writeToFile );
-	if ( nCount )
-	{
-		m_tLastSave = tNow;
-		bReturn = true;
+	return true;
+}
 
-		systemLog.postLog( LogSeverity::Debug,
-						   m_sMessage + QObject::tr( "Saved %1 hosts." ).arg( nCount ) );
-	}
-	else
+/**
+  * Blocks until the last snapshot handed to save() is on disk.
+  * Requires Locking: /
+  */
+void CHostCache::waitForSave()
+{
+	m_oWriter.wait();
+}
+
+/**
+  * Serializes the cache, newest hosts first, in the format read by load().
+  * Requires Locking: R
+  */
+QByteArray CHostCache::snapshot() const
+{
+	const quint32 nCount = m_lHosts.size();
+	QByteArray baSnapshot( sizeof(HostCacheFileHeader) + nCount * sizeof(HostCacheRecord), 0 );
+
+	HostCacheFileHeader* pHeader = (HostCacheFileHeader*)baSnapshot.data();
+	memcpy( pHeader->szMagic, "QHCS", 4 );
+	qToLittleEndian<quint16>( HOST_CACHE_CODE_VERSION, (uchar*)&pHeader->nVersion );
+	qToLittleEndian<quint16>( sizeof(HostCacheRecord), (uchar*)&pHeader->nRecordSize );
+	qToLittleEndian<quint32>( nCount, (uchar*)&pHeader->nCount );
+
+	HostCacheRecord* pRecord = (HostCacheRecord*)(pHeader + 1);
+
+	for ( CHostCacheIndex::const_iterator it = m_lHosts.constBegin(); it != m_lHosts.constEnd(); ++it, ++pRecord )
 	{
-		bReturn = false;
+		const CHostCacheHost* pHost = *it;
+
+		if ( pHost->m_oAddress.protocol() == QAbstractSocket::IPv4Protocol )
+		{
+			qToLittleEndian<quint32>( pHost->m_oAddress.toIPv4Address(), pRecord->pAddress );
+			pRecord->nProtocol = 4;
+		}
+		else
+		{
+			Q_IPV6ADDR oIPv6 = pHost->m_oAddress.toIPv6Address();
+			memcpy( pRecord->pAddress, &oIPv6, 16 );
+			pRecord->nProtocol = 6;
+		}
+
+		qToLittleEndian<quint16>( pHost->m_oAddress.port(), (uchar*)&pRecord->nPort );
+		qToLittleEndian<quint32>( pHost->m_nFailures,    (uchar*)&pRecord->nFailures );
+		qToLittleEndian<quint32>( pHost->m_tTimestamp,   (uchar*)&pRecord->tTimestamp );
+		qToLittleEndian<quint32>( pHost->m_tLastConnect, (uchar*)&pRecord->tLastConnect );
 	}
 
-	return bReturn;
+	return baSnapshot;
 }
 
+/**
+  * Loads the cache from a mapped snapshot in one pass: records are decoded, checked against the
+  * security rules as one batch and the newest m_nMaxCacheHosts are inserted.
+  * Requires Locking: RW
+  */
 void CHostCache::load()
 {
 	m_sMessage = QObject::tr( "[Host Cache] " );
 
 	ASSUME_LOCK( hostCache.m_pSection );
 
+	QElapsedTimer oTimer;
+	oTimer.start();
+
 	QFile file( CQuazaaGlobals::DATA_PATH() + "hostcache.dat" );
 
 	if ( !file.exists() || !file.open( QIODevice::ReadOnly ) )
 		return;
 
-	QDataStream oStream( &file );
+	qint64 nSize = file.size();
+	QByteArray baData;
+	const uchar* pData = nSize ? file.map( 0, nSize ) : NULL;
+
+	if ( !pData )
+	{
+		baData = file.readAll();
+		nSize  = baData.size();
+		baData.reserve( sizeof(HostCacheFileHeader) );
+		pData  = (const uchar*)baData.constData();
+	}
+
+	const HostCacheFileHeader* pHeader = (const HostCacheFileHeader*)pData;
+	quint32 nCount = 0;
 
-	quint16 nVersion;
-	quint32 nCount;
+	if ( nSize >= (qint64)sizeof(HostCacheFileHeader) && !memcmp( pHeader->szMagic, "QHCS", 4 ) &&
+		 qFromLittleEndian<quint16>( (const uchar*)&pHeader->nVersion ) == HOST_CACHE_CODE_VERSION &&
+		 qFromLittleEndian<quint16>( (const uchar*)&pHeader->nRecordSize ) == sizeof(HostCacheRecord) ) // else do load defaults
+	{
+		nCount = qMin<quint64>( qFromLittleEndian<quint32>( (const uchar*)&pHeader->nCount ),
+								( nSize - sizeof(HostCacheFileHeader) ) / sizeof(HostCacheRecord) );
+	}
 
-	oStream >> nVersion;
-	oStream >> nCount;
+	const quint32 tNow = common::getTNowUTC();
+	const HostCacheRecord* pRecords = (const HostCacheRecord*)(pHeader + 1);
 
-	const quint32 tNow   = common::getTNowUTC();
+	QVector<CEndPoint> lAddresses;
+	QVector<quint64>   lOrder;      // timestamp << 32 | index in lAddresses
+	QVector<quint32>   lRecord;     // record of each entry in lAddresses
+	lAddresses.reserve( nCount );
+	lOrder.reserve( nCount );
+	lRecord.reserve( nCount );
 
-	if ( nVersion == HOST_CACHE_CODE_VERSION ) // else do load defaults
+	for ( quint32 i = 0; i < nCount; ++i )
 	{
+		const HostCacheRecord* pRecord = pRecords + i;
+		const quint16 nPort = qFromLittleEndian<quint16>( (const uchar*)&pRecord->nPort );
 		CEndPoint oAddress;
-		quint32 nFailures    = 0;
-		quint32 tTimeStamp   = 0;
-		quint32 tLastConnect = 0;
 
-		CHostCacheHost* pHost = NULL;
-
-		while ( nCount )
+		if ( pRecord->nProtocol == 4 )
+		{
+			oAddress = CEndPoint( qFromLittleEndian<quint32>( pRecord->pAddress ), nPort );
+		}
+		else if ( pRecord->nProtocol == 6 )
 		{
-			oStream >> oAddress;
-			oStream >> nFailures;
+			oAddress = CEndPoint( (quint8*)pRecord->pAddress, nPort );
+		}
 
-			oStream >> tTimeStamp;
-			oStream >> tLastConnect;
+		if ( !oAddress.isValid() || oAddress.isFirewalled() )
+			continue;
 
-			if ( tTimeStamp - tNow > 0 )
-				tTimeStamp = tNow - 60;
+		// onFailure() would have dropped these, and the count indexes m_lFailures
+		if ( qFromLittleEndian<quint32>( (const uchar*)&pRecord->nFailures ) >=
+			 (quint32)qMax( quazaaSettings.Connection.FailureLimit, 0 ) )
+			continue;
 
-			pHost = add( oAddress, tTimeStamp );
-			if ( pHost )
-			{
-				if ( tLastConnect - tNow > 0 )
-					tLastConnect = tNow - 60;
+		quint32 tTimeStamp = qFromLittleEndian<quint32>( (const uchar*)&pRecord->tTimestamp );
+		if ( tTimeStamp > tNow )
+			tTimeStamp = tNow - 60;
 
-				pHost->m_nFailures    = nFailures;
-				pHost->m_tLastConnect = tLastConnect;
-			}
+		lOrder.append( ( quint64( tTimeStamp ) << 32 ) | lAddresses.size() );
+		lAddresses.append( oAddress );
+		lRecord.append( i );
+	}
 
-			--nCount;
-			pHost = NULL;
-		}
+	QBitArray oDenied;
+	securityManager.checkDenied( lAddresses, oDenied );
+
+	// Newest first, so duplicates and the cache limit keep the most recent entries
+	qSort( lOrder.begin(), lOrder.end(), qGreater<quint64>() );
+
+	for ( int i = 0; i < lOrder.size() && (quint32)m_lHosts.size() < m_nMaxCacheHosts; ++i )
+	{
+		const quint32 nIndex = (quint32)lOrder.at( i );
+		const CEndPoint& oAddress = lAddresses.at( nIndex );
+
+		if ( oDenied.testBit( nIndex ) || m_lByAddress.contains( oAddress ) )
+			continue;
+
+		const HostCacheRecord* pRecord = pRecords + lRecord.at( nIndex );
+
+		quint32 tLastConnect = qFromLittleEndian<quint32>( (const uchar*)&pRecord->tLastConnect );
+		if ( tLastConnect > tNow )
+			tLastConnect = tNow - 60;
+
+		insert( oAddress, lOrder.at( i ) >> 32,
+				qFromLittleEndian<quint32>( (const uchar*)&pRecord->nFailures ), tLastConnect );
 	}
 
 	file.close();
@@ -410,21 +641,16 @@ void CHostCache::load()
 	pruneOldHosts( tNow );
 
 	systemLog.postLog( LogSeverity::Debug,
-					   m_sMessage + QObject::tr( "Loaded %1 hosts." ).arg( m_lHosts.size() ) );
+					   m_sMessage + QObject::tr( "Loaded %1 hosts in %2 ms." ).arg( m_lHosts.size() ).arg( oTimer.elapsed() ) );
 }
 
 void CHostCache::pruneOldHosts(const quint32 tNow)
 {
-	QMutableListIterator<CHostCacheHost*> it( m_lHosts );
-	it.toBack();
-
-	while ( it.hasPrevious() )
+	while ( !m_lHosts.isEmpty() )
 	{
-		it.previous();
-		if ( (qint64)( tNow - it.value()->m_tTimestamp ) > quazaaSettings.Gnutella2.HostExpire )
+		if ( (qint64)( tNow - m_lHosts.last()->m_tTimestamp ) > quazaaSettings.Gnutella2.HostExpire )
 		{
-			delete it.value();
-			it.remove();
+			removeOldest();
 		}
 		else
 		{
@@ -439,8 +665,9 @@ void CHostCache::pruneByQueryAck(const quint32 tNow)
 	{
 		if ( (*it)->m_tAck && tNow - (*it)->m_tAck > quazaaSettings.Gnutella2.QueryHostDeadline )
 		{
-			delete *it;
-			it = m_lHosts.erase( it );
+			CHostCacheHost* pHost = *it;
+			++it;
+			remove( pHost );
 		}
 		else
 		{
@@ -449,32 +676,66 @@ void CHostCache::pruneByQueryAck(const quint32 tNow)
 	}
 }
 
-/**
-  * Helper method for save()
-  * Requires Locking: R
-  */
-quint32 CHostCache::writeToFile(const void * const pManager, QFile& oFile)
+CHostCacheWriter::CHostCacheWriter() :
+	m_bBusy( false )
 {
-	QDataStream oStream( &oFile );
-	CHostCache* pHostCache = (CHostCache*)pManager;
-
-	const quint16 nVersion = HOST_CACHE_CODE_VERSION;
-	const quint32 nCount   = (quint32)pHostCache->m_lHosts.size();
+}
 
-	oStream << nVersion;
-	oStream << nCount;
+void CHostCacheWriter::write(const QByteArray& baSnapshot, const QString& sMessage)
+{
+	m_pSection.lock();
+	m_baPending = baSnapshot;
+	m_sMessage  = sMessage;
+	const bool bStart = !m_bBusy;
+	m_bBusy = true;
+	m_pSection.unlock();
+
+	if ( bStart )
+	{
+		wait(); // the previous run may still be returning
+		start( QThread::LowPriority );
+	}
+}
 
-	if ( nCount )
+void CHostCacheWriter::run()
+{
+	forever
 	{
-		foreach ( CHostCacheHost* pHost, pHostCache->m_lHosts )
+		m_pSection.lock();
+		if ( m_baPending.isEmpty() )
 		{
-			oStream << pHost->m_oAddress;
-			oStream << pHost->m_nFailures;
-			oStream << pHost->m_tTimestamp;
-			oStream << pHost->m_tLastConnect;
+			m_bBusy = false;
+			m_pSection.unlock();
+			return;
+		}
+		m_baWriting = m_baPending;
+		m_baPending.clear();
+		const QString sMessage = m_sMessage;
+		m_pSection.unlock();
+
+		quint32 nCount = common::securedSaveFile( CQuazaaGlobals::DATA_PATH(), "hostcache.dat", sMessage,
+												   this, &CHostCacheWriter::writeToFile );
+		if ( nCount )
+		{
+			systemLog.postLog( LogSeverity::Debug,
+							   sMessage + QObject::tr( "Saved %1 hosts." ).arg( nCount ) );
 		}
-	}
 
-	return nCount;
+		m_baWriting.clear();
+	}
 }
 
+/**
+  * Helper method for run()
+  * Requires Locking: /
+  */
+quint32 CHostCacheWriter::writeToFile(const void * const pWriter, QFile& oFile)
+{
+	const QByteArray& baSnapshot = ((const CHostCacheWriter*)pWriter)->m_baWriting;
+
+	if ( oFile.write( baSnapshot ) != baSnapshot.size() )
+		return 0;
+
+	const HostCacheFileHeader* pHeader = (const HostCacheFileHeader*)baSnapshot.constData();
+	return qFromLittleEndian<quint32>( (const uchar*)&pHeader->nCount );
+}
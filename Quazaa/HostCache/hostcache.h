@@ -26,30 +26,92 @@
 #define HOSTCACHE_H
 
 #include <QMutex>
+#include <QHash>
+#include <QVector>
+#include <QThread>
+#include <QByteArray>
+#include <QSet>
 
 #include "hostcachehost.h"
 
 // Increment this if there have been made changes to the way of storing Host Cache Hosts.
-#define HOST_CACHE_CODE_VERSION	6
+#define HOST_CACHE_CODE_VERSION	7
 // History:
 // 4 - Initial implementation.
 // 6 - Fixed Hosts having an early date and changed time storage from QDateTime to quint32.
+// 7 - Fixed size little endian records that can be loaded straight from a mapped file.
 
 class QFile;
 
-typedef QList<CHostCacheHost*>::iterator CHostCacheIterator;
+#pragma pack(push, 1)
+
+struct HostCacheFileHeader
+{
+	char     szMagic[4];    // "QHCS"
+	quint16  nVersion;      // HOST_CACHE_CODE_VERSION
+	quint16  nRecordSize;   // sizeof(HostCacheRecord)
+	quint32  nCount;
+};
+
+struct HostCacheRecord
+{
+	quint8   pAddress[16];  // IPv4 addresses use the first 4 bytes
+	quint16  nPort;
+	quint8   nProtocol;     // 4 or 6
+	quint8   nReserved;
+	quint32  nFailures;
+	quint32  tTimestamp;
+	quint32  tLastConnect;
+};
+
+#pragma pack(pop)
+
+// Writes host cache snapshots on its own thread, so saving never holds the cache lock. Only the
+// newest snapshot handed over while a write is in progress is kept.
+class CHostCacheWriter : public QThread
+{
+protected:
+	QMutex      m_pSection;
+	QByteArray  m_baPending;
+	QByteArray  m_baWriting;
+	QString     m_sMessage;
+	bool        m_bBusy;
+
+public:
+	CHostCacheWriter();
+
+	void write(const QByteArray& baSnapshot, const QString& sMessage);
+
+protected:
+	void run();
+	static quint32 writeToFile(const void * const pWriter, QFile& oFile);
+};
+
+// Connection candidates with the same failure count. Hosts wait in lWaiting until their connect
+// throttle has passed, then move to lReady and to the index of their country.
+struct CHostCacheBucket
+{
+	CHostCacheIndex                 lReady;      // newest first
+	QHash<QString, CHostCacheIndex> lCountries;  // lReady split by country code
+	CHostCacheIndex                 lWaiting;    // keyed by the time the host becomes connectable
+};
 
 class CHostCache
 {
 
 public:
-	QList<CHostCacheHost*>  m_lHosts;
+	CHostCacheIndex         m_lHosts;       // all hosts, newest first
 	mutable QMutex          m_pSection;
 	quint32                 m_tLastSave;
 
 	quint32                 m_nMaxCacheHosts;
 	QString                 m_sMessage;
 
+protected:
+	QHash<CEndPoint, CHostCacheHost*> m_lByAddress;
+	QVector<CHostCacheBucket>         m_lFailures;  // hosts by failure count
+	CHostCacheWriter                  m_oWriter;
+
 public:
 	CHostCache();
 	~CHostCache();
@@ -69,25 +131,39 @@ public:
 	void remove(CHostCacheHost* pRemove);
 	void remove(CEndPoint oHost);
 
+	void setFailures(CHostCacheHost* pHost, quint32 nFailures);
+	void setLastConnect(CHostCacheHost* pHost, quint32 tLastConnect);
+
 	void addXTry(QString& sHeader);
 	QString getXTry();
 
 	void onFailure(CEndPoint addr);
 	CHostCacheHost* get();
 	CHostCacheHost* getConnectable(const quint32 tNow = common::getTNowUTC(),
-	                               QList<CHostCacheHost*> oExcept = QList<CHostCacheHost*>(),
-	                               QString sCountry = QString("ZZ"));
+	                               const QSet<CHostCacheHost*>& oExcept = QSet<CHostCacheHost*>(),
+	                               const QString& sCountry = QString("ZZ"));
+	int getConnectable(QList<CHostCacheHost*>& lHosts, int nCount, const quint32 tNow,
+	                   const QSet<CHostCacheHost*>& oExcept, const QString& sCountry = QString("ZZ"));
 
 	bool save(const quint32 tNow);
+	void waitForSave();
 	void load();
 
 	void pruneOldHosts(const quint32 tNow);
 	void pruneByQueryAck(const quint32 tNow);
 
-	static quint32 writeToFile(const void * const pManager, QFile& oFile);
+	QByteArray snapshot() const;
 
 	inline quint32 count();
 	inline bool isEmpty();
+
+protected:
+	CHostCacheHost* insert(const CEndPoint& oHost, quint32 tTimeStamp, quint32 nFailures = 0,
+	                       quint32 tLastConnect = 0);
+	void link(CHostCacheHost* pHost);
+	void unlink(CHostCacheHost* pHost);
+	void promote(CHostCacheBucket& oBucket, const quint32 tNow);
+	void removeOldest();
 };
 
 CHostCacheHost* CHostCache::take(CEndPoint oHost)
@@ -29,6 +29,15 @@
 #include "network.h"
 #include "quazaasettings.h"
 
+#include <QMap>
+
+class CHostCacheHost;
+
+// Hosts keyed by ~timestamp, so iterating from begin() walks them newest first. Hosts sharing
+// a timestamp are walked in reverse order of insertion.
+typedef QMap<quint32, CHostCacheHost*> CHostCacheIndex;
+typedef CHostCacheIndex::iterator CHostCacheIterator;
+
 class CHostCacheHost
 {
 public:
@@ -43,8 +52,15 @@ public:
 
 	quint32     m_tLastQuery;   // kiedy poslano ostatnie zapytanie?
 	quint32     m_tRetryAfter;  // kiedy mozna ponowic?
-	quint32     m_tLastConnect; // kiedy ostatnio sie polaczylismy?
-	quint32     m_nFailures;
+	quint32     m_tLastConnect; // kiedy ostatnio sie polaczylismy? set through CHostCache::setLastConnect()
+	quint32     m_nFailures;    // change through CHostCache::setFailures()
+	QString     m_sCountry;     // looked up once when the host is added
+
+private:
+	CHostCacheIterator m_itTimestamp;  // position in CHostCache::m_lHosts
+	CHostCacheIterator m_itFailures;   // position in the ready or waiting index of the failure bucket
+	CHostCacheIterator m_itCountry;    // position in the country index of the bucket, while ready
+	bool               m_bReady;
 
 private:
 	CHostCacheHost(CEndPoint oAddress, quint32 tTimestamp);
@@ -0,0 +1,164 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef EPOCHRECLAIMER_H
+#define EPOCHRECLAIMER_H
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+
+/**
+ * Lock free reclamation for objects that are published through an atomic pointer, replaced by a
+ * single writer and read without any lock.
+ * Readers enter the current epoch by counting themselves in its slot. The writer advances the
+ * epoch once the slot of the epoch before has drained, and tags each object it replaces with the
+ * epoch it was replaced in. An object replaced in epoch n can only have been loaded by readers of
+ * epochs n - 1 and n, so it is freed once the epoch has reached n + 2.
+ * Readers never wait; a reader staying in an epoch for long only delays freeing.
+ */
+class CEpochReclaimer
+{
+protected:
+	QAtomicInt	m_nEpoch;
+	QAtomicInt	m_pReaders[2];		// by epoch & 1
+
+public:
+	inline CEpochReclaimer();
+
+	// Reader side, any thread
+	inline int  enter();
+	inline void join(int nEpoch);
+	inline void leave(int nEpoch);
+
+	// Writer side, serialized by the owner
+	inline int  epoch() const;
+	inline bool advance();
+	inline bool isSafe(int nRetired) const;
+};
+
+/**
+ * Keeps the object published in an atomic pointer alive for the lifetime of the reference.
+ */
+template <typename T>
+class CEpochRef
+{
+protected:
+	CEpochReclaimer*	m_pReclaimer;
+	int					m_nEpoch;
+	const T*			m_pObject;
+
+public:
+	CEpochRef(CEpochReclaimer* pReclaimer, const QAtomicPointer<T>& pObject)
+		: m_pReclaimer( pReclaimer ),
+		  m_nEpoch( pReclaimer->enter() ),
+		  m_pObject( pObject.loadAcquire() )
+	{
+	}
+	CEpochRef(const CEpochRef& oOther)
+		: m_pReclaimer( oOther.m_pReclaimer ),
+		  m_nEpoch( oOther.m_nEpoch ),
+		  m_pObject( oOther.m_pObject )
+	{
+		m_pReclaimer->join( m_nEpoch );
+	}
+	~CEpochRef()
+	{
+		m_pReclaimer->leave( m_nEpoch );
+	}
+
+	inline const T* operator->() const
+	{
+		return m_pObject;
+	}
+
+private:
+	CEpochRef& operator=(const CEpochRef&);
+};
+
+CEpochReclaimer::CEpochReclaimer() :
+	m_nEpoch( 0 )
+{
+}
+
+/**
+ * Counts the caller in the current epoch and returns it; pass it to leave(). Retries only if the
+ * writer advanced the epoch in between.
+ */
+int CEpochReclaimer::enter()
+{
+	for ( ;; )
+	{
+		const int nEpoch = m_nEpoch.loadAcquire();
+		m_pReaders[nEpoch & 1].ref();
+
+		if ( m_nEpoch.loadAcquire() == nEpoch )
+			return nEpoch;
+
+		m_pReaders[nEpoch & 1].deref();
+	}
+}
+
+/**
+ * Counts one more reader in an epoch the caller already is in. The epoch cannot be drained in
+ * between, as the caller holds it.
+ */
+void CEpochReclaimer::join(int nEpoch)
+{
+	m_pReaders[nEpoch & 1].ref();
+}
+
+void CEpochReclaimer::leave(int nEpoch)
+{
+	m_pReaders[nEpoch & 1].deref();
+}
+
+int CEpochReclaimer::epoch() const
+{
+	return m_nEpoch.loadAcquire();
+}
+
+/**
+ * Moves to the next epoch if no reader is left in the previous one, whose slot the next epoch
+ * reuses. Returns false if readers are still in there.
+ */
+bool CEpochReclaimer::advance()
+{
+	const int nEpoch = m_nEpoch.loadAcquire();
+
+	if ( m_pReaders[(nEpoch + 1) & 1].fetchAndAddOrdered( 0 ) != 0 )
+		return false;
+
+	m_nEpoch.fetchAndAddOrdered( 1 );
+	return true;
+}
+
+/**
+ * Returns true if an object replaced in epoch nRetired can no longer be used by any reader.
+ */
+bool CEpochReclaimer::isSafe(int nRetired) const
+{
+	return quint32( epoch() ) - quint32( nRetired ) >= 2;
+}
+
+#endif // EPOCHRECLAIMER_H
@@ -29,10 +29,12 @@
 
 #include "debug_new.h"
 
-CBuffer::CBuffer(quint32 nMinimum) :
+CBuffer::CBuffer(quint32 nMinimum, bool bReadCursor) :
 	m_pBuffer(0),
+	m_nOffset(0),
 	m_nLength(0),
-	m_nBuffer(0)
+	m_nBuffer(0),
+	m_bReadCursor(bReadCursor)
 {
 	m_nMinimum = nMinimum;
 }
@@ -54,7 +56,7 @@ CBuffer& CBuffer::append(const void* pData, const quint32 nLength)
 
 	ensure(nLength);
 
-	memcpy(m_pBuffer + m_nLength, pData, nLength);
+	memcpy(data() + m_nLength, pData, nLength);
 
 	m_nLength += nLength;
 
@@ -98,11 +100,20 @@ CBuffer& CBuffer::insert(const quint32 i, const void* pData, const quint32 nLeng
 		return *this;
 	}
 
+	// prepend into the space already consumed by the read cursor
+	if(i == 0 && m_nOffset >= nLength)
+	{
+		m_nOffset -= nLength;
+		memcpy(data(), pData, nLength);
+		m_nLength += nLength;
+		return *this;
+	}
+
 	ensure(nLength);
 
-	memmove(m_pBuffer + i + nLength, m_pBuffer + i, m_nLength - i);
+	memmove(data() + i + nLength, data() + i, m_nLength - i);
 
-	memcpy(m_pBuffer + i, pData, nLength);
+	memcpy(data() + i, pData, nLength);
 
 	m_nLength += nLength;
 
@@ -119,14 +130,20 @@ CBuffer& CBuffer::remove(const quint32 nPos, const quint32 nLength)
 	if(nPos == 0 && nLength >= m_nLength)
 	{
 		m_nLength = 0;
+		m_nOffset = 0;
 	}
 	else if(nPos + nLength >= m_nLength)
 	{
 		m_nLength = nPos;
 	}
+	else if(nPos == 0 && m_bReadCursor)
+	{
+		m_nOffset += nLength;
+		m_nLength -= nLength;
+	}
 	else
 	{
-		memmove(m_pBuffer + nPos, m_pBuffer + nPos + nLength, m_nLength - nPos - nLength);
+		memmove(data() + nPos, data() + nPos + nLength, m_nLength - nPos - nLength);
 		m_nLength -= nLength;
 	}
 
@@ -148,9 +165,17 @@ void CBuffer::ensure(const quint32 nLength)
 
 	if(m_nBuffer - m_nLength > nLength)
 	{
+		// Tail is too short, but the space consumed by the read cursor is enough - slide the data down
+		if(m_nBuffer - m_nOffset - m_nLength <= nLength)
+		{
+			compact();
+		}
+
 		// We shrink the buffer if we allocated twice the minimum and we actually need less than minimum
 		if(m_nBuffer > m_nMinimum * 2 && m_nLength + nLength < m_nMinimum)
 		{
+			compact();
+
 			const quint32 nBuffer = m_nMinimum;
 			char* pBuffer = (char*)realloc(m_pBuffer, nBuffer);
 			if(! pBuffer)
@@ -163,6 +188,8 @@ void CBuffer::ensure(const quint32 nLength)
 		return;
 	}
 
+	compact();
+
 	quint32 nBuffer = m_nLength + nLength;
 
 	// first alloc will be m_nMinimum bytes or 1024
@@ -188,14 +215,36 @@ void CBuffer::ensure(const quint32 nLength)
 	m_pBuffer = pBuffer;
 }
 
+void CBuffer::compact()
+{
+	if(m_nOffset == 0)
+	{
+		return;
+	}
+
+	if(m_nLength)
+	{
+		memmove(m_pBuffer, m_pBuffer + m_nOffset, m_nLength);
+	}
+
+	m_nOffset = 0;
+}
+
 void CBuffer::resize(const quint32 nLength)
 {
-	if(nLength <= m_nLength || nLength <= m_nBuffer)
+	if(nLength <= m_nLength || nLength <= capacity())
+	{
+		m_nLength = nLength;
+	}
+	else if(nLength <= m_nBuffer)
 	{
+		compact();
 		m_nLength = nLength;
 	}
-	else if(nLength > m_nBuffer)
+	else
 	{
+		compact();
+
 		char* pBuffer = (char*)realloc(m_pBuffer, nLength * 2);
 		if(!pBuffer)
 		{
@@ -218,7 +267,7 @@ QString CBuffer::toHex() const
 
 	for(quint32 i = 0 ; i < m_nLength ; i++)
 	{
-		int nChar = *reinterpret_cast<uchar*>(&m_pBuffer[i]);
+		int nChar = *reinterpret_cast<uchar*>(&m_pBuffer[m_nOffset + i]);
 		if(i)
 		{
 			*pszDump++ = ' ';
@@ -241,7 +290,7 @@ QString CBuffer::toAscii() const
 
 	for(uint i = 0 ; i < m_nLength ; i++)
 	{
-		int nChar = *reinterpret_cast<uchar*>(&m_pBuffer[i]);
+		int nChar = *reinterpret_cast<uchar*>(&m_pBuffer[m_nOffset + i]);
 		*pszDump++ = (nChar >= 32 ? nChar : '.');
 	}
 
@@ -32,15 +32,17 @@ class CBuffer
 {
 protected:
 	char* 	m_pBuffer;	// allocated block
+	quint32	m_nOffset;	// offset of the first valid byte (read cursor)
 	quint32	m_nLength;	// length of data it stores
 	quint32	m_nBuffer;	// length of this block
 	quint32 m_nMinimum;
+	bool	m_bReadCursor;	// consume from front by moving the read cursor instead of memmove
 
 	// inlines
 public:
 	inline char* data()
 	{
-		return m_pBuffer;
+		return m_pBuffer + m_nOffset;
 	}
 
 	inline quint32 size() const
@@ -50,7 +52,7 @@ public:
 
 	inline quint32 capacity() const
 	{
-		return m_nBuffer;
+		return m_nBuffer - m_nOffset;
 	}
 
 	inline bool isEmpty() const
@@ -63,14 +65,23 @@ public:
 		m_nMinimum = nSize;
 	}
 
+	inline bool hasReadCursor() const
+	{
+		return m_bReadCursor;
+	}
+
 	inline CBuffer& clear()
 	{
 		m_nLength = 0;
+		m_nOffset = 0;
 		return *this;
 	}
 
 public:
-	CBuffer(quint32 nMinimum = 1024u);
+	// With bReadCursor set, remove(0, n) only advances the read cursor, so stream parsers
+	// consuming packets from the front pay O(1) per packet. Consumed space is reclaimed
+	// by compact() when ensure() runs out of room at the tail.
+	CBuffer(quint32 nMinimum = 1024u, bool bReadCursor = false);
 	~CBuffer();
 
 	CBuffer& append(const void* pData, const quint32 nLength);
@@ -89,6 +100,7 @@ public:
 	CBuffer& remove(const quint32 nLength);
 
 	void	 ensure(const quint32 nLength);
+	void	 compact();
 
 	void	 resize(const quint32 nLength);
 
@@ -24,7 +24,9 @@
 
 #include "compressedconnection.h"
 #include "buffer.h"
+#include "zlibutils.h"
 #include "systemlog.h"
+#include "quazaasettings.h"
 
 #include "debug_new.h"
 
@@ -96,7 +98,7 @@ bool CCompressedConnection::enableOutputCompression(bool bEnable)
 
 bool CCompressedConnection::setupInputStream()
 {
-	m_pZInput = new CBuffer(8192);
+	m_pZInput = new CBuffer(8192, true);
 
 	if(m_pZInput == 0)
 	{
@@ -120,7 +122,10 @@ bool CCompressedConnection::setupOutputStream()
 		return false;
 	}
 
-	if(deflateInit(&m_sOutput, Z_DEFAULT_COMPRESSION) != Z_OK)
+	int nLevel = qBound(-1, quazaaSettings.Gnutella2.TcpDeflateLevel, 9);
+	int nMemLevel = qBound(1, quazaaSettings.Gnutella2.TcpDeflateMemLevel, 9);
+
+	if(deflateInit2(&m_sOutput, nLevel, Z_DEFLATED, MAX_WBITS, nMemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
 	{
 		delete m_pZOutput;
 		m_pZOutput = 0;
@@ -210,8 +215,13 @@ void CCompressedConnection::inflateInput()
 		m_sInput.avail_out = qMax(m_pZInput->capacity() - oldSize, 2048u);
 		m_sInput.total_out = 0u;
 
+		QElapsedTimer tTime;
+		tTime.start();
+
 		nRet = inflate(&m_sInput, Z_SYNC_FLUSH);
 
+		ZLibUtils::count(ZLibUtils::Uncompress, m_sInput.total_in, m_sInput.total_out, tTime.nsecsElapsed());
+
 		switch(nRet)
 		{
 			case Z_MEM_ERROR:
@@ -275,8 +285,13 @@ void CCompressedConnection::deflateOutput()
 		m_sOutput.avail_out = m_pOutput->capacity() - nOldSize;
 		m_sOutput.total_out = 0u;
 
+		QElapsedTimer tTime;
+		tTime.start();
+
 		qint32 nRet = deflate(&m_sOutput, nFlushMode);
 
+		ZLibUtils::count(ZLibUtils::Compress, m_sOutput.total_in, m_sOutput.total_out, tTime.nsecsElapsed());
+
 		if(nRet == Z_OK || nRet == Z_BUF_ERROR)
 		{
 			m_pOutput->resize(nOldSize + m_sOutput.total_out);
@@ -0,0 +1,357 @@
+/*
+** datagrambatch.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "datagrambatch.h"
+
+#ifdef QUAZAA_UDP_BATCH
+
+#include "buffer.h"
+
+#include <netinet/in.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug_new.h"
+
+CDatagramBatch::CDatagramBatch()
+{
+	m_nSocket = -1;
+	m_nFamily = AF_UNSPEC;
+	m_nSize = 0;
+
+	m_pRecvMsg = 0;
+	m_pRecvVec = 0;
+	m_pRecvAddr = 0;
+	m_pRecvBuffer = 0;
+	m_nReceived = 0;
+
+	m_pSendMsg = 0;
+	m_pSendVec = 0;
+	m_pSendAddr = 0;
+	m_pSendData = 0;
+	m_nQueued = 0;
+
+	m_nRecvCalls = m_nRecvDatagrams = 0;
+	m_nSendCalls = m_nSendDatagrams = 0;
+}
+
+CDatagramBatch::~CDatagramBatch()
+{
+	release();
+}
+
+bool CDatagramBatch::attach(qintptr nSocket, int nSize)
+{
+	detach();
+
+	if(nSocket == -1 || nSize < 2)
+	{
+		return false;
+	}
+
+	sockaddr_storage oLocal;
+	socklen_t nLocal = sizeof(oLocal);
+	if(getsockname(int(nSocket), (sockaddr*)&oLocal, &nLocal) != 0
+	   || (oLocal.ss_family != AF_INET && oLocal.ss_family != AF_INET6))
+	{
+		return false;
+	}
+
+	if(nSize != m_nSize)
+	{
+		release();
+
+		m_nSize = nSize;
+
+		m_pRecvMsg = new mmsghdr[nSize];
+		m_pRecvVec = new iovec[nSize];
+		m_pRecvAddr = new sockaddr_storage[nSize];
+		m_pRecvBuffer = new CBuffer*[nSize];
+		for(int i = 0; i < nSize; i++)		// reused by every receive(), see the class comment
+		{
+			m_pRecvBuffer[i] = new CBuffer(MaxRecv);
+		}
+
+		m_pSendMsg = new mmsghdr[nSize];
+		m_pSendVec = new iovec[nSize];
+		m_pSendAddr = new sockaddr_storage[nSize];
+		m_pSendData = new char[nSize * MaxSend];
+	}
+
+	m_nSocket = int(nSocket);
+	m_nFamily = oLocal.ss_family;
+	m_nReceived = 0;
+	m_nQueued = 0;
+
+	m_nRecvCalls = m_nRecvDatagrams = 0;
+	m_nSendCalls = m_nSendDatagrams = 0;
+
+	return true;
+}
+
+void CDatagramBatch::detach()
+{
+	m_nSocket = -1;
+	m_nFamily = AF_UNSPEC;
+	m_nReceived = 0;
+	m_nQueued = 0;
+}
+
+void CDatagramBatch::release()
+{
+	if(m_pRecvBuffer)
+	{
+		for(int i = 0; i < m_nSize; i++)
+		{
+			delete m_pRecvBuffer[i];
+		}
+	}
+
+	delete [] m_pRecvMsg;
+	delete [] m_pRecvVec;
+	delete [] m_pRecvAddr;
+	delete [] m_pRecvBuffer;
+	delete [] m_pSendMsg;
+	delete [] m_pSendVec;
+	delete [] m_pSendAddr;
+	delete [] m_pSendData;
+
+	m_pRecvMsg = 0;
+	m_pRecvVec = 0;
+	m_pRecvAddr = 0;
+	m_pRecvBuffer = 0;
+	m_pSendMsg = 0;
+	m_pSendVec = 0;
+	m_pSendAddr = 0;
+	m_pSendData = 0;
+
+	m_nSize = 0;
+}
+
+// Reads up to size() datagrams without blocking.
+// Returns the number of datagrams available through buffer() and address().
+int CDatagramBatch::receive()
+{
+	m_nReceived = 0;
+
+	if(m_nSocket == -1)
+	{
+		return 0;
+	}
+
+	for(int i = 0; i < m_nSize; i++)
+	{
+		m_pRecvBuffer[i]->resize(MaxRecv);
+
+		m_pRecvVec[i].iov_base = m_pRecvBuffer[i]->data();
+		m_pRecvVec[i].iov_len = MaxRecv;
+
+		memset(&m_pRecvMsg[i], 0, sizeof(mmsghdr));
+		m_pRecvMsg[i].msg_hdr.msg_name = &m_pRecvAddr[i];
+		m_pRecvMsg[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+		m_pRecvMsg[i].msg_hdr.msg_iov = &m_pRecvVec[i];
+		m_pRecvMsg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int nRet;
+	do
+	{
+		nRet = recvmmsg(m_nSocket, m_pRecvMsg, m_nSize, MSG_DONTWAIT, 0);
+	}
+	while(nRet < 0 && errno == EINTR);
+
+	m_nRecvCalls++;
+
+	if(nRet <= 0)
+	{
+		return 0;
+	}
+
+	m_nRecvDatagrams += nRet;
+
+	for(int i = 0; i < nRet; i++)
+	{
+		// Truncated datagrams are not G2 traffic, hand them over empty so they get dropped
+		if(m_pRecvMsg[i].msg_hdr.msg_flags & MSG_TRUNC)
+		{
+			m_pRecvBuffer[i]->resize(0);
+		}
+		else
+		{
+			m_pRecvBuffer[i]->resize(m_pRecvMsg[i].msg_len);
+		}
+	}
+
+	m_nReceived = nRet;
+	return nRet;
+}
+
+CBuffer* CDatagramBatch::buffer(int nIndex) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+	return m_pRecvBuffer[nIndex];
+}
+
+void CDatagramBatch::address(int nIndex, QHostAddress* pAddress, quint16* pPort) const
+{
+	Q_ASSERT(nIndex >= 0 && nIndex < m_nReceived);
+
+	const sockaddr_storage& oAddr = m_pRecvAddr[nIndex];
+
+	if(oAddr.ss_family == AF_INET)
+	{
+		const sockaddr_in* pAddr = (const sockaddr_in*)&oAddr;
+		pAddress->setAddress(qFromBigEndian<quint32>(pAddr->sin_addr.s_addr));
+		*pPort = qFromBigEndian<quint16>(pAddr->sin_port);
+	}
+	else if(oAddr.ss_family == AF_INET6)
+	{
+		const sockaddr_in6* pAddr = (const sockaddr_in6*)&oAddr;
+		const uchar* pBytes = pAddr->sin6_addr.s6_addr;
+
+		// The rest of the code keys IPv4 hosts by their IPv4 address,
+		// so unwrap v4-mapped sources from a dual-stack socket.
+		static const uchar pMapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+		if(memcmp(pBytes, pMapped, 12) == 0)
+		{
+			pAddress->setAddress(qFromBigEndian<quint32>(pBytes + 12));
+		}
+		else
+		{
+			pAddress->setAddress((quint8*)pBytes);
+		}
+		*pPort = qFromBigEndian<quint16>(pAddr->sin6_port);
+	}
+	else
+	{
+		pAddress->clear();
+		*pPort = 0;
+	}
+}
+
+bool CDatagramBatch::add(const char* pData, quint32 nLength, const CEndPoint& oAddr)
+{
+	if(m_nSocket == -1 || m_nQueued >= m_nSize || nLength > MaxSend)
+	{
+		return false;
+	}
+
+	sockaddr_storage& oDest = m_pSendAddr[m_nQueued];
+	socklen_t nDest;
+
+	memset(&oDest, 0, sizeof(sockaddr_storage));
+
+	if(oAddr.protocol() == QAbstractSocket::IPv4Protocol)
+	{
+		if(m_nFamily == AF_INET)
+		{
+			sockaddr_in* pDest = (sockaddr_in*)&oDest;
+			pDest->sin_family = AF_INET;
+			pDest->sin_port = qToBigEndian<quint16>(oAddr.port());
+			pDest->sin_addr.s_addr = qToBigEndian<quint32>(oAddr.toIPv4Address());
+			nDest = sizeof(sockaddr_in);
+		}
+		else
+		{
+			sockaddr_in6* pDest = (sockaddr_in6*)&oDest;
+			pDest->sin6_family = AF_INET6;
+			pDest->sin6_port = qToBigEndian<quint16>(oAddr.port());
+			pDest->sin6_addr.s6_addr[10] = 0xff;
+			pDest->sin6_addr.s6_addr[11] = 0xff;
+			qToBigEndian<quint32>(oAddr.toIPv4Address(), pDest->sin6_addr.s6_addr + 12);
+			nDest = sizeof(sockaddr_in6);
+		}
+	}
+	else if(oAddr.protocol() == QAbstractSocket::IPv6Protocol && m_nFamily == AF_INET6)
+	{
+		sockaddr_in6* pDest = (sockaddr_in6*)&oDest;
+		Q_IPV6ADDR oIp6 = oAddr.toIPv6Address();
+		pDest->sin6_family = AF_INET6;
+		pDest->sin6_port = qToBigEndian<quint16>(oAddr.port());
+		memcpy(pDest->sin6_addr.s6_addr, &oIp6, 16);
+		nDest = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		return false;
+	}
+
+	// Payload is copied, callers are free to recycle their buffers right away
+	char* pSlot = m_pSendData + m_nQueued * MaxSend;
+	memcpy(pSlot, pData, nLength);
+
+	m_pSendVec[m_nQueued].iov_base = pSlot;
+	m_pSendVec[m_nQueued].iov_len = nLength;
+
+	memset(&m_pSendMsg[m_nQueued], 0, sizeof(mmsghdr));
+	m_pSendMsg[m_nQueued].msg_hdr.msg_name = &oDest;
+	m_pSendMsg[m_nQueued].msg_hdr.msg_namelen = nDest;
+	m_pSendMsg[m_nQueued].msg_hdr.msg_iov = &m_pSendVec[m_nQueued];
+	m_pSendMsg[m_nQueued].msg_hdr.msg_iovlen = 1;
+
+	m_nQueued++;
+
+	return true;
+}
+
+// Writes all queued datagrams. Datagrams the kernel refuses (full send buffer,
+// unreachable host) are dropped, the same as a failed QUdpSocket::writeDatagram().
+// Returns the number of datagrams handed to the kernel.
+int CDatagramBatch::flush()
+{
+	int nSent = 0;
+	int nDelivered = 0;
+
+	while(nSent < m_nQueued)
+	{
+		int nRet = sendmmsg(m_nSocket, m_pSendMsg + nSent, m_nQueued - nSent, MSG_DONTWAIT);
+		m_nSendCalls++;
+
+		if(nRet < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+
+			// Skip the datagram that failed and carry on with the rest
+			nSent++;
+			continue;
+		}
+
+		nSent += nRet;
+		nDelivered += nRet;
+	}
+
+	m_nSendDatagrams += nDelivered;
+	m_nQueued = 0;
+
+	return nDelivered;
+}
+
+#endif // QUAZAA_UDP_BATCH
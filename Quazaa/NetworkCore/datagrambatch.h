@@ -0,0 +1,119 @@
+/*
+** datagrambatch.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef DATAGRAMBATCH_H
+#define DATAGRAMBATCH_H
+
+#include "types.h"
+
+#if defined(Q_OS_LINUX)
+#define QUAZAA_UDP_BATCH
+#endif
+
+#ifdef QUAZAA_UDP_BATCH
+
+#include <sys/socket.h>
+
+class CBuffer;
+
+// Moves several datagrams per system call (recvmmsg/sendmmsg) on the UDP
+// socket owned by CDatagrams. Qt still owns the socket and its read
+// notifier, this class only drains and fills it in bulk.
+// The buffers are its own, not taken from CDatagrams::m_FreeBuffer: that pool
+// holds 1 KB buffers which outgoing datagrams keep until they are acked, while
+// receive slots must fit any datagram and are only valid until the next
+// receive(), and send slots are copies that are gone after flush().
+class CDatagramBatch
+{
+protected:
+	int				m_nSocket;		// native descriptor, -1 when detached
+	int				m_nFamily;		// address family the socket is bound to
+	int				m_nSize;		// datagrams per call
+
+	mmsghdr*		m_pRecvMsg;
+	iovec*			m_pRecvVec;
+	sockaddr_storage* m_pRecvAddr;
+	CBuffer**		m_pRecvBuffer;
+	int				m_nReceived;
+
+	mmsghdr*		m_pSendMsg;
+	iovec*			m_pSendVec;
+	sockaddr_storage* m_pSendAddr;
+	char*			m_pSendData;	// m_nSize slots of MaxSend bytes
+	int				m_nQueued;
+
+public:
+	quint64			m_nRecvCalls;
+	quint64			m_nRecvDatagrams;
+	quint64			m_nSendCalls;
+	quint64			m_nSendDatagrams;
+
+	enum { MaxRecv = 16384, MaxSend = 2048 };
+
+public:
+	CDatagramBatch();
+	~CDatagramBatch();
+
+	bool attach(qintptr nSocket, int nSize);
+	void detach();
+
+	inline bool isAttached() const;
+	inline int  size() const;
+
+	// Receive side
+	int  receive();
+	CBuffer* buffer(int nIndex) const;
+	void address(int nIndex, QHostAddress* pAddress, quint16* pPort) const;
+
+	// Send side. add() returns false if the datagram can not be queued,
+	// caller should send it through Qt instead.
+	bool add(const char* pData, quint32 nLength, const CEndPoint& oAddr);
+	inline bool isFull() const;
+	inline int  pending() const;
+	int  flush();
+
+protected:
+	void release();
+};
+
+bool CDatagramBatch::isAttached() const
+{
+	return (m_nSocket != -1);
+}
+int CDatagramBatch::size() const
+{
+	return m_nSize;
+}
+bool CDatagramBatch::isFull() const
+{
+	return (m_nQueued >= m_nSize);
+}
+int CDatagramBatch::pending() const
+{
+	return m_nQueued;
+}
+
+#endif // QUAZAA_UDP_BATCH
+
+#endif // DATAGRAMBATCH_H
@@ -34,54 +34,80 @@
 
 #include <stdexcept>
 
+DatagramKey::DatagramKey(const CEndPoint& oAddress, quint16 nSequence)
+{
+	if(oAddress.protocol() == QAbstractSocket::IPv4Protocol)
+	{
+		nAddress[0] = 0;
+		nAddress[1] = 0;
+		nAddress[2] = 0xffff;
+		nAddress[3] = oAddress.toIPv4Address();
+	}
+	else
+	{
+		Q_IPV6ADDR oIp6 = oAddress.toIPv6Address();
+		memcpy(nAddress, &oIp6, sizeof(nAddress));
+	}
+
+	nPort = oAddress.port();
+	this->nSequence = nSequence;
+}
+
 DatagramIn::DatagramIn()
+	: m_oData(2048)
 {
-	m_pBuffer = 0;
-	m_bLocked = 0;
-	m_nBuffer = 0;
+	m_pOffset = 0;
+	m_pLength = 0;
+	m_nParts = 0;
+	m_nCount = 0;
+	m_nLeft = 0;
+	m_pPrev = 0;
+	m_pNext = 0;
 }
 
 DatagramIn::~DatagramIn()
 {
-	if(m_pBuffer)
+	if(m_pOffset)
 	{
-		delete[] m_pBuffer;
+		delete[] m_pOffset;
 	}
-	if(m_bLocked)
+	if(m_pLength)
 	{
-		delete[] m_bLocked;
+		delete[] m_pLength;
 	}
 }
 
 void DatagramIn::create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount)
 {
 	m_oAddress = pHost;
+	m_oKey = DatagramKey(pHost, nSequence);
 
 	m_nSequence = nSequence;
 	m_bCompressed = (nFlags & 0x01) ? true : false;
+	m_bOrdered = true;
 	m_nCount = nCount;
 	m_nLeft = nCount;
 
 	m_tStarted = time(0);
 
-	if(m_nBuffer < m_nCount)
+	if(m_nParts < m_nCount)
 	{
-		if(m_pBuffer)
+		if(m_pOffset)
 		{
-			delete[] m_pBuffer;
+			delete[] m_pOffset;
 		}
-		if(m_bLocked)
+		if(m_pLength)
 		{
-			delete[] m_bLocked;
+			delete[] m_pLength;
 		}
 
-		m_nBuffer = nCount;
-		m_pBuffer = new CBuffer*[nCount];
-		m_bLocked = new bool[nCount];
+		m_nParts = nCount;
+		m_pOffset = new quint32[nCount];
+		m_pLength = new quint16[nCount];
 	}
 
-	memset(m_bLocked, 0x00, sizeof(bool) * m_nBuffer);
-	memset(m_pBuffer, 0x00, sizeof(CBuffer*) * m_nBuffer);
+	memset(m_pOffset, 0xff, sizeof(quint32) * m_nCount);
+	m_oData.clear();
 }
 
 bool DatagramIn::add(quint8 nPart, const void* pData, qint32 nLength)
@@ -91,15 +117,22 @@ bool DatagramIn::add(quint8 nPart, const void* pData, qint32 nLength)
 		return false;
 	}
 
-	if(m_nLeft == 0)
+	if(m_nLeft == 0 || nLength < 0 || nLength > 0xffff)
 	{
 		return false;
 	}
 
-	if(m_bLocked[nPart - 1] == false)
+	if(m_pOffset[nPart - 1] == NotReceived)
 	{
-		m_bLocked[nPart - 1] = true;
-		m_pBuffer[nPart - 1]->append((char*)pData, nLength);
+		// In order so far only if every earlier part is already in the slab
+		if(m_bOrdered && nPart != m_nCount - m_nLeft + 1)
+		{
+			m_bOrdered = false;
+		}
+
+		m_pOffset[nPart - 1] = m_oData.size();
+		m_pLength[nPart - 1] = quint16(nLength);
+		m_oData.append((char*)pData, nLength);
 
 		if(--m_nLeft == 0)
 		{
@@ -110,19 +143,34 @@ bool DatagramIn::add(quint8 nPart, const void* pData, qint32 nLength)
 	return false;
 }
 
-G2Packet* DatagramIn::toG2Packet()
+// Releases the fragment data but keeps the datagram identity, so late duplicates are still recognised.
+void DatagramIn::reclaim()
 {
-	if(m_nCount > 1)
-		for(qint32 i = 1; i < m_nCount; i++)
-			m_pBuffer[0]->append(m_pBuffer[i]);
+	m_oData.clear();
+}
 
+G2Packet* DatagramIn::toG2Packet(CBuffer* pScratch, bool bView)
+{
+	CBuffer* pPacket = &m_oData;
 
-	if(m_bCompressed && !ZLibUtils::uncompressBuffer(*m_pBuffer[0]))
+	if(!m_bOrdered)
+	{
+		// Parts came out of order, gather them once in part order
+		pScratch->clear();
+		pScratch->ensure(m_oData.size());
+		for(quint8 i = 0; i < m_nCount; i++)
+		{
+			pScratch->append(m_oData.data() + m_pOffset[i], m_pLength[i]);
+		}
+		pPacket = pScratch;
+	}
+
+	if(m_bCompressed && !ZLibUtils::uncompressBuffer(*pPacket))
 	{
 		throw std::logic_error("Unable to uncompress compressed packet.");
 	}
 
-	return G2Packet::readBuffer(m_pBuffer[0]);
+	return G2Packet::readBuffer(pPacket, bView);
 }
 
 DatagramOut::DatagramOut()
@@ -131,6 +179,13 @@ DatagramOut::DatagramOut()
 	m_pBuffer = 0;
 	m_nLocked = 0;
 	m_bAck = false;
+
+	m_nClass = 0;
+	m_tQueued = 0;
+	m_bStarted = false;
+	m_pDest = 0;
+	m_pPrevOut = 0;
+	m_pNextOut = 0;
 }
 
 DatagramOut::~DatagramOut()
@@ -192,10 +247,9 @@ void DatagramOut::create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence,
 	m_tSent = time(0);
 }
 
-bool DatagramOut::getPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend)
+// Index of the next part due for sending, or m_nCount if none is due.
+int DatagramOut::nextPart(quint32 tNow, bool bResend) const
 {
-	Q_ASSERT(m_pBuffer != 0);
-
 	int nPart = 0;
 	for(; nPart < m_nCount; nPart++)
 	{
@@ -218,6 +272,22 @@ bool DatagramOut::getPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bo
 		}
 	}
 
+	return nPart;
+}
+
+bool DatagramOut::hasPacket(quint32 tNow, bool bResend) const
+{
+	Q_ASSERT(m_pBuffer != 0);
+
+	return nextPart(tNow, bResend) < m_nCount;
+}
+
+bool DatagramOut::getPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend)
+{
+	Q_ASSERT(m_pBuffer != 0);
+
+	int nPart = nextPart(tNow, bResend);
+
 	if(nPart >= m_nCount)
 	{
 		return false;
@@ -26,37 +26,75 @@
 #define DATAGRAMFRAGS_H
 
 #include "types.h"
+#include "buffer.h"
 
-class CBuffer;
 class G2Packet;
 
+// Identifies one incoming datagram: sender address, port and GND sequence.
+// IPv4 senders are stored v4-mapped, so the key is flat for both families.
+struct DatagramKey
+{
+	quint32 nAddress[4];
+	quint16 nPort;
+	quint16 nSequence;
+
+	DatagramKey()
+	{
+	}
+	DatagramKey(const CEndPoint& oAddress, quint16 nSequence);
+
+	inline bool operator==(const DatagramKey& rhs) const
+	{
+		return nAddress[3] == rhs.nAddress[3] && nPort == rhs.nPort && nSequence == rhs.nSequence
+			   && nAddress[0] == rhs.nAddress[0] && nAddress[1] == rhs.nAddress[1] && nAddress[2] == rhs.nAddress[2];
+	}
+};
+
+inline uint qHash(const DatagramKey& oKey)
+{
+	return (oKey.nAddress[0] ^ oKey.nAddress[1] ^ oKey.nAddress[2]) * 31u
+		   + oKey.nAddress[3] * 2654435761u + ((uint(oKey.nPort) << 16) | oKey.nSequence);
+}
+
 class DatagramIn
 {
 protected:
 	CEndPoint  m_oAddress;
+	DatagramKey m_oKey;
 
 	quint16 m_nSequence;
 	quint8  m_nCount;
 	quint8  m_nLeft;
 	bool    m_bCompressed;
+	bool    m_bOrdered;			// parts arrived in order, m_oData already holds the packet
 	quint32 m_tStarted;
-	quint32 m_nBuffer;
-	bool*   m_bLocked;
 
-	CBuffer** m_pBuffer;
+	// Fragments are appended to one slab in arrival order
+	CBuffer m_oData;
+	quint32* m_pOffset;			// where each part starts in m_oData, NotReceived if missing
+	quint16* m_pLength;
+	quint32 m_nParts;			// capacity of the two arrays above
+
+	// Intrusive list links, for the receive LRU or the free list
+	DatagramIn* m_pPrev;
+	DatagramIn* m_pNext;
+
 public:
+	enum { NotReceived = 0xffffffff };
+
 	DatagramIn();
 	~DatagramIn();
 
 	void create(CEndPoint pHost, quint8 nFlags, quint16 nSequence, quint8 nCount);
 	bool add(quint8 nPart, const void* pData, qint32 nLength);
-	G2Packet* toG2Packet();
-
+	G2Packet* toG2Packet(CBuffer* pScratch, bool bView = true);
+	void reclaim();
 
 	friend class CDatagrams;
 };
 
 class DatagramWatcher;
+struct DatagramDestination;
 
 class DatagramOut
 {
@@ -77,15 +115,28 @@ protected:
 	void*               m_pParam;
 	CBuffer* m_pBuffer;
 
+	// Send scheduling, maintained by CDatagramPacer
+	int					m_nClass;
+	qint64				m_tQueued;
+	bool				m_bStarted;		// a fragment went out since m_tQueued
+	DatagramDestination* m_pDest;		// 0 unless waiting in the pacer
+	DatagramOut*		m_pPrevOut;
+	DatagramOut*		m_pNextOut;
+
 public:
 	DatagramOut();
 	~DatagramOut();
 
 	void create(CEndPoint oAddr, G2Packet* pPacket, quint16 nSequence, CBuffer* pBuffer, bool bAck = false);
 	bool getPacket(quint32 tNow, char** ppPacket, quint32* pnPacket, bool bResend = false);
+	bool hasPacket(quint32 tNow, bool bResend = false) const;
 	bool acknowledge(quint8 nPart);
 
+protected:
+	int nextPart(quint32 tNow, bool bResend) const;
+
 	friend class CDatagrams;
+	friend class CDatagramPacer;
 
 };
 
@@ -0,0 +1,306 @@
+/*
+** datagrampacer.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "datagrampacer.h"
+#include "g2packet.h"
+
+#include "debug_new.h"
+
+#define PACER_NS 1000000000LL
+
+CDatagramPacer::CDatagramPacer()
+{
+	for(int i = 0; i < ClassCount; i++)
+	{
+		m_oQueues[i].pHead = 0;
+		m_oQueues[i].pTail = 0;
+		m_oQueues[i].nDatagrams = 0;
+	}
+
+	m_nBytes = m_nByteRate = m_nByteBurst = 0;
+	m_nPackets = m_nPacketRate = m_nPacketBurst = 0;
+	m_tBytes = m_tPackets = 0;
+}
+
+CDatagramPacer::~CDatagramPacer()
+{
+	clear();
+}
+
+int CDatagramPacer::classOf(G2Packet* pPacket)
+{
+	switch(pPacket->m_nType)
+	{
+		case G2Type::QA:
+		case G2Type::QKA:
+		case G2Type::QKR:
+		case G2Type::PI:
+		case G2Type::PO:
+		case G2Type::CRAWLA:
+			return ClassControl;
+		case G2Type::QH2:
+			return ClassHits;
+		default:
+			return ClassBulk;
+	}
+}
+
+// Buckets hold about 1/8 s worth of traffic, which bounds the burst after an idle period.
+void CDatagramPacer::setLimits(quint32 nBytesPerSecond, quint32 nPacketsPerSecond, qint64 tNow)
+{
+	m_nByteRate = qMax<qint64>(nBytesPerSecond, 1);
+	m_nByteBurst = qMax<qint64>(m_nByteRate / 8, 2048);
+	m_nPacketRate = qMax<qint64>(nPacketsPerSecond, 1);
+	m_nPacketBurst = qMax<qint64>(m_nPacketRate / 8, 2);
+
+	m_nBytes = m_nByteBurst;
+	m_nPackets = m_nPacketBurst;
+	m_tBytes = m_tPackets = tNow;
+}
+
+// Only whole tokens are credited, the clock is advanced by exactly the time they took,
+// so no fraction is lost between calls. Time beyond what fills the bucket is dropped before
+// multiplying, a long idle period would overflow the product otherwise.
+static void refillBucket(qint64& nTokens, qint64& tLast, qint64 nRate, qint64 nBurst, qint64 tNow)
+{
+	if(nRate <= 0)
+	{
+		return;		// no limits set yet
+	}
+
+	const qint64 tElapsed = tNow - tLast;
+	const qint64 tFill = ((nBurst - nTokens) * PACER_NS + nRate - 1) / nRate;
+
+	if(tElapsed >= tFill)
+	{
+		nTokens = nBurst;
+		tLast = tNow;
+		return;
+	}
+
+	qint64 nNew = tElapsed * nRate / PACER_NS;
+	if(nNew > 0)
+	{
+		tLast += nNew * PACER_NS / nRate;
+		nTokens += nNew;
+	}
+}
+
+void CDatagramPacer::refill(qint64 tNow)
+{
+	refillBucket(m_nBytes, m_tBytes, m_nByteRate, m_nByteBurst, tNow);
+	refillBucket(m_nPackets, m_tPackets, m_nPacketRate, m_nPacketBurst, tNow);
+}
+
+// Sending is allowed while both buckets are positive, so one datagram may overdraw them.
+// The debt is paid back before anything else goes out.
+void CDatagramPacer::consume(quint32 nBytes)
+{
+	m_nBytes -= nBytes;
+	m_nPackets--;
+}
+
+// Nanoseconds until canSend() turns true again, measured from the last refill().
+qint64 CDatagramPacer::waitTime() const
+{
+	qint64 tWait = 0;
+
+	if(m_nBytes <= 0)
+	{
+		tWait = qMax(tWait, (1 - m_nBytes) * PACER_NS / m_nByteRate);
+	}
+	if(m_nPackets <= 0)
+	{
+		tWait = qMax(tWait, (1 - m_nPackets) * PACER_NS / m_nPacketRate);
+	}
+
+	return tWait;
+}
+
+void CDatagramPacer::enqueue(DatagramOut* pDatagram, int nClass, qint64 tNow)
+{
+	Q_ASSERT(nClass > ClassAck && nClass < ClassCount);
+	Q_ASSERT(pDatagram->m_pDest == 0);
+
+	SendQueue& oQueue = m_oQueues[nClass];
+	DatagramKey oKey(pDatagram->m_oAddress, 0);
+
+	DatagramDestination* pDest = oQueue.mDestinations.value(oKey, 0);
+	if(!pDest)
+	{
+		pDest = new DatagramDestination;
+		pDest->oKey = oKey;
+		pDest->pHead = pDest->pTail = 0;
+		pDest->nClass = nClass;
+
+		// New destinations join at the back of the round
+		pDest->pNext = 0;
+		pDest->pPrev = oQueue.pTail;
+		if(oQueue.pTail)
+		{
+			oQueue.pTail->pNext = pDest;
+		}
+		else
+		{
+			oQueue.pHead = pDest;
+		}
+		oQueue.pTail = pDest;
+
+		oQueue.mDestinations.insert(oKey, pDest);
+	}
+
+	pDatagram->m_nClass = nClass;
+	pDatagram->m_tQueued = tNow;
+	pDatagram->m_bStarted = false;
+	pDatagram->m_pDest = pDest;
+	pDatagram->m_pNextOut = 0;
+	pDatagram->m_pPrevOut = pDest->pTail;
+	if(pDest->pTail)
+	{
+		pDest->pTail->m_pNextOut = pDatagram;
+	}
+	else
+	{
+		pDest->pHead = pDatagram;
+	}
+	pDest->pTail = pDatagram;
+
+	oQueue.nDatagrams++;
+}
+
+// Takes the datagram out of its destination queue, if it is in one.
+void CDatagramPacer::dequeue(DatagramOut* pDatagram)
+{
+	DatagramDestination* pDest = pDatagram->m_pDest;
+	if(!pDest)
+	{
+		return;
+	}
+
+	if(pDatagram->m_pPrevOut)
+	{
+		pDatagram->m_pPrevOut->m_pNextOut = pDatagram->m_pNextOut;
+	}
+	else
+	{
+		pDest->pHead = pDatagram->m_pNextOut;
+	}
+	if(pDatagram->m_pNextOut)
+	{
+		pDatagram->m_pNextOut->m_pPrevOut = pDatagram->m_pPrevOut;
+	}
+	else
+	{
+		pDest->pTail = pDatagram->m_pPrevOut;
+	}
+
+	pDatagram->m_pDest = 0;
+	pDatagram->m_pPrevOut = pDatagram->m_pNextOut = 0;
+
+	SendQueue& oQueue = m_oQueues[pDest->nClass];
+	oQueue.nDatagrams--;
+
+	if(!pDest->pHead)
+	{
+		unlink(oQueue, pDest);
+		oQueue.mDestinations.remove(pDest->oKey);
+		delete pDest;
+	}
+}
+
+// Head datagram of the destination whose turn it is, in the highest busy class.
+DatagramOut* CDatagramPacer::front() const
+{
+	for(int i = ClassControl; i < ClassCount; i++)
+	{
+		if(m_oQueues[i].pHead)
+		{
+			return m_oQueues[i].pHead->pHead;
+		}
+	}
+
+	return 0;
+}
+
+// Called after a fragment of front() went out. Its destination moves to the back of the round,
+// and if the datagram has nothing more to send for now it leaves the queue.
+void CDatagramPacer::rotate(bool bDone)
+{
+	DatagramOut* pDatagram = front();
+	Q_ASSERT(pDatagram);
+
+	DatagramDestination* pDest = pDatagram->m_pDest;
+	SendQueue& oQueue = m_oQueues[pDest->nClass];
+
+	if(bDone)
+	{
+		if(pDest->pHead == pDest->pTail)
+		{
+			dequeue(pDatagram); // takes the destination with it
+			return;
+		}
+
+		dequeue(pDatagram);
+	}
+
+	if(oQueue.pTail != pDest)
+	{
+		unlink(oQueue, pDest);
+
+		pDest->pNext = 0;
+		pDest->pPrev = oQueue.pTail;
+		oQueue.pTail->pNext = pDest;
+		oQueue.pTail = pDest;
+	}
+}
+
+void CDatagramPacer::clear()
+{
+	while(DatagramOut* pDatagram = front())
+	{
+		dequeue(pDatagram);
+	}
+}
+
+void CDatagramPacer::unlink(SendQueue& oQueue, DatagramDestination* pDest)
+{
+	if(pDest->pPrev)
+	{
+		pDest->pPrev->pNext = pDest->pNext;
+	}
+	else
+	{
+		oQueue.pHead = pDest->pNext;
+	}
+	if(pDest->pNext)
+	{
+		pDest->pNext->pPrev = pDest->pPrev;
+	}
+	else
+	{
+		oQueue.pTail = pDest->pPrev;
+	}
+
+	pDest->pPrev = pDest->pNext = 0;
+}
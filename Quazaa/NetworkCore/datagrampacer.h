@@ -0,0 +1,122 @@
+/*
+** datagrampacer.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef DATAGRAMPACER_H
+#define DATAGRAMPACER_H
+
+#include "types.h"
+#include <QHash>
+
+#include "datagramfrags.h"
+#include "datagramqueue.h"
+
+// Datagrams waiting for one address/port within one send class
+struct DatagramDestination
+{
+	DatagramKey				oKey;
+	DatagramOut*			pHead;
+	DatagramOut*			pTail;
+	DatagramDestination*	pPrev;
+	DatagramDestination*	pNext;
+	int						nClass;
+};
+
+// Token bucket scheduler for outgoing UDP.
+// Datagrams wait in per-destination FIFOs, destinations take turns one fragment at a time
+// within a priority class, and a lower class only gets to send when the higher ones are idle.
+class CDatagramPacer
+{
+public:
+	enum SendClass
+	{
+		ClassAck,		// GND acknowledgements, kept in CDatagrams' ACK ring
+		ClassControl,	// query acks, query keys, pings, crawler replies
+		ClassHits,		// query hits
+		ClassBulk,		// everything else, queries included
+		ClassCount
+	};
+
+protected:
+	struct SendQueue
+	{
+		QHash<DatagramKey, DatagramDestination*> mDestinations;
+		DatagramDestination*	pHead;		// next destination to serve
+		DatagramDestination*	pTail;
+		quint32			nDatagrams;
+	};
+
+	SendQueue	m_oQueues[ClassCount];
+
+	// Byte and packet buckets, refilled from a monotonic clock in nanoseconds
+	qint64		m_nBytes;
+	qint64		m_nByteRate;
+	qint64		m_nByteBurst;
+	qint64		m_nPackets;
+	qint64		m_nPacketRate;
+	qint64		m_nPacketBurst;
+	qint64		m_tBytes;
+	qint64		m_tPackets;
+
+public:
+	DatagramStageStats	m_oClassStats[ClassCount];	// enqueue to first fragment on the wire
+
+public:
+	CDatagramPacer();
+	~CDatagramPacer();
+
+	static int classOf(G2Packet* pPacket);
+
+	void setLimits(quint32 nBytesPerSecond, quint32 nPacketsPerSecond, qint64 tNow);
+	void refill(qint64 tNow);
+	inline bool canSend() const;
+	void consume(quint32 nBytes);
+	qint64 waitTime() const;
+
+	void enqueue(DatagramOut* pDatagram, int nClass, qint64 tNow);
+	void dequeue(DatagramOut* pDatagram);
+	DatagramOut* front() const;
+	void rotate(bool bDone);
+	void clear();
+
+	inline bool isEmpty() const;
+	inline quint32 queued(int nClass) const;
+
+protected:
+	void unlink(SendQueue& oQueue, DatagramDestination* pDest);
+};
+
+bool CDatagramPacer::canSend() const
+{
+	return (m_nBytes > 0 && m_nPackets > 0);
+}
+bool CDatagramPacer::isEmpty() const
+{
+	return (!m_oQueues[ClassControl].pHead && !m_oQueues[ClassHits].pHead && !m_oQueues[ClassBulk].pHead);
+}
+quint32 CDatagramPacer::queued(int nClass) const
+{
+	return m_oQueues[nClass].nDatagrams;
+}
+
+#endif // DATAGRAMPACER_H
@@ -0,0 +1,101 @@
+/*
+** datagramqueue.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "datagramqueue.h"
+#include "g2packet.h"
+
+#include "debug_new.h"
+
+CDatagramQueue::CDatagramQueue()
+{
+	m_pEntries = 0;
+	m_nCapacity = 0;
+}
+
+CDatagramQueue::~CDatagramQueue()
+{
+	reset(0);
+}
+
+void CDatagramQueue::reset(quint32 nCapacity)
+{
+	DatagramQueueEntry oEntry;
+	while(pop(oEntry))
+	{
+		oEntry.pPacket->release();
+	}
+
+	delete [] m_pEntries;
+	m_pEntries = 0;
+	m_nCapacity = 0;
+
+	if(nCapacity)
+	{
+		m_nCapacity = 1;
+		while(m_nCapacity < nCapacity)
+		{
+			m_nCapacity <<= 1;
+		}
+		m_pEntries = new DatagramQueueEntry[m_nCapacity];
+	}
+
+	m_nHead.storeRelease(0);
+	m_nTail.storeRelease(0);
+}
+
+bool CDatagramQueue::push(const CEndPoint& oAddress, G2Packet* pPacket, qint64 tReceived, qint64 tQueued)
+{
+	quint32 nTail = quint32(m_nTail.load());
+
+	if(nTail - quint32(m_nHead.loadAcquire()) >= m_nCapacity)
+	{
+		return false;
+	}
+
+	DatagramQueueEntry& oEntry = m_pEntries[nTail & (m_nCapacity - 1)];
+	oEntry.oAddress = oAddress;
+	oEntry.pPacket = pPacket;
+	oEntry.tReceived = tReceived;
+	oEntry.tQueued = tQueued;
+
+	m_nTail.storeRelease(int(nTail + 1));
+	return true;
+}
+
+bool CDatagramQueue::pop(DatagramQueueEntry& oEntry)
+{
+	quint32 nHead = quint32(m_nHead.load());
+
+	if(nHead == quint32(m_nTail.loadAcquire()))
+	{
+		return false;
+	}
+
+	DatagramQueueEntry& oSlot = m_pEntries[nHead & (m_nCapacity - 1)];
+	oEntry = oSlot;
+	oSlot.pPacket = 0;
+
+	m_nHead.storeRelease(int(nHead + 1));
+	return true;
+}
@@ -0,0 +1,103 @@
+/*
+** datagramqueue.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef DATAGRAMQUEUE_H
+#define DATAGRAMQUEUE_H
+
+#include "types.h"
+#include <QAtomicInt>
+
+class G2Packet;
+
+// A reassembled UDP packet waiting for its handler.
+struct DatagramQueueEntry
+{
+	CEndPoint	oAddress;
+	G2Packet*	pPacket;
+	qint64		tReceived;	// when the last fragment was read from the socket
+	qint64		tQueued;	// when the packet entered the queue
+};
+
+// Bounded single producer / single consumer ring.
+// The datagram thread pushes, the network thread pops, neither one ever blocks.
+class CDatagramQueue
+{
+protected:
+	DatagramQueueEntry*	m_pEntries;
+	quint32				m_nCapacity;	// power of two
+	QAtomicInt			m_nHead;		// next entry to pop, written by the consumer
+	QAtomicInt			m_nTail;		// next entry to push, written by the producer
+
+public:
+	CDatagramQueue();
+	~CDatagramQueue();
+
+	// Only while neither side is running.
+	void reset(quint32 nCapacity);
+
+	bool push(const CEndPoint& oAddress, G2Packet* pPacket, qint64 tReceived, qint64 tQueued);
+	bool pop(DatagramQueueEntry& oEntry);
+
+	inline quint32 depth() const;
+	inline quint32 capacity() const;
+};
+
+quint32 CDatagramQueue::depth() const
+{
+	return quint32(m_nTail.loadAcquire()) - quint32(m_nHead.loadAcquire());
+}
+quint32 CDatagramQueue::capacity() const
+{
+	return m_nCapacity;
+}
+
+// Latency of one pipeline stage, in nanoseconds.
+struct DatagramStageStats
+{
+	quint32	nCount;
+	quint64	nTotal;
+	quint64	nMax;
+
+	DatagramStageStats()
+		: nCount(0), nTotal(0), nMax(0)
+	{
+	}
+
+	inline void add(qint64 nTime)
+	{
+		nCount++;
+		nTotal += nTime;
+		if(quint64(nTime) > nMax)
+		{
+			nMax = nTime;
+		}
+	}
+
+	inline quint64 average() const
+	{
+		return nCount ? nTotal / nCount : 0;
+	}
+};
+
+#endif // DATAGRAMQUEUE_H
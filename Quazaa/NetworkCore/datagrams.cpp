@@ -35,6 +35,7 @@
 #include "querykeys.h"
 #include "query.h"
 #include "securitymanager.h"
+#include "zlibutils.h"
 
 #include "HostCache/hostcache.h"
 
@@ -47,6 +48,7 @@
 #include "debug_new.h"
 
 CDatagrams Datagrams;
+CThread DatagramsThread;
 
 CDatagrams::CDatagrams()
 {
@@ -64,6 +66,28 @@ CDatagrams::CDatagrams()
 
 	m_nInFrags = 0;
 	m_nOutFrags = 0;
+
+	m_pInFrames = 0;
+	m_pRecvNewest = 0;
+	m_pRecvOldest = 0;
+	m_pDoneNewest = 0;
+	m_pDoneOldest = 0;
+	m_pFreeDatagramIn = 0;
+	m_nInCompleted = 0;
+	m_nInExpired = 0;
+	m_pReassembly = new CBuffer(8192);
+
+	m_nAckHead = 0;
+	m_nAcks = 0;
+	m_nAcksDropped = 0;
+	m_tResendCheck = 0;
+
+	m_oClock.start();
+	m_tRead = 0;
+	m_nQueued = 0;
+	m_nQueueDropped = 0;
+	m_nQueueMax = 0;
+	m_tStatsReported = 0;
 }
 
 CDatagrams::~CDatagrams()
@@ -91,18 +115,67 @@ CDatagrams::~CDatagrams()
 	{
 		delete m_pHostAddress;
 	}
+	if(m_pReassembly)
+	{
+		delete m_pReassembly;
+	}
 }
 
+// Called on the main thread by CNetwork::start(), which owns this object until DatagramsThread
+// takes it over. Socket I/O and reassembly run on DatagramsThread, complete packets reach the
+// network thread through m_oQueue and m_oDispatcher.
 void CDatagrams::listen()
 {
 	QMutexLocker l(&m_pSection);
 
-	if(m_bActive)
+	if(m_bActive || DatagramsThread.isRunning())
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("CDatagrams::Listen - already listening"));
 		return;
 	}
 
+	m_oQueue.reset(qMax(quazaaSettings.Gnutella2.UdpQueue, 16));
+	m_nQueued = 0;
+	m_nQueueDropped = 0;
+	m_nQueueMax = 0;
+	m_oReceiveStats = DatagramStageStats();
+	m_oQueueStats = DatagramStageStats();
+	m_oHandlerStats = DatagramStageStats();
+	for(int i = 0; i < CDatagramPacer::ClassCount; i++)
+	{
+		m_oPacer.m_oClassStats[i] = DatagramStageStats();
+	}
+	m_tStatsReported = time(0);
+
+	DatagramsThread.start("Datagrams", &m_pSection, this);
+}
+
+void CDatagrams::disconnectNode()
+{
+	QMutexLocker l(&m_pSection);
+
+	m_bActive = false;
+
+	if(DatagramsThread.isRunning())
+	{
+		DatagramsThread.exit(0);
+	}
+
+	reportStats();
+
+	// The producer is gone, drop whatever the handlers did not get to
+	m_oQueue.reset(0);
+
+	if(m_oDispatcher.thread() == QThread::currentThread())
+	{
+		m_oDispatcher.moveToThread(qApp->thread());
+	}
+}
+
+void CDatagrams::setupThread()
+{
+	ASSUME_LOCK(m_pSection);
+
 	Q_ASSERT(m_pSocket == 0);
 
 	m_pSocket = new QUdpSocket(this);
@@ -113,21 +186,47 @@ void CDatagrams::listen()
 		systemLog.postLog(LogSeverity::Debug, QString("Datagrams listening on %1").arg(m_pSocket->localPort()));
 		m_nDiscarded = 0;
 
+#ifdef QUAZAA_UDP_BATCH
+		if(m_oBatch.attach(m_pSocket->socketDescriptor(), quazaaSettings.Gnutella2.UdpBatch))
+		{
+			systemLog.postLog(LogSeverity::Debug, QString("Datagrams batching up to %1 datagrams per call").arg(m_oBatch.size()));
+		}
+#endif
+
 		for(int i = 0; i < quazaaSettings.Gnutella2.UdpBuffers; i++)
 		{
-			m_FreeBuffer.append(new CBuffer(1024));
+			m_FreeBuffer.append(new CBuffer(1024, true));
 		}
 
-		for(int i = 0; i < quazaaSettings.Gnutella2.UdpInFrames; i++)
+		int nInFrames = qMax(quazaaSettings.Gnutella2.UdpInFrames, 1);
+		m_pInFrames = new DatagramIn[nInFrames];
+		for(int i = nInFrames - 1; i >= 0; i--)
 		{
-			m_FreeDatagramIn.append(new DatagramIn);
+			m_pInFrames[i].m_oData.ensure(2048);
+			m_pInFrames[i].m_pNext = m_pFreeDatagramIn;
+			m_pFreeDatagramIn = &m_pInFrames[i];
 		}
+		m_RecvCache.reserve(nInFrames);
+
+		m_nAckHead = 0;
+		m_nAcks = 0;
+		m_nAcksDropped = 0;
 
 		for(int i = 0; i < quazaaSettings.Gnutella2.UdpOutFrames; i++)
 		{
 			m_FreeDatagramOut.append(new DatagramOut);
 		}
 
+		m_nFlushPending.storeRelease(0);
+
+		m_oPacer.setLimits(m_nUploadLimit, quazaaSettings.Connection.UDPOutLimitPPS, m_oClock.nsecsElapsed());
+		m_tResendCheck = 0;
+
+		m_tSender = new QTimer(this);
+		m_tSender->setSingleShot(true);
+		m_tSender->setTimerType(Qt::PreciseTimer);
+		connect(m_tSender, SIGNAL(timeout()), this, SLOT(flushSendCache()));
+
 		connect(this, SIGNAL(sendQueueUpdated()), this, SLOT(flushSendCache()), Qt::QueuedConnection);
 		connect(m_pSocket, SIGNAL(readyRead()), this, SLOT(onDatagram()), Qt::QueuedConnection);
 
@@ -136,18 +235,28 @@ void CDatagrams::listen()
 	else
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("Can't bind UDP socket! UDP communication disabled!"));
-		disconnectNode();
+		cleanupThread();
 	}
 
 	m_bFirewalled = true;
 }
 
-void CDatagrams::disconnectNode()
+void CDatagrams::cleanupThread()
 {
-	QMutexLocker l(&m_pSection);
+	ASSUME_LOCK(m_pSection);
 
 	m_bActive = false;
 
+#ifdef QUAZAA_UDP_BATCH
+	if(m_oBatch.isAttached())
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("Datagrams batch stats: %1 datagrams in %2 receive calls, %3 datagrams in %4 send calls")
+						  .arg(m_oBatch.m_nRecvDatagrams).arg(m_oBatch.m_nRecvCalls)
+						  .arg(m_oBatch.m_nSendDatagrams).arg(m_oBatch.m_nSendCalls));
+		m_oBatch.detach();
+	}
+#endif
+
 	if(m_pSocket)
 	{
 		m_pSocket->close();
@@ -157,25 +266,29 @@ void CDatagrams::disconnectNode()
 
 	disconnect(SIGNAL(sendQueueUpdated()));
 
-	while(!m_AckCache.isEmpty())
+	if(m_tSender)
 	{
-		QPair<CEndPoint, char*> oAck = m_AckCache.takeFirst();
-		delete [] oAck.second;
+		delete m_tSender;
+		m_tSender = 0;
 	}
 
+	m_nAcks = 0;
+	m_oPacer.clear();
+
 	while(!m_SendCache.isEmpty())
 	{
 		remove(m_SendCache.first());
 	}
 
-	while(!m_RecvCacheTime.isEmpty())
-	{
-		remove(m_RecvCacheTime.first());
-	}
+	m_RecvCache.clear();
+	m_pRecvNewest = m_pRecvOldest = 0;
+	m_pDoneNewest = m_pDoneOldest = 0;
+	m_pFreeDatagramIn = 0;
 
-	while(!m_FreeDatagramIn.isEmpty())
+	if(m_pInFrames)
 	{
-		delete m_FreeDatagramIn.takeFirst();
+		delete [] m_pInFrames;
+		m_pInFrames = 0;
 	}
 
 	while(!m_FreeDatagramOut.isEmpty())
@@ -187,6 +300,8 @@ void CDatagrams::disconnectNode()
 	{
 		delete m_FreeBuffer.takeFirst();
 	}
+
+	moveToThread(qApp->thread());
 }
 
 void CDatagrams::onDatagram()
@@ -196,153 +311,191 @@ void CDatagrams::onDatagram()
 		return;
 	}
 
-	//while(m_pSocket->hasPendingDatagrams())
+	// One datagram goes through Qt, this is what re-arms the socket notifier.
+	// The queue may already have been drained by the batch below.
+	qint64 nSize = qMax<qint64>(m_pSocket->pendingDatagramSize(), 0);
+	m_pRecvBuffer->resize(nSize);
+	qint64 nReadSize = m_pSocket->readDatagram(m_pRecvBuffer->data(), nSize, m_pHostAddress, &m_nPort);
+
+	m_mInput.Add(nReadSize);
+	m_tRead = m_oClock.nsecsElapsed();
+
+	if(nReadSize >= 0)
 	{
-		qint64 nSize = m_pSocket->pendingDatagramSize();
-		m_pRecvBuffer->resize(nSize);
-		qint64 nReadSize = m_pSocket->readDatagram(m_pRecvBuffer->data(), nSize, m_pHostAddress, &m_nPort);
+		m_pRecvBuffer->resize(nReadSize);
+		processDatagram();
+	}
 
-		m_mInput.Add(nReadSize);
+#ifdef QUAZAA_UDP_BATCH
+	// Whatever else is queued on the socket is drained in one call
+	if(m_bActive && m_oBatch.isAttached())
+	{
+		CBuffer* pRecvBuffer = m_pRecvBuffer;
+		int nReceived = m_oBatch.receive();
+		m_tRead = m_oClock.nsecsElapsed();
 
-		if(nReadSize < 8)
+		for(int i = 0; i < nReceived && m_bActive; i++)
 		{
-		//	continue;
-			return;
+			m_pRecvBuffer = m_oBatch.buffer(i);
+			m_oBatch.address(i, m_pHostAddress, &m_nPort);
+			m_mInput.Add(m_pRecvBuffer->size());
+
+			processDatagram();
 		}
 
-		m_nInFrags++;
+		m_pRecvBuffer = pRecvBuffer;
+	}
+#endif
+}
+
+void CDatagrams::processDatagram()
+{
+	if(m_pRecvBuffer->size() < 8)
+	{
+		return;
+	}
+
+	m_nInFrags++;
 
-		GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-		if(strncmp((char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount))
+	GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
+	if(strncmp((char*)&pHeader->szTag, "GND", 3) == 0 && pHeader->nPart > 0 && (pHeader->nCount == 0 || pHeader->nPart <= pHeader->nCount))
+	{
+		if(pHeader->nCount == 0)
 		{
-			if(pHeader->nCount == 0)
-			{
-				// ACK
-				onAcknowledgeGND();
-			}
-			else
-			{
-				// DG
-				onReceiveGND();
-			}
+			// ACK
+			onAcknowledgeGND();
+		}
+		else
+		{
+			// DG
+			qint64 tStart = m_oClock.nsecsElapsed();
+			onReceiveGND();
+			m_oReassemblyStats.add(m_oClock.nsecsElapsed() - tStart);
 		}
 	}
 }
 
 void CDatagrams::onReceiveGND()
 {
+	// Only DatagramsThread and the send path take this lock, never the handlers
+	QMutexLocker l(&m_pSection);
+
 	GND_HEADER* pHeader = (GND_HEADER*)m_pRecvBuffer->data();
-	QHostAddress nIp = *m_pHostAddress;
-	quint32 nSeq = ((pHeader->nSequence << 16) & 0xFFFF0000) + (m_nPort & 0x0000FFFF);
+	CEndPoint oSender(*m_pHostAddress, m_nPort);
+	DatagramKey oKey(oSender, pHeader->nSequence);
 
 #ifdef DEBUG_UDP
 	systemLog.postLog(LogSeverity::Debug, "Received GND from %s:%u nSequence = %u nPart = %u nCount = %u", m_pHostAddress->toString().toLocal8Bit().constData(), m_nPort, pHeader->nSequence, pHeader->nPart, pHeader->nCount);
 #endif
 
-	DatagramIn* pDatagramIn = 0;
+	DatagramIn* pDatagramIn = m_RecvCache.value(oKey, 0);
 
-	if(m_RecvCache.contains(nIp) && m_RecvCache[nIp].contains(nSeq))
+	if(pDatagramIn)
 	{
-		pDatagramIn = m_RecvCache[nIp][nSeq];
-
 		// To give a chance for bigger packages ;)
 		if(pDatagramIn->m_nLeft)
 		{
 			pDatagramIn->m_tStarted = time(0);
+			touch(pDatagramIn);
 		}
 	}
 	else
 	{
-		QMutexLocker l(&m_pSection);
-
-		if(!m_FreeDatagramIn.isEmpty())
+		if(!m_pFreeDatagramIn)
 		{
-			pDatagramIn = m_FreeDatagramIn.takeFirst();
-		}
-		else
-		{
-			if(m_FreeDatagramIn.isEmpty())
+			removeOldIn(true);
+			if(!m_pFreeDatagramIn)
 			{
-				removeOldIn(true);
-				if(m_FreeDatagramIn.isEmpty())
-				{
 #ifdef DEBUG_UDP
-					systemLog.postLog(LogSeverity::Debug, QString("UDP in frames exhausted"));
+				systemLog.postLog(LogSeverity::Debug, QString("UDP in frames exhausted"));
 #endif
-					m_nDiscarded++;
-					return;
-				}
+				m_nDiscarded++;
+				return;
 			}
-
-			pDatagramIn = m_FreeDatagramIn.takeFirst();
 		}
 
-		if(m_FreeBuffer.size() < pHeader->nCount)
-		{
-			m_nDiscarded++;
-			m_FreeDatagramIn.append(pDatagramIn);
-			removeOldIn(false);
-			return;
-		}
+		pDatagramIn = m_pFreeDatagramIn;
+		m_pFreeDatagramIn = pDatagramIn->m_pNext;
 
-		pDatagramIn->create(CEndPoint(*m_pHostAddress, m_nPort), pHeader->nFlags, pHeader->nSequence, pHeader->nCount);
+		pDatagramIn->create(oSender, pHeader->nFlags, pHeader->nSequence, pHeader->nCount);
 
-		for(int i = 0; i < pHeader->nCount; i++)
-		{
-			Q_ASSERT(pDatagramIn->m_pBuffer[i] == 0);
-			pDatagramIn->m_pBuffer[i] = m_FreeBuffer.takeFirst();
-		}
-
-		m_RecvCache[nIp][nSeq] = pDatagramIn;
-		m_RecvCacheTime.prepend(pDatagramIn);
+		m_RecvCache.insert(oKey, pDatagramIn);
+		pDatagramIn->m_pPrev = pDatagramIn->m_pNext = 0;
+		touch(pDatagramIn);
 	}
 
 	// It is here, in case if we did not have free datagrams
 	// ACK = I've received a datagram, and if you have received and rejected it, do not send ACK-a
 	if(pHeader->nFlags & 0x02)
 	{
-		GND_HEADER* pAck = new GND_HEADER;
-
-		memcpy(pAck, pHeader, sizeof(GND_HEADER));
-		pAck->nCount = 0;
-		pAck->nFlags = 0;
-
 #ifdef DEBUG_UDP
 		systemLog.postLog(LogSeverity::Debug, "Sending UDP ACK to %s:%u", m_pHostAddress->toString().toLocal8Bit().constData(), m_nPort);
 #endif
 
-		//m_pSocket->writeDatagram((char*)&oAck, sizeof(GND_HEADER), *m_pHostAddress, m_nPort);
-		//m_mOutput.Add(sizeof(GND_HEADER));
-		m_AckCache.append(qMakePair(CEndPoint(*m_pHostAddress, m_nPort), reinterpret_cast<char*>(pAck)));
-		if( m_AckCache.count() == 1 )
-			QMetaObject::invokeMethod(this, "flushSendCache", Qt::QueuedConnection);
+		queueAck(pHeader);
 	}
 
 	if(pDatagramIn->add(pHeader->nPart, m_pRecvBuffer->data() + sizeof(GND_HEADER), m_pRecvBuffer->size() - sizeof(GND_HEADER)))
 	{
-
 		G2Packet* pPacket = 0;
 		try
 		{
-			CEndPoint addr(*m_pHostAddress, m_nPort);
-			pPacket = pDatagramIn->toG2Packet();
-			if(pPacket)
-			{
-				onPacket(addr, pPacket);
-			}
+			// Not a view, the slab is reclaimed right below
+			pPacket = pDatagramIn->toG2Packet(m_pReassembly, false);
 		}
 		catch(...)
 		{
 
 		}
+
+		remove(pDatagramIn, true);
+
+		// Only kept for late duplicates from now on, the first to go when frames run short
+		unlink(pDatagramIn, m_pRecvNewest, m_pRecvOldest);
+		link(pDatagramIn, m_pDoneNewest, m_pDoneOldest);
+		pDatagramIn->m_tStarted = time(0);
+		m_nInCompleted++;
+
+		l.unlock();
+
 		if(pPacket)
 		{
-			pPacket->release();
+			enqueue(oSender, pPacket);
 		}
+	}
+}
 
-		m_pSection.lock();
-		remove(pDatagramIn, true);
-		m_pSection.unlock();
+// Adds an ACK for the fragment to the ring. A repeat of the newest pending ACK is coalesced.
+void CDatagrams::queueAck(const GND_HEADER* pHeader)
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(m_nAcks)
+	{
+		DatagramAck& oLast = m_pAcks[(m_nAckHead + m_nAcks - 1) % AckRingSize];
+		if(oLast.nSequence == pHeader->nSequence && oLast.nPart == pHeader->nPart
+		   && oLast.oAddress.port() == m_nPort && oLast.oAddress == *m_pHostAddress)
+		{
+			return;
+		}
+	}
+
+	if(m_nAcks == AckRingSize)
+	{
+		// The sender will retransmit, that is cheaper than growing here
+		m_nAcksDropped++;
+		return;
+	}
+
+	DatagramAck& oAck = m_pAcks[(m_nAckHead + m_nAcks) % AckRingSize];
+	oAck.oAddress = CEndPoint(*m_pHostAddress, m_nPort);
+	oAck.nSequence = pHeader->nSequence;
+	oAck.nPart = pHeader->nPart;
+	oAck.tQueued = m_oClock.nsecsElapsed();
+
+	if(++m_nAcks == 1)
+	{
+		QMetaObject::invokeMethod(this, "flushSendCache", Qt::QueuedConnection);
 	}
 }
 
@@ -354,6 +507,8 @@ void CDatagrams::onAcknowledgeGND()
 	systemLog.postLog(LogSeverity::Debug, "UDP received GND ACK from %s seq %u part %u", m_pHostAddress->toString().toLocal8Bit().constData(), pHeader->nSequence, pHeader->nPart);
 #endif
 
+	QMutexLocker l(&m_pSection);
+
 	if(!m_SendCacheMap.contains(pHeader->nSequence))
 	{
 		return;
@@ -363,77 +518,294 @@ void CDatagrams::onAcknowledgeGND()
 
 	if(pDatagramOut->acknowledge(pHeader->nPart))
 	{
-		m_pSection.lock();
 		remove(pDatagramOut);
-		m_pSection.unlock();
 	}
 }
 
-void CDatagrams::remove(DatagramIn* pDatagramIn, bool bReclaim)
+// Hands a reassembled packet over to the network thread. Never blocks,
+// if the handlers fall behind the packet is dropped.
+void CDatagrams::enqueue(const CEndPoint& oAddr, G2Packet* pPacket)
 {
-	ASSUME_LOCK(m_pSection);
-	for(int i = 0; i < pDatagramIn->m_nCount; i++)
+	qint64 tNow = m_oClock.nsecsElapsed();
+
+	if(!m_oQueue.push(oAddr, pPacket, m_tRead, tNow))
 	{
-		if(pDatagramIn->m_pBuffer[i])
+		m_nQueueDropped++;
+		pPacket->release();
+		return;
+	}
+
+	m_nQueued++;
+	m_oReceiveStats.add(tNow - m_tRead);
+
+	m_oDispatcher.schedule();
+}
+
+// Runs up to nMax queued packets through their handlers, on the network thread.
+void CDatagrams::dispatch(int nMax)
+{
+	DatagramQueueEntry oEntry;
+
+	quint32 nDepth = m_oQueue.depth();
+	if(nDepth > m_nQueueMax)
+	{
+		m_nQueueMax = nDepth;
+	}
+
+	for(int i = 0; i < nMax && m_oQueue.pop(oEntry); i++)
+	{
+		qint64 tStart = m_oClock.nsecsElapsed();
+		m_oQueueStats.add(tStart - oEntry.tQueued);
+
+		if(m_bActive)
 		{
-			m_FreeBuffer.append(pDatagramIn->m_pBuffer[i]);
-			pDatagramIn->m_pBuffer[i]->clear();
-			pDatagramIn->m_pBuffer[i] = 0;
+			onPacket(oEntry.oAddress, oEntry.pPacket);
 		}
+		oEntry.pPacket->release();
+
+		m_oHandlerStats.add(m_oClock.nsecsElapsed() - tStart);
 	}
 
-	if(bReclaim)
+	if(time(0) - m_tStatsReported >= 300)
+	{
+		reportStats();
+	}
+}
+
+void CDatagrams::reportStats()
+{
+	m_tStatsReported = time(0);
+
+	systemLog.postLog(LogSeverity::Debug, QString("UDP pipeline: %1 queued, %2 dropped, depth %3 (max %4 of %5)")
+					  .arg(m_nQueued).arg(m_nQueueDropped).arg(m_oQueue.depth()).arg(m_nQueueMax).arg(m_oQueue.capacity()));
+	systemLog.postLog(LogSeverity::Debug, QString("UDP pipeline latency (avg/max us): receive %1/%2, queue %3/%4, handler %5/%6")
+					  .arg(m_oReceiveStats.average() / 1000).arg(m_oReceiveStats.nMax / 1000)
+					  .arg(m_oQueueStats.average() / 1000).arg(m_oQueueStats.nMax / 1000)
+					  .arg(m_oHandlerStats.average() / 1000).arg(m_oHandlerStats.nMax / 1000));
+	systemLog.postLog(LogSeverity::Debug, QString("UDP reassembly: %1 completed, %2 expired, %3 discarded, %4 fragments, avg/max %5/%6 ns per fragment")
+					  .arg(m_nInCompleted).arg(m_nInExpired).arg(m_nDiscarded).arg(m_oReassemblyStats.nCount)
+					  .arg(m_oReassemblyStats.average()).arg(m_oReassemblyStats.nMax));
+
+	ZLibUtils::Stats oCompress, oUncompress;
+	ZLibUtils::statistics(oCompress, oUncompress);
+	systemLog.postLog(LogSeverity::Debug, QString("zlib: deflate %1 -> %2 bytes in %3 ms, inflate %4 -> %5 bytes in %6 ms")
+					  .arg(oCompress.nIn).arg(oCompress.nOut).arg(oCompress.nTime / 1000000)
+					  .arg(oUncompress.nIn).arg(oUncompress.nOut).arg(oUncompress.nTime / 1000000));
+
+	const DatagramStageStats* pSend = m_oPacer.m_oClassStats;
+	systemLog.postLog(LogSeverity::Debug, QString("UDP send latency (avg/max us): ack %1/%2, control %3/%4, hits %5/%6, bulk %7/%8")
+					  .arg(pSend[0].average() / 1000).arg(pSend[0].nMax / 1000)
+					  .arg(pSend[1].average() / 1000).arg(pSend[1].nMax / 1000)
+					  .arg(pSend[2].average() / 1000).arg(pSend[2].nMax / 1000)
+					  .arg(pSend[3].average() / 1000).arg(pSend[3].nMax / 1000));
+}
+
+#ifdef DEBUG_UDP
+// Feeds nDatagrams synthetic GND datagrams of nParts fragments each through the receive path,
+// last part first and every fragment twice, withholding part 1 so that none completes. Reports
+// the cost per fragment and the memory held per datagram in flight. Call on DatagramsThread.
+void CDatagrams::fragmentStorm(quint32 nDatagrams, quint8 nParts)
+{
+	if(!m_pInFrames || nParts < 2)
 	{
 		return;
 	}
 
-	if(m_RecvCache.contains(pDatagramIn->m_oAddress))
+	CBuffer* pRecvBuffer = m_pRecvBuffer;
+	QHostAddress* pHostAddress = m_pHostAddress;
+	quint16 nPort = m_nPort;
+
+	CBuffer oBuffer(1024);
+	QHostAddress oHostAddress;
+	m_pRecvBuffer = &oBuffer;
+	m_pHostAddress = &oHostAddress;
+	m_nPort = 6346;
+
+	char pPayload[480];
+	memset(pPayload, 0x55, sizeof(pPayload));
+
+	GND_HEADER oHeader;
+	memcpy(oHeader.szTag, "GND", 3);
+	oHeader.nFlags = 0;
+	oHeader.nCount = nParts;
+
+	quint32 nDiscarded = m_nDiscarded;
+	quint32 nFragments = 0;
+	qint64 tStart = m_oClock.nsecsElapsed();
+
+	for(quint8 nPart = nParts; nPart > 1; nPart--)
 	{
-		quint32 nSeq = ((pDatagramIn->m_nSequence << 16) & 0xFFFF0000) + (pDatagramIn->m_oAddress.port() & 0x0000FFFF);
-		Q_ASSERT(pDatagramIn == m_RecvCache[pDatagramIn->m_oAddress][nSeq]);
-		m_RecvCache[pDatagramIn->m_oAddress].remove(nSeq);
-		if(m_RecvCache[pDatagramIn->m_oAddress].isEmpty())
+		for(quint32 i = 0; i < nDatagrams; i++)
 		{
-			m_RecvCache.remove(pDatagramIn->m_oAddress);
+			oHostAddress.setAddress(0xC6120000 + (i >> 8));	// 198.18.0.0/15, reserved for benchmarking
+			oHeader.nSequence = quint16(i);
+			oHeader.nPart = nPart;
+
+			for(int nCopy = 0; nCopy < 2; nCopy++)
+			{
+				oBuffer.clear();
+				oBuffer.append(&oHeader, sizeof(GND_HEADER));
+				oBuffer.append(pPayload, sizeof(pPayload));
+				processDatagram();
+				nFragments++;
+			}
 		}
+	}
+
+	qint64 tElapsed = m_oClock.nsecsElapsed() - tStart;
+
+	QMutexLocker l(&m_pSection);
 
-		QLinkedList<DatagramIn*>::iterator itFrame = m_RecvCacheTime.end();
-		while( itFrame != m_RecvCacheTime.begin() )
+	quint32 nInFlight = 0;
+	quint64 nBytes = 0;
+	for(DatagramIn* pDatagramIn = m_pRecvNewest; pDatagramIn; pDatagramIn = pDatagramIn->m_pNext)
+	{
+		nInFlight++;
+		nBytes += sizeof(DatagramIn) + pDatagramIn->m_oData.capacity() + pDatagramIn->m_nParts * (sizeof(quint32) + sizeof(quint16));
+	}
+
+	systemLog.postLog(LogSeverity::Debug, QString("UDP fragment storm: %1 fragments in %2 us (%3 ns each), %4 datagrams in flight at %5 bytes each, %6 discarded")
+					  .arg(nFragments).arg(tElapsed / 1000).arg(tElapsed / qMax<quint32>(nFragments, 1))
+					  .arg(nInFlight).arg(nBytes / qMax<quint32>(nInFlight, 1)).arg(m_nDiscarded - nDiscarded));
+
+	for(quint32 i = 0; i < nDatagrams; i++)
+	{
+		oHostAddress.setAddress(0xC6120000 + (i >> 8));
+		DatagramIn* pDatagramIn = m_RecvCache.value(DatagramKey(CEndPoint(oHostAddress, m_nPort), quint16(i)), 0);
+		if(pDatagramIn)
 		{
-			--itFrame;
+			remove(pDatagramIn);
+		}
+	}
 
-			if( *itFrame == pDatagramIn )
-			{
-				m_RecvCacheTime.erase(itFrame);
-				break;
-			}
+	m_pRecvBuffer = pRecvBuffer;
+	m_pHostAddress = pHostAddress;
+	m_nPort = nPort;
+}
+#endif
+
+void CDatagrams::remove(DatagramIn* pDatagramIn, bool bReclaim)
+{
+	ASSUME_LOCK(m_pSection);
+
+	pDatagramIn->reclaim();
+
+	if(bReclaim)
+	{
+		return;
+	}
+
+	if(m_RecvCache.remove(pDatagramIn->m_oKey))
+	{
+		if(pDatagramIn->m_nLeft)
+		{
+			unlink(pDatagramIn, m_pRecvNewest, m_pRecvOldest);
+		}
+		else
+		{
+			unlink(pDatagramIn, m_pDoneNewest, m_pDoneOldest);
 		}
 
-		m_FreeDatagramIn.append(pDatagramIn);
+		pDatagramIn->m_pNext = m_pFreeDatagramIn;
+		m_pFreeDatagramIn = pDatagramIn;
 	}
 }
 
-// Removes a package from the cache collection.
+// Moves a partial frame to the newest end of the receive LRU, linking it in if needed.
+void CDatagrams::touch(DatagramIn* pDatagramIn)
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(m_pRecvNewest == pDatagramIn)
+	{
+		return;
+	}
+
+	if(pDatagramIn->m_pPrev)
+	{
+		unlink(pDatagramIn, m_pRecvNewest, m_pRecvOldest);
+	}
+
+	link(pDatagramIn, m_pRecvNewest, m_pRecvOldest);
+}
+
+void CDatagrams::link(DatagramIn* pDatagramIn, DatagramIn*& pNewest, DatagramIn*& pOldest)
+{
+	ASSUME_LOCK(m_pSection);
+
+	pDatagramIn->m_pPrev = 0;
+	pDatagramIn->m_pNext = pNewest;
+	if(pNewest)
+	{
+		pNewest->m_pPrev = pDatagramIn;
+	}
+	pNewest = pDatagramIn;
+	if(!pOldest)
+	{
+		pOldest = pDatagramIn;
+	}
+}
+
+void CDatagrams::unlink(DatagramIn* pDatagramIn, DatagramIn*& pNewest, DatagramIn*& pOldest)
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(pDatagramIn->m_pPrev)
+	{
+		pDatagramIn->m_pPrev->m_pNext = pDatagramIn->m_pNext;
+	}
+	else
+	{
+		pNewest = pDatagramIn->m_pNext;
+	}
+
+	if(pDatagramIn->m_pNext)
+	{
+		pDatagramIn->m_pNext->m_pPrev = pDatagramIn->m_pPrev;
+	}
+	else
+	{
+		pOldest = pDatagramIn->m_pPrev;
+	}
+
+	pDatagramIn->m_pPrev = pDatagramIn->m_pNext = 0;
+}
+
+// Expires frames that have been quiet for UdpInExpire seconds, completed ones first. Both lists
+// are ordered by last activity, so each walk stops at the first frame still in time.
+// bForce: if nothing expired, frees one frame anyway, preferring a completed one.
 void CDatagrams::removeOldIn(bool bForce)
 {
-	quint32 tNow = time(0);
+	ASSUME_LOCK(m_pSection);
+
+	const quint32 tNow = time(0);
+	const quint32 tExpire = quazaaSettings.Gnutella2.UdpInExpire;
 	bool bRemoved = false;
 
-	while(!m_RecvCacheTime.isEmpty() && (tNow - m_RecvCacheTime.back()->m_tStarted > quazaaSettings.Gnutella2.UdpInExpire || m_RecvCacheTime.back()->m_nLeft == 0))
+	while(m_pDoneOldest && tNow - m_pDoneOldest->m_tStarted > tExpire)
 	{
-		remove(m_RecvCacheTime.back());
+		remove(m_pDoneOldest);
 		bRemoved = true;
 	}
 
-	if(bForce && !bRemoved && !m_RecvCacheTime.isEmpty())
+	while(m_pRecvOldest && tNow - m_pRecvOldest->m_tStarted > tExpire)
 	{
-		for(QLinkedList<DatagramIn*>::iterator itPacket = m_RecvCacheTime.begin(); itPacket != m_RecvCacheTime.end(); ++itPacket)
+		remove(m_pRecvOldest);
+		m_nInExpired++;
+		bRemoved = true;
+	}
+
+	if(bForce && !bRemoved)
+	{
+		if(m_pDoneOldest)
 		{
-			if((*itPacket)->m_nLeft == 0)
-			{
-				remove(*itPacket);
-				break;
-			}
+			remove(m_pDoneOldest);
+		}
+		else if(m_pRecvOldest)
+		{
+			// Still nothing free, sacrifice the least recently active partial datagram
+			m_nDiscarded++;
+			remove(m_pRecvOldest);
 		}
 	}
 }
@@ -442,6 +814,7 @@ void CDatagrams::remove(DatagramOut* pDatagramOut)
 {
 	ASSUME_LOCK(m_pSection);
 
+	m_oPacer.dequeue(pDatagramOut);
 	m_SendCacheMap.remove(pDatagramOut->m_nSequence);
 
 	QLinkedList<DatagramOut*>::iterator itFrame = m_SendCache.end();
@@ -470,6 +843,8 @@ void CDatagrams::flushSendCache()
 {
 	QMutexLocker l(&m_pSection);
 
+	m_nFlushPending.storeRelease(0);
+
 	__FlushSendCache();
 }
 
@@ -484,99 +859,163 @@ void CDatagrams::__FlushSendCache()
 	ASSUME_LOCK(Datagrams.m_pSection);
 
 	quint32 tNow = time(0);
+	qint64 tClock = m_oClock.nsecsElapsed();
 
-	qint64 nToWrite = qint64(m_nUploadLimit) - qint64(m_mOutput.Usage());
-
-	static TCPBandwidthMeter meter;
+	m_oPacer.refill(tClock);
 
-	// TODO: Maybe make it dynamic? So bad routers are automatically detected and settings adjusted?
-	qint64 nMaxPPS = quazaaSettings.Connection.UDPOutLimitPPS - meter.Usage();
+	// ACKs go first, they are what keeps the other side from retransmitting
+	GND_HEADER oHeader;
+	memcpy(oHeader.szTag, "GND", 3);
+	oHeader.nFlags = 0;
+	oHeader.nCount = 0;
 
-	if( nMaxPPS <= 0 )
+	while(m_nAcks && m_oPacer.canSend())
 	{
-		systemLog.postLog( LogSeverity::Debug, Components::Network,
-						   "UDP: PPS limit reached, ACKS: %d, Packets: %d, Average PPS: %u / %u",
-						   m_AckCache.size(), m_SendCache.size(), meter.AvgUsage(), meter.Usage() );
-		return;
-	}
+		DatagramAck& oAck = m_pAcks[m_nAckHead];
+		oHeader.nSequence = oAck.nSequence;
+		oHeader.nPart = oAck.nPart;
 
-	while( nToWrite > 0 && !m_AckCache.isEmpty() && nMaxPPS > 0)
-	{
-		QPair< CEndPoint, char* > oAck = m_AckCache.takeFirst();
-		m_pSocket->writeDatagram(oAck.second, sizeof(GND_HEADER), oAck.first, oAck.first.port());
+		writeDatagram((char*)&oHeader, sizeof(GND_HEADER), oAck.oAddress);
 		m_mOutput.Add(sizeof(GND_HEADER));
-		nToWrite -= sizeof(GND_HEADER);
-		delete (GND_HEADER*)oAck.second;
-		nMaxPPS--;
-		meter.Add(1);
-	}
+		m_oPacer.consume(sizeof(GND_HEADER));
+		m_oPacer.m_oClassStats[CDatagramPacer::ClassAck].add(tClock - oAck.tQueued);
 
-	QHostAddress nLastHost;
+		m_nAckHead = (m_nAckHead + 1) % AckRingSize;
+		m_nAcks--;
+	}
 
-	// it can write slightly more than limit allows... that's ok
-	while(nToWrite > 0 && !m_SendCache.isEmpty() && nMaxPPS > 0)
+	// Datagrams waiting for an ACK rejoin the pacer once a part is due for resending
+	if(tNow != m_tResendCheck)
 	{
-		bool bSent = false;
+		m_tResendCheck = tNow;
 
-		char* pPacket;
-		quint32 nPacket;
+		// Runs at least once a second, CNetwork::onSecondTimer() triggers a flush
+		removeOldIn();
 
 		for(QLinkedList<DatagramOut*>::iterator itPacket = m_SendCache.begin(); itPacket != m_SendCache.end(); ++itPacket)
 		{
 			DatagramOut* pDatagramOut = *itPacket;
 
-			if(pDatagramOut->m_oAddress == nLastHost)
+			if(pDatagramOut->m_bAck && !pDatagramOut->m_pDest && pDatagramOut->hasPacket(tNow, m_nInFrags > 0))
 			{
-				continue;
+				m_oPacer.enqueue(pDatagramOut, pDatagramOut->m_nClass, tClock);
 			}
+		}
+	}
 
-			// TODO: Check the firewall's UDP state. Could do 3 UDP states.
-			if(pDatagramOut->getPacket(tNow, &pPacket, &nPacket, pDatagramOut->m_bAck && m_nInFrags > 0))
-			{
+	// Destinations take turns one fragment at a time, it can write slightly more than limit allows... that's ok
+	while(m_oPacer.canSend())
+	{
+		DatagramOut* pDatagramOut = m_oPacer.front();
+		if(!pDatagramOut)
+		{
+			break;
+		}
+
+		// TODO: Check the firewall's UDP state. Could do 3 UDP states.
+		bool bResend = pDatagramOut->m_bAck && m_nInFrags > 0;
+
+		char* pPacket;
+		quint32 nPacket;
+
+		if(pDatagramOut->getPacket(tNow, &pPacket, &nPacket, bResend))
+		{
 #ifdef DEBUG_UDP
-				systemLog.postLog(LogSeverity::Debug, "UDP sending to %s seq %u part %u count %u", pDatagramOut->m_oAddress.toString().toLocal8Bit().constData(), pDatagramOut->m_nSequence, ((GND_HEADER*)pPacket)->nPart, pDatagramOut->m_nCount);
+			systemLog.postLog(LogSeverity::Debug, "UDP sending to %s seq %u part %u count %u", pDatagramOut->m_oAddress.toString().toLocal8Bit().constData(), pDatagramOut->m_nSequence, ((GND_HEADER*)pPacket)->nPart, pDatagramOut->m_nCount);
 #endif
 
-				m_pSocket->writeDatagram(pPacket, nPacket, pDatagramOut->m_oAddress, pDatagramOut->m_oAddress.port());
-				m_nOutFrags++;
+			writeDatagram(pPacket, nPacket, pDatagramOut->m_oAddress);
+			m_nOutFrags++;
+			m_mOutput.Add(nPacket);
+			m_oPacer.consume(nPacket);
 
-				nLastHost = pDatagramOut->m_oAddress;
+			if(!pDatagramOut->m_bStarted)
+			{
+				pDatagramOut->m_bStarted = true;
+				m_oPacer.m_oClassStats[pDatagramOut->m_nClass].add(tClock - pDatagramOut->m_tQueued);
+			}
+		}
 
-				if(nToWrite >= nPacket)
-				{
-					nToWrite -= nPacket;
-				}
-				else
-				{
-					nToWrite = 0;
-				}
+		if(pDatagramOut->hasPacket(tNow, bResend))
+		{
+			m_oPacer.rotate(false);
+		}
+		else if(pDatagramOut->m_bAck)
+		{
+			m_oPacer.rotate(true);	// stays in m_SendCache until acknowledged or expired
+		}
+		else
+		{
+			remove(pDatagramOut);	// all parts are out, nobody will ACK them
+		}
+	}
 
-				m_mOutput.Add(nPacket);
+	flushWrites();
 
-				if(!pDatagramOut->m_bAck)
-				{
-					remove(pDatagramOut);
-				}
+	while(!m_SendCache.isEmpty() && tNow - m_SendCache.back()->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire)
+	{
+		remove(m_SendCache.back());
+	}
 
-				nMaxPPS--;
-				meter.Add(1);
+	schedulePacer();
+}
 
-				bSent = true;
+// Arms the single shot pacer timer for the moment the next datagram may go out,
+// or for the next resend check while datagrams wait for ACKs.
+void CDatagrams::schedulePacer()
+{
+	int nMsec = -1;
 
-				break;
-			}
+	if(m_nAcks || !m_oPacer.isEmpty())
+	{
+		nMsec = int((m_oPacer.waitTime() + 999999) / 1000000);
+		nMsec = qMax(nMsec, 1);
+	}
+	else if(!m_SendCache.isEmpty())
+	{
+		nMsec = 1000;
+	}
+
+	if(nMsec < 0)
+	{
+		m_tSender->stop();
+	}
+	else if(!m_tSender->isActive() || m_tSender->remainingTime() > nMsec)
+	{
+		m_tSender->start(nMsec);
+	}
+}
+
+// Queues a datagram for flushWrites() when batching is available, writes it right away otherwise.
+// The data is not referenced after return.
+void CDatagrams::writeDatagram(const char* pData, quint32 nLength, const CEndPoint& oAddr)
+{
+#ifdef QUAZAA_UDP_BATCH
+	if(m_oBatch.isAttached())
+	{
+		if(m_oBatch.isFull())
+		{
+			m_oBatch.flush();
 		}
 
-		if(m_SendCache.isEmpty() || !bSent)
+		if(m_oBatch.add(pData, nLength, oAddr))
 		{
-			break;
+			return;
 		}
 	}
+#endif
 
-	while(!m_SendCache.isEmpty() && tNow - m_SendCache.back()->m_tSent > quazaaSettings.Gnutella2.UdpOutExpire)
+	m_pSocket->writeDatagram(pData, nLength, oAddr, oAddr.port());
+}
+
+void CDatagrams::flushWrites()
+{
+#ifdef QUAZAA_UDP_BATCH
+	if(m_oBatch.pending())
 	{
-		remove(m_SendCache.back());
+		m_oBatch.flush();
 	}
+#endif
 }
 
 void CDatagrams::sendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, DatagramWatcher* pWatcher, void* pParam)
@@ -602,15 +1041,11 @@ void CDatagrams::sendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, Data
 
 	}
 
+	// Incoming datagrams reassemble in their own slabs, expiring them frees no buffer here
 	if(m_FreeBuffer.isEmpty())
 	{
-		removeOldIn(false);
-
-		if(m_FreeBuffer.isEmpty())
-		{
-			systemLog.postLog(LogSeverity::Debug, QString("UDP out discarded, out of buffers"));
-			return;
-		}
+		systemLog.postLog(LogSeverity::Debug, QString("UDP out discarded, out of buffers"));
+		return;
 	}
 
 	DatagramOut* pDatagramOut = m_FreeDatagramOut.takeFirst();
@@ -618,6 +1053,7 @@ void CDatagrams::sendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, Data
 
 	m_SendCache.prepend(pDatagramOut);
 	m_SendCacheMap[pDatagramOut->m_nSequence] = pDatagramOut;
+	m_oPacer.enqueue(pDatagramOut, CDatagramPacer::classOf(pPacket), m_oClock.nsecsElapsed());
 
 	// TODO: Notify the listener if we have one.
 
@@ -625,50 +1061,47 @@ void CDatagrams::sendPacket(CEndPoint& oAddr, G2Packet* pPacket, bool bAck, Data
 	systemLog.postLog(LogSeverity::Debug, "UDP queued for %s seq %u parts %u", oAddr.toString().toLocal8Bit().constData(), pDatagramOut->m_nSequence, pDatagramOut->m_nCount);
 #endif
 
-	//emit SendQueueUpdated();
-	__FlushSendCache();
+	// The socket belongs to DatagramsThread, let it do the writing
+	if(m_nFlushPending.testAndSetOrdered(0, 1))
+	{
+		emit sendQueueUpdated();
+	}
 }
 
 void CDatagrams::onPacket(CEndPoint addr, G2Packet* pPacket)
 {
 	try
 	{
-		if(pPacket->isType("PI"))
-		{
-			onPing(addr, pPacket);
-		}
-		else if(pPacket->isType("PO"))
-		{
-			onPong(addr, pPacket);
-		}
-		else if(pPacket->isType("CRAWLR"))
-		{
-			onCRAWLR(addr, pPacket);
-		}
-		else if(pPacket->isType("QKR"))
-		{
-			onQKR(addr, pPacket);
-		}
-		else if(pPacket->isType("QKA"))
-		{
-			onQKA(addr, pPacket);
-		}
-		else if(pPacket->isType("QA"))
-		{
-			onQA(addr, pPacket);
-		}
-		else if(pPacket->isType("QH2"))
-		{
-			onQH2(addr, pPacket);
-		}
-		else if(pPacket->isType("Q2"))
-		{
-			onQuery(addr, pPacket);
-		}
-		else
+		switch(pPacket->m_nType)
 		{
-			//systemLog.postLog(LogSeverity::Debug, QString("G2 UDP recieved unknown packet %1").arg(pPacket->GetType()));
-			//qDebug() << "UDP RECEIVED unknown packet " << pPacket->GetType();
+			case G2Type::PI:
+				onPing(addr, pPacket);
+				break;
+			case G2Type::PO:
+				onPong(addr, pPacket);
+				break;
+			case G2Type::CRAWLR:
+				onCRAWLR(addr, pPacket);
+				break;
+			case G2Type::QKR:
+				onQKR(addr, pPacket);
+				break;
+			case G2Type::QKA:
+				onQKA(addr, pPacket);
+				break;
+			case G2Type::QA:
+				onQA(addr, pPacket);
+				break;
+			case G2Type::QH2:
+				onQH2(addr, pPacket);
+				break;
+			case G2Type::Q2:
+				onQuery(addr, pPacket);
+				break;
+			default:
+				//systemLog.postLog(LogSeverity::Debug, QString("G2 UDP recieved unknown packet %1").arg(pPacket->GetType()));
+				//qDebug() << "UDP RECEIVED unknown packet " << pPacket->GetType();
+				break;
 		}
 	}
 	catch(...)
@@ -1078,7 +1511,9 @@ void CDatagrams::onQuery(CEndPoint &addr, G2Packet *pPacket)
 		return;
 	}
 
-	if( !Network.m_oRoutingTable.add(pQuery->m_oGUID, pQuery->m_oEndpoint) )
+	// A known GUID is the same search retransmitted or arriving again, it is acked but not routed.
+	// add() succeeds for known GUIDs as well, so it cannot tell.
+	if( Network.m_oRoutingTable.contains(pQuery->m_oGUID) )
 	{
 #if LOG_QUERY_HANDLING
 		qDebug() << "Query already processed, ignoring";
@@ -1089,6 +1524,25 @@ void CDatagrams::onQuery(CEndPoint &addr, G2Packet *pPacket)
 		return;
 	}
 
+	if( Network.m_oQueryFilter.admit(pQuery, addr) != CQueryFilter::Accepted )
+	{
+#if LOG_QUERY_HANDLING
+		qDebug() << "Query flood or repeated search from" << qPrintable(pQuery->m_oEndpoint.toStringWithPort()) << ", dropping";
+#endif // LOG_QUERY_HANDLING
+		return;
+	}
+
+	if( !Network.m_oRoutingTable.add(pQuery->m_oGUID, pQuery->m_oEndpoint) )
+	{
+#if LOG_QUERY_HANDLING
+		qDebug() << "Routing table full, ignoring query";
+#endif // LOG_QUERY_HANDLING
+		G2Packet* pQA = Neighbours.createQueryAck(pQuery->m_oGUID, false, 0, false);
+		sendPacket(pQuery->m_oEndpoint, pQA, true);
+		pQA->release();
+		return;
+	}
+
 #if LOG_QUERY_HANDLING
 	qDebug() << "Processing query from: " << qPrintable(addr.toStringWithPort());
 #endif // LOG_QUERY_HANDLING
@@ -1115,3 +1569,30 @@ void CDatagrams::onQuery(CEndPoint &addr, G2Packet *pPacket)
 
 	// local search
 }
+
+CDatagramDispatcher::CDatagramDispatcher()
+{
+}
+
+// Called by the producer after every push, posts at most one pending onQueued() event.
+void CDatagramDispatcher::schedule()
+{
+	if(m_nScheduled.testAndSetOrdered(0, 1))
+	{
+		QMetaObject::invokeMethod(this, "onQueued", Qt::QueuedConnection);
+	}
+}
+
+void CDatagramDispatcher::onQueued()
+{
+	// Reset before draining, so a push racing with us schedules another run
+	m_nScheduled.storeRelease(0);
+
+	// Bounded, so a flood does not starve the rest of the network thread
+	Datagrams.dispatch(256);
+
+	if(Datagrams.m_oQueue.depth())
+	{
+		schedule();
+	}
+}
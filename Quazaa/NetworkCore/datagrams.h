@@ -32,9 +32,15 @@
 #include <QLinkedList>
 #include <QTimer>
 #include <QTime>
+#include <QElapsedTimer>
 
 #include "queryhit.h"
 #include "networkconnection.h"
+#include "datagrambatch.h"
+#include "datagramqueue.h"
+#include "datagramfrags.h"
+#include "datagrampacer.h"
+#include "thread.h"
 
 class G2Packet;
 
@@ -46,11 +52,38 @@ public:
 	virtual void onFailure(void* pParam) = 0;
 };
 
-class DatagramOut;
-class DatagramIn;
+#pragma pack(push, 1)
+typedef struct
+{
+	char     szTag[3];
+	quint8   nFlags;
+	quint16  nSequence;
+	quint8   nPart;
+	quint8   nCount;
+} GND_HEADER;
+
+#pragma pack(pop)
+
 class CBuffer;
 class QHostAddress;
 
+// Runs UDP packet handlers on the network thread, fed by CDatagrams through CDatagramQueue.
+class CDatagramDispatcher : public QObject
+{
+	Q_OBJECT
+
+protected:
+	QAtomicInt	m_nScheduled;
+
+public:
+	CDatagramDispatcher();
+
+	void schedule();
+
+public slots:
+	void onQueued();
+};
+
 class CDatagrams : public QObject
 {
 	Q_OBJECT
@@ -64,24 +97,38 @@ protected:
 
 	bool m_bFirewalled;
 
-	QTimer*       m_tSender;
+	QTimer*       m_tSender;		// single shot, armed by schedulePacer()
+	CDatagramPacer	m_oPacer;
+	quint32			m_tResendCheck;
 
 	QHash<quint16, DatagramOut*>     m_SendCacheMap;    // To quicky find the sequence of packets.
 	QLinkedList<DatagramOut*>		 m_SendCache;		// A LIFO queue, last is oldest.
 	QLinkedList<DatagramOut*>		 m_FreeDatagramOut;
 	quint16                          m_nSequence;
 
-	QHash < QHostAddress,
-		  QHash<quint32, DatagramIn*>
-		  >                     m_RecvCache;            // For searching by ip & sequence.
-	QLinkedList<DatagramIn*>    m_RecvCacheTime;        // A list ordered by recieve time, last is oldest.
-
-	QLinkedList <
-		QPair<CEndPoint, char*>
-				>               m_AckCache;
-
-	QLinkedList<DatagramIn*> m_FreeDatagramIn;		// A list of free incoming packets.
-	QLinkedList<CBuffer*>	 m_FreeBuffer;		// A list of free buffers.
+	QHash<DatagramKey, DatagramIn*>	m_RecvCache;		// For searching by ip, port & sequence.
+	DatagramIn*		m_pInFrames;			// All incoming frames, allocated at once
+	DatagramIn*		m_pRecvNewest;			// LRU of partial frames in m_RecvCache, linked through DatagramIn::m_pPrev/m_pNext
+	DatagramIn*		m_pRecvOldest;
+	DatagramIn*		m_pDoneNewest;			// Completed frames in m_RecvCache, only kept to recognise late duplicates
+	DatagramIn*		m_pDoneOldest;			// and expired or evicted before any partial one
+	DatagramIn*		m_pFreeDatagramIn;		// Free incoming frames, linked through DatagramIn::m_pNext
+	CBuffer*		m_pReassembly;			// Scratch buffer for datagrams whose parts arrived out of order
+
+	struct DatagramAck
+	{
+		CEndPoint	oAddress;
+		quint16		nSequence;
+		quint8		nPart;
+		qint64		tQueued;
+	};
+	enum { AckRingSize = 256 };
+	DatagramAck		m_pAcks[AckRingSize];	// Pending ACKs, oldest at m_nAckHead
+	quint32			m_nAckHead;
+	quint32			m_nAcks;
+	quint32			m_nAcksDropped;
+
+	QLinkedList<CBuffer*>	 m_FreeBuffer;		// A list of free buffers for outgoing packets.
 
 	CBuffer*    	m_pRecvBuffer;
 	QHostAddress*   m_pHostAddress;
@@ -93,8 +140,29 @@ protected:
 	TCPBandwidthMeter m_mOutput;
 
 	quint32			m_nDiscarded;
+	quint32			m_nInCompleted;
+	quint32			m_nInExpired;
 	quint32			m_nInFrags;
 	quint32			m_nOutFrags;
+	QAtomicInt		m_nFlushPending;
+
+	// Receive pipeline: socket -> reassembly (datagram thread) -> m_oQueue -> handlers (network thread)
+	CDatagramQueue		m_oQueue;
+	CDatagramDispatcher	m_oDispatcher;
+	QElapsedTimer		m_oClock;
+	qint64				m_tRead;			// when the datagram in m_pRecvBuffer was read
+	quint32				m_nQueued;
+	quint32				m_nQueueDropped;
+	quint32				m_nQueueMax;
+	DatagramStageStats	m_oReceiveStats;	// socket read to queued
+	DatagramStageStats	m_oQueueStats;		// time spent in queue
+	DatagramStageStats	m_oHandlerStats;	// handler run time
+	DatagramStageStats	m_oReassemblyStats;	// per GND fragment, lookup to reassembled
+	quint32				m_tStatsReported;
+
+#ifdef QUAZAA_UDP_BATCH
+	CDatagramBatch	m_oBatch;		// recvmmsg/sendmmsg on the socket above
+#endif
 
 public:
 	CDatagrams();
@@ -107,6 +175,10 @@ public:
 
 	void removeOldIn(bool bForce = false);
 	void remove(DatagramIn* pDatagramIn, bool bReclaim = false);
+	void touch(DatagramIn* pDatagramIn);
+	void link(DatagramIn* pDatagramIn, DatagramIn*& pNewest, DatagramIn*& pOldest);
+	void unlink(DatagramIn* pDatagramIn, DatagramIn*& pNewest, DatagramIn*& pOldest);
+	void queueAck(const GND_HEADER* pHeader);
 	void remove(DatagramOut* pDatagramOut);
 	void onReceiveGND();
 	void onAcknowledgeGND();
@@ -126,29 +198,32 @@ public:
 	inline bool isFirewalled();
 	inline bool isListening();
 
+protected:
+	void processDatagram();
+	void enqueue(const CEndPoint& oAddr, G2Packet* pPacket);
+	void dispatch(int nMax);
+	void reportStats();
+	void writeDatagram(const char* pData, quint32 nLength, const CEndPoint& oAddr);
+	void flushWrites();
+	void schedulePacer();
+
 public slots:
+	void setupThread();
+	void cleanupThread();
 	void onDatagram();
 	void flushSendCache();
 	void __FlushSendCache();
+#ifdef DEBUG_UDP
+	void fragmentStorm(quint32 nDatagrams, quint8 nParts);
+#endif
 
 signals:
 	void sendQueueUpdated();
 
 	friend class CNetwork;
+	friend class CDatagramDispatcher;
 };
 
-#pragma pack(push, 1)
-typedef struct
-{
-	char     szTag[3];
-	quint8   nFlags;
-	quint16  nSequence;
-	quint8   nPart;
-	quint8   nCount;
-} GND_HEADER;
-
-#pragma pack(pop)
-
 quint32 CDatagrams::downloadSpeed()
 {
 	return m_mInput.AvgUsage();
@@ -167,5 +242,6 @@ bool CDatagrams::isListening()
 }
 
 extern CDatagrams Datagrams;
+extern CThread DatagramsThread;
 
 #endif // DATAGRAMS_H
@@ -34,6 +34,7 @@
 #include "queryhit.h"
 #include "queryhashtable.h"
 #include "queryhashmaster.h"
+#include "queryrouter.h"
 #include "hubhorizon.h"
 #include "securitymanager.h"
 
@@ -42,6 +43,16 @@
 #include "quazaasettings.h"
 #include "quazaaglobals.h"
 
+#if defined(Q_OS_LINUX)
+#define QUAZAA_TCP_WRITEV
+#endif
+
+#ifdef QUAZAA_TCP_WRITEV
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
 #include "debug_new.h"
 
 //#define _DISABLE_COMPRESSION
@@ -66,15 +77,25 @@ CG2Node::CG2Node(QObject* parent) :
 	m_pRemoteTable = 0;
 
 	m_nHAWWait = 0;
+
+	m_nSendQueueBytes = 0;
+	m_nSendUrgent = 0;
+	memset(&m_nSendDropped[0], 0, sizeof(m_nSendDropped));
 }
 
 CG2Node::~CG2Node()
 {
 	Network.m_oRoutingTable.remove(this);
+	QueryRouter.removeLeaf(this);
 
-	while(m_lSendQueue.size())
+	while(!m_lSendQueue.isEmpty())
 	{
-		m_lSendQueue.dequeue()->release();
+		m_lSendQueue.takeFirst().pPacket->release();
+	}
+
+	if(m_nSendDropped[FrameControl] + m_nSendDropped[FrameHits] + m_nSendDropped[FrameQuery])
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("Output queue of %1 dropped %2 hits, %3 queries").arg(m_oAddress.toString()).arg(m_nSendDropped[FrameHits]).arg(m_nSendDropped[FrameQuery]));
 	}
 
 	if(m_pLocalTable)
@@ -96,19 +117,30 @@ void CG2Node::sendPacket(G2Packet* pPacket, bool bBuffered, bool bRelease)
 
 	m_nPacketsOut++;
 
-	if(bBuffered)
-	{
-		while(m_lSendQueue.size() > 128)
-		{
-			m_lSendQueue.dequeue()->release();
-		}
+	G2NodeFrame oFrame;
+	oFrame.nClass = bBuffered ? frameClass(pPacket) : FrameControl;
 
-		pPacket->addRef();
-		m_lSendQueue.enqueue(pPacket);
+	if(bBuffered && !makeRoom(oFrame.nClass))
+	{
+		m_nSendDropped[oFrame.nClass]++;
 	}
 	else
 	{
-		pPacket->toBuffer(getOutputBuffer());
+		pPacket->addRef();
+		oFrame.pPacket = pPacket;
+		oFrame.nHeader = pPacket->toHeader(oFrame.pHeader);
+		oFrame.nWritten = 0;
+		m_nSendQueueBytes += oFrame.size();
+
+		if(bBuffered)
+		{
+			m_lSendQueue.append(oFrame);
+		}
+		else
+		{
+			// Unbuffered packets jump the queue, behind other unbuffered ones (e.g. PI for RTT)
+			m_lSendQueue.insert(m_nSendUrgent++, oFrame);
+		}
 	}
 
 	if(bRelease)
@@ -119,6 +151,174 @@ void CG2Node::sendPacket(G2Packet* pPacket, bool bBuffered, bool bRelease)
 	emit readyToTransfer();
 }
 
+int CG2Node::frameClass(G2Packet* pPacket)
+{
+	switch(pPacket->m_nType)
+	{
+		case G2Type::Q2:
+			return FrameQuery;
+		case G2Type::QH2:
+		case G2Type::QA:
+			return FrameHits;
+		default:
+			return FrameControl;
+	}
+}
+
+// Called before a buffered frame of class nClass is queued. While the queue is over its limits,
+// the oldest frame of the least important class present goes, as long as that class is not
+// more important than nClass. Returns false if the new frame should be dropped instead.
+bool CG2Node::makeRoom(int nClass)
+{
+	while(m_lSendQueue.size() - m_nSendUrgent >= SendQueueFrames || m_nSendQueueBytes >= SendQueueBytes)
+	{
+		int nVictim = -1;
+
+		for(int i = m_nSendUrgent; i < m_lSendQueue.size(); ++i)
+		{
+			int nFrameClass = m_lSendQueue.at(i).nClass;
+
+			if(nFrameClass != FrameControl && nFrameClass >= nClass && (nVictim < 0 || nFrameClass > m_lSendQueue.at(nVictim).nClass))
+			{
+				nVictim = i;
+			}
+		}
+
+		if(nVictim < 0)
+		{
+			return (nClass == FrameControl);
+		}
+
+		m_nSendDropped[m_lSendQueue.at(nVictim).nClass]++;
+		removeFrame(nVictim);
+	}
+
+	return true;
+}
+
+void CG2Node::removeFrame(int nIndex)
+{
+	G2NodeFrame oFrame = m_lSendQueue.takeAt(nIndex);
+
+	m_nSendQueueBytes -= oFrame.size();
+	oFrame.pPacket->release();
+
+	if(nIndex < m_nSendUrgent)
+	{
+		m_nSendUrgent--;
+	}
+}
+
+// Marks nBytes from the head of the queue as sent.
+void CG2Node::consumeFrames(quint32 nBytes)
+{
+	while(nBytes && !m_lSendQueue.isEmpty())
+	{
+		G2NodeFrame& oFrame = m_lSendQueue.first();
+		quint32 nLeft = oFrame.size() - oFrame.nWritten;
+
+		if(nBytes < nLeft)
+		{
+			oFrame.nWritten += nBytes;
+
+			// A partly written frame has to finish before anything else goes out
+			if(m_nSendUrgent == 0)
+			{
+				m_nSendUrgent = 1;
+			}
+			return;
+		}
+
+		nBytes -= nLeft;
+		removeFrame(0);
+	}
+}
+
+// Gathers frames from the queue into the output buffer, one copy per packet.
+void CG2Node::fillOutput(qint64 nBytes)
+{
+	CBuffer* pOutput = getOutputBuffer();
+
+	while(!m_lSendQueue.isEmpty() && pOutput->size() < nBytes)
+	{
+		const G2NodeFrame& oFrame = m_lSendQueue.first();
+		quint32 nLeft = oFrame.size() - oFrame.nWritten;
+
+		pOutput->ensure(nLeft);
+
+		if(oFrame.nWritten < oFrame.nHeader)
+		{
+			pOutput->append(oFrame.pHeader + oFrame.nWritten, oFrame.nHeader - oFrame.nWritten);
+		}
+
+		quint32 nPayload = qMax(oFrame.nWritten, (quint32)oFrame.nHeader) - oFrame.nHeader;
+		pOutput->append((char*)oFrame.pPacket->m_pBuffer + nPayload, oFrame.pPacket->m_nLength - nPayload);
+
+		consumeFrames(nLeft);
+	}
+}
+
+// Sends queued frames straight from the packets with one vectored write.
+// Only used on uncompressed links while nothing else is pending on the socket.
+qint64 CG2Node::writeFrames(qint64 nBytes)
+{
+#ifdef QUAZAA_TCP_WRITEV
+	iovec pVectors[SendVectors];
+	int nVectors = 0;
+	qint64 nQueued = 0;
+
+	for(int i = 0; i < m_lSendQueue.size() && nVectors + 2 <= SendVectors && nQueued < nBytes; ++i)
+	{
+		const G2NodeFrame& oFrame = m_lSendQueue.at(i);
+		quint32 nOffset = oFrame.nWritten;
+
+		if(nOffset < oFrame.nHeader)
+		{
+			pVectors[nVectors].iov_base = (void*)(oFrame.pHeader + nOffset);
+			pVectors[nVectors].iov_len = qMin<qint64>(oFrame.nHeader - nOffset, nBytes - nQueued);
+			nQueued += pVectors[nVectors].iov_len;
+			nVectors++;
+			nOffset = oFrame.nHeader;
+		}
+
+		quint32 nPayload = nOffset - oFrame.nHeader;
+
+		if(nQueued < nBytes && nPayload < oFrame.pPacket->m_nLength)
+		{
+			pVectors[nVectors].iov_base = (void*)(oFrame.pPacket->m_pBuffer + nPayload);
+			pVectors[nVectors].iov_len = qMin<qint64>(oFrame.pPacket->m_nLength - nPayload, nBytes - nQueued);
+			nQueued += pVectors[nVectors].iov_len;
+			nVectors++;
+		}
+	}
+
+	msghdr oMsg;
+	memset(&oMsg, 0, sizeof(oMsg));
+	oMsg.msg_iov = pVectors;
+	oMsg.msg_iovlen = nVectors;
+
+	ssize_t nSent;
+	do
+	{
+		nSent = sendmsg(m_pSocket->socketDescriptor(), &oMsg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	while(nSent < 0 && errno == EINTR);
+
+	if(nSent < 0)
+	{
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+
+	consumeFrames(nSent);
+	m_mOutput.Add(nSent);
+
+	return nSent;
+#else
+	Q_UNUSED(nBytes);
+	return 0;
+#endif
+}
+
 void CG2Node::onConnectNode()
 {
 	//QMutexLocker l(&Neighbours.m_pSection);
@@ -127,7 +327,7 @@ void CG2Node::onConnectNode()
 						"Connection with %s established, handshaking...",
 						qPrintable( m_oAddress.toString() ) );
 
-	m_nState = nsHandshaking;
+	setState(nsHandshaking);
 	emit nodeStateChanged();
 
 	QByteArray sHs;
@@ -186,7 +386,7 @@ void CG2Node::onRead()
 		G2Packet* pPacket = 0;
 		try
 		{
-			while((pPacket = G2Packet::readBuffer(getInputBuffer())))
+			while((pPacket = G2Packet::readBuffer(getInputBuffer(), true)))
 			{
 				m_tLastPacketIn = time(0);
 				m_nPacketsIn++;
@@ -273,28 +473,6 @@ void CG2Node::onTimer(quint32 tNow)
 			securityManager.ban(m_oAddress, RuleTime::ThirtyMinutes, true, QString("Hub not accepting leaves (%1)").arg(m_oAddress.toString()));
 			return;
 		}
-
-		// Anti-DDoS
-		// cleaning table
-		if(m_lRABan.size() >= 1000)
-		{
-			systemLog.postLog(LogSeverity::Debug, QString("Clearing bans on hub %1").arg(m_oAddress.toString()));
-			//qDebug() << "Clearing bans on hub " << m_oAddress.toString();
-			for(QHash<quint32, quint32>::iterator itBan = m_lRABan.begin(); itBan != m_lRABan.end();)
-			{
-				if(tNow - itBan.value() > 60)   // 1 minute
-				{
-					itBan = m_lRABan.erase(itBan);
-				}
-				else
-				{
-					++itBan;
-				}
-			}
-			systemLog.postLog(LogSeverity::Debug, QString("Still active bans: %1").arg(m_lRABan.size()));
-			//qDebug() << "Still active bans: " << m_lRABan.size();
-		}
-
 	}
 }
 
@@ -437,7 +615,7 @@ void CG2Node::parseIncomingHandshake()
 		}
 #endif
 
-		m_nState = nsConnected;
+		setState(nsConnected);
 		emit nodeStateChanged();
 
 		sendStartups();
@@ -452,7 +630,7 @@ void CG2Node::parseIncomingHandshake()
 	{
 		systemLog.postLog(LogSeverity::Debug, QString("Connection to %1 rejected: %2").arg(this->m_oAddress.toString()).arg(sHs.left(sHs.indexOf("\r\n"))));
 		//qDebug() << "Connection rejected: " << sHs.left(sHs.indexOf("\r\n"));
-		m_nState = nsClosing;
+		setState(nsClosing);
 		emit nodeStateChanged();
 		close();
 	}
@@ -597,7 +775,7 @@ void CG2Node::parseOutgoingHandshake()
 	hostCache.m_pSection.lock();
 	CHostCacheHost* pThisHost = hostCache.take(m_oAddress);
 	if( pThisHost )
-		pThisHost->m_nFailures = 0;
+		hostCache.setFailures( pThisHost, 0 );
 	hostCache.m_pSection.unlock();
 
 #ifndef _DISABLE_COMPRESSION
@@ -613,7 +791,7 @@ void CG2Node::parseOutgoingHandshake()
 	}
 #endif
 
-	m_nState = nsConnected;
+	setState(nsConnected);
 	emit nodeStateChanged();
 
 	sendStartups();
@@ -773,54 +951,45 @@ void CG2Node::onPacket(G2Packet* pPacket)
 	if(!Network.routePacket(pPacket))
 	{
 
-		if(pPacket->isType("PI"))
-		{
-			onPing(pPacket);
-		}
-		else if(pPacket->isType("PO"))
-		{
-			onPong(pPacket);
-		}
-		else if(pPacket->isType("LNI"))
-		{
-			onLNI(pPacket);
-		}
-		else if(pPacket->isType("KHL"))
-		{
-			onKHL(pPacket);
-		}
-		else if(pPacket->isType("QHT"))
-		{
-			onQHT(pPacket);
-		}
-		else if(pPacket->isType("Q2"))
-		{
-			onQuery(pPacket);
-		}
-		else if(pPacket->isType("QKR"))
-		{
-			onQKR(pPacket);
-		}
-		else if(pPacket->isType("QKA"))
-		{
-			onQKA(pPacket);
-		}
-		else if(pPacket->isType("QA"))
-		{
-			onQA(pPacket);
-		}
-		else if(pPacket->isType("QH2"))
-		{
-			onQH2(pPacket);
-		}
-		else if(pPacket->isType("HAW"))
-		{
-			onHaw(pPacket);
-		}
-		else
-		{
-			systemLog.postLog(LogSeverity::Debug, QString("G2 TCP recieved unknown packet %1").arg(pPacket->getType()));
-			//qDebug() << "Unknown packet " << pPacket->GetType();
+		switch(pPacket->m_nType)
+		{
+			case G2Type::PI:
+				onPing(pPacket);
+				break;
+			case G2Type::PO:
+				onPong(pPacket);
+				break;
+			case G2Type::LNI:
+				onLNI(pPacket);
+				break;
+			case G2Type::KHL:
+				onKHL(pPacket);
+				break;
+			case G2Type::QHT:
+				onQHT(pPacket);
+				break;
+			case G2Type::Q2:
+				onQuery(pPacket);
+				break;
+			case G2Type::QKR:
+				onQKR(pPacket);
+				break;
+			case G2Type::QKA:
+				onQKA(pPacket);
+				break;
+			case G2Type::QA:
+				onQA(pPacket);
+				break;
+			case G2Type::QH2:
+				onQH2(pPacket);
+				break;
+			case G2Type::HAW:
+				onHaw(pPacket);
+				break;
+			default:
+				systemLog.postLog(LogSeverity::Debug, QString("G2 TCP recieved unknown packet %1").arg(pPacket->getType()));
+				//qDebug() << "Unknown packet " << pPacket->GetType();
+				break;
 		}
 	}
 	/*}
@@ -1022,7 +1191,7 @@ void CG2Node::onKHL(G2Packet* pPacket)
 	const quint32 tNow = common::getTNowUTC();
 	qint32 nDiff = 0;
 
-	m_pHubGroup->clear();
+	QList<CEndPoint> lHubs;
 
 	char szType[9], szInner[9];
 	quint32 nLength = 0, nInnerLength = 0;
@@ -1069,7 +1238,7 @@ void CG2Node::onKHL(G2Packet* pPacket)
 
 				if(m_nType == G2_HUB)
 				{
-					m_pHubGroup->add(pAddr);
+					lHubs.append(pAddr);
 				}
 
 				if(!pGUID.isNull())
@@ -1144,6 +1313,8 @@ void CG2Node::onKHL(G2Packet* pPacket)
 		}
 		pPacket->m_nPosition = nNext;
 	}
+
+	m_pHubGroup->setHubs(lHubs);
 }
 
 void CG2Node::onQHT(G2Packet* pPacket)
@@ -1162,7 +1333,22 @@ void CG2Node::onQHT(G2Packet* pPacket)
 
 	bool bLive = m_pRemoteTable->m_bLive;
 
-	if(!m_pRemoteTable->onPacket(pPacket))
+	// The router threads read the tables of leaves they route to
+	QMutex* pRouterSection = QueryRouter.leafSection(this);
+	if(pRouterSection)
+	{
+		pRouterSection->lock();
+	}
+
+	bool bValid = m_pRemoteTable->onPacket(pPacket);
+
+	if(pRouterSection)
+	{
+		QueryRouter.refreshLeaf(this);
+		pRouterSection->unlock();
+	}
+
+	if(!bValid)
 	{
 		systemLog.postLog(LogSeverity::Error, tr("Neighbour %1 sent bad query hash table update. Closing connection.").arg(m_oAddress.toString().toLocal8Bit().constData()));
 		close();
@@ -1185,6 +1371,11 @@ void CG2Node::onQHT(G2Packet* pPacket)
 	{
 		QueryHashMaster.add(m_pRemoteTable);
 	}
+
+	if(m_nType == G2_LEAF && m_pRemoteTable->m_bLive)
+	{
+		QueryRouter.updateLeaf(this);
+	}
 }
 
 void CG2Node::onQKR(G2Packet* pPacket)
@@ -1406,27 +1597,23 @@ void CG2Node::onQuery(G2Packet* pPacket)
 		return;
 	}
 
-	/*
-	 * Anti-DDoS
-	 * Code below is to minimize the impact caused by forwarded searches.
-	 * We restrict number of queries with a given return address sent by this neighbouring hub.
-	 * We allow unlimited queried for this connected hub (when its address is specified in query).
-	 * Our hub can still be searched via other neighbouring hubs.
-	 * This is to protect inter-hub query forwarding where nothing is checked.
-	 * The main problem is still there, though.
-	 */
+	// A known GUID is the same search arriving again, it was routed already
+	if( Network.m_oRoutingTable.contains(pQuery->m_oGUID) )
+	{
+		return;
+	}
 
-	/*if( Neighbours.IsG2Hub() && m_nType == G2_HUB ) // must be both hubs
+	// Anti-DDoS: drop floods and repeated searches before they cost a route and leaf bandwidth.
+	// A neighbouring hub's own searches (return address is the hub) are not rate limited.
+	if( Neighbours.isG2Hub() )
 	{
-		QHash<quint32,quint32>::const_iterator itEntry = m_lRABan.find(oReturnAddr.ip);
-		if( itEntry != m_lRABan.end() && time(0) - itEntry.value() < 60 && itEntry.key() != oReturnAddr.ip )
+		bool bOwnQuery = m_nType == G2_HUB && static_cast<const QHostAddress&>(pQuery->m_oEndpoint) == m_oAddress;
+
+		if( Network.m_oQueryFilter.admit(pQuery, m_oAddress, !bOwnQuery) != CQueryFilter::Accepted )
 		{
-			qDebug() << "Dropping query for return address " << oReturnAddr.toString() << "on hub" << m_oAddress.toString();
-			return; // drop excess packets
+			return;
 		}
-		m_lRABan.insert(oReturnAddr.ip, time(0));
-		qDebug() << "Banning return address" << oReturnAddr.toString() << "on hub " << m_oAddress.toString() << " num banned: " << m_lRABan.size();
-	}*/
+	}
 
 	if(Network.m_oRoutingTable.add(pQuery->m_oGUID, this, false))
 	{
@@ -1444,15 +1631,21 @@ void CG2Node::onQuery(G2Packet* pPacket)
 
 qint64 CG2Node::writeToNetwork(qint64 nBytes)
 {
+#ifdef QUAZAA_TCP_WRITEV
+	if(!m_bCompressedOutput && !m_lSendQueue.isEmpty() && m_pOutput->isEmpty()
+	   && m_pSocket->bytesToWrite() == 0 && m_pSocket->socketDescriptor() != -1)
+	{
+		return writeFrames(nBytes);
+	}
+#endif
+
 	qint64 nTotalSent = 0;
 
 	do
 	{
 		if(getOutputBuffer()->isEmpty() && !m_lSendQueue.isEmpty())
 		{
-			G2Packet* pPacket = m_lSendQueue.dequeue();
-			pPacket->toBuffer(getOutputBuffer());
-			pPacket->release();
+			fillOutput(nBytes - nTotalSent);
 		}
 
 		qint64 nSent = CNeighbour::writeToNetwork(nBytes - nTotalSent);
@@ -26,14 +26,30 @@
 #define G2NODE_H
 
 #include "neighbour.h"
+#include "g2packet.h"
 #include <QElapsedTimer>
-#include <QQueue>
+#include <QList>
 #include <QHash>
 
-class G2Packet;
 class CQueryHashTable;
 class CHubHorizonGroup;
 
+// A packet waiting in the output queue of a CG2Node. The payload is not copied, the same
+// G2Packet may be queued on many neighbours at once; only the wire header is kept per frame.
+struct G2NodeFrame
+{
+	G2Packet*	pPacket;
+	char		pHeader[G2_MAX_HEADER];
+	quint8		nHeader;
+	quint8		nClass;
+	quint32		nWritten;	// bytes of header and payload already handed to the socket
+
+	inline quint32 size() const
+	{
+		return nHeader + pPacket->m_nLength;
+	}
+};
+
 class CG2Node : public CNeighbour
 {
 	Q_OBJECT
@@ -57,14 +73,20 @@ public:
 
 	quint32         m_nHAWWait;
 
-	QQueue<G2Packet*>   m_lSendQueue;
+	// Output queue classes, in order of priority. Control frames are never dropped,
+	// queries go first when the queue overflows.
+	enum { FrameControl, FrameHits, FrameQuery, FrameClasses };
+	enum { SendQueueFrames = 128, SendQueueBytes = 262144, SendVectors = 64 };
+
+	QList<G2NodeFrame>  m_lSendQueue;
+	quint32             m_nSendQueueBytes;
+	int                 m_nSendUrgent;		// leading frames that must go out first: unbuffered packets and a partly written head
+	quint32             m_nSendDropped[FrameClasses];
 
 	CQueryHashTable*    m_pRemoteTable;
 	CQueryHashTable*    m_pLocalTable;
 	CHubHorizonGroup*   m_pHubGroup;
 
-	QHash<quint32, quint32> m_lRABan;       // list of banned return addresses
-
 public:
 	CG2Node(QObject* parent = NULL);
 	virtual ~CG2Node();
@@ -76,6 +98,14 @@ public:
 
 	void sendPacket(G2Packet* pPacket, bool bBuffered = false, bool bRelease = false);
 
+protected:
+	static int frameClass(G2Packet* pPacket);
+	bool makeRoom(int nClass);
+	void removeFrame(int nIndex);
+	void consumeFrames(quint32 nBytes);
+	void fillOutput(qint64 nBytes);
+	qint64 writeFrames(qint64 nBytes);
+
 protected:
 	void parseOutgoingHandshake();
 	void parseIncomingHandshake();
@@ -32,6 +32,11 @@
 
 G2PacketPool G2Packets;
 
+const quint32 G2PacketPool::m_pClassSize[G2_PAYLOAD_CLASSES] = { 64, 256, 1024, 4096, G2_PAYLOAD_MAX_CLASS };
+
+// Cleared when G2Packets is torn down, thread caches dying after that have nothing to return to
+static bool g_bPoolActive = false;
+
 G2Packet::G2Packet()
 {
 	m_pNext			= 0;
@@ -44,7 +49,12 @@ G2Packet::G2Packet()
 	m_nLength = 0;
 
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
+
+	m_bView = false;
+	m_pStorage = 0;
+	m_nStorage = 0;
 }
 
 G2Packet::~G2Packet()
@@ -55,7 +65,13 @@ G2Packet::~G2Packet()
 	}
 	Q_ASSERT(m_nReference == 0);
 
-	if(m_pBuffer)
+	if(m_bView)
+	{
+		dropView();
+	}
+
+	// slab blocks are released together with their slabs
+	if(m_pBuffer && m_nBuffer > G2_PAYLOAD_MAX_CLASS)
 	{
 		free(m_pBuffer);
 	}
@@ -65,11 +81,17 @@ void G2Packet::reset()
 {
 	Q_ASSERT(m_nReference == 0);
 
+	if(m_bView)
+	{
+		dropView();
+	}
+
 	m_pNext			= 0;
 	m_nLength		= 0;
 	m_nPosition		= 0;
 
 	memset(&m_sType[0], 0, sizeof(m_sType));
+	m_nType = 0;
 	m_bCompound = false;
 }
 
@@ -112,8 +134,94 @@ char* G2Packet::getType() const
 	return (char*)&m_sType;
 }
 
+bool G2Packet::detach()
+{
+	if(!m_bView)
+	{
+		return true;
+	}
+
+	uchar* pSource = m_pBuffer;
+	quint32 nLength = m_nLength;
+
+	dropView();
+	m_nLength = 0;
+
+	if(!ensure(nLength))
+	{
+		return false;
+	}
+
+	memcpy(m_pBuffer, pSource, nLength);
+	m_nLength = nLength;
+
+	return true;
+}
+
+void G2Packet::setView(char* pSource, quint32 nLength)
+{
+	Q_ASSERT(!m_bView);
+
+	m_pStorage = m_pBuffer;
+	m_nStorage = m_nBuffer;
+
+	m_pBuffer = (uchar*)pSource;
+	m_nBuffer = nLength;
+	m_nLength = nLength;
+
+	m_bView = true;
+}
+
+void G2Packet::dropView()
+{
+	Q_ASSERT(m_bView);
+
+	m_pBuffer = m_pStorage;
+	m_nBuffer = m_nStorage;
+
+	m_pStorage = 0;
+	m_nStorage = 0;
+
+	m_bView = false;
+}
+
+bool G2Packet::grow(quint32 nSize)
+{
+	quint32 nBlock = 0;
+	uchar* pBlock = G2Packets.allocBuffer(nSize, nBlock);
+
+	if(!pBlock)
+	{
+		return false;
+	}
+
+	if(m_pBuffer)
+	{
+		memcpy(pBlock, m_pBuffer, m_nLength);
+		G2Packets.freeBuffer(m_pBuffer, m_nBuffer);
+	}
+
+	m_pBuffer = pBlock;
+	m_nBuffer = nBlock;
+
+	return true;
+}
+
 void G2Packet::deletePacket()
 {
+	if(m_bView)
+	{
+		dropView();
+	}
+
+	// small payloads stay with the packet, bigger ones go back to be shared by all packets
+	if(m_pBuffer && m_nBuffer > 1024)
+	{
+		G2Packets.freeBuffer(m_pBuffer, m_nBuffer);
+		m_pBuffer = 0;
+		m_nBuffer = 0;
+	}
+
 	G2Packets.deletePacket(this);
 }
 
@@ -126,13 +234,16 @@ G2Packet* G2Packet::newPacket(const char* pszType, bool bCompound)
 		size_t nLength = strlen(pszType);
 		strncpy(pPacket->m_sType, pszType, nLength);
 		pPacket->m_sType[nLength] = 0;
+		pPacket->m_nType = packType(pszType, nLength);
 	}
 
 	pPacket->m_bCompound = bCompound;
 
 	return pPacket;
 }
-G2Packet* G2Packet::newPacket(char* pSource)
+// With bView set the payload is not copied, the packet points into pSource and is only valid
+// as long as the memory behind it. addRef() or any write detaches it into a private copy.
+G2Packet* G2Packet::newPacket(char* pSource, bool bView)
 {
 	G2Packet* pPacket = newPacket();
 
@@ -161,6 +272,7 @@ G2Packet* G2Packet::newPacket(char* pSource)
 	}
 
 	nTypeLen++;
+	pPacket->m_nType = packType(pSource, nTypeLen);
 	char* pszType = pPacket->m_sType;
 	for(; nTypeLen-- ;)
 	{
@@ -168,19 +280,59 @@ G2Packet* G2Packet::newPacket(char* pSource)
 	}
 	*pszType++ = 0;
 
-	pPacket->write(pSource, nLength);
+	if(bView)
+	{
+		pPacket->setView(pSource, nLength);
+	}
+	else
+	{
+		pPacket->write(pSource, nLength);
+	}
 
 	return pPacket;
 }
 
-G2PacketPool::G2PacketPool()
+G2PacketCache::G2PacketCache()
 {
 	m_pFree = 0;
 	m_nFree = 0;
+
+	memset(&m_pBlocks[0], 0, sizeof(m_pBlocks));
+	memset(&m_nBlocks[0], 0, sizeof(m_nBlocks));
+
+	m_nHits = 0;
+	m_nMisses = 0;
+	m_nPayloadHits = 0;
+	m_nPayloadMisses = 0;
+	m_nInUse = 0;
+}
+
+G2PacketCache::~G2PacketCache()
+{
+	if(!g_bPoolActive)
+	{
+		return;
+	}
+
+	// thread is going away, hand everything back to the shared lists
+	G2Packets.publish(this);
+	G2Packets.spill(this, m_nFree);
+
+	for(int nClass = 0; nClass < G2_PAYLOAD_CLASSES; nClass++)
+	{
+		G2Packets.spillBlocks(this, nClass, m_nBlocks[nClass]);
+	}
+}
+
+G2PacketPool::G2PacketPool()
+{
+	memset(&m_oStats, 0, sizeof(m_oStats));
+	g_bPoolActive = true;
 }
 
 G2PacketPool::~G2PacketPool()
 {
+	g_bPoolActive = false;
 	clear();
 }
 
@@ -282,6 +434,55 @@ bool G2Packet::readPacket(char* pszType, quint32& nLength, bool* pbCompound)
 	return true;
 }
 
+// Same as above, but hands out the packed type so callers can switch on it
+bool G2Packet::readPacket(quint64& nType, quint32& nLength, bool* pbCompound)
+{
+	if(getRemaining() == 0)
+	{
+		return false;
+	}
+
+	char nInput = readByte();
+	if(nInput == 0)
+	{
+		return false;
+	}
+
+	char nLenLen	= (nInput & 0xC0) >> 6;
+	char nTypeLen	= (nInput & 0x38) >> 3;
+	char nFlags		= (nInput & 0x07);
+
+	if(getRemaining() < nTypeLen + nLenLen + 1)
+	{
+		throw std::underflow_error("Packet read will not reach end.");
+	}
+
+	nLength = 0;
+	read(&nLength, nLenLen);
+
+	if(getRemaining() < (int)(nLength + nTypeLen + 1))
+	{
+		throw std::underflow_error("Packet read will not reach end.");
+	}
+
+	nType = packType((char*)m_pBuffer + m_nPosition, nTypeLen + 1);
+	m_nPosition += nTypeLen + 1;
+
+	if(pbCompound)
+	{
+		*pbCompound = (nFlags & G2_FLAG_COMPOUND) == G2_FLAG_COMPOUND;
+	}
+	else
+	{
+		if(nFlags & G2_FLAG_COMPOUND)
+		{
+			skipCompound(nLength);
+		}
+	}
+
+	return true;
+}
+
 bool G2Packet::skipCompound()
 {
 	if(m_bCompound)
@@ -341,7 +542,9 @@ bool G2Packet::skipCompound(quint32& nLength, quint32 nRemaining)
 	return nRemaining ? nLength >= nRemaining : true;
 }
 
-void G2Packet::toBuffer(CBuffer* pBuffer) const
+// Writes the control byte, length and type of this packet to pHeader, which must hold
+// G2_MAX_HEADER bytes. Returns the header length; the payload follows as m_pBuffer/m_nLength.
+quint32 G2Packet::toHeader(char* pHeader) const
 {
 	Q_ASSERT(strlen(m_sType) > 0);
 
@@ -368,20 +571,30 @@ void G2Packet::toBuffer(CBuffer* pBuffer) const
 		nFlags |= G2_FLAG_COMPOUND;
 	}
 
-	pBuffer->append((char*)&nFlags, 1);
+	pHeader[0] = nFlags;
 
 	quint32 nLength = m_nLength;
-	pBuffer->append((char*)&nLength, nLenLen);
+	memcpy(pHeader + 1, (char*)&nLength, nLenLen);
 
-	pBuffer->append((char*)&m_sType[0], nTypeLen + 1);
+	memcpy(pHeader + 1 + nLenLen, (char*)&m_sType[0], nTypeLen + 1);
 
+	return 1 + nLenLen + nTypeLen + 1;
+}
+
+void G2Packet::toBuffer(CBuffer* pBuffer) const
+{
+	char pHeader[G2_MAX_HEADER];
+	quint32 nHeader = toHeader(pHeader);
+
+	pBuffer->ensure(nHeader + m_nLength);
+	pBuffer->append(pHeader, nHeader);
 	pBuffer->append((char*)m_pBuffer, m_nLength);
 }
 
 //////////////////////////////////////////////////////////////////////
 // G2Packet buffer stream read
 
-G2Packet* G2Packet::readBuffer(CBuffer* pBuffer)
+G2Packet* G2Packet::readBuffer(CBuffer* pBuffer, bool bView)
 {
 	if(pBuffer == 0)
 	{
@@ -432,7 +645,8 @@ G2Packet* G2Packet::readBuffer(CBuffer* pBuffer)
 		return 0;
 	}
 
-	G2Packet* pPacket = G2Packet::newPacket(pBuffer->data());
+	// remove() does not move or free consumed bytes, so a view stays valid until pBuffer is written again
+	G2Packet* pPacket = G2Packet::newPacket(pBuffer->data(), bView && pBuffer->hasReadCursor());
 	pBuffer->remove(0, nLength + nLenLen + nTypeLen + 2u);
 
 	return pPacket;
@@ -567,37 +781,341 @@ void G2PacketPool::clear()
 		delete [] pPool;
 	}
 
-	m_pPools.clear();;
-	m_pFree = 0;
-	m_nFree = 0;
+	for(int nIndex = 0; nIndex < m_lSlabs.size(); nIndex++)
+	{
+		free(m_lSlabs[nIndex]);
+	}
+
+	m_pPools.clear();
+	m_lSlabs.clear();
+	m_pShared.fetchAndStoreOrdered(0);
+
+	for(int nClass = 0; nClass < G2_PAYLOAD_CLASSES; nClass++)
+	{
+		m_pSharedBlocks[nClass].fetchAndStoreOrdered(0);
+	}
+}
+
+G2PacketCache* G2PacketPool::createCache()
+{
+	G2PacketCache* pCache = new G2PacketCache();
+	m_oCache.setLocalData(pCache);
+	return pCache;
 }
 
 //////////////////////////////////////////////////////////////////////
 // G2PacketPool new pool setup
 
-void G2PacketPool::newPool()
+void G2PacketPool::newPool(G2PacketCache* pCache)
 {
-	G2Packet* pPool = 0;
-	int nPitch = 0, nSize = 256;
+	const int nSize = 256;
 
-	nPitch	= sizeof(G2Packet);
-	pPool	= new G2Packet[ nSize ];
+	QMutexLocker l(&m_pSection);
 
+	G2Packet* pPool = new G2Packet[ nSize ];
 	m_pPools.append(pPool);
 
-	char* pchars = (char*)pPool;
+	for(int nIndex = 0; nIndex < nSize; nIndex++)
+	{
+		pPool[nIndex].m_pNext = pCache->m_pFree;
+		pCache->m_pFree = &pPool[nIndex];
+	}
+
+	pCache->m_nFree += nSize;
+	m_oStats.nPackets += nSize;
+}
 
-	while(nSize-- > 0)
+void G2PacketPool::newSlab(G2PacketCache* pCache, int nClass)
+{
+	const quint32 nBlock = m_pClassSize[nClass];
+	const quint32 nSlab = qMax(65536u, nBlock * 4);
+
+	uchar* pSlab = (uchar*)malloc(nSlab);
+
+	if(!pSlab)
 	{
-		pPool = (G2Packet*)pchars;
-		pchars += nPitch;
+		return;
+	}
 
-		pPool->m_pNext = m_pFree;
-		m_pFree = pPool;
-		m_nFree++;
+	m_pSection.lock();
+	m_lSlabs.append(pSlab);
+	m_oStats.nSlabBytes += nSlab;
+	m_pSection.unlock();
+
+	for(quint32 nOffset = 0; nOffset + nBlock <= nSlab; nOffset += nBlock)
+	{
+		*reinterpret_cast<uchar**>(pSlab + nOffset) = pCache->m_pBlocks[nClass];
+		pCache->m_pBlocks[nClass] = pSlab + nOffset;
+		pCache->m_nBlocks[nClass]++;
 	}
 }
 
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool thread cache refill and spill
+
+void G2PacketPool::refill(G2PacketCache* pCache)
+{
+	Q_ASSERT(pCache->m_nFree == 0);
+
+	pCache->m_nMisses++;
+
+	G2Packet* pChain = m_pShared.fetchAndStoreAcquire(0);
+
+	if(pChain)
+	{
+		// keep one batch, give the rest back
+		G2Packet* pLast = pChain;
+		quint32 nCount = 1;
+
+		while(pLast->m_pNext && nCount < 256)
+		{
+			pLast = pLast->m_pNext;
+			nCount++;
+		}
+
+		G2Packet* pRest = pLast->m_pNext;
+		pLast->m_pNext = 0;
+
+		pCache->m_pFree = pChain;
+		pCache->m_nFree = nCount;
+
+		// usually nobody has pushed in the meantime and the rest goes back in one step
+		if(pRest && !m_pShared.testAndSetRelease(0, pRest))
+		{
+			G2Packet* pTail = pRest;
+			while(pTail->m_pNext)
+			{
+				pTail = pTail->m_pNext;
+			}
+
+			G2Packet* pHead;
+			do
+			{
+				pHead = m_pShared.loadAcquire();
+				pTail->m_pNext = pHead;
+			}
+			while(!m_pShared.testAndSetRelease(pHead, pRest));
+		}
+	}
+	else
+	{
+		newPool(pCache);
+	}
+
+	publish(pCache);
+}
+
+void G2PacketPool::spill(G2PacketCache* pCache, quint32 nCount)
+{
+	nCount = qMin(nCount, pCache->m_nFree);
+
+	if(nCount == 0)
+	{
+		return;
+	}
+
+	G2Packet* pFirst = pCache->m_pFree;
+	G2Packet* pLast = pFirst;
+
+	for(quint32 i = 1; i < nCount; i++)
+	{
+		pLast = pLast->m_pNext;
+	}
+
+	pCache->m_pFree = pLast->m_pNext;
+	pCache->m_nFree -= nCount;
+
+	G2Packet* pHead;
+	do
+	{
+		pHead = m_pShared.loadAcquire();
+		pLast->m_pNext = pHead;
+	}
+	while(!m_pShared.testAndSetRelease(pHead, pFirst));
+}
+
+void G2PacketPool::refillBlocks(G2PacketCache* pCache, int nClass)
+{
+	Q_ASSERT(pCache->m_pBlocks[nClass] == 0);
+
+	pCache->m_nPayloadMisses++;
+
+	uchar* pChain = m_pSharedBlocks[nClass].fetchAndStoreAcquire(0);
+
+	if(pChain)
+	{
+		const quint32 nBatch = qMax(2u, 131072u / m_pClassSize[nClass]);
+
+		uchar* pLast = pChain;
+		quint32 nCount = 1;
+
+		while(*reinterpret_cast<uchar**>(pLast) && nCount < nBatch)
+		{
+			pLast = *reinterpret_cast<uchar**>(pLast);
+			nCount++;
+		}
+
+		uchar* pRest = *reinterpret_cast<uchar**>(pLast);
+		*reinterpret_cast<uchar**>(pLast) = 0;
+
+		pCache->m_pBlocks[nClass] = pChain;
+		pCache->m_nBlocks[nClass] = nCount;
+
+		if(pRest && !m_pSharedBlocks[nClass].testAndSetRelease(0, pRest))
+		{
+			uchar* pTail = pRest;
+			while(*reinterpret_cast<uchar**>(pTail))
+			{
+				pTail = *reinterpret_cast<uchar**>(pTail);
+			}
+
+			uchar* pHead;
+			do
+			{
+				pHead = m_pSharedBlocks[nClass].loadAcquire();
+				*reinterpret_cast<uchar**>(pTail) = pHead;
+			}
+			while(!m_pSharedBlocks[nClass].testAndSetRelease(pHead, pRest));
+		}
+	}
+	else
+	{
+		newSlab(pCache, nClass);
+	}
+
+	publish(pCache);
+}
+
+void G2PacketPool::spillBlocks(G2PacketCache* pCache, int nClass, quint32 nCount)
+{
+	nCount = qMin(nCount, pCache->m_nBlocks[nClass]);
+
+	if(nCount == 0)
+	{
+		return;
+	}
+
+	uchar* pFirst = pCache->m_pBlocks[nClass];
+	uchar* pLast = pFirst;
+
+	for(quint32 i = 1; i < nCount; i++)
+	{
+		pLast = *reinterpret_cast<uchar**>(pLast);
+	}
+
+	pCache->m_pBlocks[nClass] = *reinterpret_cast<uchar**>(pLast);
+	pCache->m_nBlocks[nClass] -= nCount;
+
+	uchar* pHead;
+	do
+	{
+		pHead = m_pSharedBlocks[nClass].loadAcquire();
+		*reinterpret_cast<uchar**>(pLast) = pHead;
+	}
+	while(!m_pSharedBlocks[nClass].testAndSetRelease(pHead, pFirst));
+}
+
+void G2PacketPool::publish(G2PacketCache* pCache)
+{
+	// statistics are not worth waiting for, try again on the next batch
+	if(!m_pSection.tryLock())
+	{
+		return;
+	}
+
+	m_oStats.nHits += pCache->m_nHits;
+	m_oStats.nMisses += pCache->m_nMisses;
+	m_oStats.nPayloadHits += pCache->m_nPayloadHits;
+	m_oStats.nPayloadMisses += pCache->m_nPayloadMisses;
+	m_oStats.nInUse += pCache->m_nInUse;
+	m_oStats.nPeak = qMax(m_oStats.nPeak, m_oStats.nInUse);
+
+	m_pSection.unlock();
+
+	pCache->m_nHits = 0;
+	pCache->m_nMisses = 0;
+	pCache->m_nPayloadHits = 0;
+	pCache->m_nPayloadMisses = 0;
+	pCache->m_nInUse = 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// G2PacketPool payload blocks
+
+uchar* G2PacketPool::allocBuffer(quint32 nSize, quint32& nBlock)
+{
+	int nClass = 0;
+	while(nClass < G2_PAYLOAD_CLASSES && m_pClassSize[nClass] < nSize)
+	{
+		nClass++;
+	}
+
+	if(nClass == G2_PAYLOAD_CLASSES)
+	{
+		// oversized, leave some room so writing a big packet piecewise does not realloc every time
+		nBlock = nSize + nSize / 2;
+		return (uchar*)malloc(nBlock);
+	}
+
+	G2PacketCache* pCache = localCache();
+
+	if(pCache->m_pBlocks[nClass] == 0)
+	{
+		refillBlocks(pCache, nClass);
+
+		if(pCache->m_pBlocks[nClass] == 0)
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		pCache->m_nPayloadHits++;
+	}
+
+	uchar* pBlock = pCache->m_pBlocks[nClass];
+	pCache->m_pBlocks[nClass] = *reinterpret_cast<uchar**>(pBlock);
+	pCache->m_nBlocks[nClass]--;
+
+	nBlock = m_pClassSize[nClass];
+	return pBlock;
+}
+
+void G2PacketPool::freeBuffer(uchar* pBlock, quint32 nBlock)
+{
+	if(nBlock > G2_PAYLOAD_MAX_CLASS)
+	{
+		free(pBlock);
+		return;
+	}
+
+	int nClass = 0;
+	while(m_pClassSize[nClass] != nBlock)
+	{
+		nClass++;
+	}
+	Q_ASSERT(nClass < G2_PAYLOAD_CLASSES);
+
+	G2PacketCache* pCache = localCache();
+
+	*reinterpret_cast<uchar**>(pBlock) = pCache->m_pBlocks[nClass];
+	pCache->m_pBlocks[nClass] = pBlock;
+	pCache->m_nBlocks[nClass]++;
+
+	// about 256 KB per size class and thread
+	const quint32 nLimit = qMax(4u, 262144u / nBlock);
+	if(pCache->m_nBlocks[nClass] > nLimit)
+	{
+		spillBlocks(pCache, nClass, nLimit / 2);
+	}
+}
+
+G2PacketPoolStats G2PacketPool::stats()
+{
+	QMutexLocker l(&m_pSection);
+	return m_oStats;
+}
+
 G2Packet * G2Packet::addOrReplaceChild(const char* pFind, G2Packet *pReplacement, bool bRelease, bool bPreserveExtensions)
 {
 	m_nPosition = 0; // start at zero
@@ -664,6 +1182,11 @@ G2Packet * G2Packet::addOrReplaceChild(const char* pFind, G2Packet *pReplacement
 		pNew->write(m_pBuffer + m_nPosition, m_nLength - m_nPosition);
 	}
 
+	if(m_bView)
+	{
+		dropView();
+	}
+
 	uchar*  pBuff = m_pBuffer;
 	quint32 nBuff = m_nBuffer;
 	m_pBuffer = pNew->m_pBuffer;
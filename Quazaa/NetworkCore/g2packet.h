@@ -29,10 +29,54 @@
 #include <QtGlobal>
 #include <QMutex>
 #include <QList>
+#include <QAtomicPointer>
+#include <QThreadStorage>
 #include <stdexcept>
 
 class CBuffer;
 
+// G2 type names are at most 8 characters, so they fit into one integer and can be
+// compared, switched on and hashed as such. First character goes into the lowest byte.
+#define G2_PACK(a, b, c, d, e, f, g, h) \
+	(  quint64(uchar(a))        | (quint64(uchar(b)) << 8)  | (quint64(uchar(c)) << 16) | (quint64(uchar(d)) << 24) \
+	| (quint64(uchar(e)) << 32) | (quint64(uchar(f)) << 40) | (quint64(uchar(g)) << 48) | (quint64(uchar(h)) << 56) )
+
+namespace G2Type
+{
+	// root packets
+	const quint64 CRAWLA	= G2_PACK('C', 'R', 'A', 'W', 'L', 'A', 0, 0);
+	const quint64 CRAWLR	= G2_PACK('C', 'R', 'A', 'W', 'L', 'R', 0, 0);
+	const quint64 HAW		= G2_PACK('H', 'A', 'W', 0, 0, 0, 0, 0);
+	const quint64 KHL		= G2_PACK('K', 'H', 'L', 0, 0, 0, 0, 0);
+	const quint64 LNI		= G2_PACK('L', 'N', 'I', 0, 0, 0, 0, 0);
+	const quint64 PI		= G2_PACK('P', 'I', 0, 0, 0, 0, 0, 0);
+	const quint64 PO		= G2_PACK('P', 'O', 0, 0, 0, 0, 0, 0);
+	const quint64 Q2		= G2_PACK('Q', '2', 0, 0, 0, 0, 0, 0);
+	const quint64 QA		= G2_PACK('Q', 'A', 0, 0, 0, 0, 0, 0);
+	const quint64 QH2		= G2_PACK('Q', 'H', '2', 0, 0, 0, 0, 0);
+	const quint64 QHT		= G2_PACK('Q', 'H', 'T', 0, 0, 0, 0, 0);
+	const quint64 QKA		= G2_PACK('Q', 'K', 'A', 0, 0, 0, 0, 0);
+	const quint64 QKR		= G2_PACK('Q', 'K', 'R', 0, 0, 0, 0, 0);
+
+	// child packets
+	const quint64 CSC		= G2_PACK('C', 'S', 'C', 0, 0, 0, 0, 0);
+	const quint64 DN		= G2_PACK('D', 'N', 0, 0, 0, 0, 0, 0);
+	const quint64 GU		= G2_PACK('G', 'U', 0, 0, 0, 0, 0, 0);
+	const quint64 H			= G2_PACK('H', 0, 0, 0, 0, 0, 0, 0);
+	const quint64 I			= G2_PACK('I', 0, 0, 0, 0, 0, 0, 0);
+	const quint64 MD		= G2_PACK('M', 'D', 0, 0, 0, 0, 0, 0);
+	const quint64 NA		= G2_PACK('N', 'A', 0, 0, 0, 0, 0, 0);
+	const quint64 NH		= G2_PACK('N', 'H', 0, 0, 0, 0, 0, 0);
+	const quint64 PART		= G2_PACK('P', 'A', 'R', 'T', 0, 0, 0, 0);
+	const quint64 QK		= G2_PACK('Q', 'K', 0, 0, 0, 0, 0, 0);
+	const quint64 SZ		= G2_PACK('S', 'Z', 0, 0, 0, 0, 0, 0);
+	const quint64 SZR		= G2_PACK('S', 'Z', 'R', 0, 0, 0, 0, 0);
+	const quint64 UDP		= G2_PACK('U', 'D', 'P', 0, 0, 0, 0, 0);
+	const quint64 URL		= G2_PACK('U', 'R', 'L', 0, 0, 0, 0, 0);
+	const quint64 URN		= G2_PACK('U', 'R', 'N', 0, 0, 0, 0, 0);
+	const quint64 V			= G2_PACK('V', 0, 0, 0, 0, 0, 0, 0);
+}
+
 class G2Packet
 {
 	// Construction
@@ -42,7 +86,7 @@ protected:
 
 public:
 	static G2Packet* newPacket(const char* pszType = 0, bool bCompound = false);
-	static G2Packet* newPacket(char* pSource);
+	static G2Packet* newPacket(char* pSource, bool bView = false);
 
 
 	// Attributes
@@ -55,8 +99,16 @@ public:
 	quint32		m_nLength;
 	quint32		m_nPosition;
 	char		m_sType[9];
+	quint64		m_nType;		// m_sType packed, see G2_PACK
 	bool		m_bCompound;
+protected:
+	// A view packet does not own m_pBuffer, it points into the receive buffer it was parsed from.
+	// The pooled allocation is parked in m_pStorage until the view is detached or released.
+	bool		m_bView;
+	uchar*		m_pStorage;
+	quint32		m_nStorage;
 
+public:
 	enum { seekStart, seekEnd };
 
 	// Operations
@@ -64,24 +116,36 @@ public:
 	void	reset();
 	void	seek(quint32 nPosition, int nRelative = seekStart);
 	uchar* 	writeGetPointer(quint32 nLength, quint32 nOffset = 0xFFFFFFFF);
+	bool	detach();
+protected:
+	void	setView(char* pSource, quint32 nLength);
+	void	dropView();
 public:
 	char* 	getType() const;
+	inline bool isView() const;
+protected:
+	bool	grow(quint32 nSize);
+public:
 
 public:
 	G2Packet* 	writePacket(G2Packet* pPacket);
 	G2Packet* 	writePacket(const char* pszType, quint32 nLength, bool bCompound = false);
 	G2Packet*	prependPacket(G2Packet* pPacket, bool bRelease = true);
 	bool	readPacket(char* pszType, quint32& nLength, bool* pbCompound = 0);
+	bool	readPacket(quint64& nType, quint32& nLength, bool* pbCompound = 0);
 	bool	skipCompound();
 	bool	skipCompound(quint32& nLength, quint32 nRemaining = 0);
 	bool	getTo(QUuid& pGUID);
 
 public:
-	static	G2Packet* readBuffer(CBuffer* pBuffer);
+	static	G2Packet* readBuffer(CBuffer* pBuffer, bool bView = false);
+	quint32	toHeader(char* pHeader) const;
 	void	toBuffer(CBuffer* pBuffer) const;
 
 	// Inline Packet Operations
 	inline bool isType(const char* sType);
+	inline bool isType(quint64 nType) const;
+	static inline quint64 packType(const char* pszType, int nLength);
 	inline int getRemaining();
 	inline bool ensure(quint32 nBytes);
 	inline void read(void* pData, int nLength);
@@ -122,7 +186,44 @@ protected:
 
 #define G2_FLAG_COMPOUND	0x04
 #define G2_FLAG_BIG_ENDIAN	0x02
+#define G2_MAX_HEADER		12		// control byte, up to 3 length bytes and 8 type bytes
+
+
+// Payload size classes, payloads above the largest class go straight to malloc()
+#define G2_PAYLOAD_CLASSES		5
+#define G2_PAYLOAD_MAX_CLASS	65536u
+
+struct G2PacketPoolStats
+{
+	quint64 nHits;			// packets served from a thread cache
+	quint64 nMisses;		// thread cache was empty and had to be refilled
+	quint64 nPayloadHits;	// payload blocks served from a thread cache
+	quint64 nPayloadMisses;	// payload blocks taken from the shared list or a new slab
+	quint32 nPackets;		// packet headers allocated
+	qint32	nInUse;			// packets handed out (exact to one batch per thread)
+	qint32	nPeak;			// highest nInUse seen
+	quint32 nSlabBytes;		// bytes reserved for payload slabs
+};
 
+// Per-thread free lists, only ever touched by the owning thread.
+class G2PacketCache
+{
+public:
+	G2PacketCache();
+	~G2PacketCache();
+
+	G2Packet*	m_pFree;
+	quint32		m_nFree;
+
+	uchar*		m_pBlocks[G2_PAYLOAD_CLASSES];
+	quint32		m_nBlocks[G2_PAYLOAD_CLASSES];
+
+	quint32		m_nHits;
+	quint32		m_nMisses;
+	quint32		m_nPayloadHits;
+	quint32		m_nPayloadMisses;
+	qint32		m_nInUse;
+};
 
 class G2PacketPool
 {
@@ -133,22 +234,45 @@ public:
 
 	// Attributes
 protected:
-	G2Packet* 	m_pFree;
-	quint32		m_nFree;
+	// Shared fallback lists. Only whole chains are pushed and only the whole list is taken,
+	// so the lock-free stacks are not exposed to ABA.
+	QAtomicPointer<G2Packet>	m_pShared;
+	QAtomicPointer<uchar>		m_pSharedBlocks[G2_PAYLOAD_CLASSES];
+
+	QThreadStorage<G2PacketCache*>	m_oCache;
 protected:
-	QMutex				m_pSection;
+	QMutex				m_pSection;		// guards pool/slab allocation and the counters below
 	QList<G2Packet*>	m_pPools;
+	QList<uchar*>		m_lSlabs;
+	G2PacketPoolStats	m_oStats;		// thread caches publish into this once per batch
+
+	static const quint32 m_pClassSize[G2_PAYLOAD_CLASSES];
 
 	// Operations
 protected:
 	void	clear();
-	void	newPool();
+	void	newPool(G2PacketCache* pCache);
+	void	newSlab(G2PacketCache* pCache, int nClass);
+	void	refill(G2PacketCache* pCache);
+	void	refillBlocks(G2PacketCache* pCache, int nClass);
+	void	spill(G2PacketCache* pCache, quint32 nCount);
+	void	spillBlocks(G2PacketCache* pCache, int nClass, quint32 nCount);
+	void	publish(G2PacketCache* pCache);
+	G2PacketCache* createCache();
+
+public:
+	uchar*	allocBuffer(quint32 nSize, quint32& nBlock);
+	void	freeBuffer(uchar* pBlock, quint32 nBlock);
+	G2PacketPoolStats stats();
 
 	// Inlines
 public:
 	inline G2Packet* newPacket();
 	inline void deletePacket(G2Packet* pPacket);
+protected:
+	inline G2PacketCache* localCache();
 
+	friend class G2PacketCache;
 };
 
 // Inlines impl
@@ -159,22 +283,38 @@ bool G2Packet::isType(const char* sType)
 	return strcmp(sType, m_sType) == 0;
 }
 
+bool G2Packet::isType(quint64 nType) const
+{
+	return m_nType == nType;
+}
+
+quint64 G2Packet::packType(const char* pszType, int nLength)
+{
+	quint64 nType = 0;
+	memcpy(&nType, pszType, qMin(nLength, 8));
+	return qFromLittleEndian(nType);
+}
+
 int G2Packet::getRemaining()
 {
 	return m_nLength - m_nPosition;
 }
 
+bool G2Packet::isView() const
+{
+	return m_bView;
+}
+
 bool G2Packet::ensure(quint32 nBytes)
 {
-	if(m_nLength + nBytes > m_nBuffer)
+	if(m_bView && !detach())
 	{
-		m_nBuffer += qMax(nBytes, 128u);
-		m_pBuffer = (uchar*)realloc(m_pBuffer, m_nBuffer);
+		return false;
+	}
 
-		if(!m_pBuffer)
-		{
-			return false;
-		}
+	if(m_nLength + nBytes > m_nBuffer)
+	{
+		return grow(m_nLength + nBytes);
 	}
 
 	return true;
@@ -311,6 +451,12 @@ void G2Packet::writeGUID(QUuid& guid)
 
 void G2Packet::addRef()
 {
+	// Anyone keeping an extra reference outlives the receive buffer - take a private copy
+	if(m_bView)
+	{
+		detach();
+	}
+
 	m_nReference++;
 }
 
@@ -338,21 +484,36 @@ void G2Packet::releaseChain()
 }
 
 // G2PacketPool
-G2Packet* G2PacketPool::newPacket()
+G2PacketCache* G2PacketPool::localCache()
 {
-	m_pSection.lock();
+	G2PacketCache* pCache = m_oCache.localData();
 
-	if(m_nFree == 0)
+	if(!pCache)
 	{
-		newPool();
+		pCache = createCache();
 	}
-	Q_ASSERT(m_nFree > 0);
 
-	G2Packet* pPacket = m_pFree;
-	m_pFree = m_pFree->m_pNext;
-	m_nFree --;
+	return pCache;
+}
+
+G2Packet* G2PacketPool::newPacket()
+{
+	G2PacketCache* pCache = localCache();
+
+	if(pCache->m_nFree == 0)
+	{
+		refill(pCache);
+	}
+	else
+	{
+		pCache->m_nHits++;
+	}
+	Q_ASSERT(pCache->m_nFree > 0);
 
-	m_pSection.unlock();
+	G2Packet* pPacket = pCache->m_pFree;
+	pCache->m_pFree = pPacket->m_pNext;
+	pCache->m_nFree--;
+	pCache->m_nInUse++;
 
 	pPacket->reset();
 	pPacket->addRef();
@@ -365,13 +526,19 @@ void G2PacketPool::deletePacket(G2Packet *pPacket)
 	Q_ASSERT(pPacket != NULL);
 	Q_ASSERT(pPacket->m_nReference == 0);
 
-	m_pSection.lock();
+	G2PacketCache* pCache = localCache();
 
-	pPacket->m_pNext = m_pFree;
-	m_pFree = pPacket;
-	m_nFree ++;
+	pPacket->m_pNext = pCache->m_pFree;
+	pCache->m_pFree = pPacket;
+	pCache->m_nFree++;
+	pCache->m_nInUse--;
 
-	m_pSection.unlock();
+	// keep thread caches bounded, packets released by another thread than the one
+	// that built them would otherwise pile up there
+	if(pCache->m_nFree > 1024)
+	{
+		spill(pCache, 512);
+	}
 }
 
 extern G2PacketPool G2Packets;
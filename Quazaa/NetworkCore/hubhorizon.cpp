@@ -39,6 +39,9 @@ CHubHorizonPool::CHubHorizonPool()
 	m_pFree		= 0;
 	m_pActive	= 0;
 	m_nActive	= 0;
+	m_pHash		= 0;
+	m_nHashMask	= 0;
+	m_nStamp	= 0;
 }
 
 CHubHorizonPool::~CHubHorizonPool()
@@ -47,6 +50,10 @@ CHubHorizonPool::~CHubHorizonPool()
 	{
 		delete [] m_pBuffer;
 	}
+	if(m_pHash != 0)
+	{
+		delete [] m_pHash;
+	}
 }
 
 void CHubHorizonPool::setup()
@@ -55,18 +62,24 @@ void CHubHorizonPool::setup()
 	{
 		delete [] m_pBuffer;
 	}
+	if(m_pHash != 0)
+	{
+		delete [] m_pHash;
+	}
 
-	m_nBuffer	= quazaaSettings.Gnutella2.HubHorizonSize;
+	m_nBuffer	= qMax(1, quazaaSettings.Gnutella2.HubHorizonSize);
 	m_pBuffer	= new CHubHorizonHub[ m_nBuffer ];
-	m_pActive	= 0;
-	m_nActive	= 0;
-	m_pFree		= m_pBuffer;
 
-	for(quint32 nItem = 0 ; nItem < m_nBuffer ; nItem++)
+	// At most half full, so chains stay one or two entries long
+	quint32 nHash = 64;
+	while(nHash < m_nBuffer * 2)
 	{
-		m_pBuffer[ nItem ].m_pNext	= (nItem < m_nBuffer - 1)
-									  ? &m_pBuffer[ nItem + 1 ] : 0;
+		nHash *= 2;
 	}
+	m_pHash		= new CHubHorizonHub*[ nHash ];
+	m_nHashMask	= nHash - 1;
+
+	clear();
 }
 
 void CHubHorizonPool::clear()
@@ -79,15 +92,32 @@ void CHubHorizonPool::clear()
 	{
 		m_pBuffer[ nItem ].m_pNext	= (nItem < m_nBuffer - 1)
 									  ? &m_pBuffer[ nItem + 1 ] : 0;
+		m_pBuffer[ nItem ].m_nStamp	= 0;
 	}
+
+	if(m_pHash != 0)
+	{
+		memset(m_pHash, 0, sizeof(CHubHorizonHub*) * (m_nHashMask + 1));
+	}
+}
+
+quint32 CHubHorizonPool::hashAddress(const CEndPoint& oAddress)
+{
+	return qHash(static_cast<const QHostAddress&>(oAddress)) ^ (quint32(oAddress.port()) * 0x9e3779b1u);
 }
 
-CHubHorizonHub* CHubHorizonPool::add(CEndPoint oAddress)
+CHubHorizonHub* CHubHorizonPool::add(const CEndPoint& oAddress)
 {
-	CHubHorizonHub* pHub = m_pActive;
-	for(; pHub ; pHub = pHub->m_pNext)
+	if(m_pHash == 0)
 	{
-		if(pHub->m_oAddress == oAddress)
+		return 0;
+	}
+
+	const quint32 nHash = hashAddress(oAddress);
+
+	for(CHubHorizonHub* pHub = m_pHash[ nHash & m_nHashMask ] ; pHub ; pHub = pHub->m_pHashNext)
+	{
+		if(pHub->m_nHash == nHash && pHub->m_oAddress == oAddress)
 		{
 			pHub->m_nReference ++;
 			return pHub;
@@ -99,14 +129,23 @@ CHubHorizonHub* CHubHorizonPool::add(CEndPoint oAddress)
 		return 0;
 	}
 
-	pHub = m_pFree;
+	CHubHorizonHub* pHub = m_pFree;
 	m_pFree = m_pFree->m_pNext;
 
+	pHub->m_pPrev = 0;
 	pHub->m_pNext = m_pActive;
+	if(m_pActive)
+	{
+		m_pActive->m_pPrev = pHub;
+	}
 	m_pActive = pHub;
 	m_nActive ++;
 
+	pHub->m_pHashNext = m_pHash[ nHash & m_nHashMask ];
+	m_pHash[ nHash & m_nHashMask ] = pHub;
+
 	pHub->m_oAddress	= oAddress;
+	pHub->m_nHash		= nHash;
 	pHub->m_nReference	= 1;
 
 	return pHub;
@@ -114,28 +153,49 @@ CHubHorizonHub* CHubHorizonPool::add(CEndPoint oAddress)
 
 void CHubHorizonPool::remove(CHubHorizonHub* pHub)
 {
-	CHubHorizonHub** ppPrev = &m_pActive;
+	CHubHorizonHub** ppPrev = &m_pHash[ pHub->m_nHash & m_nHashMask ];
 
-	for(CHubHorizonHub* pSeek = *ppPrev ; pSeek ; pSeek = pSeek->m_pNext)
+	for( ; *ppPrev && *ppPrev != pHub ; ppPrev = &(*ppPrev)->m_pHashNext)
 	{
-		if(pHub == pSeek)
-		{
-			*ppPrev = pHub->m_pNext;
-			pHub->m_pNext = m_pFree;
-			m_pFree = pHub;
-			m_nActive --;
-			break;
-		}
+	}
 
-		ppPrev = &pSeek->m_pNext;
+	if(*ppPrev == 0)
+	{
+		return;
 	}
+
+	*ppPrev = pHub->m_pHashNext;
+
+	if(pHub->m_pPrev)
+	{
+		pHub->m_pPrev->m_pNext = pHub->m_pNext;
+	}
+	else
+	{
+		m_pActive = pHub->m_pNext;
+	}
+	if(pHub->m_pNext)
+	{
+		pHub->m_pNext->m_pPrev = pHub->m_pPrev;
+	}
+
+	pHub->m_pNext = m_pFree;
+	m_pFree = pHub;
+	m_nActive --;
 }
 
-CHubHorizonHub* CHubHorizonPool::find(CEndPoint oAddress)
+CHubHorizonHub* CHubHorizonPool::find(const CEndPoint& oAddress)
 {
-	for(CHubHorizonHub* pHub = m_pActive ; pHub ; pHub = pHub->m_pNext)
+	if(m_pHash == 0)
+	{
+		return 0;
+	}
+
+	const quint32 nHash = hashAddress(oAddress);
+
+	for(CHubHorizonHub* pHub = m_pHash[ nHash & m_nHashMask ] ; pHub ; pHub = pHub->m_pHashNext)
 	{
-		if(pHub->m_oAddress == oAddress)
+		if(pHub->m_nHash == nHash && pHub->m_oAddress == oAddress)
 		{
 			return pHub;
 		}
@@ -144,11 +204,11 @@ CHubHorizonHub* CHubHorizonPool::find(CEndPoint oAddress)
 	return 0;
 }
 
-int CHubHorizonPool::addHorizonHubs(G2Packet* pPacket)
+int CHubHorizonPool::addHorizonHubs(G2Packet* pPacket, int nMax)
 {
 	int nCount = 0;
 
-	for(CHubHorizonHub* pHub = m_pActive ; pHub ; pHub = pHub->m_pNext)
+	for(CHubHorizonHub* pHub = m_pActive ; pHub && nCount < nMax ; pHub = pHub->m_pNext)
 	{
 		pPacket->writePacket("S", (pHub->m_oAddress.protocol() == QAbstractSocket::IPv4Protocol ? 6 : 18));
 		pPacket->writeHostAddress(&pHub->m_oAddress);
@@ -159,6 +219,21 @@ int CHubHorizonPool::addHorizonHubs(G2Packet* pPacket)
 	return nCount;
 }
 
+quint32 CHubHorizonPool::nextStamp()
+{
+	// 0 marks hubs never listed
+	if(++m_nStamp == 0)
+	{
+		for(quint32 nItem = 0 ; nItem < m_nBuffer ; nItem++)
+		{
+			m_pBuffer[ nItem ].m_nStamp = 0;
+		}
+		m_nStamp = 1;
+	}
+
+	return m_nStamp;
+}
+
 CHubHorizonGroup::CHubHorizonGroup()
 {
 	m_pList		= 0;
@@ -175,42 +250,49 @@ CHubHorizonGroup::~CHubHorizonGroup()
 	}
 }
 
-void CHubHorizonGroup::add(CEndPoint oAddress)
+// Replaces the hubs of the group with the ones listed in one KHL. New references are taken
+// before the old ones are dropped, so hubs listed again are never freed and re-added.
+void CHubHorizonGroup::setHubs(const QList<CEndPoint>& lAddresses)
 {
-	CHubHorizonHub** ppHub = m_pList;
+	CHubHorizonHub** pOld = m_pList;
+	quint32 nOld = m_nCount;
 
-	for(quint32 nCount = m_nCount ; nCount ; nCount--, ppHub++)
-	{
-		if((*ppHub)->m_oAddress == oAddress)
-		{
-			return;
-		}
-	}
+	m_nBuffer	= lAddresses.size();
+	m_pList		= m_nBuffer ? new CHubHorizonHub*[ m_nBuffer ] : 0;
+	m_nCount	= 0;
 
-	CHubHorizonHub* pHub = HubHorizonPool.add(oAddress);
-	if(pHub == 0)
-	{
-		return;
-	}
+	const quint32 nStamp = HubHorizonPool.nextStamp();
 
-	if(m_nCount == m_nBuffer)
+	foreach(const CEndPoint& oAddress, lAddresses)
 	{
-		m_nBuffer += 8;
-		CHubHorizonHub** pList = new CHubHorizonHub*[ m_nBuffer ];
-		if(m_nCount)
+		CHubHorizonHub* pHub = HubHorizonPool.add(oAddress);
+		if(pHub == 0)
 		{
-			memcpy(pList, m_pList, sizeof(CHubHorizonHub*) * m_nCount);
+			continue;
 		}
 
-		if(m_pList)
+		if(pHub->m_nStamp == nStamp)
 		{
-			delete [] m_pList;
+			pHub->m_nReference --;	// listed twice
+			continue;
 		}
 
-		m_pList = pList;
+		pHub->m_nStamp = nStamp;
+		m_pList[ m_nCount++ ] = pHub;
 	}
 
-	m_pList[ m_nCount++ ] = pHub;
+	for(quint32 nItem = 0 ; nItem < nOld ; nItem++)
+	{
+		if(-- (pOld[ nItem ]->m_nReference) == 0)
+		{
+			HubHorizonPool.remove(pOld[ nItem ]);
+		}
+	}
+
+	if(pOld)
+	{
+		delete [] pOld;
+	}
 }
 
 void CHubHorizonGroup::clear()
@@ -227,4 +309,3 @@ void CHubHorizonGroup::clear()
 
 	m_nCount = 0;
 }
-
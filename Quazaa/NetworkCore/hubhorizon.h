@@ -27,6 +27,7 @@
 #define HUBHORIZON_H
 
 #include "types.h"
+#include <QList>
 
 class G2Packet;
 
@@ -35,8 +36,12 @@ class CHubHorizonHub
 {
 public:
 	CEndPoint		m_oAddress;
-	quint32			m_nReference;
-	CHubHorizonHub*	m_pNext;
+	quint32			m_nReference;		// number of groups listing this hub
+	quint32			m_nHash;
+	quint32			m_nStamp;			// last batch that listed this hub, see CHubHorizonGroup::setHubs()
+	CHubHorizonHub*	m_pNext;			// active or free list
+	CHubHorizonHub*	m_pPrev;
+	CHubHorizonHub*	m_pHashNext;		// hash chain
 };
 
 
@@ -52,32 +57,43 @@ protected:
 	quint32				m_nBuffer;
 
 public:
-	void		add(CEndPoint oAddress);
+	void		setHubs(const QList<CEndPoint>& lAddresses);
 	void		clear();
 
 };
 
 
+// Hubs known through neighbouring hubs, kept in one preallocated arena with a hashed index.
+// Entries are reference counted by the groups that list them.
 class CHubHorizonPool
 {
 public:
 	CHubHorizonPool();
 	virtual ~CHubHorizonPool();
 
+	enum { MaxAckHubs = 128 };	// hubs listed in a query acknowledgement
+
 protected:
 	CHubHorizonHub*		m_pBuffer;
 	quint32				m_nBuffer;
 	CHubHorizonHub*		m_pFree;
-	CHubHorizonHub*		m_pActive;
+	CHubHorizonHub*		m_pActive;			// most recently added first
 	quint32				m_nActive;
+	CHubHorizonHub**	m_pHash;
+	quint32				m_nHashMask;
+	quint32				m_nStamp;
 
 public:
 	void				setup();
 	void				clear();
-	CHubHorizonHub*		add(CEndPoint oAddress);
+	CHubHorizonHub*		add(const CEndPoint& oAddress);
 	void				remove(CHubHorizonHub* pHub);
-	CHubHorizonHub*		find(CEndPoint oAddress);
-	int					addHorizonHubs(G2Packet* pPacket);
+	CHubHorizonHub*		find(const CEndPoint& oAddress);
+	int					addHorizonHubs(G2Packet* pPacket, int nMax = MaxAckHubs);
+	quint32				nextStamp();
+
+protected:
+	static quint32		hashAddress(const CEndPoint& oAddress);
 
 };
 
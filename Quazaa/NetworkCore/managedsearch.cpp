@@ -222,6 +222,9 @@ void CManagedSearch::searchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 
 	QMutexLocker oHostCacheLock( &hostCache.m_pSection );
 
+	// Read without Neighbours.m_pSection, one copy for the whole walk
+	CNeighboursSnapshotRef oNeighbours = Neighbours.snapshot();
+
 	for ( CHostCacheIterator itHost = hostCache.m_lHosts.begin();
 		  itHost != hostCache.m_lHosts.end(); ++itHost )
 	{
@@ -245,14 +248,11 @@ void CManagedSearch::searchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 			}
 		}
 
-		Neighbours.m_pSection.lock();
-		if ( Neighbours.find(pHost->m_oAddress ) )
+		if ( oNeighbours->find( pHost->m_oAddress ) )
 		{
 			// don't udp to neighbours
-			Neighbours.m_pSection.unlock();
 			continue;
 		}
-		Neighbours.m_pSection.unlock();
 
 		CEndPoint pReceiver;
 
@@ -284,20 +284,16 @@ void CManagedSearch::searchG2(const QDateTime& tNowDT, quint32* pnMaxPackets)
 			else
 			{
 				// we are firewalled, so key must be for one of our connected neighbours
-				Neighbours.m_pSection.lock();
-
-				CNeighbour* pNode = Neighbours.find( pHost->m_nKeyHost, dpG2 );
+				const CNeighbourSnapshotEntry* pNode = oNeighbours->find( pHost->m_nKeyHost, dpG2 );
 
-				if( pNode && static_cast<CG2Node*>(pNode)->m_nState == nsConnected )
+				if( pNode && pNode->nState == nsConnected )
 				{
-					pReceiver = pNode->m_oAddress;
+					pReceiver = pNode->oAddress;
 				}
 				else
 				{
 					pHost->m_nQueryKey = 0;
 				}
-
-				Neighbours.m_pSection.unlock();
 			}
 		}
 
@@ -99,10 +99,17 @@ void CNeighbour::onTimer(quint32 tNow)
 
 void CNeighbour::close(bool bDelayed)
 {
-	m_nState = nsClosing;
+	setState(nsClosing);
 	CCompressedConnection::close(bDelayed);
 }
 
+// Any thread; the neighbours snapshot is republished on the next event loop pass
+void CNeighbour::setState(NodeState nState)
+{
+	m_nState = nState;
+	Neighbours.schedulePublish();
+}
+
 void CNeighbour::onDisconnectNode()
 {
 	Neighbours.m_pSection.lock();
@@ -63,18 +63,20 @@ public:
 		systemLog.postLog( LogSeverity::Information, Components::Network,
 						   "Initiating neighbour connection to %s...",
 						   qPrintable( oAddress.toString() ) );
-		m_nState = nsConnecting;
+		setState(nsConnecting);
 		CNetworkConnection::connectTo( oAddress );
 	}
 	void attachTo(CNetworkConnection* pOther)
 	{
-		m_nState = nsHandshaking;
+		setState(nsHandshaking);
 		CCompressedConnection::attachTo( pOther );
 	}
 
 	virtual void onTimer(quint32 tNow);
 	void close(bool bDelayed = false);
 
+	void setState(NodeState nState);
+
 signals:
 
 public slots:
@@ -24,11 +24,15 @@
 
 #include "neighboursbase.h"
 #include "neighbour.h"
+
+#include <algorithm>
+
 #include "debug_new.h"
 
 CNeighboursBase::CNeighboursBase(QObject* parent) :
 	QObject(parent),
-	m_bActive(false)
+	m_bActive(false),
+	m_pSnapshot(new CNeighboursSnapshot())
 {
 }
 CNeighboursBase::~CNeighboursBase()
@@ -37,6 +41,9 @@ CNeighboursBase::~CNeighboursBase()
 	{
 		disconnectNode();
 	}
+
+	delete m_pSnapshot.loadAcquire();
+	qDeleteAll(m_lRetiredSnapshots);
 }
 
 void CNeighboursBase::connectNode()
@@ -60,6 +67,8 @@ void CNeighboursBase::addNode(CNeighbour* pNode)
 	m_lNodesByAddr.insert(pNode->m_oAddress, pNode);
 	m_lNodesByPtr.insert(pNode);
 
+	publishSnapshot();
+
 	emit neighbourAdded(pNode);
 }
 void CNeighboursBase::removeNode(CNeighbour* pNode)
@@ -70,6 +79,8 @@ void CNeighboursBase::removeNode(CNeighbour* pNode)
 	m_lNodesByAddr.remove(pNode->m_oAddress);
 	m_lNodesByPtr.remove(pNode);
 
+	publishSnapshot();
+
 	emit neighbourRemoved(pNode);
 }
 
@@ -106,5 +117,103 @@ void CNeighboursBase::maintain()
 	{
 		pNode->onTimer(tNow);
 	}
+
+	reclaimSnapshots();
+}
+
+// Never blocks: the reader only counts itself in the current epoch (see CEpochReclaimer)
+CNeighboursSnapshotRef CNeighboursBase::snapshot()
+{
+	return CNeighboursSnapshotRef(&m_oSnapshotEpochs, m_pSnapshot);
+}
+
+void CNeighboursBase::publishSnapshot()
+{
+	ASSUME_LOCK(m_pSection);
+
+	CNeighboursSnapshot* pSnapshot = new CNeighboursSnapshot();
+	pSnapshot->m_lNodes.reserve(m_lNodes.size());
+	pSnapshot->m_lByAddress.reserve(m_lNodes.size());
+
+	foreach(CNeighbour * pNode, m_lNodes)
+	{
+		CNeighbourSnapshotEntry oEntry;
+		oEntry.pNode = pNode;
+		oEntry.oAddress = pNode->m_oAddress;
+		oEntry.nProtocol = pNode->m_nProtocol;
+		oEntry.nState = pNode->m_nState;
+
+		pSnapshot->m_lByAddress.append((quint64(qHash(static_cast<const QHostAddress&>(oEntry.oAddress))) << 32) | pSnapshot->m_lNodes.size());
+		pSnapshot->m_lNodes.append(oEntry);
+	}
+
+	std::sort(pSnapshot->m_lByAddress.begin(), pSnapshot->m_lByAddress.end());
+
+	CNeighboursSnapshot* pOld = m_pSnapshot.fetchAndStoreOrdered(pSnapshot);
+	pOld->m_nRetired = m_oSnapshotEpochs.epoch();
+	m_lRetiredSnapshots.append(pOld);
+
+	reclaimSnapshots();
+}
+
+// Any thread. Queues at most one republish, which picks up all state changes made until it runs.
+void CNeighboursBase::schedulePublish()
+{
+	if(m_nPublishScheduled.testAndSetOrdered(0, 1))
+	{
+		QMetaObject::invokeMethod(this, "onPublish", Qt::QueuedConnection);
+	}
+}
+
+void CNeighboursBase::onPublish()
+{
+	// Cleared first, a state change made while we rebuild queues another pass
+	m_nPublishScheduled.fetchAndStoreOrdered(0);
+
+	QMutexLocker l(&m_pSection);
+	publishSnapshot();
+}
+
+void CNeighboursBase::reclaimSnapshots()
+{
+	ASSUME_LOCK(m_pSection);
+
+	if(m_lRetiredSnapshots.isEmpty())
+	{
+		return;
+	}
+
+	m_oSnapshotEpochs.advance();
+
+	for(QList<CNeighboursSnapshot*>::iterator itOld = m_lRetiredSnapshots.begin(); itOld != m_lRetiredSnapshots.end();)
+	{
+		if(m_oSnapshotEpochs.isSafe((*itOld)->m_nRetired))
+		{
+			delete *itOld;
+			itOld = m_lRetiredSnapshots.erase(itOld);
+		}
+		else
+		{
+			++itOld;
+		}
+	}
+}
+
+const CNeighbourSnapshotEntry* CNeighboursSnapshot::find(const QHostAddress& oAddress, DiscoveryProtocol nProtocol) const
+{
+	const quint64 nHash = quint64(qHash(oAddress)) << 32;
+
+	for(QVector<quint64>::const_iterator itIndex = std::lower_bound(m_lByAddress.constBegin(), m_lByAddress.constEnd(), nHash);
+		itIndex != m_lByAddress.constEnd() && (*itIndex & Q_UINT64_C(0xffffffff00000000)) == nHash; ++itIndex)
+	{
+		const CNeighbourSnapshotEntry& oEntry = m_lNodes.at(*itIndex & 0xffffffff);
+
+		if(static_cast<const QHostAddress&>(oEntry.oAddress) == oAddress && (oEntry.nProtocol == nProtocol || nProtocol == dpNull))
+		{
+			return &oEntry;
+		}
+	}
+
+	return 0;
 }
 
@@ -31,10 +31,39 @@
 #include <QList>
 #include <QHash>
 #include <QSet>
+#include <QVector>
+#include <QAtomicInt>
+#include <QAtomicPointer>
 #include "types.h"
+#include "epochreclaimer.h"
 
 class CNeighbour;
 
+struct CNeighbourSnapshotEntry
+{
+	CNeighbour*			pNode;			// for comparison only, dereference with m_pSection held
+	CEndPoint			oAddress;
+	DiscoveryProtocol	nProtocol;
+	NodeState			nState;
+};
+
+// Immutable copy of the neighbour list, for readers that only need addresses and states and
+// should not wait for m_pSection. Republished on topology changes, state changes are coalesced
+// into one republish per event loop pass (see schedulePublish()).
+class CNeighboursSnapshot
+{
+public:
+	QVector<CNeighbourSnapshotEntry>	m_lNodes;
+	QVector<quint64>					m_lByAddress;	// address hash << 32 | index into m_lNodes, sorted
+	int									m_nRetired;		// epoch it was replaced in
+
+public:
+	const CNeighbourSnapshotEntry* find(const QHostAddress& oAddress, DiscoveryProtocol nProtocol = dpNull) const;
+};
+
+// Holds a snapshot for the lifetime of the object
+typedef CEpochRef<CNeighboursSnapshot> CNeighboursSnapshotRef;
+
 class CNeighboursBase : public QObject
 {
 	Q_OBJECT
@@ -46,6 +75,11 @@ protected:
 	QList<CNeighbour*>				 m_lNodes;
 	QHash<QHostAddress, CNeighbour*> m_lNodesByAddr;  // lookups by ip address
 	QSet<CNeighbour*>				 m_lNodesByPtr;	// lookups by pointer
+
+	QAtomicPointer<CNeighboursSnapshot>	m_pSnapshot;
+	CEpochReclaimer					 m_oSnapshotEpochs;	// readers of m_pSnapshot
+	QList<CNeighboursSnapshot*>		 m_lRetiredSnapshots;
+	QAtomicInt						 m_nPublishScheduled;
 public:
 	CNeighboursBase(QObject* parent = 0);
 	virtual ~CNeighboursBase();
@@ -59,6 +93,13 @@ public:
 	CNeighbour* find(QHostAddress& oAddress, DiscoveryProtocol nProtocol = dpNull);
 	bool neighbourExists(const CNeighbour* pNode);
 
+	CNeighboursSnapshotRef snapshot();
+	void publishSnapshot();
+	void schedulePublish();
+protected:
+	void reclaimSnapshots();
+public:
+
 	virtual quint32 downloadSpeed()
 	{
 		return 0;
@@ -94,6 +135,8 @@ signals:
 	void neighbourRemoved(CNeighbour*);
 public slots:
 	virtual void maintain();
+protected slots:
+	void onPublish();
 };
 
 #endif // NEIGHBOURSBASE_H
@@ -271,37 +271,19 @@ void CNeighboursConnections::maintain()
 			const quint32 tNow = common::getTNowUTC();
 			bool bCountry = true;
 			int  nCountry = 0;
-			QList<CHostCacheHost*> oExcept;
+			QSet<CHostCacheHost*> oExcept;
+			QList<CHostCacheHost*> lHosts;
 
-			for ( ; nAttempt > 0; --nAttempt )
+			while ( nAttempt > 0 )
 			{
-				// nowe polaczenie
-				CHostCacheHost* pHost;
+				// nowe polaczenia, all attempts of a country are drawn at once
 				QString sCountry;
 				sCountry = bCountry ? ( quazaaSettings.Connection.PreferredCountries.size() ?
 										quazaaSettings.Connection.PreferredCountries.at(nCountry) :
 										geoIP.findCountryCode(Network.m_oAddress) ) : "ZZ";
-				pHost = hostCache.getConnectable( tNow, oExcept, sCountry );
 
-				if ( pHost )
-				{
-					if ( !Neighbours.find( pHost->m_oAddress ) )
-					{
-						if ( securityManager.isDenied( pHost->m_oAddress ) )
-						{
-							hostCache.remove( pHost );
-							continue;
-						}
-						connectTo(pHost->m_oAddress, dpG2);
-						pHost->m_tLastConnect = tNow;
-					}
-					else
-					{
-						oExcept.append(pHost);
-						nAttempt++;
-					}
-				}
-				else
+				lHosts.clear();
+				if ( !hostCache.getConnectable( lHosts, nAttempt, tNow, oExcept, sCountry ) )
 				{
 					if(!bCountry)
 					{
@@ -316,13 +298,32 @@ void CNeighboursConnections::maintain()
 							{
 								bCountry = false;
 							}
-							nAttempt++;
 							continue;
 						}
 						bCountry = false;
-						nAttempt++;
+						continue;
 					}
 				}
+
+				foreach ( CHostCacheHost* pHost, lHosts )
+				{
+					if ( Neighbours.find( pHost->m_oAddress ) )
+					{
+						oExcept.insert( pHost );
+						continue;
+					}
+
+					if ( securityManager.isDenied( pHost->m_oAddress ) )
+					{
+						hostCache.remove( pHost );
+					}
+					else
+					{
+						connectTo(pHost->m_oAddress, dpG2);
+						hostCache.setLastConnect( pHost, tNow );
+					}
+					--nAttempt;
+				}
 			}
 		}
 	}
@@ -345,35 +346,36 @@ void CNeighboursConnections::maintain()
 			const quint32 tNow = common::getTNowUTC();
 			qint32 nAttempt = qint32((quazaaSettings.Gnutella2.NumPeers - nHubsG2) * quazaaSettings.Gnutella.ConnectFactor);
 			nAttempt = qMin(nAttempt, 8) - nUnknown;
-			QList<CHostCacheHost*> oExcept;
+			QSet<CHostCacheHost*> oExcept;
+			QList<CHostCacheHost*> lHosts;
 
-			for ( ; nAttempt > 0; --nAttempt )
+			while ( nAttempt > 0 )
 			{
-				// nowe polaczenie
-				CHostCacheHost* pHost = hostCache.getConnectable( tNow, oExcept );
+				// nowe polaczenia
+				lHosts.clear();
+				if ( !hostCache.getConnectable( lHosts, nAttempt, tNow, oExcept ) )
+				{
+					break;
+				}
 
-				if ( pHost )
+				foreach ( CHostCacheHost* pHost, lHosts )
 				{
-					if( !Neighbours.find( pHost->m_oAddress ) )
+					if ( Neighbours.find( pHost->m_oAddress ) )
 					{
-						if ( securityManager.isDenied( pHost->m_oAddress ) )
-						{
-							hostCache.remove( pHost );
-							continue;
-						}
+						oExcept.insert( pHost );
+						continue;
+					}
 
-						connectTo( pHost->m_oAddress, dpG2 );
-						pHost->m_tLastConnect = tNow;
+					if ( securityManager.isDenied( pHost->m_oAddress ) )
+					{
+						hostCache.remove( pHost );
 					}
 					else
 					{
-						oExcept.append( pHost );
-						++nAttempt;
+						connectTo( pHost->m_oAddress, dpG2 );
+						hostCache.setLastConnect( pHost, tNow );
 					}
-				}
-				else
-				{
-					break;
+					--nAttempt;
 				}
 			}
 		}
@@ -29,6 +29,7 @@
 #include "g2node.h"
 #include "g2packet.h"
 #include "queryhashtable.h"
+#include "queryrouter.h"
 
 #include "debug_new.h"
 
@@ -40,11 +41,35 @@ CNeighboursRouting::~CNeighboursRouting()
 {
 }
 
+void CNeighboursRouting::connectNode()
+{
+	ASSUME_LOCK(m_pSection);
+
+	QueryRouter.start();
+
+	CNeighboursBase::connectNode();
+}
+void CNeighboursRouting::disconnectNode()
+{
+	ASSUME_LOCK(m_pSection);
+
+	QueryRouter.stop();
+
+	CNeighboursBase::disconnectNode();
+}
+
 void CNeighboursRouting::routeQuery(CQueryPtr pQuery, G2Packet *pPacket, CNeighbour* pFrom, bool bToHubs)
 {
 	quint32 tNow = time(0);
 	quint32 nCount = 0, nHubs = 0, nLeaves = 0;
 
+	// Slot positions are built once per table size, most neighbours share the same one
+	const CQueryHashPositions* pPositions = 0;
+	const CQueryHashPositions* pSummary = 0;
+
+	// Leaves are matched by the router threads when they run
+	const bool bRouteLeaves = !QueryRouter.isActive();
+
 	foreach(CNeighbour* pNode, m_lNodes)
 	{
 		if( pNode != pFrom && pNode->m_nState == nsConnected && pNode->m_nProtocol == dpG2 && tNow - pNode->m_tConnected > 30 )
@@ -56,9 +81,33 @@ void CNeighboursRouting::routeQuery(CQueryPtr pQuery, G2Packet *pPacket, CNeighb
 				continue;
 			}
 
+			if( !bRouteLeaves && pG2->m_nType == G2_LEAF )
+			{
+				continue;
+			}
+
 			if( pG2->m_pRemoteTable != 0 && pG2->m_pRemoteTable->m_bLive )
 			{
-				if( !pG2->m_pRemoteTable->checkQuery(pQuery) )
+				// The 4 KB summary stays in cache, most tables are rejected without touching the table
+				if( pG2->m_pRemoteTable->m_pSummary )
+				{
+					if( !pSummary )
+					{
+						pSummary = &pQuery->hashPositions(CQueryHashTable::SummaryBits);
+					}
+
+					if( !pG2->m_pRemoteTable->checkSummary(*pSummary) )
+					{
+						continue;
+					}
+				}
+
+				if( !pPositions || pPositions->nBits != pG2->m_pRemoteTable->m_nBits )
+				{
+					pPositions = &pQuery->hashPositions(pG2->m_pRemoteTable->m_nBits);
+				}
+
+				if( !pG2->m_pRemoteTable->checkPositions(*pPositions) )
 				{
 					continue;
 				}
@@ -78,6 +127,11 @@ void CNeighboursRouting::routeQuery(CQueryPtr pQuery, G2Packet *pPacket, CNeighb
 		}
 	}
 
+	if( !bRouteLeaves )
+	{
+		QueryRouter.publish(pPacket, pQuery, pFrom);
+	}
+
 #if LOG_QUERY_FORWARDING
 	qDebug() << "G2 Query forwarded to " << nCount << "nodes (hubs:" << nHubs << "leaves:" << nLeaves << ")";
 #endif
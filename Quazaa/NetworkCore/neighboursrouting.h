@@ -40,6 +40,9 @@ public:
 	CNeighboursRouting(QObject* parent = 0);
 	virtual ~CNeighboursRouting();
 
+	virtual void connectNode();
+	virtual void disconnectNode();
+
 	void routeQuery(CQueryPtr pQuery, G2Packet* pPacket, CNeighbour* pFrom = 0, bool bToHubs = true);
 
 signals:
@@ -35,6 +35,7 @@
 #include "quazaasettings.h"
 
 #include "queryhashmaster.h"
+#include "queryrouter.h"
 #include "searchmanager.h"
 #include "sharemanager.h"
 
@@ -79,14 +80,17 @@ void CNetwork::start()
 	m_oAddress.setPort(quazaaSettings.Connection.Port);
 
 	Handshakes.listen();
+	Datagrams.listen();
 
 	m_oRoutingTable.clear();
+	m_oQueryFilter.clear();
 
 	connect(&ShareManager, SIGNAL(sharesReady()), this, SLOT(onSharesReady()), Qt::UniqueConnection);
 
 	NetworkThread.start("Network", &m_pSection, this);
 
-	Datagrams.moveToThread(&NetworkThread);
+	Datagrams.m_oDispatcher.moveToThread(&NetworkThread);
+	QueryRouter.moveToThread(&NetworkThread);
 
 	SearchManager.moveToThread(&NetworkThread);
 	Neighbours.moveToThread(&NetworkThread);
@@ -112,7 +116,6 @@ void CNetwork::setupThread()
 	connect(m_pSecondTimer, SIGNAL(timeout()), this, SLOT(onSecondTimer()));
 	m_pSecondTimer->start(1000);
 
-	Datagrams.listen();
 	Handshakes.listen();
 
 	m_bSharesReady = ShareManager.sharesAreReady();
@@ -159,6 +162,21 @@ void CNetwork::onSecondTimer()
 		//m_oRoutingTable.Dump();
 		m_oRoutingTable.expireOldRoutes();
 		m_tCleanRoutesNext = 60;
+
+		if(m_oQueryFilter.m_nRateLimited || m_oQueryFilter.m_nDuplicates)
+		{
+			systemLog.postLog(LogSeverity::Debug, QString("Query filter: %1 accepted, %2 rate limited, %3 duplicates")
+							  .arg(m_oQueryFilter.m_nAccepted).arg(m_oQueryFilter.m_nRateLimited).arg(m_oQueryFilter.m_nDuplicates));
+		}
+		m_oQueryFilter.m_nAccepted = m_oQueryFilter.m_nRateLimited = m_oQueryFilter.m_nDuplicates = 0;
+
+		if(QueryRouter.isActive())
+		{
+			systemLog.postLog(LogSeverity::Debug, QString("Query router: %1 queries matched on %2 threads, %3 leaf tables checked, %4 sent to leaves")
+							  .arg(QueryRouter.m_nPublished.fetchAndStoreRelaxed(0)).arg(QueryRouter.shards())
+							  .arg(QueryRouter.m_nCandidates.fetchAndStoreRelaxed(0))
+							  .arg(QueryRouter.m_nDelivered.fetchAndStoreRelaxed(0)));
+		}
 	}
 
 	if(!QueryHashMaster.isValid())
@@ -29,6 +29,7 @@
 #include <QMutex>
 #include "types.h"
 #include "routetable.h"
+#include "queryfilter.h"
 
 // TODO: rename external variables
 
@@ -51,6 +52,7 @@ public:
 	CEndPoint	     m_oAddress;
 
 	CRouteTable      m_oRoutingTable;
+	CQueryFilter     m_oQueryFilter;
 	quint32          m_tCleanRoutesNext;
 
 	bool             m_bSharesReady;
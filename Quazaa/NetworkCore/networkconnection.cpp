@@ -77,7 +77,7 @@ void CNetworkConnection::connectTo(CEndPoint oAddress)
 
 	Q_ASSERT(m_pInput == 0);
 	Q_ASSERT(m_pOutput == 0);
-	m_pInput = new CBuffer(8192);
+	m_pInput = new CBuffer(8192, true);
 	m_pOutput = new CBuffer(8192);
 	Q_ASSERT(m_pSocket == 0);
 
@@ -131,7 +131,7 @@ void CNetworkConnection::acceptFrom(qintptr nHandle)
 
 	Q_ASSERT(m_pInput == 0);
 	Q_ASSERT(m_pOutput == 0);
-	m_pInput = new CBuffer(8192);
+	m_pInput = new CBuffer(8192, true);
 	m_pOutput = new CBuffer(8192);
 
 	m_pSocket->setSocketDescriptor(nHandle);
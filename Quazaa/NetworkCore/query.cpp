@@ -34,6 +34,7 @@ CQuery::CQuery()
 {
 	m_nMinimumSize = 0;
 	m_nMaximumSize = Q_UINT64_C(0xffffffffffffffff);
+	m_bHashedURNs = false;
 }
 
 void CQuery::setGUID(QUuid& guid)
@@ -57,6 +58,8 @@ void CQuery::setSizeRestriction(quint64 nMin, quint64 nMax)
 void CQuery::addURN(const CHash& pHash)
 {
 	m_lHashes.append(pHash);
+	m_bHashedURNs = false;
+	m_lPositions.clear();
 }
 
 G2Packet* CQuery::toG2Packet(CEndPoint* pAddr, quint32 nKey)
@@ -239,6 +242,49 @@ void CQuery::buildG2Keywords(QString strPhrase)
 	}
 }
 
+// A 32 bit QHT hash shifted right gives the slot in a table of any size, so the URN strings
+// are built and hashed once per query and each table size costs only a few shifts.
+const CQueryHashPositions& CQuery::hashPositions(quint32 nBits)
+{
+	for(int i = 0; i < m_lPositions.size(); ++i)
+	{
+		if(m_lPositions.at(i).nBits == nBits)
+		{
+			return m_lPositions.at(i);
+		}
+	}
+
+	if(!m_bHashedURNs)
+	{
+		m_lHashedURNs.clear();
+
+		foreach(const CHash& oHash, m_lHashes)
+		{
+			QByteArray baURN = oHash.toURN().toUtf8();
+			m_lHashedURNs.append(CQueryHashTable::hashWord(baURN.constData(), baURN.size(), 32));
+		}
+
+		m_bHashedURNs = true;
+	}
+
+	CQueryHashPositions oPositions;
+	oPositions.nBits = nBits;
+
+	foreach(quint32 nHash, m_lHashedURNs)
+	{
+		oPositions.lURNs.append(nHash >> (32 - nBits));
+	}
+
+	foreach(quint32 nHash, m_lHashedKeywords)
+	{
+		oPositions.lWords.append(nHash >> (32 - nBits));
+	}
+
+	m_lPositions.append(oPositions);
+
+	return m_lPositions.last();
+}
+
 CQueryPtr CQuery::fromPacket(G2Packet *pPacket, CEndPoint *pEndpoint)
 {
 	CQueryPtr pQuery(new CQuery());
@@ -261,92 +307,93 @@ bool CQuery::fromG2Packet(G2Packet *pPacket, CEndPoint *pEndpoint)
 	if( !pPacket->m_bCompound )
 		return false;
 
-	char szType[9];
+	quint64 nType = 0;
 	quint32 nLength = 0, nNext = 0;
 
-	while(pPacket->readPacket(&szType[0], nLength))
+	while(pPacket->readPacket(nType, nLength))
 	{
 		nNext = pPacket->m_nPosition + nLength;
 
-		if( strcmp("UDP", szType) == 0 && nLength >= 6 )
+		switch(nType)
 		{
-			if( nLength > 18 )
-			{
-				// IPv6
-				pPacket->readHostAddress(&m_oEndpoint, false);
-			}
-			else
-			{
-				// IPv4
-				pPacket->readHostAddress(&m_oEndpoint);
-			}
-
-			if( m_oEndpoint.isNull() && pEndpoint )
-				m_oEndpoint = *pEndpoint;
-
-			if( nLength >= 10 || nLength >= 22 )
+			case G2Type::UDP:
+				if( nLength >= 6 )
+				{
+					if( nLength > 18 )
+					{
+						// IPv6
+						pPacket->readHostAddress(&m_oEndpoint, false);
+					}
+					else
+					{
+						// IPv4
+						pPacket->readHostAddress(&m_oEndpoint);
+					}
+
+					if( m_oEndpoint.isNull() && pEndpoint )
+						m_oEndpoint = *pEndpoint;
+
+					if( nLength >= 10 || nLength >= 22 )
+					{
+						m_nQueryKey = pPacket->readIntLE<quint32>();
+
+						quint32* pKey = (quint32*)(pPacket->m_pBuffer + pPacket->m_nPosition - 4);
+						*pKey = 0;
+					}
+				}
+				break;
+			case G2Type::DN:
+				m_sDescriptiveName = pPacket->readString(nLength);
+				break;
+			case G2Type::URN:
 			{
-				m_nQueryKey = pPacket->readIntLE<quint32>();
-
-				quint32* pKey = (quint32*)(pPacket->m_pBuffer + pPacket->m_nPosition - 4);
-				*pKey = 0;
-			}
-		}
-		else if( strcmp("DN", szType) == 0 )
-		{
-			m_sDescriptiveName = pPacket->readString(nLength);
-		}
-		else if( strcmp("URN", szType) == 0 )
-		{
-			QString sURN;
-			QByteArray hashBuff;
-			sURN = pPacket->readString();
+				QString sURN;
+				QByteArray hashBuff;
+				sURN = pPacket->readString();
 
-			if(nLength >= 44u && sURN.compare("bp") == 0)
-			{
-				hashBuff.resize(CHash::byteCount(CHash::SHA1));
-				pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
-				CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
-				if(pHash)
+				if(nLength >= 44u && sURN.compare("bp") == 0)
 				{
-					m_lHashes.append(*pHash);
-					delete pHash;
+					hashBuff.resize(CHash::byteCount(CHash::SHA1));
+					pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
+					CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
+					if(pHash)
+					{
+						m_lHashes.append(*pHash);
+						delete pHash;
+					}
+					// TODO: Tiger
 				}
-				// TODO: Tiger
-			}
-			else if(nLength >= CHash::byteCount(CHash::SHA1) + 5u && sURN.compare("sha1") == 0)
-			{
-				hashBuff.resize(CHash::byteCount(CHash::SHA1));
-				pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
-				CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
-				if(pHash)
+				else if(nLength >= CHash::byteCount(CHash::SHA1) + 5u && sURN.compare("sha1") == 0)
 				{
-					m_lHashes.append(*pHash);
-					delete pHash;
+					hashBuff.resize(CHash::byteCount(CHash::SHA1));
+					pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
+					CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
+					if(pHash)
+					{
+						m_lHashes.append(*pHash);
+						delete pHash;
+					}
 				}
+				break;
 			}
-		}
-		else if( strcmp("SZR", szType) == 0 && nLength >= 8 )
-		{
-			if( nLength >= 16 )
-			{
-				m_nMinimumSize = pPacket->readIntLE<quint64>();
-				m_nMaximumSize = pPacket->readIntLE<quint64>();
-			}
-			else
-			{
-				m_nMinimumSize = pPacket->readIntLE<quint32>();
-				m_nMaximumSize = pPacket->readIntLE<quint32>();
-			}
-
-		}
-		else if( strcmp("I", szType) == 0 )
-		{
+			case G2Type::SZR:
+				if( nLength >= 16 )
+				{
+					m_nMinimumSize = pPacket->readIntLE<quint64>();
+					m_nMaximumSize = pPacket->readIntLE<quint64>();
+				}
+				else if( nLength >= 8 )
+				{
+					m_nMinimumSize = pPacket->readIntLE<quint32>();
+					m_nMaximumSize = pPacket->readIntLE<quint32>();
+				}
+				break;
+			case G2Type::I:
+				break;
 
+			// TODO: /Q2/MD
 		}
 
-		// TODO: /Q2/MD
-
 		pPacket->m_nPosition = nNext;
 	}
 
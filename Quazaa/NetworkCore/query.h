@@ -26,6 +26,7 @@
 #define QUERY_H
 
 #include "types.h"
+#include <QVector>
 
 class G2Packet;
 class CQuery;
@@ -33,6 +34,14 @@ class CHash;
 
 typedef QSharedPointer<CQuery> CQueryPtr;
 
+// Query hash table slots of a query's URNs and keywords, for tables of one size
+struct CQueryHashPositions
+{
+	quint32				nBits;
+	QVector<quint32>	lURNs;
+	QVector<quint32>	lWords;
+};
+
 class CQuery
 {
 public:
@@ -48,6 +57,10 @@ public:
 	QString			m_sG2PositiveWords;
 	QString			m_sG2NegativeWords;
 	QList<quint32>	m_lHashedKeywords;
+protected:
+	QList<quint32>	m_lHashedURNs;		// 32 bit QHT hashes of the URN strings, same as m_lHashedKeywords
+	bool			m_bHashedURNs;
+	QList<CQueryHashPositions>	m_lPositions;	// one entry per table size seen while routing
 
 public:
 	CQuery();
@@ -65,6 +78,8 @@ public:
 
 	bool checkValid();
 
+	const CQueryHashPositions& hashPositions(quint32 nBits);
+
 	G2Packet* toG2Packet(CEndPoint* pAddr = 0, quint32 nKey = 0);
 
 	static CQueryPtr fromPacket(G2Packet* pPacket, CEndPoint* pEndpoint = 0);
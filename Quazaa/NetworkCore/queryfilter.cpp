@@ -0,0 +1,199 @@
+/*
+** queryfilter.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "queryfilter.h"
+#include "query.h"
+#include "quazaasettings.h"
+
+#include <QUuid>
+
+#include "debug_new.h"
+
+static inline quint64 mix64(quint64 nValue)
+{
+	nValue ^= nValue >> 33;
+	nValue *= Q_UINT64_C(0xff51afd7ed558ccd);
+	nValue ^= nValue >> 33;
+	nValue *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+	nValue ^= nValue >> 33;
+	return nValue;
+}
+
+CQueryFilter::CQueryFilter()
+{
+	clear();
+}
+
+void CQueryFilter::clear()
+{
+	memset(m_pCounts, 0, sizeof(m_pCounts));
+	memset(m_pFingerprints, 0, sizeof(m_pFingerprints));
+
+	m_nWindow = time(0) / RateWindow;
+	m_nGeneration = time(0) / FingerprintWindow;
+
+	// Keyed, so a flooder cannot pick addresses that share sketch cells with a victim
+	QUuid oSeed = QUuid::createUuid();
+	memcpy(&m_nSeed, &oSeed, sizeof(m_nSeed));
+
+	m_nAccepted = m_nRateLimited = m_nDuplicates = 0;
+}
+
+CQueryFilter::Verdict CQueryFilter::admit(CQueryPtr pQuery, const CEndPoint& oSource, bool bRateLimit)
+{
+	const quint32 tNow = time(0);
+	const quint64 nSource = sourceHash(pQuery->m_oEndpoint.isNull() ? oSource : pQuery->m_oEndpoint);
+
+	if(bRateLimit && quazaaSettings.Gnutella2.QueryRateLimit > 0
+	   && countSource(nSource, tNow) > (quint32)quazaaSettings.Gnutella2.QueryRateLimit)
+	{
+		m_nRateLimited++;
+		return RateLimited;
+	}
+
+	const CQueryHashPositions& oPositions = pQuery->hashPositions(32);
+
+	if(pQuery->m_lHashedKeywords.isEmpty() && oPositions.lURNs.isEmpty())
+	{
+		m_nAccepted++;
+		return Accepted;
+	}
+
+	// Keyword order does not change the search, so the hashes are combined order independently
+	quint64 nSum = 0, nXor = 0;
+
+	foreach(quint32 nHash, pQuery->m_lHashedKeywords)
+	{
+		nSum += mix64(nHash);
+		nXor ^= mix64(nHash + Q_UINT64_C(0x9e3779b97f4a7c15));
+	}
+	foreach(quint32 nHash, oPositions.lURNs)
+	{
+		nSum += mix64(~quint64(nHash));
+		nXor ^= mix64(nHash + Q_UINT64_C(0x632be59bd9b4e019));
+	}
+
+	const quint64 nFingerprint = mix64(nSource ^ mix64(nSum ^ (nXor << 1)));
+
+	if(testFingerprint(nFingerprint, tNow))
+	{
+		m_nDuplicates++;
+		return Duplicate;
+	}
+
+	m_nAccepted++;
+	return Accepted;
+}
+
+quint64 CQueryFilter::sourceHash(const CEndPoint& oSource) const
+{
+	if(oSource.protocol() == QAbstractSocket::IPv6Protocol)
+	{
+		Q_IPV6ADDR oIPv6 = oSource.toIPv6Address();
+		quint64 nPrefix;
+		memcpy(&nPrefix, &oIPv6, sizeof(nPrefix));
+		return mix64(nPrefix ^ m_nSeed);
+	}
+
+	return mix64(oSource.toIPv4Address() ^ m_nSeed);
+}
+
+// Counts one query for the source and returns its estimated count over the last RateWindow seconds.
+// Conservative update: only the cells at the current minimum are raised.
+quint32 CQueryFilter::countSource(quint64 nHash, quint32 tNow)
+{
+	const quint32 nWindow = tNow / RateWindow;
+
+	if(nWindow != m_nWindow)
+	{
+		if(nWindow - m_nWindow > 1)
+		{
+			memset(m_pCounts[(nWindow + 1) & 1], 0, sizeof(m_pCounts[0]));
+		}
+		memset(m_pCounts[nWindow & 1], 0, sizeof(m_pCounts[0]));
+		m_nWindow = nWindow;
+	}
+
+	quint16 (*pCurrent)[SketchWidth] = m_pCounts[nWindow & 1];
+	quint16 (*pPrevious)[SketchWidth] = m_pCounts[(nWindow + 1) & 1];
+
+	quint32 pCells[SketchDepth];
+	quint32 nCurrent = 0xffff, nPrevious = 0xffff;
+	const quint32 nStep = quint32(nHash >> 32) | 1;
+
+	for(int i = 0; i < SketchDepth; ++i)
+	{
+		pCells[i] = (quint32(nHash) + i * nStep) % SketchWidth;
+		nCurrent = qMin<quint32>(nCurrent, pCurrent[i][pCells[i]]);
+		nPrevious = qMin<quint32>(nPrevious, pPrevious[i][pCells[i]]);
+	}
+
+	if(nCurrent < 0xffff)
+	{
+		for(int i = 0; i < SketchDepth; ++i)
+		{
+			if(pCurrent[i][pCells[i]] == nCurrent)
+			{
+				pCurrent[i][pCells[i]]++;
+			}
+		}
+		nCurrent++;
+	}
+
+	return nCurrent + nPrevious * (RateWindow - tNow % RateWindow) / RateWindow;
+}
+
+// Returns true if the fingerprint was seen in this or the previous generation, adds it otherwise
+bool CQueryFilter::testFingerprint(quint64 nHash, quint32 tNow)
+{
+	const quint32 nGeneration = tNow / FingerprintWindow;
+
+	if(nGeneration != m_nGeneration)
+	{
+		if(nGeneration - m_nGeneration > 1)
+		{
+			memset(m_pFingerprints[(nGeneration + 1) & 1], 0, sizeof(m_pFingerprints[0]));
+		}
+		memset(m_pFingerprints[nGeneration & 1], 0, sizeof(m_pFingerprints[0]));
+		m_nGeneration = nGeneration;
+	}
+
+	quint32* pCurrent = m_pFingerprints[nGeneration & 1];
+	quint32* pPrevious = m_pFingerprints[(nGeneration + 1) & 1];
+
+	bool bCurrent = true, bPrevious = true;
+	const quint32 nStep = quint32(nHash >> 32) | 1;
+
+	for(int i = 0; i < FingerprintHashes; ++i)
+	{
+		const quint32 nBit = (quint32(nHash) + i * nStep) % FingerprintBits;
+		const quint32 nMask = 1u << (nBit & 31);
+
+		bCurrent = bCurrent && (pCurrent[nBit >> 5] & nMask);
+		bPrevious = bPrevious && (pPrevious[nBit >> 5] & nMask);
+		pCurrent[nBit >> 5] |= nMask;
+	}
+
+	return bCurrent || bPrevious;
+}
@@ -0,0 +1,75 @@
+/*
+** queryfilter.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef QUERYFILTER_H
+#define QUERYFILTER_H
+
+#include "types.h"
+#include <QSharedPointer>
+
+class CQuery;
+typedef QSharedPointer<CQuery> CQueryPtr;
+
+// Admission control for queries a hub is about to route. Memory is fixed no matter how many
+// addresses send queries:
+//  - query rate per return address is counted in a count-min sketch over a sliding window
+//    (current and previous minute, the previous one weighted by how much of it still overlaps),
+//  - a fingerprint of the return address and the keyword/URN hash set goes into a two
+//    generation bloom filter, so the same search repeated under new GUIDs is dropped.
+// Callers drop queries whose GUID is already routed before asking, only new GUIDs get here.
+// IPv6 sources are counted by /64 prefix.
+class CQueryFilter
+{
+public:
+	enum Verdict { Accepted, RateLimited, Duplicate };
+
+	enum { SketchDepth = 4, SketchWidth = 4096 };
+	enum { FingerprintBits = 1 << 17, FingerprintHashes = 3 };
+	enum { RateWindow = 60, FingerprintWindow = 30 };	// seconds
+
+protected:
+	quint16		m_pCounts[2][SketchDepth][SketchWidth];		// by window & 1
+	quint32		m_nWindow;
+	quint32		m_pFingerprints[2][FingerprintBits / 32];	// by generation & 1
+	quint32		m_nGeneration;
+	quint64		m_nSeed;
+
+public:
+	quint32		m_nAccepted;
+	quint32		m_nRateLimited;
+	quint32		m_nDuplicates;
+
+public:
+	CQueryFilter();
+
+	Verdict admit(CQueryPtr pQuery, const CEndPoint& oSource, bool bRateLimit = true);
+	void clear();
+
+protected:
+	quint64 sourceHash(const CEndPoint& oSource) const;
+	quint32 countSource(quint64 nHash, quint32 tNow);
+	bool testFingerprint(quint64 nHash, quint32 tNow);
+};
+
+#endif // QUERYFILTER_H
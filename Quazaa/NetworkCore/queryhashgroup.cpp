@@ -24,6 +24,7 @@
 
 #include "queryhashgroup.h"
 #include "queryhashmaster.h"
+#include "queryhashkernels.h"
 #include "quazaasettings.h"
 
 #include "debug_new.h"
@@ -60,7 +61,7 @@ void CQueryHashGroup::add(CQueryHashTable* pTable)
 	m_pTables.append(pTable);
 
 	operate(pTable, true);
-	QueryHashMaster.invalidate();
+	QueryHashMaster.markTable(pTable);
 }
 
 void CQueryHashGroup::remove(CQueryHashTable* pTable)
@@ -75,7 +76,7 @@ void CQueryHashGroup::remove(CQueryHashTable* pTable)
 	pTable->m_pGroup = 0;
 
 	operate(pTable, false);
-	QueryHashMaster.invalidate();
+	QueryHashMaster.markTable(pTable);
 }
 
 void CQueryHashGroup::operate(CQueryHashTable* pTable, bool bAdd)
@@ -83,152 +84,12 @@ void CQueryHashGroup::operate(CQueryHashTable* pTable, bool bAdd)
 	Q_ASSERT(m_pHash != 0);
 	Q_ASSERT(pTable->m_nHash == m_nHash);
 
-	uchar* pSource = pTable->m_pHash;
-	uchar* pTarget = m_pHash;
-
 	if(bAdd)
 	{
-		for(quint32 nHash = m_nHash >> 3 ; nHash ; nHash--)
-		{
-			register uchar nSource = *pSource++;
-
-			if((nSource & 0x01) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x02) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x04) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x08) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x10) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x20) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x40) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x80) == 0)
-			{
-				(*pTarget++) ++;
-			}
-			else
-			{
-				pTarget++;
-			}
-		}
+		QueryHashKernels::addCounters(m_pHash, pTable->m_pHash, m_nHash >> 3);
 	}
 	else
 	{
-		for(quint32 nHash = m_nHash >> 3 ; nHash ; nHash--)
-		{
-			register uchar nSource = *pSource++;
-
-			if((nSource & 0x01) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x02) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x04) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x08) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x10) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x20) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x40) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-			if((nSource & 0x80) == 0)
-			{
-				(*pTarget++) --;
-			}
-			else
-			{
-				pTarget++;
-			}
-		}
+		QueryHashKernels::removeCounters(m_pHash, pTable->m_pHash, m_nHash >> 3);
 	}
 }
-
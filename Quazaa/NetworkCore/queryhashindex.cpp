@@ -0,0 +1,174 @@
+/*
+** queryhashindex.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "queryhashindex.h"
+#include "query.h"
+
+#include "debug_new.h"
+
+CQueryHashIndex::CQueryHashIndex()
+	: m_pRows(0), m_nWords(0)
+{
+}
+
+CQueryHashIndex::~CQueryHashIndex()
+{
+	delete [] m_pRows;
+}
+
+void CQueryHashIndex::grow(quint32 nWords)
+{
+	quint64* pRows = new quint64[(quint64)Positions * nWords];
+	memset(pRows, 0, sizeof(quint64) * Positions * nWords);
+
+	for(quint32 nRow = 0; nRow < Positions && m_nWords; ++nRow)
+	{
+		memcpy(pRows + nRow * nWords, m_pRows + nRow * m_nWords, sizeof(quint64) * m_nWords);
+	}
+
+	delete [] m_pRows;
+	m_pRows = pRows;
+	m_nWords = nWords;
+}
+
+void CQueryHashIndex::setColumn(quint32 nColumn, const CQueryHashTable* pTable)
+{
+	if(nColumn >= columns())
+	{
+		grow(qMax(m_nWords * 2, nColumn / 64 + 1));
+	}
+
+	const quint32 nWord = nColumn / 64;
+	const quint64 nBit = Q_UINT64_C(1) << (nColumn % 64);
+	quint64* pRow = m_pRows + nWord;
+
+	if(pTable == 0 || !pTable->m_bLive || pTable->m_pSummary == 0)
+	{
+		for(quint32 nRow = 0; nRow < Positions; ++nRow, pRow += m_nWords)
+		{
+			*pRow |= nBit;
+		}
+		return;
+	}
+
+	for(quint32 nRow = 0; nRow < Positions; ++nRow, pRow += m_nWords)
+	{
+		if(pTable->summaryBit(nRow))
+		{
+			*pRow |= nBit;
+		}
+		else
+		{
+			*pRow &= ~nBit;
+		}
+	}
+}
+
+void CQueryHashIndex::clearColumn(quint32 nColumn)
+{
+	if(nColumn >= columns())
+	{
+		return;
+	}
+
+	const quint64 nMask = ~(Q_UINT64_C(1) << (nColumn % 64));
+	quint64* pRow = m_pRows + nColumn / 64;
+
+	for(quint32 nRow = 0; nRow < Positions; ++nRow, pRow += m_nWords)
+	{
+		*pRow &= nMask;
+	}
+}
+
+// Same rules as CQueryHashTable::checkPositions(): any URN, all of one or two words,
+// otherwise at least two thirds of the words.
+void CQueryHashIndex::candidates(const CQueryHashPositions& oPositions, quint64* pMask) const
+{
+	Q_ASSERT(oPositions.nBits == CQueryHashTable::SummaryBits);
+
+	const int nURNs = oPositions.lURNs.size();
+	const int nWords = oPositions.lWords.size();
+
+	for(quint32 nWord = 0; nWord < m_nWords; ++nWord)
+	{
+		quint64 nURNHits = 0;
+		for(int i = 0; i < nURNs; ++i)
+		{
+			nURNHits |= m_pRows[oPositions.lURNs[i] * m_nWords + nWord];
+		}
+
+		quint64 nWordHits = 0;
+
+		if(nWords > 0 && nWords < 3)
+		{
+			nWordHits = ~Q_UINT64_C(0);
+			for(int i = 0; i < nWords; ++i)
+			{
+				nWordHits &= m_pRows[oPositions.lWords[i] * m_nWords + nWord];
+			}
+		}
+		else if(nWords >= 3)
+		{
+			// Counts hits per column in bit-sliced counters, saturating at the threshold
+			const int nNeeded = (nWords * 2 + 2) / 3;
+			quint64 pCount[32];
+			int nPlanes = 0;
+			while((1 << nPlanes) <= nNeeded)
+			{
+				++nPlanes;
+			}
+			memset(pCount, 0, sizeof(pCount));
+
+			for(int i = 0; i < nWords; ++i)
+			{
+				quint64 nCarry = m_pRows[oPositions.lWords[i] * m_nWords + nWord];
+				for(int nPlane = 0; nPlane < nPlanes && nCarry; ++nPlane)
+				{
+					const quint64 nNext = pCount[nPlane] & nCarry;
+					pCount[nPlane] ^= nCarry;
+					nCarry = nNext;
+				}
+				nWordHits |= nCarry;	// overflowed the counter, certainly above the threshold
+			}
+
+			// Columns whose count is at least nNeeded
+			quint64 nGreater = 0, nEqual = ~Q_UINT64_C(0);
+			for(int nPlane = nPlanes - 1; nPlane >= 0; --nPlane)
+			{
+				if(nNeeded & (1 << nPlane))
+				{
+					nEqual &= pCount[nPlane];
+				}
+				else
+				{
+					nGreater |= nEqual & pCount[nPlane];
+					nEqual &= ~pCount[nPlane];
+				}
+			}
+			nWordHits |= nGreater | nEqual;
+		}
+
+		pMask[nWord] = nURNHits | nWordHits;
+	}
+}
@@ -0,0 +1,69 @@
+/*
+** queryhashindex.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef QUERYHASHINDEX_H
+#define QUERYHASHINDEX_H
+
+#include "queryhashtable.h"
+
+struct CQueryHashPositions;
+
+// Column-wise view of the summaries of many remote tables. Each summary position has a row of
+// bits, one per column, so a query is screened against all tables with a few word operations
+// per keyword instead of a table lookup per table. Columns are assigned by the owner.
+class CQueryHashIndex
+{
+public:
+	enum { Positions = 1 << CQueryHashTable::SummaryBits };
+
+protected:
+	quint64*	m_pRows;		// Positions rows of m_nWords words
+	quint32		m_nWords;
+
+public:
+	CQueryHashIndex();
+	~CQueryHashIndex();
+
+	inline quint32 words() const
+	{
+		return m_nWords;
+	}
+	inline quint32 columns() const
+	{
+		return m_nWords * 64;
+	}
+
+	// Copies the summary of pTable to nColumn, a table without a summary matches everything
+	void setColumn(quint32 nColumn, const CQueryHashTable* pTable);
+	void clearColumn(quint32 nColumn);
+
+	// Sets the bits of the columns that may match, pMask must hold words() words.
+	// oPositions must have been built for CQueryHashTable::SummaryBits.
+	void candidates(const CQueryHashPositions& oPositions, quint64* pMask) const;
+
+protected:
+	void grow(quint32 nWords);
+};
+
+#endif // QUERYHASHINDEX_H
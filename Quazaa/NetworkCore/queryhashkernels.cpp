@@ -0,0 +1,648 @@
+/*
+** queryhashkernels.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "queryhashkernels.h"
+
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define QHT_KERNELS_X86
+#include <immintrin.h>
+#define QHT_TARGET(x) __attribute__((target(x)))
+#endif
+
+#include "debug_new.h"
+
+namespace
+{
+
+struct KernelTable
+{
+	quint32	(*mergeTable)(uchar*, const uchar*, quint32);
+	quint32	(*mergeCounters)(uchar*, const uchar*, quint32);
+	void	(*addCounters)(uchar*, const uchar*, quint32);
+	void	(*removeCounters)(uchar*, const uchar*, quint32);
+	quint32	(*countSlots)(const uchar*, quint32);
+	bool	(*diffTables)(uchar*, const uchar*, const uchar*, quint32);
+};
+
+const quint64 g_nLow7 = Q_UINT64_C(0x7f7f7f7f7f7f7f7f);
+const quint64 g_nHigh = Q_UINT64_C(0x8080808080808080);
+
+// g_pExpand[n] holds 0x01 in byte i when bit i of table byte n is 0, i.e. the slot is set
+quint64 g_pExpand[256];
+
+inline quint64 load64(const uchar* pData)
+{
+	quint64 nValue;
+	memcpy(&nValue, pData, sizeof(nValue));
+	return nValue;
+}
+
+inline void store64(uchar* pData, quint64 nValue)
+{
+	memcpy(pData, &nValue, sizeof(nValue));
+}
+
+inline quint32 popCount64(quint64 nValue)
+{
+	nValue = nValue - ((nValue >> 1) & Q_UINT64_C(0x5555555555555555));
+	nValue = (nValue & Q_UINT64_C(0x3333333333333333)) + ((nValue >> 2) & Q_UINT64_C(0x3333333333333333));
+	nValue = (nValue + (nValue >> 4)) & Q_UINT64_C(0x0f0f0f0f0f0f0f0f);
+	return (quint32)((nValue * Q_UINT64_C(0x0101010101010101)) >> 56);
+}
+
+// Byte wise add and subtract within a 64 bit word, each byte wraps on its own
+inline quint64 addBytes(quint64 nX, quint64 nY)
+{
+	return ((nX & g_nLow7) + (nY & g_nLow7)) ^ ((nX ^ nY) & g_nHigh);
+}
+
+inline quint64 subBytes(quint64 nX, quint64 nY)
+{
+	return ((nX | g_nHigh) - (nY & g_nLow7)) ^ ((nX ^ ~nY) & g_nHigh);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Scalar kernels, 64 bits at a time. Also used for the tails of the vector kernels.
+
+quint32 mergeTableScalar(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	quint32 nSet = 0;
+	quint32 i = 0;
+
+	for(; i + 8 <= nBytes; i += 8)
+	{
+		quint64 nDest = load64(pDest + i);
+		quint64 nSource = load64(pSource + i);
+		quint64 nNew = nDest & ~nSource;
+
+		if(nNew)
+		{
+			nSet += popCount64(nNew);
+			store64(pDest + i, nDest & nSource);
+		}
+	}
+
+	for(; i < nBytes; ++i)
+	{
+		nSet += popCount64(pDest[i] & ~pSource[i] & 0xff);
+		pDest[i] &= pSource[i];
+	}
+
+	return nSet;
+}
+
+quint32 mergeCountersScalar(uchar* pDest, const uchar* pCounters, quint32 nBytes)
+{
+	quint32 nSet = 0;
+
+	for(quint32 i = 0; i < nBytes; ++i, pCounters += 8)
+	{
+		if(!load64(pCounters))
+		{
+			continue;
+		}
+
+		uchar nMask = 0;
+		for(int nBit = 0; nBit < 8; ++nBit)
+		{
+			if(pCounters[nBit])
+			{
+				nMask |= uchar(1 << nBit);
+			}
+		}
+
+		nSet += popCount64(pDest[i] & nMask);
+		pDest[i] &= ~nMask;
+	}
+
+	return nSet;
+}
+
+void addCountersScalar(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	for(quint32 i = 0; i < nBytes; ++i, pCounters += 8)
+	{
+		if(pTable[i] != 0xff)
+		{
+			store64(pCounters, addBytes(load64(pCounters), g_pExpand[pTable[i]]));
+		}
+	}
+}
+
+void removeCountersScalar(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	for(quint32 i = 0; i < nBytes; ++i, pCounters += 8)
+	{
+		if(pTable[i] != 0xff)
+		{
+			store64(pCounters, subBytes(load64(pCounters), g_pExpand[pTable[i]]));
+		}
+	}
+}
+
+quint32 countSlotsScalar(const uchar* pTable, quint32 nBytes)
+{
+	quint32 nClear = 0;
+	quint32 i = 0;
+
+	for(; i + 8 <= nBytes; i += 8)
+	{
+		nClear += popCount64(load64(pTable + i));
+	}
+
+	for(; i < nBytes; ++i)
+	{
+		nClear += popCount64(pTable[i]);
+	}
+
+	return nBytes * 8 - nClear;
+}
+
+bool diffTablesScalar(uchar* pDiff, const uchar* pOld, const uchar* pNew, quint32 nBytes)
+{
+	quint64 nAny = 0;
+	quint32 i = 0;
+
+	for(; i + 8 <= nBytes; i += 8)
+	{
+		quint64 nDiff = load64(pOld + i) ^ load64(pNew + i);
+		store64(pDiff + i, nDiff);
+		nAny |= nDiff;
+	}
+
+	for(; i < nBytes; ++i)
+	{
+		pDiff[i] = pOld[i] ^ pNew[i];
+		nAny |= pDiff[i];
+	}
+
+	return nAny != 0;
+}
+
+const KernelTable g_oScalar =
+{
+	mergeTableScalar,
+	mergeCountersScalar,
+	addCountersScalar,
+	removeCountersScalar,
+	countSlotsScalar,
+	diffTablesScalar
+};
+
+#ifdef QHT_KERNELS_X86
+
+//////////////////////////////////////////////////////////////////////
+// SSE2 kernels, 16 bytes of table or 16 counters at a time
+
+QHT_TARGET("sse2") inline quint32 sumLanes(__m128i nSums)
+{
+	quint64 pSums[2];
+	_mm_storeu_si128((__m128i*)pSums, nSums);
+	return (quint32)(pSums[0] + pSums[1]);
+}
+
+// Bit count of each 64 bit half, the classic bit slicing followed by a byte sum
+QHT_TARGET("sse2") inline __m128i popCountSSE2(__m128i nValue)
+{
+	const __m128i nMask1 = _mm_set1_epi8(0x55);
+	const __m128i nMask2 = _mm_set1_epi8(0x33);
+	const __m128i nMask4 = _mm_set1_epi8(0x0f);
+
+	nValue = _mm_sub_epi8(nValue, _mm_and_si128(_mm_srli_epi64(nValue, 1), nMask1));
+	nValue = _mm_add_epi8(_mm_and_si128(nValue, nMask2), _mm_and_si128(_mm_srli_epi64(nValue, 2), nMask2));
+	nValue = _mm_and_si128(_mm_add_epi8(nValue, _mm_srli_epi64(nValue, 4)), nMask4);
+
+	return _mm_sad_epu8(nValue, _mm_setzero_si128());
+}
+
+QHT_TARGET("sse2") quint32 mergeTableSSE2(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	const __m128i nZero = _mm_setzero_si128();
+	__m128i nSet = nZero;
+	quint32 i = 0;
+
+	for(; i + 16 <= nBytes; i += 16)
+	{
+		__m128i nDest = _mm_loadu_si128((const __m128i*)(pDest + i));
+		__m128i nSource = _mm_loadu_si128((const __m128i*)(pSource + i));
+		__m128i nNew = _mm_andnot_si128(nSource, nDest);
+
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(nNew, nZero)) != 0xffff)
+		{
+			nSet = _mm_add_epi64(nSet, popCountSSE2(nNew));
+			_mm_storeu_si128((__m128i*)(pDest + i), _mm_and_si128(nDest, nSource));
+		}
+	}
+
+	return sumLanes(nSet) + mergeTableScalar(pDest + i, pSource + i, nBytes - i);
+}
+
+QHT_TARGET("sse2") quint32 mergeCountersSSE2(uchar* pDest, const uchar* pCounters, quint32 nBytes)
+{
+	const __m128i nZero = _mm_setzero_si128();
+	quint32 nSet = 0;
+	quint32 i = 0;
+
+	for(; i + 2 <= nBytes; i += 2)
+	{
+		__m128i nCounters = _mm_loadu_si128((const __m128i*)(pCounters + i * 8));
+		quint32 nMask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(nCounters, nZero)) & 0xffff;
+
+		if(nMask)
+		{
+			quint32 nDest = pDest[i] | (pDest[i + 1] << 8);
+			nSet += popCount64(nDest & nMask);
+			nDest &= ~nMask;
+			pDest[i] = uchar(nDest);
+			pDest[i + 1] = uchar(nDest >> 8);
+		}
+	}
+
+	return nSet + mergeCountersScalar(pDest + i, pCounters + i * 8, nBytes - i);
+}
+
+// Spreads two table bytes over 16 counter bytes: 0xff for each set slot, 0 otherwise
+QHT_TARGET("sse2") inline __m128i expandSSE2(quint32 nTable)
+{
+	const __m128i nBits = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+
+	__m128i nValue = _mm_cvtsi32_si128(nTable);
+	nValue = _mm_unpacklo_epi8(nValue, nValue);
+	nValue = _mm_unpacklo_epi16(nValue, nValue);
+	nValue = _mm_unpacklo_epi32(nValue, nValue);
+
+	return _mm_cmpeq_epi8(_mm_and_si128(nValue, nBits), _mm_setzero_si128());
+}
+
+QHT_TARGET("sse2") void addCountersSSE2(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	quint32 i = 0;
+
+	for(; i + 2 <= nBytes; i += 2)
+	{
+		quint32 nTable = pTable[i] | (pTable[i + 1] << 8);
+
+		if(nTable != 0xffff)
+		{
+			__m128i* pTarget = (__m128i*)(pCounters + i * 8);
+			_mm_storeu_si128(pTarget, _mm_sub_epi8(_mm_loadu_si128(pTarget), expandSSE2(nTable)));
+		}
+	}
+
+	addCountersScalar(pCounters + i * 8, pTable + i, nBytes - i);
+}
+
+QHT_TARGET("sse2") void removeCountersSSE2(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	quint32 i = 0;
+
+	for(; i + 2 <= nBytes; i += 2)
+	{
+		quint32 nTable = pTable[i] | (pTable[i + 1] << 8);
+
+		if(nTable != 0xffff)
+		{
+			__m128i* pTarget = (__m128i*)(pCounters + i * 8);
+			_mm_storeu_si128(pTarget, _mm_add_epi8(_mm_loadu_si128(pTarget), expandSSE2(nTable)));
+		}
+	}
+
+	removeCountersScalar(pCounters + i * 8, pTable + i, nBytes - i);
+}
+
+QHT_TARGET("sse2") quint32 countSlotsSSE2(const uchar* pTable, quint32 nBytes)
+{
+	__m128i nClear = _mm_setzero_si128();
+	quint32 i = 0;
+
+	for(; i + 16 <= nBytes; i += 16)
+	{
+		nClear = _mm_add_epi64(nClear, popCountSSE2(_mm_loadu_si128((const __m128i*)(pTable + i))));
+	}
+
+	return i * 8 - sumLanes(nClear) + countSlotsScalar(pTable + i, nBytes - i);
+}
+
+QHT_TARGET("sse2") bool diffTablesSSE2(uchar* pDiff, const uchar* pOld, const uchar* pNew, quint32 nBytes)
+{
+	__m128i nAny = _mm_setzero_si128();
+	quint32 i = 0;
+
+	for(; i + 16 <= nBytes; i += 16)
+	{
+		__m128i nDiff = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(pOld + i)), _mm_loadu_si128((const __m128i*)(pNew + i)));
+		_mm_storeu_si128((__m128i*)(pDiff + i), nDiff);
+		nAny = _mm_or_si128(nAny, nDiff);
+	}
+
+	bool bTail = diffTablesScalar(pDiff + i, pOld + i, pNew + i, nBytes - i);
+
+	return bTail || _mm_movemask_epi8(_mm_cmpeq_epi8(nAny, _mm_setzero_si128())) != 0xffff;
+}
+
+const KernelTable g_oSSE2 =
+{
+	mergeTableSSE2,
+	mergeCountersSSE2,
+	addCountersSSE2,
+	removeCountersSSE2,
+	countSlotsSSE2,
+	diffTablesSSE2
+};
+
+//////////////////////////////////////////////////////////////////////
+// AVX2 kernels, 32 bytes of table or 32 counters at a time
+
+QHT_TARGET("avx2") inline quint32 sumLanes(__m256i nSums)
+{
+	quint64 pSums[4];
+	_mm256_storeu_si256((__m256i*)pSums, nSums);
+	return (quint32)(pSums[0] + pSums[1] + pSums[2] + pSums[3]);
+}
+
+// Bit count of each 64 bit lane through a nibble lookup
+QHT_TARGET("avx2") inline __m256i popCountAVX2(__m256i nValue)
+{
+	const __m256i nLookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+											 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nNibble = _mm256_set1_epi8(0x0f);
+
+	__m256i nLow = _mm256_shuffle_epi8(nLookup, _mm256_and_si256(nValue, nNibble));
+	__m256i nHigh = _mm256_shuffle_epi8(nLookup, _mm256_and_si256(_mm256_srli_epi16(nValue, 4), nNibble));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(nLow, nHigh), _mm256_setzero_si256());
+}
+
+QHT_TARGET("avx2") quint32 mergeTableAVX2(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	__m256i nSet = _mm256_setzero_si256();
+	quint32 i = 0;
+
+	for(; i + 32 <= nBytes; i += 32)
+	{
+		__m256i nDest = _mm256_loadu_si256((const __m256i*)(pDest + i));
+		__m256i nSource = _mm256_loadu_si256((const __m256i*)(pSource + i));
+		__m256i nNew = _mm256_andnot_si256(nSource, nDest);
+
+		if(!_mm256_testz_si256(nNew, nNew))
+		{
+			nSet = _mm256_add_epi64(nSet, popCountAVX2(nNew));
+			_mm256_storeu_si256((__m256i*)(pDest + i), _mm256_and_si256(nDest, nSource));
+		}
+	}
+
+	return sumLanes(nSet) + mergeTableScalar(pDest + i, pSource + i, nBytes - i);
+}
+
+QHT_TARGET("avx2") quint32 mergeCountersAVX2(uchar* pDest, const uchar* pCounters, quint32 nBytes)
+{
+	const __m256i nZero = _mm256_setzero_si256();
+	quint32 nSet = 0;
+	quint32 i = 0;
+
+	for(; i + 4 <= nBytes; i += 4)
+	{
+		__m256i nCounters = _mm256_loadu_si256((const __m256i*)(pCounters + i * 8));
+		quint32 nMask = ~(quint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nCounters, nZero));
+
+		if(nMask)
+		{
+			quint32 nDest = pDest[i] | (pDest[i + 1] << 8) | (pDest[i + 2] << 16) | ((quint32)pDest[i + 3] << 24);
+			nSet += popCount64(nDest & nMask);
+			nDest &= ~nMask;
+			pDest[i] = uchar(nDest);
+			pDest[i + 1] = uchar(nDest >> 8);
+			pDest[i + 2] = uchar(nDest >> 16);
+			pDest[i + 3] = uchar(nDest >> 24);
+		}
+	}
+
+	return nSet + mergeCountersScalar(pDest + i, pCounters + i * 8, nBytes - i);
+}
+
+// Spreads four table bytes over 32 counter bytes: 0xff for each set slot, 0 otherwise
+QHT_TARGET("avx2") inline __m256i expandAVX2(quint32 nTable)
+{
+	const __m256i nSpread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+											 2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i nBits = _mm256_set1_epi64x(Q_INT64_C(0x8040201008040201));
+
+	__m256i nValue = _mm256_shuffle_epi8(_mm256_set1_epi32(nTable), nSpread);
+
+	return _mm256_cmpeq_epi8(_mm256_and_si256(nValue, nBits), _mm256_setzero_si256());
+}
+
+QHT_TARGET("avx2") void addCountersAVX2(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	quint32 i = 0;
+
+	for(; i + 4 <= nBytes; i += 4)
+	{
+		quint32 nTable = pTable[i] | (pTable[i + 1] << 8) | (pTable[i + 2] << 16) | ((quint32)pTable[i + 3] << 24);
+
+		if(nTable != 0xffffffff)
+		{
+			__m256i* pTarget = (__m256i*)(pCounters + i * 8);
+			_mm256_storeu_si256(pTarget, _mm256_sub_epi8(_mm256_loadu_si256(pTarget), expandAVX2(nTable)));
+		}
+	}
+
+	addCountersScalar(pCounters + i * 8, pTable + i, nBytes - i);
+}
+
+QHT_TARGET("avx2") void removeCountersAVX2(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	quint32 i = 0;
+
+	for(; i + 4 <= nBytes; i += 4)
+	{
+		quint32 nTable = pTable[i] | (pTable[i + 1] << 8) | (pTable[i + 2] << 16) | ((quint32)pTable[i + 3] << 24);
+
+		if(nTable != 0xffffffff)
+		{
+			__m256i* pTarget = (__m256i*)(pCounters + i * 8);
+			_mm256_storeu_si256(pTarget, _mm256_add_epi8(_mm256_loadu_si256(pTarget), expandAVX2(nTable)));
+		}
+	}
+
+	removeCountersScalar(pCounters + i * 8, pTable + i, nBytes - i);
+}
+
+QHT_TARGET("avx2") quint32 countSlotsAVX2(const uchar* pTable, quint32 nBytes)
+{
+	__m256i nClear = _mm256_setzero_si256();
+	quint32 i = 0;
+
+	for(; i + 32 <= nBytes; i += 32)
+	{
+		nClear = _mm256_add_epi64(nClear, popCountAVX2(_mm256_loadu_si256((const __m256i*)(pTable + i))));
+	}
+
+	return i * 8 - sumLanes(nClear) + countSlotsScalar(pTable + i, nBytes - i);
+}
+
+QHT_TARGET("avx2") bool diffTablesAVX2(uchar* pDiff, const uchar* pOld, const uchar* pNew, quint32 nBytes)
+{
+	__m256i nAny = _mm256_setzero_si256();
+	quint32 i = 0;
+
+	for(; i + 32 <= nBytes; i += 32)
+	{
+		__m256i nDiff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pOld + i)), _mm256_loadu_si256((const __m256i*)(pNew + i)));
+		_mm256_storeu_si256((__m256i*)(pDiff + i), nDiff);
+		nAny = _mm256_or_si256(nAny, nDiff);
+	}
+
+	bool bTail = diffTablesScalar(pDiff + i, pOld + i, pNew + i, nBytes - i);
+
+	return bTail || !_mm256_testz_si256(nAny, nAny);
+}
+
+const KernelTable g_oAVX2 =
+{
+	mergeTableAVX2,
+	mergeCountersAVX2,
+	addCountersAVX2,
+	removeCountersAVX2,
+	countSlotsAVX2,
+	diffTablesAVX2
+};
+
+#endif // QHT_KERNELS_X86
+
+//////////////////////////////////////////////////////////////////////
+// Runtime selection
+
+struct KernelSelection
+{
+	QueryHashKernels::Level	eSupported;
+	QueryHashKernels::Level	eLevel;
+	const KernelTable*		pKernels;
+
+	KernelSelection()
+	{
+		for(int nByte = 0; nByte < 256; ++nByte)
+		{
+			uchar pExpand[8];
+			for(int nBit = 0; nBit < 8; ++nBit)
+			{
+				pExpand[nBit] = (nByte & (1 << nBit)) ? 0 : 1;
+			}
+			memcpy(&g_pExpand[nByte], pExpand, sizeof(pExpand));
+		}
+
+		eSupported = QueryHashKernels::LevelScalar;
+#ifdef QHT_KERNELS_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+		{
+			eSupported = QueryHashKernels::LevelAVX2;
+		}
+		else if(__builtin_cpu_supports("sse2"))
+		{
+			eSupported = QueryHashKernels::LevelSSE2;
+		}
+#endif
+		select(eSupported);
+	}
+
+	void select(QueryHashKernels::Level eWanted)
+	{
+		eLevel = qMin(eWanted, eSupported);
+
+		switch(eLevel)
+		{
+#ifdef QHT_KERNELS_X86
+			case QueryHashKernels::LevelAVX2:
+				pKernels = &g_oAVX2;
+				break;
+			case QueryHashKernels::LevelSSE2:
+				pKernels = &g_oSSE2;
+				break;
+#endif
+			default:
+				pKernels = &g_oScalar;
+				break;
+		}
+	}
+};
+
+KernelSelection g_oSelection;
+
+}
+
+quint32 QueryHashKernels::mergeTable(uchar* pDest, const uchar* pSource, quint32 nBytes)
+{
+	return g_oSelection.pKernels->mergeTable(pDest, pSource, nBytes);
+}
+
+quint32 QueryHashKernels::mergeCounters(uchar* pDest, const uchar* pCounters, quint32 nBytes)
+{
+	return g_oSelection.pKernels->mergeCounters(pDest, pCounters, nBytes);
+}
+
+void QueryHashKernels::addCounters(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	g_oSelection.pKernels->addCounters(pCounters, pTable, nBytes);
+}
+
+void QueryHashKernels::removeCounters(uchar* pCounters, const uchar* pTable, quint32 nBytes)
+{
+	g_oSelection.pKernels->removeCounters(pCounters, pTable, nBytes);
+}
+
+quint32 QueryHashKernels::countSlots(const uchar* pTable, quint32 nBytes)
+{
+	return g_oSelection.pKernels->countSlots(pTable, nBytes);
+}
+
+bool QueryHashKernels::diffTables(uchar* pDiff, const uchar* pOld, const uchar* pNew, quint32 nBytes)
+{
+	return g_oSelection.pKernels->diffTables(pDiff, pOld, pNew, nBytes);
+}
+
+QueryHashKernels::Level QueryHashKernels::level()
+{
+	return g_oSelection.eLevel;
+}
+
+const char* QueryHashKernels::levelName()
+{
+	switch(g_oSelection.eLevel)
+	{
+		case LevelAVX2:
+			return "AVX2";
+		case LevelSSE2:
+			return "SSE2";
+		default:
+			return "scalar";
+	}
+}
+
+void QueryHashKernels::setLevel(Level eLevel)
+{
+	g_oSelection.select(eLevel);
+}
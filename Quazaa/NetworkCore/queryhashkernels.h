@@ -0,0 +1,62 @@
+/*
+** queryhashkernels.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef QUERYHASHKERNELS_H
+#define QUERYHASHKERNELS_H
+
+#include <QtGlobal>
+
+// Bulk operations on query hash tables. QHT bit tables are inverted, a 0 bit marks a slot
+// that is set; group tables hold one counter byte per slot. Each operation has a scalar,
+// an SSE2 and an AVX2 version, the best one supported by the CPU is picked at startup.
+class QueryHashKernels
+{
+public:
+	enum Level
+	{
+		LevelScalar,
+		LevelSSE2,
+		LevelAVX2
+	};
+
+	// pDest &= pSource over nBytes, returns the number of slots that became set in pDest.
+	static quint32 mergeTable(uchar* pDest, const uchar* pSource, quint32 nBytes);
+	// Sets every slot of the nBytes long bit table pDest whose counter in pCounters is non zero.
+	// Returns the number of slots that became set.
+	static quint32 mergeCounters(uchar* pDest, const uchar* pCounters, quint32 nBytes);
+	// Increments (decrements) the counter of every slot set in the nBytes long bit table pTable.
+	static void addCounters(uchar* pCounters, const uchar* pTable, quint32 nBytes);
+	static void removeCounters(uchar* pCounters, const uchar* pTable, quint32 nBytes);
+	// Number of slots set in the nBytes long bit table.
+	static quint32 countSlots(const uchar* pTable, quint32 nBytes);
+	// pDiff = pOld ^ pNew, returns true if the tables differ.
+	static bool diffTables(uchar* pDiff, const uchar* pOld, const uchar* pNew, quint32 nBytes);
+
+	static Level level();
+	static const char* levelName();
+	// Forces a kernel level, capped at what the CPU supports. Used to compare the implementations.
+	static void setLevel(Level eLevel);
+};
+
+#endif // QUERYHASHKERNELS_H
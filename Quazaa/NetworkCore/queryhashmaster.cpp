@@ -24,6 +24,7 @@
 
 #include "queryhashmaster.h"
 #include "queryhashgroup.h"
+#include "queryhashkernels.h"
 #include "sharemanager.h"
 #include <QDateTime>
 
@@ -34,11 +35,19 @@ CQueryHashMaster QueryHashMaster;
 CQueryHashMaster::CQueryHashMaster()
 {
 	m_nPerGroup = 0;
+	m_bValid = false;
+	m_bFullRebuild = true;
+	m_pLocal = 0;
+	m_nLocal = 0;
+	m_tBuilt = 0;
+	m_nGeneration = 0;
 }
 
 CQueryHashMaster::~CQueryHashMaster()
 {
 	Q_ASSERT(getCount() == 0);
+
+	delete [] m_pLocal;
 }
 
 void CQueryHashMaster::create()
@@ -49,6 +58,10 @@ void CQueryHashMaster::create()
 	m_bValid			= false;
 	m_bLive				= false;
 	m_nCookie			= 0;
+	m_bFullRebuild		= true;
+	m_tBuilt			= 0;
+
+	systemLog.postLog(LogSeverity::Debug, QString("Query hash tables use %1 kernels").arg(QueryHashKernels::levelName()));
 }
 
 void CQueryHashMaster::add(CQueryHashTable* pTable)
@@ -99,20 +112,59 @@ void CQueryHashMaster::remove(CQueryHashTable* pTable)
 	m_bValid = false;
 }
 
+// nOffset and nLength are in bytes of a table with nHash slots
+void CQueryHashMaster::markDirty(quint32 nHash, quint32 nOffset, quint32 nLength)
+{
+	m_bValid = false;
+
+	if(nHash != m_nHash || m_bFullRebuild || !nLength)
+	{
+		m_bFullRebuild = true;
+		return;
+	}
+
+	for(quint32 nBlock = nOffset / BlockBytes; nBlock <= (nOffset + nLength - 1) / BlockBytes; ++nBlock)
+	{
+		m_oDirty.setBit(nBlock);
+	}
+}
+
+// Marks every block in which pTable has a slot set, used when a table joins or leaves a group.
+void CQueryHashMaster::markTable(const CQueryHashTable* pTable)
+{
+	m_bValid = false;
+
+	if(pTable->m_nHash != m_nHash || m_bFullRebuild)
+	{
+		m_bFullRebuild = true;
+		return;
+	}
+
+	const quint32 nBytes = m_nHash >> 3;
+
+	for(quint32 nOffset = 0, nBlock = 0; nOffset < nBytes; nOffset += BlockBytes, ++nBlock)
+	{
+		if(QueryHashKernels::countSlots(pTable->m_pHash + nOffset, qMin<quint32>(BlockBytes, nBytes - nOffset)))
+		{
+			m_oDirty.setBit(nBlock);
+		}
+	}
+}
+
 void CQueryHashMaster::build()
 {
 	quint32 tNow = time(0);
 
 	if(m_bValid)
 	{
-		if(tNow - m_nCookie < 600)
+		if(tNow - m_tBuilt < 600)
 		{
 			return;
 		}
 	}
 	else
 	{
-		if(tNow - m_nCookie < 20)
+		if(tNow - m_tBuilt < 20)
 		{
 			return;
 		}
@@ -128,19 +180,136 @@ void CQueryHashMaster::build()
 		return;
 	}
 
+	bool bFull = m_bFullRebuild || pLocalTable->m_nHash != m_nHash || m_nLocal != m_nHash;
+
+	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end() && !bFull; itGroup++)
+	{
+		bFull = ((*itGroup)->m_nHash != m_nHash);
+	}
+
+	bool bChanged = false;
+
+	if(bFull)
+	{
+		rebuild(pLocalTable);
+		ShareManager.m_oSection.unlock();
+		bChanged = true;
+	}
+	else
+	{
+		// Pick up changes to our own shares by comparing with the copy taken last time
+		const quint32 nBytes = m_nHash >> 3;
+
+		for(quint32 nOffset = 0, nBlock = 0; nOffset < nBytes; nOffset += BlockBytes, ++nBlock)
+		{
+			const quint32 nLength = qMin<quint32>(BlockBytes, nBytes - nOffset);
+
+			if(memcmp(m_pLocal + nOffset, pLocalTable->m_pHash + nOffset, nLength))
+			{
+				memcpy(m_pLocal + nOffset, pLocalTable->m_pHash + nOffset, nLength);
+				m_oDirty.setBit(nBlock);
+			}
+		}
+
+		ShareManager.m_oSection.unlock();
+
+		const quint32 nBlocks = m_oDirty.size();
+		quint32 nDirty = 0;
+		m_nGeneration++;
+
+		for(quint32 nBlock = 0; nBlock < nBlocks; ++nBlock)
+		{
+			if(m_oDirty.testBit(nBlock))
+			{
+				nDirty++;
+				if(buildBlock(nBlock))
+				{
+					bChanged = true;
+				}
+			}
+		}
+
+		m_oDirty.fill(false);
+
+		if(nDirty)
+		{
+			systemLog.postLog(LogSeverity::Debug, QString("Query hash master: rebuilt %1 of %2 blocks").arg(nDirty).arg(nBlocks));
+		}
+	}
+
+	m_bValid	= true;
+	m_bLive		= true;
+	m_tBuilt	= tNow;
+
+	if(bChanged)
+	{
+		m_nCookie = tNow;
+	}
+}
+
+// Recomputes the whole table from the share table and all groups.
+void CQueryHashMaster::rebuild(const CQueryHashTable* pLocalTable)
+{
 	clear();
 	merge(pLocalTable);
 
-	ShareManager.m_oSection.unlock();
+	if(m_nLocal != m_nHash)
+	{
+		delete [] m_pLocal;
+		m_pLocal = new uchar[(m_nHash + 31) / 8];
+		m_nLocal = m_nHash;
+	}
+
+	const quint32 nBlocks = ((m_nHash >> 3) + BlockBytes - 1) / BlockBytes;
+
+	m_bFullRebuild = (pLocalTable->m_nHash != m_nHash);
+	if(!m_bFullRebuild)
+	{
+		memcpy(m_pLocal, pLocalTable->m_pHash, m_nHash >> 3);
+	}
 
 	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end(); itGroup++)
 	{
 		CQueryHashGroup* pGroup = *itGroup;
 		merge(pGroup);
+
+		if(pGroup->m_nHash != m_nHash)
+		{
+			m_bFullRebuild = true;
+		}
 	}
 
-	m_bValid	= true;
-	m_bLive		= true;
-	m_nCookie	= tNow;
+	m_oDirty.fill(false, nBlocks);
+
+	m_nGeneration++;
+	m_pChanged.fill(m_nGeneration, nBlocks);
 }
 
+// Recomputes one block from the copy of the share table and the groups, which all have
+// the size of the master table here. Returns true if the block changed.
+bool CQueryHashMaster::buildBlock(quint32 nBlock)
+{
+	const quint32 nOffset = nBlock * BlockBytes;
+	const quint32 nLength = qMin<quint32>(BlockBytes, (m_nHash >> 3) - nOffset);
+	uchar* pBlock = m_pHash + nOffset;
+
+	uchar pOld[BlockBytes];
+	memcpy(pOld, pBlock, nLength);
+
+	m_nCount -= QueryHashKernels::countSlots(pBlock, nLength);
+	memcpy(pBlock, m_pLocal + nOffset, nLength);
+	m_nCount += QueryHashKernels::countSlots(pBlock, nLength);
+
+	for(QList<CQueryHashGroup*>::iterator itGroup = m_pGroups.begin(); itGroup != m_pGroups.end(); itGroup++)
+	{
+		m_nCount += QueryHashKernels::mergeCounters(pBlock, (*itGroup)->m_pHash + nOffset * 8, nLength);
+	}
+
+	if(memcmp(pOld, pBlock, nLength))
+	{
+		m_pChanged[nBlock] = m_nGeneration;
+		return true;
+	}
+
+	return false;
+}
@@ -26,6 +26,8 @@
 #define QUERYHASHMASTER_H
 
 #include "queryhashtable.h"
+#include <QBitArray>
+#include <QVector>
 
 class CQueryHashGroup;
 
@@ -41,12 +43,28 @@ protected:
 	int			m_nPerGroup;
 	bool		m_bValid;
 
+	// Incremental rebuild: groups and the share table mark the blocks they change,
+	// build() recomputes only those. Tables of a different size force a full rebuild.
+	bool		m_bFullRebuild;
+	QBitArray	m_oDirty;
+	uchar*		m_pLocal;		// share table as of the last build
+	quint32		m_nLocal;
+	quint32		m_tBuilt;
+public:
+	quint32				m_nGeneration;	// bumped by every build that changed the table
+	QVector<quint32>	m_pChanged;		// per block, the generation it last changed in
+
 public:
 	void		create();
 	void		add(CQueryHashTable* pTable);
 	void		remove(CQueryHashTable* pTable);
+	void		markDirty(quint32 nHash, quint32 nOffset, quint32 nLength);
+	void		markTable(const CQueryHashTable* pTable);
 public slots:
 	void		build();
+protected:
+	void		rebuild(const CQueryHashTable* pLocalTable);
+	bool		buildBlock(quint32 nBlock);
 
 public:
 
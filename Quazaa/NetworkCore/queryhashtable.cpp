@@ -25,6 +25,7 @@
 #include "queryhashtable.h"
 #include "queryhashmaster.h"
 #include "queryhashgroup.h"
+#include "queryhashkernels.h"
 #include <QString>
 #include "network.h"
 #include "neighbour.h"
@@ -52,6 +53,8 @@ CQueryHashTable::CQueryHashTable() : QObject(0),
 	,	m_nCount(0ul)
 	,	m_pBuffer(new CBuffer(131072))    // 128KB
 	,	m_pGroup(0)
+	,	m_nPatched(0ul)
+	,	m_pSummary(0)
 {
 }
 
@@ -63,6 +66,7 @@ CQueryHashTable::~CQueryHashTable()
 	}
 
 	delete [] m_pHash;
+	delete [] m_pSummary;
 	delete m_pBuffer;
 }
 
@@ -124,34 +128,7 @@ bool CQueryHashTable::merge(const CQueryHashTable* pSource)
 
 	if(m_nHash == pSource->m_nHash)
 	{
-		uchar* pSourcePtr	= pSource->m_pHash;
-		uchar* pDestPtr		= m_pHash;
-
-		for(quint32 nPosition = m_nHash >> 3 ; nPosition ; --nPosition)
-		{
-			register uchar nSourceByte = *pSourcePtr;
-			register uchar nDestByte = *pDestPtr;
-
-#define DO_MERGE(MASKVAL) \
-	if ( ! ( nSourceByte & MASKVAL ) && ( nDestByte & MASKVAL ) ) \
-	{ \
-		*pDestPtr &= ~ MASKVAL; \
-		++m_nCount; \
-	}
-
-			DO_MERGE(0x01);
-			DO_MERGE(0x02);
-			DO_MERGE(0x04);
-			DO_MERGE(0x08);
-			DO_MERGE(0x10);
-			DO_MERGE(0x20);
-			DO_MERGE(0x40);
-			DO_MERGE(0x80);
-#undef DO_MERGE
-
-			++pSourcePtr;
-			++pDestPtr;
-		}
+		m_nCount += QueryHashKernels::mergeTable(m_pHash, pSource->m_pHash, m_nHash >> 3);
 	}
 	else
 	{
@@ -247,32 +224,7 @@ bool CQueryHashTable::merge(const CQueryHashGroup* pSource)
 
 	if(m_nHash == pSource->m_nHash)
 	{
-		uchar* pSourcePtr	= pSource->m_pHash;
-		uchar* pDestPtr		= m_pHash;
-
-		for(quint32 nPosition = m_nHash >> 3 ; nPosition ; --nPosition)
-		{
-			register uchar nDestByte = *pDestPtr;
-
-#define DO_MERGE(MASKVAL) \
-	if ( *pSourcePtr++ && ( nDestByte & MASKVAL ) ) \
-	{ \
-		*pDestPtr &= ~ MASKVAL; \
-		m_nCount++; \
-	}
-
-			DO_MERGE(0x01);
-			DO_MERGE(0x02);
-			DO_MERGE(0x04);
-			DO_MERGE(0x08);
-			DO_MERGE(0x10);
-			DO_MERGE(0x20);
-			DO_MERGE(0x40);
-			DO_MERGE(0x80);
-#undef DO_MERGE
-
-			++pDestPtr;
-		}
+		m_nCount += QueryHashKernels::mergeCounters(m_pHash, pSource->m_pHash, m_nHash >> 3);
 	}
 	else
 	{
@@ -393,22 +345,41 @@ bool CQueryHashTable::patchTo(const CQueryHashTable* pTarget,
 	uchar* pHashT	= pTarget->m_pHash;
 	uchar* pHashS	= m_pHash;
 
-	const quint32 nEnd = (m_nHash + 31) / 32;
-	quint32* const pDwordBuffer = reinterpret_cast< quint32* >(pBuffer);
-	const quint32* const pDwordHashS = reinterpret_cast< quint32* >(pHashS);
-	const quint32* const pDwordHashT = reinterpret_cast< quint32* >(pHashT);
-	for(quint32 nPosition = 0; nPosition < nEnd; ++nPosition)
+	const quint32 nBytes = (m_nHash + 31) / 32 * 4;
+	const quint32 nBlocks = (nBytes + BlockBytes - 1) / BlockBytes;
+	const bool bMaster = (pTarget == &QueryHashMaster);
+
+	if(bMaster && !bChanged && m_nPatched && QueryHashMaster.m_pChanged.size() == (int)nBlocks)
 	{
-		if((pDwordBuffer[ nPosition ] = pDwordHashS[ nPosition ] ^ pDwordHashT[ nPosition ]) != 0)
+		// Only blocks the master rebuilt since our last patch can differ, the rest of the patch stays zero
+		memset(pBuffer, 0, nBytes);
+
+		for(quint32 nBlock = 0, nOffset = 0; nBlock < nBlocks; ++nBlock, nOffset += BlockBytes)
 		{
-			bChanged = true;
+			const quint32 nLength = qMin<quint32>(BlockBytes, nBytes - nOffset);
+
+			if(QueryHashMaster.m_pChanged[nBlock] > m_nPatched &&
+			   QueryHashKernels::diffTables(pBuffer + nOffset, pHashS + nOffset, pHashT + nOffset, nLength))
+			{
+				memcpy(pHashS + nOffset, pHashT + nOffset, nLength);
+				bChanged = true;
+			}
 		}
 	}
-	if(bChanged)
+	else
 	{
-		memcpy(pHashS, pHashT, (m_nHash + 31) / 8);
+		if(QueryHashKernels::diffTables(pBuffer, pHashS, pHashT, nBytes))
+		{
+			bChanged = true;
+		}
+		if(bChanged)
+		{
+			memcpy(pHashS, pHashT, (m_nHash + 31) / 8);
+		}
 	}
 
+	m_nPatched = bMaster ? QueryHashMaster.m_nGeneration : 0;
+
 	if(!bChanged && m_bLive)
 	{
 		return false;
@@ -416,7 +387,7 @@ bool CQueryHashTable::patchTo(const CQueryHashTable* pTarget,
 
 	baBuffer.resize(m_nHash / 8);
 
-	if(!ZLibUtils::compressBuffer(baBuffer))
+	if(!ZLibUtils::compressBuffer(baBuffer, false, ZLibUtils::LinkStream))
 	{
 		systemLog.postLog(LogSeverity::Debug, "QHT compress error");
 		//qDebug() << "QHT compress error";
@@ -543,6 +514,9 @@ bool CQueryHashTable::onReset(G2Packet* pPacket)
 	m_nCookie	= time(0);
 	m_nCount	= 0;
 
+	delete [] m_pSummary;
+	m_pSummary	= 0;
+
 	m_pBuffer->clear();
 
 	return true;
@@ -609,6 +583,10 @@ bool CQueryHashTable::onPatch(G2Packet* pPacket)
 		return false;
 	}
 
+	// The table changes below, the summary is rebuilt once the patch is applied
+	delete [] m_pSummary;
+	m_pSummary = 0;
+
 	uchar* pData		= (uchar*)m_pBuffer->data();
 	uchar* pHash		= m_pHash;
 
@@ -617,8 +595,22 @@ bool CQueryHashTable::onPatch(G2Packet* pPacket)
 
 	if(nBits == 1)
 	{
+		quint32 nDirtyBlock = 0xffffffff;
+
 		for(quint32 nPosition = (m_nHash >> 3) ; nPosition ; --nPosition, ++pHash, ++pData)
 		{
+			if(*pData == 0)
+			{
+				pGroup += 8;
+				continue;
+			}
+
+			if(bGroup && (pHash - m_pHash) / BlockBytes != nDirtyBlock)
+			{
+				nDirtyBlock = (pHash - m_pHash) / BlockBytes;
+				QueryHashMaster.markDirty(m_nHash, pHash - m_pHash, 1);
+			}
+
 			for(uchar nMask = 1 ; ; nMask <<= 1)
 			{
 				if(*pData & nMask)
@@ -673,15 +665,70 @@ bool CQueryHashTable::onPatch(G2Packet* pPacket)
 		return false;
 	}
 
+	buildSummary();
+
 	m_bLive		= true;
 	m_nCookie	= time(0);
 
-	if(bGroup)
+	return true;
+}
+
+// Folds the table into 2^SummaryBits positive bits. Summary position j covers the slots whose
+// top SummaryBits bits are j, so hashPositions(SummaryBits) of a query address it directly.
+void CQueryHashTable::buildSummary()
+{
+	const quint32 nSummary = 1u << SummaryBits;
+
+	if(!m_pSummary)
 	{
-		QueryHashMaster.invalidate();
+		m_pSummary = new uchar[nSummary / 8];
 	}
+	memset(m_pSummary, 0, nSummary / 8);
 
-	return true;
+	if(m_nBits >= SummaryBits)
+	{
+		const quint32 nShift = m_nBits - SummaryBits;
+
+		for(quint32 nPosition = 0; nPosition < nSummary; ++nPosition)
+		{
+			const quint32 nFirst = nPosition << nShift;
+			bool bSet = false;
+
+			if(nShift >= 3)
+			{
+				const uchar* pHash = m_pHash + (nFirst >> 3);
+				for(quint32 nByte = 1u << (nShift - 3); nByte && !bSet; --nByte, ++pHash)
+				{
+					bSet = (*pHash != 0xFF);
+				}
+			}
+			else
+			{
+				for(quint32 nSlot = nFirst; nSlot < nFirst + (1u << nShift) && !bSet; ++nSlot)
+				{
+					bSet = !(m_pHash[nSlot >> 3] & (1 << (nSlot & 7)));
+				}
+			}
+
+			if(bSet)
+			{
+				m_pSummary[nPosition >> 3] |= (1 << (nPosition & 7));
+			}
+		}
+	}
+	else
+	{
+		const quint32 nShift = SummaryBits - m_nBits;
+
+		for(quint32 nPosition = 0; nPosition < nSummary; ++nPosition)
+		{
+			const quint32 nSlot = nPosition >> nShift;
+			if(!(m_pHash[nSlot >> 3] & (1 << (nSlot & 7))))
+			{
+				m_pSummary[nPosition >> 3] |= (1 << (nPosition & 7));
+			}
+		}
+	}
 }
 
 void CQueryHashTable::addExactString(const QString& strString)
@@ -796,7 +843,7 @@ int CQueryHashTable::getPercent() const
 		return 0;
 	}
 
-	return m_nCount * 100 / m_nHash;
+	return (quint64)m_nCount * 100 / m_nHash;
 }
 
 quint32 CQueryHashTable::hashWord(const char* pSz, quint32 nLength, qint32 nBits)
@@ -888,24 +935,62 @@ bool CQueryHashTable::checkQuery(CQueryPtr pQuery)
 	if( !m_bLive || !m_pHash )
 		return true;
 
-	for(int i = 0; i < pQuery->m_lHashes.size(); ++i)
+	return checkPositions(pQuery->hashPositions(m_nBits));
+}
+
+// oPositions must have been built for m_nBits
+bool CQueryHashTable::checkPositions(const CQueryHashPositions& oPositions) const
+{
+	Q_ASSERT(oPositions.nBits == m_nBits);
+
+	if( !m_bLive || !m_pHash )
+		return true;
+
+	const uchar* pHash = m_pHash;
+
+	for(int i = 0; i < oPositions.lURNs.size(); ++i)
 	{
-		if(checkString(pQuery->m_lHashes[i].toURN()))
+		const quint32 nSlot = oPositions.lURNs[i];
+		if(!(pHash[nSlot >> 3] & (1 << (nSlot & 7))))
 			return true;
 	}
 
-	int nWords = 0, nWordHits = 0;
+	const int nWords = oPositions.lWords.size();
+	int nWordHits = 0;
 
-	if( pQuery->m_lHashedKeywords.size() )
+	for(int i = 0; i < nWords; ++i)
 	{
-		foreach(quint32 nHash, pQuery->m_lHashedKeywords)
-		{
-			nWords++;
-			if(checkHash(nHash))
-				nWordHits++;
-		}
+		const quint32 nSlot = oPositions.lWords[i];
+		if(!(pHash[nSlot >> 3] & (1 << (nSlot & 7))))
+			nWordHits++;
 	}
 
 	return (nWords >= 3) ? (nWordHits * 3 / nWords >= 2) : (nWords == nWordHits && nWords > 0);
 }
 
+// Cheap pre-screen with the same rules as checkPositions(). oPositions must have been built
+// for SummaryBits; a false result means the full table can not match either.
+bool CQueryHashTable::checkSummary(const CQueryHashPositions& oPositions) const
+{
+	Q_ASSERT(oPositions.nBits == SummaryBits);
+
+	if( !m_bLive || !m_pSummary )
+		return true;
+
+	for(int i = 0; i < oPositions.lURNs.size(); ++i)
+	{
+		if(summaryBit(oPositions.lURNs[i]))
+			return true;
+	}
+
+	const int nWords = oPositions.lWords.size();
+	int nWordHits = 0;
+
+	for(int i = 0; i < nWords; ++i)
+	{
+		if(summaryBit(oPositions.lWords[i]))
+			nWordHits++;
+	}
+
+	return (nWords >= 3) ? (nWordHits * 3 / nWords >= 2) : (nWords == nWordHits && nWords > 0);
+}
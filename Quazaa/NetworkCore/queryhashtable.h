@@ -35,6 +35,7 @@ class QByteArray;
 class CBuffer;
 class CQueryHashGroup;
 class CQuery;
+struct CQueryHashPositions;
 
 typedef QSharedPointer<CQuery> CQueryPtr;
 
@@ -45,6 +46,10 @@ public:
 	CQueryHashTable();
 	virtual ~CQueryHashTable();
 
+public:
+	enum { BlockBytes = 512 };		// table bytes per block in incremental builds and patches
+	enum { SummaryBits = 15 };		// size of the folded summary of remote tables, 4 KB
+
 public:
 	bool				m_bLive;
 	quint32				m_nCookie;
@@ -52,9 +57,11 @@ public:
 	quint32				m_nHash;
 	quint32				m_nBits;
 	quint32				m_nInfinity;
-	quint32				m_nCount;
+	quint32				m_nCount;		// occupied slots, kept up to date by every change to m_pHash
 	CBuffer*			m_pBuffer;
 	CQueryHashGroup* 	m_pGroup;
+	quint32				m_nPatched;		// master generation this table was last patched to
+	uchar*				m_pSummary;		// remote tables: 2^SummaryBits bits, a set bit covers any set slot it folds
 
 public:
 	static quint32 hashWord(const char* pSz, const quint32 nLength, qint32 nBits);
@@ -76,12 +83,19 @@ public:
 	bool	checkString(const QString& strString) const;
 	bool	checkHash(const quint32 nHash) const;
 	bool	checkQuery(CQueryPtr pQuery);
+	bool	checkPositions(const CQueryHashPositions& oPositions) const;
+	bool	checkSummary(const CQueryHashPositions& oPositions) const;
+	inline bool	summaryBit(quint32 nPosition) const
+	{
+		return m_pSummary[nPosition >> 3] & (1 << (nPosition & 7));
+	}
 	int		getPercent() const;
 protected:
 	bool	onReset(G2Packet* pPacket);
 	bool	onPatch(G2Packet* pPacket);
 	void	add(const char* pszString, quint32 nLength);
 	void	addExact(const char* pszString, quint32 nLength);
+	void	buildSummary();
 };
 
 #pragma pack(push,1)
@@ -76,7 +76,7 @@ QueryHitInfo* CQueryHit::readInfo(G2Packet* pPacket, CEndPoint* pSender)
 
 	try
 	{
-		char szType[9];
+		quint64 nType = 0;
 		quint32 nLength = 0, nNext = 0;
 		bool bCompound = false;
 
@@ -87,11 +87,11 @@ QueryHitInfo* CQueryHit::readInfo(G2Packet* pPacket, CEndPoint* pSender)
 			bHaveNA = true;
 		}
 
-		while(pPacket->readPacket(&szType[0], nLength, &bCompound))
+		while(pPacket->readPacket(nType, nLength, &bCompound))
 		{
 			nNext = pPacket->m_nPosition + nLength;
 
-			if(strcmp("H", szType) == 0 && bCompound)
+			if(nType == G2Type::H && bCompound)
 			{
 				bHaveHits = true;
 				continue;
@@ -102,37 +102,48 @@ QueryHitInfo* CQueryHit::readInfo(G2Packet* pPacket, CEndPoint* pSender)
 				pPacket->skipCompound();
 			}
 
-			if(strcmp("NA", szType) == 0 && nLength >= 6)
+			switch(nType)
 			{
-				CEndPoint oNodeAddr;
-				pPacket->readHostAddress(&oNodeAddr, !(nLength >= 18));
-				if(oNodeAddr.isValid())
-				{
-					pHitInfo->m_oNodeAddress = oNodeAddr;
-					bHaveNA = true;
-				}
-			}
-			else if(strcmp("GU", szType) == 0 && nLength >= 16)
-			{
-				QUuid oNodeGUID = pPacket->readGUID();
-				if(!oNodeGUID.isNull())
-				{
-					pHitInfo->m_oNodeGUID = oNodeGUID;
-					bHaveGUID = true;
-				}
-			}
-			else if(strcmp("NH", szType) == 0 && nLength >= 6)
-			{
-				CEndPoint oNH;
-				pPacket->readHostAddress(&oNH, !(nLength >= 18));
-				if(oNH.isValid())
-				{
-					pHitInfo->m_lNeighbouringHubs.append(oNH);
-				}
-			}
-			else if(strcmp("V", szType) == 0 && nLength >= 4)
-			{
-				pHitInfo->m_sVendor = pPacket->readString(4);
+				case G2Type::NA:
+					if(nLength >= 6)
+					{
+						CEndPoint oNodeAddr;
+						pPacket->readHostAddress(&oNodeAddr, !(nLength >= 18));
+						if(oNodeAddr.isValid())
+						{
+							pHitInfo->m_oNodeAddress = oNodeAddr;
+							bHaveNA = true;
+						}
+					}
+					break;
+				case G2Type::GU:
+					if(nLength >= 16)
+					{
+						QUuid oNodeGUID = pPacket->readGUID();
+						if(!oNodeGUID.isNull())
+						{
+							pHitInfo->m_oNodeGUID = oNodeGUID;
+							bHaveGUID = true;
+						}
+					}
+					break;
+				case G2Type::NH:
+					if(nLength >= 6)
+					{
+						CEndPoint oNH;
+						pPacket->readHostAddress(&oNH, !(nLength >= 18));
+						if(oNH.isValid())
+						{
+							pHitInfo->m_lNeighbouringHubs.append(oNH);
+						}
+					}
+					break;
+				case G2Type::V:
+					if(nLength >= 4)
+					{
+						pHitInfo->m_sVendor = pPacket->readString(4);
+					}
+					break;
 			}
 
 			pPacket->m_nPosition = nNext;
@@ -174,15 +185,15 @@ CQueryHit* CQueryHit::readPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 
 	try
 	{
-		char szType[9], szTypeX[9];
+		quint64 nType = 0, nTypeX = 0;
 		quint32 nLength = 0, nLengthX = 0, nNext = 0, nNextX = 0;
 		bool bCompound = false;
 
-		while(pPacket->readPacket(&szType[0], nLength, &bCompound))
+		while(pPacket->readPacket(nType, nLength, &bCompound))
 		{
 			nNext = pPacket->m_nPosition + nLength;
 
-			if(strcmp("H", szType) == 0 && bCompound)
+			if(nType == G2Type::H && bCompound)
 			{
 				CQueryHit* pHit = (bFirstHit ? pThisHit : new CQueryHit());
 
@@ -201,97 +212,103 @@ CQueryHit* CQueryHit::readPacket(G2Packet* pPacket, QueryHitInfo* pHitInfo)
 				bool bHaveDN = false;
 				bool bHaveURN = false;
 
-				while(pPacket->m_nPosition < nNext && pPacket->readPacket(&szTypeX[0], nLengthX))
+				while(pPacket->m_nPosition < nNext && pPacket->readPacket(nTypeX, nLengthX))
 				{
 					nNextX = pPacket->m_nPosition + nLengthX;
 
-					if(strcmp("URN", szTypeX) == 0)
+					switch(nTypeX)
 					{
-						QString sURN;
-						QByteArray hashBuff;
-						sURN = pPacket->readString();
-
-						if(nLengthX >= 44u && sURN.compare("bp") == 0)
+						case G2Type::URN:
 						{
-							hashBuff.resize(CHash::byteCount(CHash::SHA1));
-							pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
-							CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
-							if(pHash)
+							QString sURN;
+							QByteArray hashBuff;
+							sURN = pPacket->readString();
+
+							if(nLengthX >= 44u && sURN.compare("bp") == 0)
 							{
-								pHit->m_lHashes.append(*pHash);
-								bHaveURN = true;
+								hashBuff.resize(CHash::byteCount(CHash::SHA1));
+								pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
+								CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
+								if(pHash)
+								{
+									pHit->m_lHashes.append(*pHash);
+									bHaveURN = true;
+								}
+								delete pHash;
+								// TODO: Tiger
 							}
-							delete pHash;
-							// TODO: Tiger
-						}
-						else if(nLengthX >= CHash::byteCount(CHash::SHA1) + 5u && sURN.compare("sha1") == 0)
-						{
-							hashBuff.resize(CHash::byteCount(CHash::SHA1));
-							pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
-							CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
-							if(pHash)
+							else if(nLengthX >= CHash::byteCount(CHash::SHA1) + 5u && sURN.compare("sha1") == 0)
 							{
-								pHit->m_lHashes.append(*pHash);
-								bHaveURN = true;
+								hashBuff.resize(CHash::byteCount(CHash::SHA1));
+								pPacket->read(hashBuff.data(), CHash::byteCount(CHash::SHA1));
+								CHash* pHash = CHash::fromRaw(hashBuff, CHash::SHA1);
+								if(pHash)
+								{
+									pHit->m_lHashes.append(*pHash);
+									bHaveURN = true;
+								}
+								delete pHash;
 							}
-							delete pHash;
-						}
-
-					}
-					else if(strcmp("URL", szTypeX) == 0 && nLengthX)
-					{
-						// if url empty - try uri-res resolver or a node do not have this object
-						// bez sensu...
-						pHit->m_sURL = pPacket->readString();
-					}
-					else if(strcmp("DN", szTypeX) == 0)
-					{
-						if(bHaveSize)
-						{
-							pHit->m_sDescriptiveName = pPacket->readString(nLengthX);
-						}
-						else if(nLengthX > 4)
-						{
-							baTemp.resize(4);
-							pPacket->read(baTemp.data(), 4);
-							pHit->m_sDescriptiveName = pPacket->readString(nLengthX - 4);
+							break;
 						}
+						case G2Type::URL:
+							if(nLengthX)
+							{
+								// if url empty - try uri-res resolver or a node do not have this object
+								// bez sensu...
+								pHit->m_sURL = pPacket->readString();
+							}
+							break;
+						case G2Type::DN:
+							if(bHaveSize)
+							{
+								pHit->m_sDescriptiveName = pPacket->readString(nLengthX);
+							}
+							else if(nLengthX > 4)
+							{
+								baTemp.resize(4);
+								pPacket->read(baTemp.data(), 4);
+								pHit->m_sDescriptiveName = pPacket->readString(nLengthX - 4);
+							}
 
-						bHaveDN = true;
-					}
-					else if(strcmp("MD", szTypeX) == 0)
-					{
-						pHit->m_sMetadata = pPacket->readString();
-					}
-					else if(strcmp("SZ", szTypeX) == 0 && nLengthX >= 4)
-					{
-						if(nLengthX >= 8)
-						{
-							if(!baTemp.isEmpty())
+							bHaveDN = true;
+							break;
+						case G2Type::MD:
+							pHit->m_sMetadata = pPacket->readString();
+							break;
+						case G2Type::SZ:
+							if(nLengthX >= 8)
 							{
-								pHit->m_sDescriptiveName.prepend(baTemp);
+								if(!baTemp.isEmpty())
+								{
+									pHit->m_sDescriptiveName.prepend(baTemp);
+								}
+								pHit->m_nObjectSize = pPacket->readIntLE<quint64>();
+								bHaveSize = true;
 							}
-							pHit->m_nObjectSize = pPacket->readIntLE<quint64>();
-							bHaveSize = true;
-						}
-						else if(nLengthX >= 4)
-						{
-							if(!baTemp.isEmpty())
+							else if(nLengthX >= 4)
 							{
-								pHit->m_sDescriptiveName.prepend(baTemp);
+								if(!baTemp.isEmpty())
+								{
+									pHit->m_sDescriptiveName.prepend(baTemp);
+								}
+								pHit->m_nObjectSize = pPacket->readIntLE<quint32>();
+								bHaveSize = true;
 							}
-							pHit->m_nObjectSize = pPacket->readIntLE<quint32>();
-							bHaveSize = true;
-						}
-					}
-					else if(strcmp("CSC", szTypeX) == 0 && nLengthX >= 2)
-					{
-						pHit->m_nCachedSources = pPacket->readIntLE<quint16>();
-					}
-					else if(strcmp("PART", szTypeX) == 0 && nLengthX >= 4)
-					{
-						pHit->m_bIsPartial = true;
-						pHit->m_nPartialBytesAvailable = pPacket->readIntLE<quint32>();
+							break;
+						case G2Type::CSC:
+							if(nLengthX >= 2)
+							{
+								pHit->m_nCachedSources = pPacket->readIntLE<quint16>();
+							}
+							break;
+						case G2Type::PART:
+							if(nLengthX >= 4)
+							{
+								pHit->m_bIsPartial = true;
+								pHit->m_nPartialBytesAvailable = pPacket->readIntLE<quint32>();
+							}
+							break;
 					}
 					pPacket->m_nPosition = nNextX;
 				}
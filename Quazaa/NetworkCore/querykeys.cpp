@@ -23,47 +23,125 @@
 */
 
 #include "querykeys.h"
-#include <limits>
 #include <QHostAddress>
+#include <QUuid>
 
 #include "debug_new.h"
 
 CQueryKeys QueryKeys;
 
-CQueryKeys::CQueryKeys()
-	: m_pTable(0), m_nTable(0)
+#define SIPROUND(v0, v1, v2, v3) \
+	do { \
+		v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+		v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+		v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+		v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+	} while(0)
+
+// SipHash-2-4 of nWords little endian words followed by up to 7 tail bytes in nTail
+static quint64 sipHash(const quint64* pKey, const quint64* pWords, int nWords, quint64 nTail, quint8 nLength)
 {
+	quint64 v0 = pKey[0] ^ Q_UINT64_C(0x736f6d6570736575);
+	quint64 v1 = pKey[1] ^ Q_UINT64_C(0x646f72616e646f6d);
+	quint64 v2 = pKey[0] ^ Q_UINT64_C(0x6c7967656e657261);
+	quint64 v3 = pKey[1] ^ Q_UINT64_C(0x7465646279746573);
+
+	for(int i = 0; i < nWords; ++i)
+	{
+		v3 ^= pWords[i];
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= pWords[i];
+	}
+
+	const quint64 nLast = (quint64(nLength) << 56) | nTail;
+	v3 ^= nLast;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= nLast;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
 }
 
-CQueryKeys::~CQueryKeys()
+CQueryKeys::CQueryKeys()
+	: m_nEpoch(0), m_bReady(false)
 {
-	delete [] m_pTable;
 }
 
 void CQueryKeys::prepare()
 {
-	m_nTable = 1u << 16;
-	m_pTable = new quint32[m_nTable];
+	m_nEpoch = time(0) / EpochLength;
 
-	for(uint i = 0; i < m_nTable; i++)
+	// Both secrets are fresh, keys handed out before a restart are of no use anyway
+	for(int i = 0; i < 2; ++i)
 	{
-		m_pTable[i] = ((qrand() % std::numeric_limits<quint32>::max()) << 16) | qrand() % std::numeric_limits<quint32>::max();
+		QUuid oSecret = QUuid::createUuid();
+		memcpy(m_pSecret[i], &oSecret, sizeof(m_pSecret[i]));
 	}
+
+	m_bReady = true;
 }
 
-quint32 CQueryKeys::create(QHostAddress pAddr)
+// Replaces the secret of the epoch before the previous one. After a long pause both are replaced.
+void CQueryKeys::rotate()
 {
-	if(!m_pTable)
+	const quint32 nEpoch = time(0) / EpochLength;
+
+	if(nEpoch == m_nEpoch)
 	{
-		prepare();
+		return;
 	}
 
-	int nHash = qHash(pAddr) % m_nTable;
+	for(quint32 nSkipped = 0; m_nEpoch != nEpoch && nSkipped < 2; ++nSkipped)
+	{
+		m_nEpoch++;
+		QUuid oSecret = QUuid::createUuid();
+		memcpy(m_pSecret[m_nEpoch & 1], &oSecret, sizeof(m_pSecret[0]));
+	}
+
+	m_nEpoch = nEpoch;
+}
+
+quint32 CQueryKeys::hash(const QHostAddress& oAddress, quint32 nSecret) const
+{
+	if(oAddress.protocol() == QAbstractSocket::IPv6Protocol)
+	{
+		Q_IPV6ADDR oIPv6 = oAddress.toIPv6Address();
+		quint64 nPrefix;
+		memcpy(&nPrefix, &oIPv6, sizeof(nPrefix));		// network prefix only
+		return quint32(sipHash(m_pSecret[nSecret], &nPrefix, 1, 0, 8));
+	}
 
-	return m_pTable[nHash];
+	return quint32(sipHash(m_pSecret[nSecret], 0, 0, oAddress.toIPv4Address(), 4));
 }
-bool CQueryKeys::check(QHostAddress pAddr, quint32 nKey)
+
+quint32 CQueryKeys::create(const QHostAddress& oAddress)
 {
-	return (nKey == create(pAddr));
+	if(!m_bReady)
+	{
+		prepare();
+	}
+	rotate();
+
+	const quint32 nSecret = m_nEpoch & 1;
+
+	return (hash(oAddress, nSecret) & ~1u) | nSecret;
 }
+bool CQueryKeys::check(const QHostAddress& oAddress, quint32 nKey)
+{
+	if(!m_bReady)
+	{
+		prepare();
+	}
+	rotate();
 
+	const quint32 nSecret = nKey & 1;
+
+	return ((hash(oAddress, nSecret) & ~1u) | nSecret) == nKey;
+}
@@ -29,18 +29,30 @@
 
 class QHostAddress;
 
+// Query keys are a keyed hash (SipHash-2-4) of the requesting address and a secret that
+// changes every epoch. The lowest bit of a key tells which epoch issued it; keys of the
+// current and the previous epoch are accepted, so rotation does not invalidate live searches.
+// IPv6 keys cover the /64 prefix, the part a host cannot change freely.
 class CQueryKeys
 {
+public:
+	enum { EpochLength = 3600 };	// seconds
+
 protected:
-	quint32*	m_pTable;
-	quint32		m_nTable;
+	quint64		m_pSecret[2][2];	// by epoch & 1
+	quint32		m_nEpoch;
+	bool		m_bReady;
+
 public:
 	CQueryKeys();
-	~CQueryKeys();
 
 	void prepare();
-	quint32 create(QHostAddress pAddr);
-	bool check(QHostAddress pAddr, quint32 nKey);
+	quint32 create(const QHostAddress& oAddress);
+	bool check(const QHostAddress& oAddress, quint32 nKey);
+
+protected:
+	void rotate();
+	quint32 hash(const QHostAddress& oAddress, quint32 nSecret) const;
 };
 
 extern CQueryKeys QueryKeys;
@@ -0,0 +1,493 @@
+/*
+** queryrouter.cpp
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "queryrouter.h"
+#include "g2node.h"
+#include "g2packet.h"
+#include "queryhashtable.h"
+#include "neighbours.h"
+#include "quazaasettings.h"
+#include <QVarLengthArray>
+
+#include "debug_new.h"
+
+CQueryRouter QueryRouter;
+
+// Pushes the chain pFirst..pLast onto a lock-free LIFO list
+template<typename T>
+static void pushChain(QAtomicPointer<T>& pHead, T* pFirst, T* pLast, T* T::* pNext)
+{
+	T* pOld;
+	do
+	{
+		pOld = pHead.loadAcquire();
+		pLast->*pNext = pOld;
+	}
+	while(!pHead.testAndSetRelease(pOld, pFirst));
+}
+
+// Takes the whole list and returns it oldest first
+template<typename T>
+static T* takeAll(QAtomicPointer<T>& pHead, T* T::* pNext)
+{
+	T* pList = pHead.fetchAndStoreAcquire(0);
+	T* pReversed = 0;
+
+	while(pList)
+	{
+		T* pItem = pList;
+		pList = pItem->*pNext;
+		pItem->*pNext = pReversed;
+		pReversed = pItem;
+	}
+
+	return pReversed;
+}
+
+const CQueryHashPositions* CRoutedQuery::positions(quint32 nBits) const
+{
+	for(int i = 0; i < lPositions.size(); ++i)
+	{
+		if(lPositions.at(i).nBits == nBits)
+		{
+			return &lPositions.at(i);
+		}
+	}
+
+	return 0;
+}
+
+CQueryRouterShard::CQueryRouterShard(CQueryRouter* pRouter)
+	: m_pRouter(pRouter), m_pInbox(0), m_bStop(false)
+{
+}
+
+void CQueryRouterShard::publish(CRoutedQuery* pQuery)
+{
+	CRoutedQueryLink* pLink = new CRoutedQueryLink;
+	pLink->pQuery = pQuery;
+	pLink->pNode = 0;
+
+	pushChain(m_pInbox, pLink, pLink, &CRoutedQueryLink::pNext);
+	m_oSignal.release();
+}
+
+void CQueryRouterShard::stop()
+{
+	m_bStop = true;
+	m_oSignal.release();
+	wait();
+
+	for(CRoutedQueryLink* pLink = takeAll(m_pInbox, &CRoutedQueryLink::pNext); pLink;)
+	{
+		CRoutedQueryLink* pNext = pLink->pNext;
+		m_pRouter->release(pLink->pQuery);
+		delete pLink;
+		pLink = pNext;
+	}
+}
+
+void CQueryRouterShard::addLeaf(CG2Node* pNode)
+{
+	QMutexLocker l(&m_pSection);
+
+	int nColumn = m_lLeaves.indexOf(0);
+	if(nColumn < 0)
+	{
+		nColumn = m_lLeaves.size();
+		m_lLeaves.append(pNode);
+	}
+	else
+	{
+		m_lLeaves[nColumn] = pNode;
+	}
+
+	m_lColumns.insert(pNode, nColumn);
+	m_oIndex.setColumn(nColumn, pNode->m_pRemoteTable);
+}
+
+void CQueryRouterShard::removeLeaf(CG2Node* pNode)
+{
+	QMutexLocker l(&m_pSection);
+
+	QHash<CG2Node*, int>::iterator itColumn = m_lColumns.find(pNode);
+	if(itColumn == m_lColumns.end())
+	{
+		return;
+	}
+
+	m_oIndex.clearColumn(*itColumn);
+	m_lLeaves[*itColumn] = 0;
+	m_lColumns.erase(itColumn);
+}
+
+// Called with m_pSection held, after the remote table of pNode changed
+void CQueryRouterShard::refreshLeaf(CG2Node* pNode)
+{
+	QHash<CG2Node*, int>::const_iterator itColumn = m_lColumns.constFind(pNode);
+	if(itColumn != m_lColumns.constEnd())
+	{
+		m_oIndex.setColumn(*itColumn, pNode->m_pRemoteTable);
+	}
+}
+
+void CQueryRouterShard::run()
+{
+	forever
+	{
+		m_oSignal.acquire();
+
+		if(m_bStop)
+		{
+			break;
+		}
+
+		CRoutedQueryLink* pList = takeAll(m_pInbox, &CRoutedQueryLink::pNext);
+		const quint32 tNow = time(0);
+
+		m_pSection.lock();
+		for(CRoutedQueryLink* pLink = pList; pLink; pLink = pLink->pNext)
+		{
+			match(pLink->pQuery, tNow);
+		}
+		m_pSection.unlock();
+
+		while(pList)
+		{
+			CRoutedQueryLink* pNext = pList->pNext;
+			m_pRouter->release(pList->pQuery);
+			delete pList;
+			pList = pNext;
+		}
+	}
+}
+
+// Same tests as the inline loop in CNeighboursRouting::routeQuery(), for leaves only.
+// Called with m_pSection held, so the tables can not change underneath.
+void CQueryRouterShard::match(CRoutedQuery* pQuery, quint32 tNow)
+{
+	CRoutedQueryLink* pFirst = 0;
+	CRoutedQueryLink* pLast = 0;
+
+	// The index narrows the leaves down to those whose summary matches, the full tables
+	// are only checked for these.
+	const quint32 nWords = m_oIndex.words();
+	QVarLengthArray<quint64, 16> lMask(nWords);
+	const CQueryHashPositions* pSummary = pQuery->positions(CQueryHashTable::SummaryBits);
+
+	if(pSummary)
+	{
+		m_oIndex.candidates(*pSummary, lMask.data());
+	}
+	else
+	{
+		memset(lMask.data(), 0xFF, sizeof(quint64) * nWords);
+	}
+
+	int nCandidates = 0;
+
+	for(int nColumn = 0; nColumn < m_lLeaves.size(); ++nColumn)
+	{
+		if(!(nColumn & 63) && lMask[nColumn >> 6] == 0)
+		{
+			nColumn += 63;
+			continue;
+		}
+
+		CG2Node* pLeaf = m_lLeaves.at(nColumn);
+
+		if(pLeaf == 0 || !(lMask[nColumn >> 6] & (Q_UINT64_C(1) << (nColumn & 63))))
+		{
+			continue;
+		}
+
+		if(pLeaf == pQuery->pFrom || tNow - pLeaf->m_tConnected <= 30)
+		{
+			continue;
+		}
+
+		CQueryHashTable* pTable = pLeaf->m_pRemoteTable;
+
+		if(pTable == 0 || !pTable->m_bLive)
+		{
+			continue;
+		}
+
+		++nCandidates;
+
+		// Table resized since publishing: forward, a leaf can cope with a false positive
+		const CQueryHashPositions* pPositions = pQuery->positions(pTable->m_nBits);
+
+		if(pPositions && !pTable->checkPositions(*pPositions))
+		{
+			continue;
+		}
+
+		CRoutedQueryLink* pLink = new CRoutedQueryLink;
+		pLink->pQuery = pQuery;
+		pLink->pNode = pLeaf;
+		pLink->pNext = pFirst;
+		pFirst = pLink;
+		if(!pLast)
+		{
+			pLast = pLink;
+		}
+
+		pQuery->nReference.ref();
+	}
+
+	m_pRouter->m_nCandidates.fetchAndAddRelaxed(nCandidates);
+
+	if(pFirst)
+	{
+		m_pRouter->deliver(pFirst, pLast);
+	}
+}
+
+CQueryRouter::CQueryRouter()
+	: m_pOutbox(0), m_pRetired(0)
+{
+	memset(m_pBitsCount, 0, sizeof(m_pBitsCount));
+}
+
+CQueryRouter::~CQueryRouter()
+{
+	stop();
+}
+
+void CQueryRouter::start()
+{
+	stop();
+
+	int nThreads = quazaaSettings.Gnutella2.QueryRouterThreads;
+
+	if(nThreads == 0)
+	{
+		nThreads = qMin(QThread::idealThreadCount() - 1, 4);
+	}
+
+	for(int i = 0; i < nThreads; ++i)
+	{
+		CQueryRouterShard* pShard = new CQueryRouterShard(this);
+		pShard->start();
+		m_lShards.append(pShard);
+	}
+
+	if(nThreads > 0)
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("Routing queries to leaves on %1 threads").arg(nThreads));
+	}
+}
+
+void CQueryRouter::stop()
+{
+	foreach(CQueryRouterShard* pShard, m_lShards)
+	{
+		pShard->stop();
+		delete pShard;
+	}
+	m_lShards.clear();
+
+	drain(false);
+
+	m_lLeafShard.clear();
+	m_lLeafBits.clear();
+	memset(m_pBitsCount, 0, sizeof(m_pBitsCount));
+}
+
+// Called by the network thread whenever a leaf's table went live or changed
+void CQueryRouter::updateLeaf(CG2Node* pNode)
+{
+	if(!isActive() || pNode->m_pRemoteTable == 0)
+	{
+		return;
+	}
+
+	const quint32 nBits = qMin<quint32>(pNode->m_pRemoteTable->m_nBits, 32);
+	QHash<CG2Node*, quint32>::iterator itBits = m_lLeafBits.find(pNode);
+
+	if(itBits != m_lLeafBits.end())
+	{
+		if(*itBits != nBits)
+		{
+			m_pBitsCount[*itBits]--;
+			m_pBitsCount[nBits]++;
+			*itBits = nBits;
+		}
+		return;
+	}
+
+	m_lLeafBits.insert(pNode, nBits);
+	m_pBitsCount[nBits]++;
+
+	int nShard = 0;
+	for(int i = 1; i < m_lShards.size(); ++i)
+	{
+		if(m_lShards.at(i)->leaves() < m_lShards.at(nShard)->leaves())
+		{
+			nShard = i;
+		}
+	}
+
+	m_lShards.at(nShard)->addLeaf(pNode);
+	m_lLeafShard.insert(pNode, nShard);
+}
+
+// Must be called before the leaf or its remote table are deleted
+void CQueryRouter::removeLeaf(CG2Node* pNode)
+{
+	QHash<CG2Node*, int>::iterator itShard = m_lLeafShard.find(pNode);
+
+	if(itShard == m_lLeafShard.end())
+	{
+		return;
+	}
+
+	m_lShards.at(*itShard)->removeLeaf(pNode);
+
+	m_lLeafShard.erase(itShard);
+	m_pBitsCount[m_lLeafBits.take(pNode)]--;
+}
+
+// Updates the index column of a routed leaf, called with leafSection(pNode) held
+void CQueryRouter::refreshLeaf(CG2Node* pNode)
+{
+	QHash<CG2Node*, int>::const_iterator itShard = m_lLeafShard.constFind(pNode);
+
+	if(itShard != m_lLeafShard.constEnd())
+	{
+		m_lShards.at(*itShard)->refreshLeaf(pNode);
+	}
+}
+
+// The lock to hold while changing the remote table of a routed leaf, 0 if the leaf is not routed
+QMutex* CQueryRouter::leafSection(CG2Node* pNode)
+{
+	QHash<CG2Node*, int>::const_iterator itShard = m_lLeafShard.constFind(pNode);
+
+	if(itShard == m_lLeafShard.constEnd())
+	{
+		return 0;
+	}
+
+	return &m_lShards.at(*itShard)->m_pSection;
+}
+
+bool CQueryRouter::isRouted(CG2Node* pNode) const
+{
+	return m_lLeafShard.contains(pNode);
+}
+
+void CQueryRouter::publish(G2Packet* pPacket, CQueryPtr pQuery, CNeighbour* pFrom)
+{
+	if(m_lLeafShard.isEmpty())
+	{
+		return;
+	}
+
+	CRoutedQuery* pRouted = new CRoutedQuery;
+
+	pPacket->addRef();
+	pRouted->pPacket = pPacket;
+	pRouted->pFrom = pFrom;
+	pRouted->nReference.storeRelease(m_lShards.size());
+	pRouted->pNextRetired = 0;
+
+	// CQuery caches positions lazily, so the shards get their own copy of every size in use
+	// and of the summary positions for the index
+	for(quint32 nBits = 1; nBits <= 32; ++nBits)
+	{
+		if(m_pBitsCount[nBits] || nBits == CQueryHashTable::SummaryBits)
+		{
+			pRouted->lPositions.append(pQuery->hashPositions(nBits));
+		}
+	}
+
+	foreach(CQueryRouterShard* pShard, m_lShards)
+	{
+		pShard->publish(pRouted);
+	}
+
+	m_nPublished.ref();
+}
+
+// Called by the shards
+void CQueryRouter::deliver(CRoutedQueryLink* pFirst, CRoutedQueryLink* pLast)
+{
+	pushChain(m_pOutbox, pFirst, pLast, &CRoutedQueryLink::pNext);
+	schedule();
+}
+
+// Packets are only released on the network thread, the last reference from a shard is
+// parked in m_pRetired until then.
+void CQueryRouter::release(CRoutedQuery* pQuery)
+{
+	if(!pQuery->nReference.deref())
+	{
+		pushChain(m_pRetired, pQuery, pQuery, &CRoutedQuery::pNextRetired);
+		schedule();
+	}
+}
+
+void CQueryRouter::schedule()
+{
+	if(m_nScheduled.testAndSetOrdered(0, 1))
+	{
+		QMetaObject::invokeMethod(this, "onRouted", Qt::QueuedConnection);
+	}
+}
+
+void CQueryRouter::onRouted()
+{
+	m_nScheduled.storeRelease(0);
+
+	QMutexLocker l(&Neighbours.m_pSection);
+	drain(true);
+}
+
+void CQueryRouter::drain(bool bSend)
+{
+	for(CRoutedQueryLink* pLink = takeAll(m_pOutbox, &CRoutedQueryLink::pNext); pLink;)
+	{
+		CRoutedQueryLink* pNext = pLink->pNext;
+
+		if(bSend && Neighbours.neighbourExists(pLink->pNode) && pLink->pNode->m_nState == nsConnected)
+		{
+			pLink->pNode->sendPacket(pLink->pQuery->pPacket, true, false);
+			m_nDelivered.ref();
+		}
+
+		release(pLink->pQuery);
+		delete pLink;
+		pLink = pNext;
+	}
+
+	for(CRoutedQuery* pQuery = takeAll(m_pRetired, &CRoutedQuery::pNextRetired); pQuery;)
+	{
+		CRoutedQuery* pNext = pQuery->pNextRetired;
+		pQuery->pPacket->release();
+		delete pQuery;
+		pQuery = pNext;
+	}
+}
@@ -0,0 +1,161 @@
+/*
+** queryrouter.h
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of QUAZAA (quazaa.sourceforge.net)
+**
+** Quazaa is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** Quazaa is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with Quazaa; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef QUERYROUTER_H
+#define QUERYROUTER_H
+
+#include "types.h"
+#include "query.h"
+#include "queryhashindex.h"
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QHash>
+#include <QList>
+#include <QVector>
+
+class G2Packet;
+class CG2Node;
+class CNeighbour;
+class CQueryRouter;
+
+// A query published to the shards. Nothing in it changes after publishing; the packet
+// reference is only touched by the network thread.
+struct CRoutedQuery
+{
+	G2Packet*					pPacket;
+	CNeighbour*					pFrom;
+	QVector<CQueryHashPositions>	lPositions;		// one entry per leaf table size at publishing time
+	QAtomicInt					nReference;
+	CRoutedQuery*				pNextRetired;
+
+	const CQueryHashPositions* positions(quint32 nBits) const;
+};
+
+// Link of the lock-free lists between the network thread and the shards.
+// pNode is 0 in a shard inbox, the matching leaf in the outbox.
+struct CRoutedQueryLink
+{
+	CRoutedQuery*		pQuery;
+	CG2Node*			pNode;
+	CRoutedQueryLink*	pNext;
+};
+
+// A worker thread that owns a subset of the leaves and matches published queries against their tables
+class CQueryRouterShard : public QThread
+{
+public:
+	QMutex							m_pSection;		// guards the members below and the remote tables of the leaves
+	QVector<CG2Node*>				m_lLeaves;		// by index column, 0 for a free column
+	QHash<CG2Node*, int>			m_lColumns;
+	CQueryHashIndex					m_oIndex;		// summaries of the leaf tables
+
+protected:
+	CQueryRouter*					m_pRouter;
+	QAtomicPointer<CRoutedQueryLink>	m_pInbox;		// multiple producers, LIFO
+	QSemaphore						m_oSignal;
+	bool							m_bStop;
+
+public:
+	CQueryRouterShard(CQueryRouter* pRouter);
+
+	void publish(CRoutedQuery* pQuery);
+	void stop();
+
+	void addLeaf(CG2Node* pNode);
+	void removeLeaf(CG2Node* pNode);
+	void refreshLeaf(CG2Node* pNode);
+	inline int leaves() const
+	{
+		return m_lColumns.size();
+	}
+
+protected:
+	void run();
+	void match(CRoutedQuery* pQuery, quint32 tNow);
+};
+
+// Spreads query matching against leaf QHTs over worker threads. Leaves with a live table are
+// assigned to a shard; routeQuery() publishes each query once to every shard, the shards
+// match it against their leaves and post the hits to an outbox, which the network thread
+// moves into the leaves' send queues (sockets and send queues stay on the network thread).
+class CQueryRouter : public QObject
+{
+	Q_OBJECT
+
+public:
+	QAtomicInt		m_nPublished;
+	QAtomicInt		m_nDelivered;
+	QAtomicInt		m_nCandidates;	// leaf tables checked after the index pre-screen
+
+protected:
+	QList<CQueryRouterShard*>	m_lShards;
+	QHash<CG2Node*, int>		m_lLeafShard;
+	QHash<CG2Node*, quint32>	m_lLeafBits;	// table size of each leaf
+	quint32						m_pBitsCount[33];
+
+	QAtomicPointer<CRoutedQueryLink>	m_pOutbox;
+	QAtomicPointer<CRoutedQuery>		m_pRetired;
+	QAtomicInt						m_nScheduled;
+
+public:
+	CQueryRouter();
+	~CQueryRouter();
+
+	void start();
+	void stop();
+	inline bool isActive() const
+	{
+		return !m_lShards.isEmpty();
+	}
+	inline int shards() const
+	{
+		return m_lShards.size();
+	}
+
+	void updateLeaf(CG2Node* pNode);
+	void removeLeaf(CG2Node* pNode);
+	void refreshLeaf(CG2Node* pNode);
+	QMutex* leafSection(CG2Node* pNode);
+	bool isRouted(CG2Node* pNode) const;
+
+	void publish(G2Packet* pPacket, CQueryPtr pQuery, CNeighbour* pFrom);
+
+	void deliver(CRoutedQueryLink* pFirst, CRoutedQueryLink* pLast);
+	void release(CRoutedQuery* pQuery);
+
+protected:
+	void schedule();
+	void drain(bool bSend);
+
+public slots:
+	void onRouted();
+};
+
+extern CQueryRouter QueryRouter;
+
+#endif // QUERYROUTER_H
@@ -23,16 +23,69 @@
 */
 
 #include "routetable.h"
+#include "quazaasettings.h"
+#include "quazaaglobals.h"
 
 #include "debug_new.h"
 
+static inline quint32 hashGUID(const QUuid& oGUID)
+{
+	quint64 nLow, nHigh;
+	memcpy(&nLow, &oGUID, sizeof(nLow));
+	memcpy(&nHigh, reinterpret_cast<const char*>(&oGUID) + sizeof(nLow), sizeof(nHigh));
+
+	quint64 nHash = nLow ^ (nHigh * Q_UINT64_C(0x9e3779b97f4a7c15));
+	nHash ^= nHash >> 29;
+	nHash *= Q_UINT64_C(0xbf58476d1ce4e5b9);
+	nHash ^= nHash >> 32;
+
+	return quint32(nHash);
+}
+
 CRouteTable::CRouteTable()
 {
+	m_pSlots = 0;
+	m_nMask = 0;
+	m_nFreeItem = NoIndex;
+	m_nRoutes = 0;
+	m_nCapacity = 0;
+	m_tWheel = 0;
 }
 CRouteTable::~CRouteTable()
 {
-	qDeleteAll(m_lRoutes);
-	m_lRoutes.clear();
+	delete [] m_pSlots;
+}
+
+// Sizes the table from the settings. Slots are kept at most half full.
+void CRouteTable::create()
+{
+	m_nCapacity = qMax(1000, quazaaSettings.Gnutella2.RouteTableSize);
+
+	quint32 nSlots = 1024;
+	while(nSlots < m_nCapacity * 2)
+	{
+		nSlots *= 2;
+	}
+
+	delete [] m_pSlots;
+	m_pSlots = new RouteSlot[nSlots];
+	m_nMask = nSlots - 1;
+
+	for(quint32 i = 0; i < nSlots; ++i)
+	{
+		m_pSlots[i].nItem = NoIndex;
+	}
+
+	m_pItems.clear();
+	m_nFreeItem = NoIndex;
+	m_nRoutes = 0;
+	m_lNodeRoutes.clear();
+
+	for(quint32 i = 0; i < WheelSize; ++i)
+	{
+		m_pWheel[i] = NoIndex;
+	}
+	m_tWheel = time(0);
 }
 
 bool CRouteTable::add(QUuid& pGUID, CG2Node* pNeighbour, CEndPoint* pEndpoint, bool bNoExpire)
@@ -45,44 +98,101 @@ bool CRouteTable::add(QUuid& pGUID, CG2Node* pNeighbour, CEndPoint* pEndpoint, b
 		return false;
 	}
 
-	if((quint32)m_lRoutes.size() >= MaxRoutes)
+	if(!m_pSlots)
 	{
-		expireOldRoutes(true);
+		create();
 	}
 
-	G2RouteItem* pRoute = 0;
+	const quint32 nHash = hashGUID(pGUID);
+	quint32 nSlot = findSlot(pGUID, nHash);
+	quint32 nItem;
 
-	if( m_lRoutes.contains(pGUID) )
+	if(nSlot == NoIndex)
 	{
-		pRoute = m_lRoutes.value(pGUID);
+		if(m_nRoutes >= m_nCapacity)
+		{
+			expireOldRoutes(true);
+
+			if(m_nRoutes >= m_nCapacity)
+			{
+				return false;
+			}
+		}
+
+		if(m_nFreeItem != NoIndex)
+		{
+			nItem = m_nFreeItem;
+			m_nFreeItem = m_pItems[nItem].nNextNode;
+		}
+		else
+		{
+			nItem = m_pItems.size();
+			m_pItems.resize(nItem + 1);
+		}
+
+		G2RouteItem& oNew = m_pItems[nItem];
+		oNew.pGUID = pGUID;
+		oNew.pNeighbour = 0;
+		oNew.nExpireTime = 0;
+		oNew.nHash = nHash;
+		oNew.nAddressType = RouteNoAddress;
+		oNew.nPrevNode = oNew.nNextNode = NoIndex;
+		oNew.nWheel = NoIndex;
+
+		for(nSlot = nHash & m_nMask; m_pSlots[nSlot].nItem != NoIndex; nSlot = (nSlot + 1) & m_nMask)
+		{
+		}
+
+		m_pSlots[nSlot].nHash = nHash;
+		m_pSlots[nSlot].nItem = nItem;
+		m_nRoutes++;
 	}
 	else
 	{
-		pRoute = new G2RouteItem();
-		m_lRoutes.insert(pGUID, pRoute);
+		nItem = m_pSlots[nSlot].nItem;
 	}
 
+	G2RouteItem& oRoute = m_pItems[nItem];
+
 	if(bNoExpire && pNeighbour)
 	{
-		pRoute->nExpireTime = 0;
+		oRoute.nExpireTime = 0;		// dropped from the wheel when its slot comes up
 	}
 	else
 	{
-		pRoute->nExpireTime = time(0) + RouteExpire;
-	}
+		oRoute.nExpireTime = time(0) + RouteExpire;
 
-	pRoute->pGUID = pGUID;
+		if(oRoute.nWheel == NoIndex)
+		{
+			linkWheel(nItem);
+		}
+	}
 
-	if(pNeighbour)
+	if(pNeighbour && pNeighbour != oRoute.pNeighbour)
 	{
-		pRoute->pNeighbour = pNeighbour;
+		unlinkNode(nItem);
+		oRoute.pNeighbour = pNeighbour;
+		linkNode(nItem);
 	}
 	if(pEndpoint)
 	{
-		pRoute->pEndpoint = *pEndpoint;
+		oRoute.nPort = pEndpoint->port();
+
+		if(pEndpoint->protocol() == QAbstractSocket::IPv4Protocol)
+		{
+			oRoute.nAddressType = RouteIPv4;
+			quint32 nIPv4 = pEndpoint->toIPv4Address();
+			memcpy(oRoute.pAddress, &nIPv4, sizeof(nIPv4));
+		}
+		else
+		{
+			oRoute.nAddressType = RouteIPv6;
+			Q_IPV6ADDR oIPv6 = pEndpoint->toIPv6Address();
+			memcpy(oRoute.pAddress, &oIPv6, sizeof(oRoute.pAddress));
+		}
 	}
 
-	Q_ASSERT_X(m_lRoutes[pGUID]->pNeighbour != 0 || !m_lRoutes[pGUID]->pEndpoint.isNull(), Q_FUNC_INFO, "Whooops! No neighbour and no endpoint!");
+	Q_ASSERT_X(oRoute.pNeighbour != 0 || oRoute.nAddressType != RouteNoAddress, Q_FUNC_INFO, "Whooops! No neighbour and no endpoint!");
 
 	return true;
 
@@ -98,106 +208,171 @@ bool CRouteTable::add(QUuid& pGUID, CEndPoint& pEndpoint, bool bNoExpire)
 
 void CRouteTable::remove(QUuid& pGUID)
 {
-	G2RouteItem* pRoute = m_lRoutes.value(pGUID, 0);
-	if( pRoute )
+	if(!m_pSlots)
+	{
+		return;
+	}
+
+	quint32 nSlot = findSlot(pGUID, hashGUID(pGUID));
+	if(nSlot != NoIndex)
 	{
-		m_lRoutes.remove(pGUID);
-		delete pRoute;
+		removeItem(m_pSlots[nSlot].nItem, true);
 	}
 }
 void CRouteTable::remove(CG2Node* pNeighbour)
 {
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end();)
+	quint32 nItem = m_lNodeRoutes.take(pNeighbour);
+
+	if(!m_pSlots || nItem == 0)
 	{
-		if(itRoute.value()->pNeighbour == pNeighbour)
-		{
-			delete *itRoute;
-			itRoute = m_lRoutes.erase(itRoute);
-		}
-		else
-		{
-			itRoute++;
-		}
+		return;
 	}
+
+	for(nItem = nItem - 1; nItem != NoIndex;)
+	{
+		quint32 nNext = m_pItems[nItem].nNextNode;
+		removeItem(nItem, false);
+		nItem = nNext;
+	}
+}
+
+// Unlike find(), leaves the route's expiry alone
+bool CRouteTable::contains(const QUuid& oGUID) const
+{
+	return m_pSlots && findSlot(oGUID, hashGUID(oGUID)) != NoIndex;
 }
 
 bool CRouteTable::find(QUuid& pGUID, CG2Node** ppNeighbour, CEndPoint* pEndpoint)
 {
 	Q_ASSERT_X(ppNeighbour || pEndpoint, Q_FUNC_INFO, "Invalid arguments");
 
-	if(m_lRoutes.contains(pGUID))
+	if(!m_pSlots)
 	{
-		if(ppNeighbour)
+		return false;
+	}
+
+	quint32 nSlot = findSlot(pGUID, hashGUID(pGUID));
+
+	if(nSlot == NoIndex)
+	{
+		return false;
+	}
+
+	G2RouteItem& oRoute = m_pItems[m_pSlots[nSlot].nItem];
+
+	if(ppNeighbour)
+	{
+		*ppNeighbour = oRoute.pNeighbour;
+	}
+	if(pEndpoint)
+	{
+		if(oRoute.nAddressType == RouteIPv4)
 		{
-			*ppNeighbour = m_lRoutes[pGUID]->pNeighbour;
+			quint32 nIPv4;
+			memcpy(&nIPv4, oRoute.pAddress, sizeof(nIPv4));
+			*pEndpoint = CEndPoint(nIPv4, oRoute.nPort);
 		}
-		if(pEndpoint)
+		else if(oRoute.nAddressType == RouteIPv6)
 		{
-			*pEndpoint = m_lRoutes[pGUID]->pEndpoint;
+			*pEndpoint = CEndPoint(oRoute.pAddress, oRoute.nPort);
 		}
+		else
+		{
+			pEndpoint->clear();
+		}
+	}
 
-		Q_ASSERT_X(*ppNeighbour != 0 || !pEndpoint->isNull(), Q_FUNC_INFO, "Found GUID but no destination");
-
-		m_lRoutes[pGUID]->nExpireTime = time(0) + RouteExpire;
+	Q_ASSERT_X(oRoute.pNeighbour != 0 || oRoute.nAddressType != RouteNoAddress, Q_FUNC_INFO, "Found GUID but no destination");
 
-		return true;
+	// Neighbour routes added with bNoExpire stay until the neighbour goes away
+	if(oRoute.nExpireTime)
+	{
+		oRoute.nExpireTime = time(0) + RouteExpire;
 	}
 
-	return false;
+	return true;
 }
 
+// Advances the timing wheel to now. A route whose expiry was pushed back since it was linked
+// is moved to its new slot instead of being dropped.
 void CRouteTable::expireOldRoutes(bool bForce)
 {
-	quint32 tNow = time(0);
-
-	// First expired.
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end();)
+	if(!m_pSlots)
 	{
-		if(itRoute.value()->nExpireTime < tNow)
-		{
-			delete *itRoute;
-			itRoute = m_lRoutes.erase(itRoute);
-		}
-		else
-		{
-			itRoute++;
-		}
+		return;
 	}
 
-	// Now, we are forced to clean something
-	// only if the list is full at 75%
+	quint32 tNow = time(0);
+	quint32 nSeconds = qMin<quint32>(tNow - m_tWheel, WheelSize);
+#if LOG_ROUTE_TABLE
+	quint32 nRoutes = m_nRoutes;
+#endif
 
-	if(bForce && m_lRoutes.size() >= MaxRoutes * 0.75)
+	for(quint32 i = 1; i <= nSeconds; ++i)
 	{
-		qint32 tExpire = RouteExpire;
+		quint32 nWheel = (m_tWheel + i) % WheelSize;
+		quint32 nItem = m_pWheel[nWheel];
+		m_pWheel[nWheel] = NoIndex;
 
-		while(m_lRoutes.size() > MaxRoutes * 0.75)
+		while(nItem != NoIndex)
 		{
-			if( tExpire > 0 )
+			G2RouteItem& oRoute = m_pItems[nItem];
+			quint32 nNext = oRoute.nNextWheel;
+			oRoute.nWheel = NoIndex;
+
+			if(oRoute.nExpireTime == 0)
 			{
-				tExpire /= 2;
+				// no longer expires
 			}
-			else if( tExpire < 0 )
+			else if(oRoute.nExpireTime <= tNow)
 			{
-				tExpire *= 2;
+				removeItem(nItem, true);
 			}
 			else
 			{
-				tExpire = -10;
+				linkWheel(nItem);
 			}
 
-			// We reduce the hash to three quarters of its value.
-			for( QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end() && m_lRoutes.size() > MaxRoutes * 0.75; )
+			nItem = nNext;
+		}
+	}
+
+	m_tWheel = tNow;
+
+	// Now, we are forced to clean something
+	if(bForce && m_nRoutes >= m_nCapacity * 3 / 4)
+	{
+		evict();
+	}
+
+#if LOG_ROUTE_TABLE
+	if(m_nRoutes < nRoutes)
+	{
+		systemLog.postLog(LogSeverity::Debug, QString("Route table: %1 routes expired, %2 of %3 left, %4 KB, %5 bytes per route")
+						  .arg(nRoutes - m_nRoutes).arg(m_nRoutes).arg(m_nCapacity).arg(memoryUsage() / 1024).arg(m_nRoutes ? memoryUsage() / m_nRoutes : 0));
+	}
+#endif // LOG_ROUTE_TABLE
+}
+
+// Drops the routes closest to expiry until the table is three quarters full.
+// Routes without expiry (neighbours) are not in the wheel and stay.
+void CRouteTable::evict()
+{
+	for(quint32 i = 1; i <= WheelSize && m_nRoutes > m_nCapacity * 3 / 4; ++i)
+	{
+		quint32 nWheel = (m_tWheel + i) % WheelSize;
+
+		while(m_pWheel[nWheel] != NoIndex && m_nRoutes > m_nCapacity * 3 / 4)
+		{
+			quint32 nItem = m_pWheel[nWheel];
+
+			if(m_pItems[nItem].nExpireTime == 0)
+			{
+				unlinkWheel(nItem);
+			}
+			else
 			{
-				if( itRoute.value()->nExpireTime < tNow + tExpire )
-				{
-					delete *itRoute;
-					itRoute = m_lRoutes.erase(itRoute);
-				}
-				else
-				{
-					itRoute++;
-				}
+				removeItem(nItem, true);
 			}
 		}
 	}
@@ -205,8 +380,20 @@ void CRouteTable::expireOldRoutes(bool bForce)
 
 void CRouteTable::clear()
 {
-	qDeleteAll(m_lRoutes);
-	m_lRoutes.clear();
+	create();
+}
+
+quint32 CRouteTable::size() const
+{
+	return m_nRoutes;
+}
+
+quint64 CRouteTable::memoryUsage() const
+{
+	return quint64(m_nMask + 1) * sizeof(RouteSlot)
+		   + quint64(m_pItems.capacity()) * sizeof(G2RouteItem)
+		   + quint64(m_lNodeRoutes.size()) * (sizeof(CG2Node*) + sizeof(quint32) + 2 * sizeof(void*))
+		   + sizeof(m_pWheel);
 }
 
 void CRouteTable::dump()
@@ -216,21 +403,175 @@ void CRouteTable::dump()
 
 	systemLog.postLog(LogSeverity::Debug, "----------------------------------");
 	systemLog.postLog(LogSeverity::Debug, "Dumping routing table:");
-	systemLog.postLog(LogSeverity::Debug, QString("Table size: ").arg(m_lRoutes.size()));
+	systemLog.postLog(LogSeverity::Debug, QString("Table size: %1").arg(m_nRoutes));
 
-	for(QHash<QUuid, G2RouteItem*>::iterator itRoute = m_lRoutes.begin(); itRoute != m_lRoutes.end(); itRoute++)
+	for(quint32 nSlot = 0; m_pSlots && nSlot <= m_nMask; ++nSlot)
 	{
-		qint64 nExpire = itRoute.value()->nExpireTime - tNow;
-		if(itRoute.value()->nExpireTime == 0)
+		if(m_pSlots[nSlot].nItem == NoIndex)
+		{
+			continue;
+		}
+
+		const G2RouteItem& oRoute = m_pItems[m_pSlots[nSlot].nItem];
+		qint64 nExpire = oRoute.nExpireTime - tNow;
+		if(oRoute.nExpireTime == 0)
 		{
 			nExpire = 0;
 		}
+
+		CEndPoint oEndpoint;
+		if(oRoute.nAddressType == RouteIPv4)
+		{
+			quint32 nIPv4;
+			memcpy(&nIPv4, oRoute.pAddress, sizeof(nIPv4));
+			oEndpoint = CEndPoint(nIPv4, oRoute.nPort);
+		}
+		else if(oRoute.nAddressType == RouteIPv6)
+		{
+			oEndpoint = CEndPoint((quint8*)oRoute.pAddress, oRoute.nPort);
+		}
+
 		systemLog.postLog( LogSeverity::Debug, Components::G2, "%s %i %s TTL %i",
-						   qPrintable( itRoute.key().toString() ), itRoute.value()->pNeighbour,
-						   qPrintable( itRoute.value()->pEndpoint.toString() ), nExpire );
+						   qPrintable( oRoute.pGUID.toString() ), oRoute.pNeighbour,
+						   qPrintable( oEndpoint.toString() ), nExpire );
 	}
 
 	systemLog.postLog(LogSeverity::Debug, "End of data");
 	systemLog.postLog(LogSeverity::Debug, "----------------------------------");
 }
 
+quint32 CRouteTable::findSlot(const QUuid& oGUID, quint32 nHash) const
+{
+	for(quint32 nSlot = nHash & m_nMask; m_pSlots[nSlot].nItem != NoIndex; nSlot = (nSlot + 1) & m_nMask)
+	{
+		if(m_pSlots[nSlot].nHash == nHash && m_pItems[m_pSlots[nSlot].nItem].pGUID == oGUID)
+		{
+			return nSlot;
+		}
+	}
+
+	return NoIndex;
+}
+
+// Backward shift deletion: later entries of the probe run move up so no tombstones are needed
+void CRouteTable::eraseSlot(quint32 nSlot)
+{
+	quint32 nHole = nSlot;
+
+	for(quint32 nNext = (nSlot + 1) & m_nMask; m_pSlots[nNext].nItem != NoIndex; nNext = (nNext + 1) & m_nMask)
+	{
+		quint32 nHome = m_pSlots[nNext].nHash & m_nMask;
+
+		if(((nNext - nHome) & m_nMask) >= ((nNext - nHole) & m_nMask))
+		{
+			m_pSlots[nHole] = m_pSlots[nNext];
+			nHole = nNext;
+		}
+	}
+
+	m_pSlots[nHole].nItem = NoIndex;
+}
+
+void CRouteTable::removeItem(quint32 nItem, bool bUnlinkNode)
+{
+	G2RouteItem& oRoute = m_pItems[nItem];
+
+	eraseSlot(findSlot(oRoute.pGUID, oRoute.nHash));
+
+	if(bUnlinkNode)
+	{
+		unlinkNode(nItem);
+	}
+	unlinkWheel(nItem);
+
+	oRoute.pNeighbour = 0;
+	oRoute.nNextNode = m_nFreeItem;
+	m_nFreeItem = nItem;
+	m_nRoutes--;
+}
+
+// m_lNodeRoutes holds the first item + 1, so a missing neighbour reads as 0
+void CRouteTable::linkNode(quint32 nItem)
+{
+	G2RouteItem& oRoute = m_pItems[nItem];
+	quint32& nHead = m_lNodeRoutes[oRoute.pNeighbour];
+
+	oRoute.nPrevNode = NoIndex;
+	oRoute.nNextNode = nHead ? nHead - 1 : NoIndex;
+	if(nHead)
+	{
+		m_pItems[nHead - 1].nPrevNode = nItem;
+	}
+	nHead = nItem + 1;
+}
+
+void CRouteTable::unlinkNode(quint32 nItem)
+{
+	G2RouteItem& oRoute = m_pItems[nItem];
+
+	if(!oRoute.pNeighbour)
+	{
+		return;
+	}
+
+	if(oRoute.nNextNode != NoIndex)
+	{
+		m_pItems[oRoute.nNextNode].nPrevNode = oRoute.nPrevNode;
+	}
+
+	if(oRoute.nPrevNode != NoIndex)
+	{
+		m_pItems[oRoute.nPrevNode].nNextNode = oRoute.nNextNode;
+	}
+	else if(oRoute.nNextNode != NoIndex)
+	{
+		m_lNodeRoutes[oRoute.pNeighbour] = oRoute.nNextNode + 1;
+	}
+	else
+	{
+		m_lNodeRoutes.remove(oRoute.pNeighbour);
+	}
+
+	oRoute.nPrevNode = oRoute.nNextNode = NoIndex;
+}
+
+void CRouteTable::linkWheel(quint32 nItem)
+{
+	G2RouteItem& oRoute = m_pItems[nItem];
+	quint32 nWheel = oRoute.nExpireTime % WheelSize;
+
+	oRoute.nWheel = nWheel;
+	oRoute.nPrevWheel = NoIndex;
+	oRoute.nNextWheel = m_pWheel[nWheel];
+	if(m_pWheel[nWheel] != NoIndex)
+	{
+		m_pItems[m_pWheel[nWheel]].nPrevWheel = nItem;
+	}
+	m_pWheel[nWheel] = nItem;
+}
+
+void CRouteTable::unlinkWheel(quint32 nItem)
+{
+	G2RouteItem& oRoute = m_pItems[nItem];
+
+	if(oRoute.nWheel == NoIndex)
+	{
+		return;
+	}
+
+	if(oRoute.nNextWheel != NoIndex)
+	{
+		m_pItems[oRoute.nNextWheel].nPrevWheel = oRoute.nPrevWheel;
+	}
+
+	if(oRoute.nPrevWheel != NoIndex)
+	{
+		m_pItems[oRoute.nPrevWheel].nNextWheel = oRoute.nNextWheel;
+	}
+	else
+	{
+		m_pWheel[oRoute.nWheel] = oRoute.nNextWheel;
+	}
+
+	oRoute.nWheel = NoIndex;
+}
@@ -26,6 +26,7 @@
 
 #include "types.h"
 #include <QHash>
+#include <QVector>
 
 class CG2Node;
 
@@ -33,21 +34,47 @@ struct G2RouteItem
 {
 	QUuid           pGUID;
 	CG2Node*        pNeighbour;
-	CEndPoint	    pEndpoint;
-	quint32         nExpireTime;
-
-	G2RouteItem()
-	{
-		pNeighbour = 0;
-		nExpireTime = 0;
-	}
+	quint32         nExpireTime;		// 0 for routes that do not expire
+	quint32			nHash;
+	quint16			nPort;				// endpoint, if nAddressType is not RouteNoAddress
+	quint8			nAddressType;
+	quint8			pAddress[16];		// IPv4 address in the first 4 bytes, host order
 
+	// Links, as indices into CRouteTable::m_pItems
+	quint32			nPrevNode;			// routes through the same neighbour; nNextNode also links free items
+	quint32			nNextNode;
+	quint32			nPrevWheel;			// routes in the same timing wheel slot
+	quint32			nNextWheel;
+	quint32			nWheel;				// timing wheel slot, NoIndex if not in the wheel
 };
 
+// GUID routes in a flat open-addressing table. Items live in one array and are referenced
+// by index from the slots, from a timing wheel that expires them and from per-neighbour lists.
 class CRouteTable
 {
+public:
+	enum { NoIndex = 0xffffffff };
+	enum { RouteNoAddress, RouteIPv4, RouteIPv6 };
+	enum { WheelSize = 1024 };				// seconds, must exceed RouteExpire
+
 protected:
-	QHash<QUuid, G2RouteItem*>  m_lRoutes;
+	struct RouteSlot
+	{
+		quint32 nHash;
+		quint32 nItem;						// NoIndex for an empty slot
+	};
+
+	RouteSlot*				m_pSlots;		// linear probing, backward shift deletion
+	quint32					m_nMask;
+	QVector<G2RouteItem>	m_pItems;
+	quint32					m_nFreeItem;
+	quint32					m_nRoutes;
+	quint32					m_nCapacity;
+
+	QHash<CG2Node*, quint32>	m_lNodeRoutes;	// first route of each neighbour, plus one
+	quint32					m_pWheel[WheelSize];
+	quint32					m_tWheel;		// last second the wheel was advanced to
+
 public:
 	CRouteTable();
 	~CRouteTable();
@@ -60,13 +87,26 @@ public:
 	void remove(CG2Node* pNeighbour);
 
 	bool find(QUuid& pGUID, CG2Node** ppNeighbour = 0, CEndPoint* pEndpoint = 0);
+	bool contains(const QUuid& oGUID) const;
 
 	void expireOldRoutes(bool bForce = false);
 	void clear();
 
+	quint32 size() const;
+	quint64 memoryUsage() const;
 	void dump();
+
+protected:
+	void create();
+	quint32 findSlot(const QUuid& oGUID, quint32 nHash) const;
+	void eraseSlot(quint32 nSlot);
+	void removeItem(quint32 nItem, bool bUnlinkNode);
+	void linkNode(quint32 nItem);
+	void unlinkNode(quint32 nItem);
+	void linkWheel(quint32 nItem);
+	void unlinkWheel(quint32 nItem);
+	void evict();
 };
 
-const quint32 MaxRoutes = 50000;
 const quint32 RouteExpire = 600;
 #endif // ROUTETABLE_H
@@ -25,73 +25,349 @@
 #include "zlibutils.h"
 #include "zlib.h"
 
+#include "quazaasettings.h"
+
+#include <QThreadStorage>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <QList>
+
 #include "debug_new.h"
 
-QMutex ZLibUtils::m_oMutex;
-CBuffer ZLibUtils::m_oCompressBuffer(262144); // 256KB
+// Strings that show up in almost every G2 query, hit and host packet. Deflate favours matches
+// near the end of the dictionary, so the most frequent ones come last.
+static const char g_szG2Dictionary[] =
+	"CRAWLRCRAWLAKHLLNIHAWQHTPUSHUPROQKRQKAQAFWTSRANHNACSCBUPHGSSPCHUDPUSQKDNSZMDURLPARTCOMMENT"
+	"bitprint:urn:bitprint:ed2k:urn:ed2khash:md5:urn:md5:btih:urn:btih:tree:tiger/:urn:tree:tiger/:sha1:urn:sha1:"
+	"QH2GUVHURNQ2";
+
+class ZLibContext
+{
+public:
+	z_stream	m_sDeflate;
+	z_stream	m_sInflate;
+	bool		m_bDeflate;
+	bool		m_bInflate;
+	int			m_nLevel;		// level and memory level the deflate stream was set up with
+	int			m_nMemLevel;
+	CBuffer		m_oBuffer;		// output scratch, grows to the largest packet seen on this thread
+
+	ZLibContext();
+	~ZLibContext();
+
+	bool prepareDeflate(int nLevel, int nMemLevel);
+	bool prepareInflate();
+};
+
+// Counters of one thread, indexed by ZLibUtils::Direction. Only the owning thread adds to them,
+// statistics() reads them from any thread, so counting never waits for a lock.
+class ZLibCounters
+{
+public:
+	QAtomicInteger<quint64>	m_nIn[2];
+	QAtomicInteger<quint64>	m_nOut[2];
+	QAtomicInteger<quint64>	m_nTime[2];
+
+	ZLibCounters();
+	~ZLibCounters();
+};
+
+static QThreadStorage<ZLibContext*> g_oContexts;
+static QThreadStorage<ZLibCounters*> g_oCounters;
+static QMutex g_oStatsMutex;						// guards the two lists below, not taken to count
+static QList<ZLibCounters*> g_lCounters;			// of running threads
+static ZLibUtils::Stats g_pExited[2] = { { 0, 0, 0 }, { 0, 0, 0 } };	// of threads that have exited
+
+ZLibCounters::ZLibCounters()
+{
+	QMutexLocker l(&g_oStatsMutex);
+	g_lCounters.append(this);
+}
+
+ZLibCounters::~ZLibCounters()
+{
+	QMutexLocker l(&g_oStatsMutex);
+	g_lCounters.removeOne(this);
+
+	for(int i = 0; i < 2; ++i)
+	{
+		g_pExited[i].nIn += m_nIn[i].loadAcquire();
+		g_pExited[i].nOut += m_nOut[i].loadAcquire();
+		g_pExited[i].nTime += m_nTime[i].loadAcquire();
+	}
+}
+
+ZLibContext::ZLibContext()
+	: m_oBuffer(16384)
+{
+	memset(&m_sDeflate, 0, sizeof(z_stream));
+	memset(&m_sInflate, 0, sizeof(z_stream));
+	m_bDeflate = false;
+	m_bInflate = false;
+	m_nLevel = Z_DEFAULT_COMPRESSION;
+	m_nMemLevel = 8;
+}
+
+ZLibContext::~ZLibContext()
+{
+	if(m_bDeflate)
+	{
+		deflateEnd(&m_sDeflate);
+	}
+	if(m_bInflate)
+	{
+		inflateEnd(&m_sInflate);
+	}
+}
+
+// Streams are set up once per thread and only reset between buffers,
+// which saves the allocation compress() and uncompress() do on every call.
+bool ZLibContext::prepareDeflate(int nLevel, int nMemLevel)
+{
+	if(m_bDeflate && nMemLevel != m_nMemLevel)
+	{
+		deflateEnd(&m_sDeflate);
+		m_bDeflate = false;
+	}
+
+	if(!m_bDeflate)
+	{
+		if(deflateInit2(&m_sDeflate, nLevel, Z_DEFLATED, MAX_WBITS, nMemLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return false;
+		}
+		m_bDeflate = true;
+		m_nLevel = nLevel;
+		m_nMemLevel = nMemLevel;
+		return true;
+	}
+
+	if(deflateReset(&m_sDeflate) != Z_OK)
+	{
+		return false;
+	}
+
+	if(nLevel != m_nLevel)
+	{
+		if(deflateParams(&m_sDeflate, nLevel, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return false;
+		}
+		m_nLevel = nLevel;
+	}
+
+	return true;
+}
+
+bool ZLibContext::prepareInflate()
+{
+	if(!m_bInflate)
+	{
+		if(inflateInit(&m_sInflate) != Z_OK)
+		{
+			return false;
+		}
+		m_bInflate = true;
+		return true;
+	}
+
+	return (inflateReset(&m_sInflate) == Z_OK);
+}
+
+ZLibContext* ZLibUtils::context()
+{
+	if(!g_oContexts.hasLocalData())
+	{
+		g_oContexts.setLocalData(new ZLibContext());
+	}
+
+	return g_oContexts.localData();
+}
 
-bool ZLibUtils::compressBuffer(CBuffer& pSrc, bool bIfSmaller)
+QByteArray ZLibUtils::dictionary()
 {
-	QMutexLocker l(&ZLibUtils::m_oMutex);
+	return QByteArray::fromRawData(g_szG2Dictionary, sizeof(g_szG2Dictionary) - 1);
+}
 
+bool ZLibUtils::compressBuffer(CBuffer& pSrc, bool bIfSmaller, Link eLink)
+{
 	if(bIfSmaller && pSrc.size() < 64)
 	{
 		return false;
 	}
 
-	ulong nCompress = qMax(ZLibUtils::m_oCompressBuffer.size(), pSrc.size() * 2);
+	int nLevel, nMemLevel;
+	bool bDictionary = false;
+
+	if(eLink == LinkDatagram)
+	{
+		nLevel = quazaaSettings.Gnutella2.UdpDeflateLevel;
+		nMemLevel = quazaaSettings.Gnutella2.UdpDeflateMemLevel;
+		bDictionary = quazaaSettings.Gnutella2.UdpDictionary;
+	}
+	else
+	{
+		nLevel = quazaaSettings.Gnutella2.TcpDeflateLevel;
+		nMemLevel = quazaaSettings.Gnutella2.TcpDeflateMemLevel;
+	}
+
+	nLevel = qBound(-1, nLevel, 9);
+	nMemLevel = qBound(1, nMemLevel, 9);
+
+	ZLibContext* pContext = context();
+
+	QElapsedTimer tTime;
+	tTime.start();
+
+	if(!pContext->prepareDeflate(nLevel, nMemLevel))
+	{
+		return false;
+	}
+
+	if(bDictionary && deflateSetDictionary(&pContext->m_sDeflate, (const Bytef*)g_szG2Dictionary, sizeof(g_szG2Dictionary) - 1) != Z_OK)
+	{
+		return false;
+	}
 
-	ZLibUtils::m_oCompressBuffer.resize(nCompress);
+	CBuffer& oOut = pContext->m_oBuffer;
+	oOut.clear();
+	oOut.resize(deflateBound(&pContext->m_sDeflate, pSrc.size()));
 
-	int nRet = ::compress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (const Bytef*)pSrc.data(), pSrc.size());
+	pContext->m_sDeflate.next_in = (Bytef*)pSrc.data();
+	pContext->m_sDeflate.avail_in = pSrc.size();
+	pContext->m_sDeflate.next_out = (Bytef*)oOut.data();
+	pContext->m_sDeflate.avail_out = oOut.size();
 
-	if(nRet != Z_OK)
+	int nRet = deflate(&pContext->m_sDeflate, Z_FINISH);
+
+	if(nRet != Z_STREAM_END)
 	{
 		Q_ASSERT(nRet != Z_BUF_ERROR);
 		return false;
 	}
 
-	ZLibUtils::m_oCompressBuffer.resize(nCompress);
+	oOut.resize(pContext->m_sDeflate.total_out);
+
+	count(Compress, pSrc.size(), oOut.size(), tTime.nsecsElapsed());
 
-	if(bIfSmaller && ZLibUtils::m_oCompressBuffer.size() > pSrc.size())
+	if(bIfSmaller && oOut.size() > pSrc.size())
 	{
 		return false;
 	}
 
 	pSrc.clear();
-	pSrc.append(ZLibUtils::m_oCompressBuffer);
+	pSrc.append(oOut);
 
 	return true;
 }
 
 bool ZLibUtils::uncompressBuffer(CBuffer& pSrc)
 {
-	QMutexLocker l(&ZLibUtils::m_oMutex);
+	ZLibContext* pContext = context();
 
-	for(ulong nSize = qMax(pSrc.size() * 6u, 1024u); ; nSize *= 2)
+	QElapsedTimer tTime;
+	tTime.start();
+
+	if(!pContext->prepareInflate())
 	{
-		ZLibUtils::m_oCompressBuffer.resize(nSize);
+		return false;
+	}
 
-		ulong nCompress = ZLibUtils::m_oCompressBuffer.size();
+	z_stream& sInflate = pContext->m_sInflate;
+	CBuffer& oOut = pContext->m_oBuffer;
+	oOut.clear();
+	oOut.resize(qMax(pSrc.size() * 6u, 1024u));
 
-		int nRet = ::uncompress((Bytef*)ZLibUtils::m_oCompressBuffer.data(), &nCompress, (Bytef*)pSrc.data(), pSrc.size());
+	sInflate.next_in = (Bytef*)pSrc.data();
+	sInflate.avail_in = pSrc.size();
+	sInflate.next_out = (Bytef*)oOut.data();
+	sInflate.avail_out = oOut.size();
 
-		if(nRet == Z_OK)
-		{
-			ZLibUtils::m_oCompressBuffer.resize(nCompress);
-			pSrc.clear();
-			pSrc.append(ZLibUtils::m_oCompressBuffer);
+	forever
+	{
+		int nRet = inflate(&sInflate, Z_NO_FLUSH);
 
+		if(nRet == Z_STREAM_END)
+		{
 			break;
 		}
 
-		if(nRet != Z_BUF_ERROR)
+		if(nRet == Z_NEED_DICT)
+		{
+			// Only our own preset dictionary is known
+			if(sInflate.adler != adler32(adler32(0L, Z_NULL, 0), (const Bytef*)g_szG2Dictionary, sizeof(g_szG2Dictionary) - 1)
+			   || inflateSetDictionary(&sInflate, (const Bytef*)g_szG2Dictionary, sizeof(g_szG2Dictionary) - 1) != Z_OK)
+			{
+				return false;
+			}
+			continue;
+		}
+
+		if(nRet != Z_OK && nRet != Z_BUF_ERROR)
 		{
 			return false;
 		}
+
+		if(sInflate.avail_out == 0)
+		{
+			if(oOut.size() >= 0x4000000)
+			{
+				return false; // 64 MB is more than any G2 packet or hash table
+			}
+
+			// Out of room, double the output and carry on where inflate stopped
+			quint32 nDone = sInflate.total_out;
+			oOut.resize(oOut.size() * 2);
+			sInflate.next_out = (Bytef*)oOut.data() + nDone;
+			sInflate.avail_out = oOut.size() - nDone;
+		}
+		else if(sInflate.avail_in == 0)
+		{
+			return false; // truncated stream
+		}
 	}
 
+	oOut.resize(sInflate.total_out);
+
+	count(Uncompress, pSrc.size(), oOut.size(), tTime.nsecsElapsed());
+
+	pSrc.clear();
+	pSrc.append(oOut);
+
 	return true;
+}
+
+// Any thread, adds to the calling thread's own counters.
+void ZLibUtils::count(Direction eDirection, quint64 nIn, quint64 nOut, quint64 nTime)
+{
+	if(!g_oCounters.hasLocalData())
+	{
+		g_oCounters.setLocalData(new ZLibCounters());
+	}
 
+	ZLibCounters* pCounters = g_oCounters.localData();
+	pCounters->m_nIn[eDirection].fetchAndAddRelaxed(nIn);
+	pCounters->m_nOut[eDirection].fetchAndAddRelaxed(nOut);
+	pCounters->m_nTime[eDirection].fetchAndAddRelaxed(nTime);
 }
 
+// Totals so far, from all threads.
+void ZLibUtils::statistics(Stats& oCompress, Stats& oUncompress)
+{
+	QMutexLocker l(&g_oStatsMutex);
+
+	Stats pTotals[2] = { g_pExited[0], g_pExited[1] };
+
+	foreach(ZLibCounters* pCounters, g_lCounters)
+	{
+		for(int i = 0; i < 2; ++i)
+		{
+			pTotals[i].nIn += pCounters->m_nIn[i].loadAcquire();
+			pTotals[i].nOut += pCounters->m_nOut[i].loadAcquire();
+			pTotals[i].nTime += pCounters->m_nTime[i].loadAcquire();
+		}
+	}
+
+	oCompress = pTotals[Compress];
+	oUncompress = pTotals[Uncompress];
+}
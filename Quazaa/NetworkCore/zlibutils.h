@@ -29,15 +29,45 @@
 #include <QMutex>
 #include <QMutexLocker>
 
+class ZLibContext;
+
 class ZLibUtils
 {
 public:
+	// Compression settings are picked per link type
+	enum Link
+	{
+		LinkDatagram,	// G2 UDP packets
+		LinkStream		// data sent over TCP, query hash tables
+	};
+
+	enum Direction
+	{
+		Compress,
+		Uncompress
+	};
 
-	static QMutex m_oMutex;
-	static CBuffer m_oCompressBuffer;
+	struct Stats
+	{
+		quint64 nIn;		// bytes given to zlib
+		quint64 nOut;		// bytes produced
+		quint64 nTime;		// nanoseconds spent in zlib
+	};
 
-	static bool compressBuffer(CBuffer& pSrc, bool bIfSmaller = false);
+	// Compression and decompression run on a context owned by the calling thread, no locking involved.
+	static bool compressBuffer(CBuffer& pSrc, bool bIfSmaller = false, Link eLink = LinkDatagram);
 	static bool uncompressBuffer(CBuffer& pSrc);
+
+	static QByteArray dictionary();
+
+	// Process wide totals, also fed by the TCP streams of CCompressedConnection.
+	static void count(Direction eDirection, quint64 nIn, quint64 nOut, quint64 nTime);
+	static void statistics(Stats& oCompress, Stats& oUncompress);
+
+protected:
+	static ZLibContext* context();
+
+	friend class ZLibContext;
 };
 
 #endif // ZLIBUTILS_H
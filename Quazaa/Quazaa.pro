@@ -256,6 +256,7 @@ HEADERS += \
 		Metalink/magnetlink.h \
 		Metalink/metalinkhandler.h \
 		Metalink/metalink4handler.h \
+		Misc/epochreclaimer.h \
 		Misc/fileiconprovider.h \
 		Misc/networkiconprovider.h \
 		Misc/timedsignalqueue.h \
@@ -270,7 +271,10 @@ HEADERS += \
 		Models/sharesnavigatortreemodel.h \
 		NetworkCore/buffer.h \
 		NetworkCore/compressedconnection.h \
+		NetworkCore/datagrambatch.h \
 		NetworkCore/datagramfrags.h \
+		NetworkCore/datagrampacer.h \
+		NetworkCore/datagramqueue.h \
 		NetworkCore/datagrams.h \
 		NetworkCore/endpoint.h \
 		NetworkCore/g2node.h \
@@ -290,11 +294,15 @@ HEADERS += \
 		NetworkCore/networkconnection.h \
 		NetworkCore/parser.h \
 		NetworkCore/query.h \
+		NetworkCore/queryfilter.h \
 		NetworkCore/queryhashgroup.h \
+		NetworkCore/queryhashindex.h \
+		NetworkCore/queryhashkernels.h \
 		NetworkCore/queryhashmaster.h \
 		NetworkCore/queryhashtable.h \
 		NetworkCore/queryhit.h \
 		NetworkCore/querykeys.h \
+		NetworkCore/queryrouter.h \
 		NetworkCore/ratecontroller.h \
 		NetworkCore/routetable.h \
 		NetworkCore/searchmanager.h \
@@ -387,6 +395,8 @@ HEADERS += \
 		UI/dialogirccolordialog.h \
 		UI/wizardircconnection.h \
 		Models/ircuserlistmodel.h \
+		Security/blocklistparser.h \
+		Security/ipfilter.h \
 		Security/iprule.h \
 		Security/iprangerule.h \
 		Security/hashrule.h \
@@ -435,7 +445,10 @@ SOURCES += \
 		Models/sharesnavigatortreemodel.cpp \
 		NetworkCore/buffer.cpp \
 		NetworkCore/compressedconnection.cpp \
+		NetworkCore/datagrambatch.cpp \
 		NetworkCore/datagramfrags.cpp \
+		NetworkCore/datagrampacer.cpp \
+		NetworkCore/datagramqueue.cpp \
 		NetworkCore/datagrams.cpp \
 		NetworkCore/endpoint.cpp \
 		NetworkCore/g2node.cpp \
@@ -455,11 +468,15 @@ SOURCES += \
 		NetworkCore/networkconnection.cpp \
 		NetworkCore/parser.cpp \
 		NetworkCore/query.cpp \
+		NetworkCore/queryfilter.cpp \
 		NetworkCore/queryhashgroup.cpp \
+		NetworkCore/queryhashindex.cpp \
+		NetworkCore/queryhashkernels.cpp \
 		NetworkCore/queryhashmaster.cpp \
 		NetworkCore/queryhashtable.cpp \
 		NetworkCore/queryhit.cpp \
 		NetworkCore/querykeys.cpp \
+		NetworkCore/queryrouter.cpp \
 		NetworkCore/ratecontroller.cpp \
 		NetworkCore/routetable.cpp \
 		NetworkCore/searchmanager.cpp \
@@ -550,6 +567,8 @@ SOURCES += \
 		UI/dialogirccolordialog.cpp \
 		UI/wizardircconnection.cpp \
 		Models/ircuserlistmodel.cpp \
+		Security/blocklistparser.cpp \
+		Security/ipfilter.cpp \
 		Security/iprule.cpp \
 		Security/iprangerule.cpp \
 		Security/hashrule.cpp \
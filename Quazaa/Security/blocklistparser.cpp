@@ -0,0 +1,187 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of the Quazaa Security Library (quazaa.sourceforge.net)
+**
+** The Quazaa Security Library is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** The Quazaa Security Library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with the Quazaa Security Library; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <algorithm>
+#include <string.h>
+
+#include "blocklistparser.h"
+
+#include "debug_new.h"
+
+CBlocklistParser::CBlocklistParser(const char* pFile, const char* pBegin, const char* pEnd,
+								   QAtomicInt* pProgress) :
+	m_nInvalid( 0 ),
+	m_pFile( pFile ),
+	m_pBegin( pBegin ),
+	m_pEnd( pEnd ),
+	m_pProgress( pProgress )
+{
+}
+
+void CBlocklistParser::run()
+{
+	const char* pLine = m_pBegin;
+	const char* pReported = m_pBegin;
+
+	m_lRanges.reserve( int( ( m_pEnd - m_pBegin ) / 48 ) );	// a typical line
+
+	while ( pLine < m_pEnd )
+	{
+		const char* pNext = (const char*)memchr( pLine, '\n', m_pEnd - pLine );
+		if ( !pNext )
+			pNext = m_pEnd;
+
+		if ( !parseLine( pLine, pNext ) )
+			++m_nInvalid;
+
+		pLine = pNext + 1;
+
+		if ( pLine - pReported >= ProgressStep )
+		{
+			m_pProgress->fetchAndAddRelaxed( int( pLine - pReported ) );
+			pReported = pLine;
+		}
+	}
+
+	if ( m_pEnd > pReported )
+		m_pProgress->fetchAndAddRelaxed( int( m_pEnd - pReported ) );
+
+	std::sort( m_lRanges.begin(), m_lRanges.end(), lessThan );
+	merge( m_lRanges );
+}
+
+/**
+  * Parses one line. Returns false for lines that are neither empty, a comment nor a valid range.
+  */
+bool CBlocklistParser::parseLine(const char* pLine, const char* pEnd)
+{
+	while ( pEnd > pLine && ( pEnd[-1] == '\r' || pEnd[-1] == ' ' || pEnd[-1] == '\t' ) )
+		--pEnd;
+
+	if ( pLine == pEnd || *pLine == '#' )
+		return true;
+
+	// The comment may contain colons itself
+	const char* pColon = pEnd;
+	while ( pColon > pLine && pColon[-1] != ':' )
+		--pColon;
+
+	if ( pColon == pLine )
+		return false;
+
+	CBlocklistRange oRange;
+	oRange.nComment = quint32( pLine - m_pFile );
+	oRange.nCommentLength = quint32( pColon - 1 - pLine );
+
+	const char* pPos = pColon;
+
+	while ( pPos < pEnd && *pPos == ' ' )
+		++pPos;
+
+	if ( !parseIPv4( pPos, pEnd, oRange.nStart ) )
+		return false;
+
+	while ( pPos < pEnd && *pPos == ' ' )
+		++pPos;
+
+	if ( pPos == pEnd || *pPos != '-' )
+		return false;
+	++pPos;
+
+	while ( pPos < pEnd && *pPos == ' ' )
+		++pPos;
+
+	if ( !parseIPv4( pPos, pEnd, oRange.nEnd ) || pPos != pEnd || oRange.nEnd < oRange.nStart )
+		return false;
+
+	m_lRanges.append( oRange );
+	return true;
+}
+
+/**
+  * Reads a dotted quad, leading zeros allowed, and advances pPos past it.
+  */
+bool CBlocklistParser::parseIPv4(const char*& pPos, const char* pEnd, quint32& nIP)
+{
+	nIP = 0;
+
+	for ( int nPart = 0; nPart < 4; ++nPart )
+	{
+		if ( nPart )
+		{
+			if ( pPos == pEnd || *pPos != '.' )
+				return false;
+			++pPos;
+		}
+
+		quint32 nValue = 0;
+		int nDigits = 0;
+
+		while ( pPos < pEnd && *pPos >= '0' && *pPos <= '9' && nDigits < 3 )
+		{
+			nValue = nValue * 10 + ( *pPos - '0' );
+			++pPos;
+			++nDigits;
+		}
+
+		if ( !nDigits || nValue > 255 )
+			return false;
+
+		nIP = ( nIP << 8 ) | nValue;
+	}
+
+	return true;
+}
+
+/**
+  * Merges overlapping ranges of a sorted list. A merged range keeps the comment of its first part.
+  */
+void CBlocklistParser::merge(QVector<CBlocklistRange>& lRanges)
+{
+	if ( lRanges.isEmpty() )
+		return;
+
+	CBlocklistRange* pRanges = lRanges.data();
+	int nLast = 0;
+
+	for ( int i = 1; i < lRanges.size(); ++i )
+	{
+		if ( pRanges[i].nStart <= pRanges[nLast].nEnd )
+		{
+			if ( pRanges[i].nEnd > pRanges[nLast].nEnd )
+				pRanges[nLast].nEnd = pRanges[i].nEnd;
+		}
+		else
+		{
+			pRanges[++nLast] = pRanges[i];
+		}
+	}
+
+	lRanges.resize( nLast + 1 );
+}
+
+bool CBlocklistParser::lessThan(const CBlocklistRange& oRange1, const CBlocklistRange& oRange2)
+{
+	return oRange1.nStart < oRange2.nStart;
+}
@@ -0,0 +1,71 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of the Quazaa Security Library (quazaa.sourceforge.net)
+**
+** The Quazaa Security Library is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** The Quazaa Security Library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with the Quazaa Security Library; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef BLOCKLISTPARSER_H
+#define BLOCKLISTPARSER_H
+
+#include <QAtomicInt>
+#include <QThread>
+#include <QVector>
+
+// An IPv4 range read from a blocklist, nStart to nEnd inclusive. The comment is not copied, it is
+// referenced by its offset in the file.
+struct CBlocklistRange
+{
+	quint32	nStart;
+	quint32	nEnd;
+	quint32	nComment;
+	quint32	nCommentLength;
+};
+
+// Parses a part of a P2P format blocklist ("comment:1.2.3.0-1.2.3.255" per line) straight from the
+// mapped file, then sorts its ranges and merges overlapping ones. CSecurity::fromP2P() runs one per
+// core on consecutive parts of the file.
+class CBlocklistParser : public QThread
+{
+public:
+	enum { MinPartSize = 1 << 20, ProgressStep = 1 << 16 };
+
+	QVector<CBlocklistRange>	m_lRanges;		// sorted by nStart, not overlapping
+	quint32						m_nInvalid;		// lines that could not be parsed
+
+protected:
+	const char*		m_pFile;		// comment offsets are relative to this
+	const char*		m_pBegin;
+	const char*		m_pEnd;
+	QAtomicInt*		m_pProgress;	// bytes parsed by all parsers of the file
+
+public:
+	CBlocklistParser(const char* pFile, const char* pBegin, const char* pEnd, QAtomicInt* pProgress);
+
+	static void merge(QVector<CBlocklistRange>& lRanges);
+	static bool lessThan(const CBlocklistRange& oRange1, const CBlocklistRange& oRange2);
+
+protected:
+	void run();
+	bool parseLine(const char* pLine, const char* pEnd);
+	static bool parseIPv4(const char*& pPos, const char* pEnd, quint32& nIP);
+};
+
+#endif // BLOCKLISTPARSER_H
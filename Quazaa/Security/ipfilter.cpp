@@ -0,0 +1,357 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of the Quazaa Security Library (quazaa.sourceforge.net)
+**
+** The Quazaa Security Library is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** The Quazaa Security Library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with the Quazaa Security Library; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <algorithm>
+
+#include "ipfilter.h"
+#include "iprangerule.h"
+#include "iprule.h"
+
+#include "debug_new.h"
+
+// Local, private and reserved IPv4 ranges, sorted by start address.
+static const quint32 s_pPrivate4[][2] =
+{
+	{ 0x00000000, 0x00FFFFFF },	// 0.0.0.0/8
+	{ 0x0A000000, 0x0AFFFFFF },	// 10.0.0.0/8
+	{ 0x64400000, 0x647FFFFF },	// 100.64.0.0/10
+	{ 0x7F000000, 0x7FFFFFFF },	// 127.0.0.0/8
+	{ 0xA9FE0000, 0xA9FEFFFF },	// 169.254.0.0/16
+	{ 0xAC100000, 0xAC1FFFFF },	// 172.16.0.0/12
+	{ 0xC0000000, 0xC00000FF },	// 192.0.0.0/24
+	{ 0xC0000200, 0xC00002FF },	// 192.0.2.0/24
+	{ 0xC0A80000, 0xC0A8FFFF },	// 192.168.0.0/16
+	{ 0xC6120000, 0xC613FFFF },	// 198.18.0.0/15
+	{ 0xC6336400, 0xC63364FF },	// 198.51.100.0/24
+	{ 0xCB007100, 0xCB0071FF },	// 203.0.113.0/24
+	{ 0xF0000000, 0xFFFFFFFF }	// 240.0.0.0 - 255.255.255.255
+};
+
+template <typename T>
+static bool entryLessThan(const CIPFilterEntry<T>& oEntry1, const CIPFilterEntry<T>& oEntry2)
+{
+	return oEntry1.nStart < oEntry2.nStart;
+}
+
+// Flattens the intervals of range and single IP rules into lEntries. Like CSecurity used to check
+// them, range rules take precedence over single IP rules; where ranges overlap, the one starting
+// first wins.
+template <typename T>
+static void compileEntries(QVector< CIPFilterEntry<T> >& lRanges, QVector< CIPFilterEntry<T> >& lSingles,
+						   QVector< CIPFilterEntry<T> >& lEntries)
+{
+	std::stable_sort( lRanges.begin(), lRanges.end(), entryLessThan<T> );
+	std::stable_sort( lSingles.begin(), lSingles.end(), entryLessThan<T> );
+
+	QVector< CIPFilterEntry<T> > lClipped;
+	lClipped.reserve( lRanges.size() );
+
+	for ( int i = 0; i < lRanges.size(); ++i )
+	{
+		CIPFilterEntry<T> oEntry = lRanges.at( i );
+
+		if ( !lClipped.isEmpty() )
+		{
+			const T nLast = lClipped.last().nEnd;
+
+			if ( oEntry.nEnd <= nLast )
+				continue;
+
+			if ( oEntry.nStart <= nLast )
+			{
+				oEntry.nStart = nLast;
+				++oEntry.nStart;
+			}
+		}
+
+		lClipped.append( oEntry );
+	}
+
+	lEntries.clear();
+	lEntries.reserve( lClipped.size() + lSingles.size() );
+
+	int nRange = 0;
+	for ( int i = 0; i < lSingles.size(); ++i )
+	{
+		const CIPFilterEntry<T>& oSingle = lSingles.at( i );
+
+		while ( nRange < lClipped.size() && lClipped.at( nRange ).nStart <= oSingle.nStart )
+		{
+			lEntries.append( lClipped.at( nRange ) );
+			++nRange;
+		}
+
+		// Covered by a range or a duplicate of the previous single IP rule
+		if ( !lEntries.isEmpty() && oSingle.nStart <= lEntries.last().nEnd )
+			continue;
+
+		lEntries.append( oSingle );
+	}
+
+	while ( nRange < lClipped.size() )
+	{
+		lEntries.append( lClipped.at( nRange ) );
+		++nRange;
+	}
+}
+
+CIPFilter::CIPFilter() :
+	m_nRetired( 0 )
+{
+}
+
+/**
+  * Compiles the rules of the given lists. The lists need not be sorted.
+  * Requires Locking: R
+  */
+void CIPFilter::compile(const QList<CIPRangeRule*>& lRanges, const QList<CIPRule*>& lIPs)
+{
+	QVector<Entry4> lRanges4, lSingles4;
+	QVector<Entry6> lRanges6, lSingles6;
+	Entry4 oEntry4;
+	Entry6 oEntry6;
+	quint32 nEnd4;
+	CIPv6Key oEnd6;
+
+	lRanges4.reserve( lRanges.size() );
+	lSingles4.reserve( lIPs.size() );
+
+	foreach ( CIPRangeRule* pRule, lRanges )
+	{
+		const CEndPoint oStart = pRule->startIP();
+		const CEndPoint oEnd = pRule->endIP();
+
+		if ( oStart.isNull() || oEnd.isNull() )
+			continue;
+
+		const bool bIPv4 = toKey( oStart, oEntry4.nStart, oEntry6.nStart );
+
+		// A range from an IPv4 to an IPv6 address matches nothing
+		if ( bIPv4 != toKey( oEnd, nEnd4, oEnd6 ) )
+			continue;
+
+		if ( bIPv4 )
+		{
+			if ( nEnd4 < oEntry4.nStart )
+				continue;
+
+			oEntry4.nEnd = nEnd4;
+			oEntry4.oRule.pRule = pRule;
+			oEntry4.oRule.nAction = action( pRule );
+			lRanges4.append( oEntry4 );
+		}
+		else
+		{
+			if ( oEnd6 < oEntry6.nStart )
+				continue;
+
+			oEntry6.nEnd = oEnd6;
+			oEntry6.oRule.pRule = pRule;
+			oEntry6.oRule.nAction = action( pRule );
+			lRanges6.append( oEntry6 );
+		}
+	}
+
+	foreach ( CIPRule* pRule, lIPs )
+	{
+		const CEndPoint oIP = pRule->IP();
+
+		if ( oIP.isNull() )
+			continue;
+
+		if ( toKey( oIP, oEntry4.nStart, oEntry6.nStart ) )
+		{
+			oEntry4.nEnd = oEntry4.nStart;
+			oEntry4.oRule.pRule = pRule;
+			oEntry4.oRule.nAction = action( pRule );
+			lSingles4.append( oEntry4 );
+		}
+		else
+		{
+			oEntry6.nEnd = oEntry6.nStart;
+			oEntry6.oRule.pRule = pRule;
+			oEntry6.oRule.nAction = action( pRule );
+			lSingles6.append( oEntry6 );
+		}
+	}
+
+	compileEntries( lRanges4, lSingles4, m_lEntries4 );
+	compileEntries( lRanges6, lSingles6, m_lEntries6 );
+
+	m_lIndex4.clear();
+
+	if ( m_lEntries4.isEmpty() )
+		return;
+
+	const quint32 nPrefixes = 1 << IndexBits;
+	m_lIndex4.resize( nPrefixes + 1 );
+
+	int nEntry = 0;
+	for ( quint32 nPrefix = 0; nPrefix < nPrefixes; ++nPrefix )
+	{
+		while ( nEntry < m_lEntries4.size() && ( m_lEntries4.at( nEntry ).nStart >> IndexShift ) < nPrefix )
+			++nEntry;
+
+		m_lIndex4[nPrefix] = nEntry;
+	}
+	m_lIndex4[nPrefixes] = m_lEntries4.size();
+}
+
+/**
+  * Returns the rule matching nIP, or NULL.
+  * Locking: /
+  */
+const CIPFilterRule* CIPFilter::find(quint32 nIP) const
+{
+	if ( m_lEntries4.isEmpty() )
+		return NULL;
+
+	// Only entries starting within the /16 of nIP, and the last one starting before it, can match.
+	const quint32 nPrefix = nIP >> IndexShift;
+	quint32 nBegin = m_lIndex4.at( nPrefix );
+	quint32 nEnd   = m_lIndex4.at( nPrefix + 1 );
+
+	while ( nBegin < nEnd )
+	{
+		const quint32 nMiddle = ( nBegin + nEnd ) >> 1;
+
+		if ( m_lEntries4.at( nMiddle ).nStart <= nIP )
+			nBegin = nMiddle + 1;
+		else
+			nEnd = nMiddle;
+	}
+
+	if ( !nBegin )
+		return NULL;
+
+	const Entry4& oEntry = m_lEntries4.at( nBegin - 1 );
+	return nIP <= oEntry.nEnd ? &oEntry.oRule : NULL;
+}
+
+/**
+  * Returns the rule matching oIP, or NULL.
+  * Locking: /
+  */
+const CIPFilterRule* CIPFilter::find(const CIPv6Key& oIP) const
+{
+	int nBegin = 0;
+	int nEnd = m_lEntries6.size();
+
+	while ( nBegin < nEnd )
+	{
+		const int nMiddle = ( nBegin + nEnd ) >> 1;
+
+		if ( m_lEntries6.at( nMiddle ).nStart <= oIP )
+			nBegin = nMiddle + 1;
+		else
+			nEnd = nMiddle;
+	}
+
+	if ( !nBegin )
+		return NULL;
+
+	const Entry6& oEntry = m_lEntries6.at( nBegin - 1 );
+	return oIP <= oEntry.nEnd ? &oEntry.oRule : NULL;
+}
+
+/**
+  * Returns the action the filter may take for pRule on its own. Single IP rules that expire or are
+  * extended on each hit (automatic bans) return RuleAction::None.
+  * Requires Locking: R
+  */
+quint8 CIPFilter::action(const CSecureRule* pRule)
+{
+	if ( pRule->type() == RuleType::IPAddress &&
+		 ( pRule->m_bAutomatic || pRule->getExpiryTime() != (quint32)RuleTime::Special ) )
+	{
+		return RuleAction::None;
+	}
+
+	return pRule->m_nAction;
+}
+
+/**
+  * Converts oAddress to a number. IPv4 mapped IPv6 addresses are treated as IPv4 addresses.
+  * Locking: /
+  */
+bool CIPFilter::toKey(const CEndPoint& oAddress, quint32& nIPv4, CIPv6Key& oIPv6)
+{
+	if ( oAddress.protocol() == QAbstractSocket::IPv4Protocol )
+	{
+		nIPv4 = oAddress.toIPv4Address();
+		return true;
+	}
+
+	const Q_IPV6ADDR oAddress6 = oAddress.toIPv6Address();
+
+	oIPv6.nHigh = 0;
+	oIPv6.nLow = 0;
+	for ( int i = 0; i < 8; ++i )
+	{
+		oIPv6.nHigh = ( oIPv6.nHigh << 8 ) | oAddress6[i];
+		oIPv6.nLow  = ( oIPv6.nLow  << 8 ) | oAddress6[i + 8];
+	}
+
+	if ( !oIPv6.nHigh && ( oIPv6.nLow >> 32 ) == 0xFFFF )
+	{
+		nIPv4 = quint32( oIPv6.nLow );
+		return true;
+	}
+
+	return false;
+}
+
+/**
+  * Returns true for local, private and reserved addresses.
+  * Locking: /
+  */
+bool CIPFilter::isPrivate(const CEndPoint& oAddress)
+{
+	quint32 nIPv4;
+	CIPv6Key oIPv6;
+
+	if ( toKey( oAddress, nIPv4, oIPv6 ) )
+		return isPrivate( nIPv4 );
+
+	return isPrivate( oIPv6 );
+}
+
+bool CIPFilter::isPrivate(quint32 nIPv4)
+{
+	for ( uint i = 0; i < sizeof( s_pPrivate4 ) / sizeof( s_pPrivate4[0] ) && s_pPrivate4[i][0] <= nIPv4; ++i )
+	{
+		if ( nIPv4 <= s_pPrivate4[i][1] )
+			return true;
+	}
+
+	return false;
+}
+
+bool CIPFilter::isPrivate(const CIPv6Key& oIPv6)
+{
+	return ( !oIPv6.nHigh && ( oIPv6.nLow >> 32 ) < 0xFFFF ) ||	// unspecified, loopback, IPv4 compatible
+		   ( oIPv6.nHigh >> 57 ) == 0x7E ||							// fc00::/7 unique local
+		   ( oIPv6.nHigh >> 54 ) == 0x3FA ||						// fe80::/10 link local
+		   ( oIPv6.nHigh >> 32 ) == 0x20010DB8;						// 2001:db8::/32 documentation
+}
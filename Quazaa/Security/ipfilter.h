@@ -0,0 +1,112 @@
+/*
+** $Id$
+**
+** Copyright © Quazaa Development Team, 2009-2013.
+** This file is part of the Quazaa Security Library (quazaa.sourceforge.net)
+**
+** The Quazaa Security Library is free software; this file may be used under the terms of the GNU
+** General Public License version 3.0 or later as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL included in the
+** packaging of this file.
+**
+** The Quazaa Security Library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**
+** Please review the following information to ensure the GNU General Public
+** License version 3.0 requirements will be met:
+** http://www.gnu.org/copyleft/gpl.html.
+**
+** You should have received a copy of the GNU General Public License version
+** 3.0 along with the Quazaa Security Library; if not, write to the Free Software Foundation,
+** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef IPFILTER_H
+#define IPFILTER_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QVector>
+
+#include "NetworkCore/endpoint.h"
+#include "epochreclaimer.h"
+
+class CSecureRule;
+class CIPRule;
+class CIPRangeRule;
+
+// IPv6 address as an unsigned 128 bit number.
+struct CIPv6Key
+{
+	quint64	nHigh;
+	quint64	nLow;
+
+	inline bool operator<(const CIPv6Key& rhs) const
+	{
+		return nHigh < rhs.nHigh || ( nHigh == rhs.nHigh && nLow < rhs.nLow );
+	}
+	inline bool operator<=(const CIPv6Key& rhs) const
+	{
+		return !( rhs < *this );
+	}
+	inline CIPv6Key& operator++()
+	{
+		if ( !++nLow )
+			++nHigh;
+		return *this;
+	}
+};
+
+struct CIPFilterRule
+{
+	CSecureRule*		pRule;		// dereference only with the security manager lock held
+	quint8				nAction;	// RuleAction::None: the rule must be evaluated by CSecurity under its lock
+	mutable QAtomicInt	nHits;		// hits not yet added to pRule, see CSecurity::collectFilterHits()
+};
+
+// One interval of the filter, nStart to nEnd inclusive.
+template <typename T>
+struct CIPFilterEntry
+{
+	T				nStart;
+	T				nEnd;
+	CIPFilterRule	oRule;
+};
+
+// Immutable, compiled form of the IP and IP range rules of the Security Manager. The intervals of
+// all rules are flattened into sorted, non overlapping arrays, so lookups need no lock and no
+// allocation. CSecurity publishes a new filter whenever the address rules change, readers keep
+// theirs alive through an epoch (see CEpochReclaimer).
+class CIPFilter
+{
+public:
+	typedef CIPFilterEntry<quint32>		Entry4;
+	typedef CIPFilterEntry<CIPv6Key>	Entry6;
+
+	enum { IndexBits = 16, IndexShift = 32 - IndexBits };
+
+	QVector<Entry4>		m_lEntries4;	// sorted by nStart
+	QVector<quint32>	m_lIndex4;		// per /16: number of entries starting below it, with an end marker
+	QVector<Entry6>		m_lEntries6;	// sorted by nStart
+	int					m_nRetired;		// epoch it was replaced in
+
+public:
+	CIPFilter();
+
+	void compile(const QList<CIPRangeRule*>& lRanges, const QList<CIPRule*>& lIPs);
+
+	const CIPFilterRule* find(quint32 nIP) const;
+	const CIPFilterRule* find(const CIPv6Key& oIP) const;
+
+	static quint8 action(const CSecureRule* pRule);
+	static bool toKey(const CEndPoint& oAddress, quint32& nIPv4, CIPv6Key& oIPv6);	// true for IPv4 and IPv4 mapped addresses
+	static bool isPrivate(const CEndPoint& oAddress);
+	static bool isPrivate(quint32 nIPv4);
+	static bool isPrivate(const CIPv6Key& oIPv6);
+};
+
+// Holds a filter for the lifetime of the object
+typedef CEpochRef<CIPFilter> CIPFilterRef;
+
+#endif // IPFILTER_H
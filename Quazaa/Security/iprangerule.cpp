@@ -16,6 +16,13 @@ CEndPoint CIPRangeRule::endIP() const
 	return m_oEndIP;
 }
 
+void CIPRangeRule::setRange(const CEndPoint& oStartIP, const CEndPoint& oEndIP)
+{
+	m_oStartIP = oStartIP;
+	m_oEndIP = oEndIP;
+	m_sContent = QString("%1-%2").arg(oStartIP.toString()).arg(oEndIP.toString());
+}
+
 CSecureRule* CIPRangeRule::getCopy() const
 {
 	return new CIPRangeRule( *this );
@@ -14,6 +14,7 @@ public:
 
 	CEndPoint startIP() const;
 	CEndPoint endIP() const;
+	void setRange(const CEndPoint& oStartIP, const CEndPoint& oEndIP);
 
 	bool parseContent(const QString& sContent);
 
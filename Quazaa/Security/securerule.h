@@ -117,7 +117,7 @@ public:
 	bool	isBeingRemoved();
 
 	// Hit count control
-	void     count();
+	void     count(int nHits = 1);
 	void     resetCount();
 	quint32  getTodayCount() const;
 	quint32  getTotalCount() const;
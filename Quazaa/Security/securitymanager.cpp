@@ -22,16 +22,19 @@
 ** Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#include <math.h>
+#include <algorithm>
 
 #include <QDir>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMetaType>
 
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
 
 #include "securitymanager.h"
+#include "blocklistparser.h"
 
 #include "quazaaglobals.h"
 #include "quazaasettings.h"
@@ -61,8 +64,9 @@ bool IPLessThan(const CIPRule *rule1, const CIPRule *rule2)
 CSecurity::CSecurity() :
 	m_pSection(QMutex::Recursive),
 	m_bIsLoading( false ),
+	m_pFilter( new CIPFilter() ),
+	m_bFilterDirty( false ),
 	m_bLogIPCheckHits( false ),
-	m_bUseMissCache( false ),
 	m_bNewRulesLoaded( false ),
 	m_nPendingOperations( 0 ),
 	m_nMaxUnsavedRules( 100 ),
@@ -77,6 +81,8 @@ CSecurity::CSecurity() :
   */
 CSecurity::~CSecurity()
 {
+	delete m_pFilter.loadAcquire();
+	qDeleteAll( m_lRetiredFilters );
 }
 
 /**
@@ -147,12 +153,10 @@ bool CSecurity::add(CSecureRule* pRule)
 			}
 		}
 
+		invalidateFilter();
 		m_lIPs.prepend(pNewRule);
 
 		bNewAddress = true;
-
-		if ( !m_bUseMissCache )
-			evaluateCacheUsage();
 	}
 	break;
 
@@ -230,12 +234,10 @@ bool CSecurity::add(CSecureRule* pRule)
 			}
 		}
 
+		invalidateFilter();
 		m_lIPRanges.prepend( pNewRule );
 
 		bNewAddress = true;
-
-		if ( !m_bUseMissCache )
-			evaluateCacheUsage();
 	}
 	break;
 	case RuleType::Hash:
@@ -403,23 +405,6 @@ bool CSecurity::add(CSecureRule* pRule)
 		remove( pExRule );
 	m_lRules.append( pRule );
 
-	// If an address rule is added, the miss cache is cleared either in whole or just the relevant
-	// address.
-	if ( type == RuleType::IPAddress )
-	{
-		m_lsCache.remove( qHash( ((CIPRule*)pRule)->IP() ) );
-
-		if ( !m_bUseMissCache )
-			evaluateCacheUsage();
-	}
-	else if ( type == RuleType::IPAddressRange )
-	{
-		missCacheClear();
-
-		if ( !m_bUseMissCache )
-			evaluateCacheUsage();
-	}
-
 	if ( bNewAddress )	// only add IP, IP range and country rules to the queue
 	{
 		m_lqNewAddressRules.enqueue( pRule->getCopy() );
@@ -446,6 +431,7 @@ bool CSecurity::add(CSecureRule* pRule)
 			qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
 		if(pRule->type() == RuleType::IPAddressRange)
 			qSort(m_lIPRanges.begin(), m_lIPRanges.end(), IPRangeLessThan);
+		updateFilter();
 		sanityCheck();
 		save();
 	}
@@ -459,6 +445,9 @@ bool CSecurity::add(CSecureRule* pRule)
   */
 void CSecurity::clear()
 {
+	QMutexLocker locker(&m_pSection);
+
+	invalidateFilter();
 	m_lIPs.clear();
 	m_lIPRanges.clear();
 	m_lmmHashes.clear();
@@ -487,7 +476,7 @@ void CSecurity::clear()
 		pRule = m_lqNewHitRules.dequeue();
 		delete pRule;
 	}
-	missCacheClear();
+	updateFilter();
 
 	m_nUnsaved.fetchAndStoreRelaxed( 0 );
 }
@@ -513,6 +502,7 @@ void CSecurity::ban(const CEndPoint& oAddress, quint32 nRuleTime, bool bMessage,
 	CIPRule* pRule = isInAddressRules(oAddress);
 	if ( pRule ) // If rule exists, add time on to ban
 	{
+		const quint8 nFilterAction = CIPFilter::action( pRule );
 		pRule->m_bAutomatic = bAutomatic;
 
 		if ( pRule->m_nAction == RuleAction::Deny )
@@ -587,6 +577,14 @@ void CSecurity::ban(const CEndPoint& oAddress, quint32 nRuleTime, bool bMessage,
 				}
 			}
 
+			// Extending an automatic ban does not change the compiled filter.
+			if ( CIPFilter::action( pRule ) != nFilterAction )
+			{
+				invalidateFilter();
+				if ( !m_bIsLoading )
+					updateFilter();
+			}
+
 			hit(pRule);
 
 			return;
@@ -690,6 +688,7 @@ void CSecurity::ban(const CEndPoint& oAddress, quint32 nRuleTime, bool bMessage,
 
 	if(result) {
 		qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
+		updateFilter();
 		sanityCheck();
 	}
 }
@@ -781,100 +780,71 @@ bool CSecurity::isNewlyDenied(const CQueryHit* pHit, const QList<QString>& lQuer
 
 /**
   * Checks an IP against the security database. Writes a message to the system log if LogIPCheckHits
-  * is true.
-  * Locking: R (+ RW while/if new IP is added to miss cache)
+  * is true. The address is looked up in the compiled filter, so this does not lock unless the
+  * matching rule is a single IP rule that expires or is extended automatically.
+  * Locking: / (+ RW for timed and automatic IP rules)
   */
 bool CSecurity::isDenied(const CEndPoint &oAddress)
 {
-	QMutexLocker locker(&m_pSection);
 	if ( oAddress.isNull() )
 		return true;
 
-	const quint32 tNow = common::getTNowUTC();
-
-	// First, check the miss cache if the IP is not included in the list of rules.
-	// If the address is in cache, it is a miss and no further lookup is needed.
-	if ( m_bUseMissCache )
-	{
-		if(m_lsCache.contains( qHash( oAddress ) ))
-		{
-			if ( m_bLogIPCheckHits )
-			{
-				systemLog.postLog( LogSeverity::Security,
-						 Components::Security,
-						 tr( "Skipped repeat IP security check for %s (%i IPs cached)")
-						.arg( oAddress.toString(), m_lsCache.size() ) );
-			}
+	quint32 nIPv4 = 0;
+	CIPv6Key oIPv6;
+	const bool bIPv4 = CIPFilter::toKey( oAddress, nIPv4, oIPv6 );
 
-			return m_bDenyPolicy;
-		}
-	}
-	else if ( m_bLogIPCheckHits )
+	if ( m_bLogIPCheckHits )
 	{
 		systemLog.postLog( LogSeverity::Security,
 				 Components::Security,
-				 tr( "Called first-time IP security check for %s"
-					 ).arg( oAddress.toString() )
-//					+ tr( " ( Call source: %s)" ).arg( source )
-				 );
+				 tr( "Called IP security check for %1" ).arg( oAddress.toString() ) );
 	}
 
-	// Second, if quazaa local/private blocking is turned on, check if the IP is local/private
-	if( quazaaSettings.Security.IgnorePrivateIP )
+	// First, if quazaa local/private blocking is turned on, check if the IP is local/private
+	if ( quazaaSettings.Security.IgnorePrivateIP )
 	{
-		if(isPrivate( oAddress ))
+		if ( bIPv4 ? CIPFilter::isPrivate( nIPv4 ) : CIPFilter::isPrivate( oIPv6 ) )
 		{
 			systemLog.postLog( LogSeverity::Security,
 					 Components::Security,
-					 tr( "Local/Private IP denied: %s" ).arg( oAddress.toString() ) );
+					 tr( "Local/Private IP denied: %1" ).arg( oAddress.toString() ) );
 			return true;
 		}
 	}
 
-	// Third, check whether the IP is contained within one of the IP range rules
-	CIPRangeRule* pIPRangeRule = isInAddressRangeRules( oAddress );
+	// Second, look the IP up in the compiled IP and IP range rules
+	const CIPFilterRef pFilter( filter() );
+	const CIPFilterRule* pMatch = bIPv4 ? pFilter->find( nIPv4 ) : pFilter->find( oIPv6 );
 
-	if(pIPRangeRule)
-	{
-		hit( pIPRangeRule );
+	if ( !pMatch )
+		return m_bDenyPolicy;
 
-		if ( pIPRangeRule->m_nAction == RuleAction::Accept )
-			return false;
-		else if ( pIPRangeRule->m_nAction == RuleAction::Deny )
-			return true;
-		else
-			Q_ASSERT( pIPRangeRule->m_nAction == RuleAction::None );
+	if ( pMatch->nAction == RuleAction::None )
+	{
+		QMutexLocker locker(&m_pSection);
+		return isDeniedByRules( oAddress );
 	}
 
-	// Fourth, check whether the IP is contained within one of the single IP rules
-	CIPRule* pIPRule = isInAddressRules( oAddress );
+	// Added to the rule by collectFilterHits()
+	pMatch->nHits.ref();
+	m_nFilterHits.ref();
 
-	if ( pIPRule )
-	{
-		if(pIPRule->m_bAutomatic) {
-			if(pIPRule->getExpiryTime() != RuleTime::Special) // If rule isn't forever or session
-				ban(pIPRule->IP(), 10, false, pIPRule->m_sComment); // Add 30 seconds to the rule time for every hit.
-		} else {
-			if ( !pIPRule->isExpired( tNow ) && pIPRule->match( oAddress ) )
-			{
-				hit( pIPRule );
-
-				if ( pIPRule->m_nAction == RuleAction::Accept )
-					return false;
-				else if ( pIPRule->m_nAction == RuleAction::Deny )
-					return true;
-				else
-					Q_ASSERT( pIPRule->m_nAction == RuleAction::None );
-			}
-		}
-	}
+	return pMatch->nAction == RuleAction::Deny;
+}
 
-	// If the IP is not within the rules (and we're using the cache),
-	// add the IP to the miss cache.
-	missCacheAdd( qHash( oAddress ) );
+/**
+  * Checks a batch of addresses, e.g. a whole host cache on startup.
+  * Locking: / (+ RW for timed and automatic IP rules)
+  */
+void CSecurity::checkDenied(const QVector<CEndPoint>& lAddresses, QBitArray& oDenied)
+{
+	oDenied.fill( false, lAddresses.size() );
 
-	// In this case, return our default policy
-	return m_bDenyPolicy;
+	for ( int i = 0; i < lAddresses.size(); ++i )
+	{
+		if ( isDenied( lAddresses.at( i ) ) )
+			oDenied.setBit( i );
+	}
 }
 
 /**
@@ -891,60 +861,13 @@ bool CSecurity::isDenied(const CQueryHit* const pHit, const QList<QString> &lQue
 			 isDenied( lQuery, pHit->m_sDescriptiveName ) ); // test regex
 }
 
+/**
+  * Returns true for local, private and reserved addresses.
+  * Locking: /
+  */
 bool CSecurity::isPrivate(const CEndPoint &oAddress)
 {
-	if( oAddress <= CEndPoint("0.255.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("10.0.0.0") &&
-	  oAddress <= CEndPoint("10.255.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("100.64.0.0") &&
-	  oAddress <= CEndPoint("100.127.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("127.0.0.0") &&
-	  oAddress <= CEndPoint("127.255.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("169.254.0.0") &&
-	  oAddress <= CEndPoint("169.254.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("172.16.0.0") &&
-	  oAddress <= CEndPoint("172.31.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("192.0.0.0") &&
-	  oAddress <= CEndPoint("192.0.2.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("192.0.2.0") &&
-	  oAddress <= CEndPoint("10.255.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("192.168.0.0") &&
-	  oAddress <= CEndPoint("192.168.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("198.18.0.0") &&
-	  oAddress <= CEndPoint("198.19.255.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("198.51.100.0") &&
-	  oAddress <= CEndPoint("198.51.100.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("203.0.113.0") &&
-	  oAddress <= CEndPoint("203.0.113.255") )
-		return true;
-
-	if( oAddress >= CEndPoint("240.0.0.0") &&
-	  oAddress <= CEndPoint("255.255.255.255") )
-		return true;
-
-	return false;
+	return CIPFilter::isPrivate( oAddress );
 }
 
 CIPRule *CSecurity::isInAddressRules(const CEndPoint nIp)
@@ -1194,7 +1117,6 @@ bool CSecurity::start()
 	// Set up interval timed cleanup operations.
 	m_tMaintenance = new QTimer(this);
 	connect(m_tMaintenance, SIGNAL(timeout()), SLOT(expire()));
-	connect(m_tMaintenance, SIGNAL(timeout()), SLOT(missCacheClear()));
 	m_tMaintenance->start(1000);
 
 	connect( &quazaaSettings, SIGNAL( securitySettingsChanged() ), SLOT( settingsChanged() ) );
@@ -1306,6 +1228,7 @@ bool CSecurity::load( QString sPath )
 		// If necessary perform sanity check after loading.
 		qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
 		qSort(m_lIPRanges.begin(), m_lIPRanges.end(), IPRangeLessThan);
+		updateFilter();
 		sanityCheck();
 
 		m_bIsLoading = false;
@@ -1430,6 +1353,7 @@ bool CSecurity::fromXML(const QString& sPath)
 
 	systemLog.postLog( LogSeverity::Security,
 			 Components::Security, tr( "Importing security rules from file: " ) + sPath );
+	emit updateLoadMax( oFile.size() );
 
 	float nVersion;
 
@@ -1458,6 +1382,12 @@ bool CSecurity::fromXML(const QString& sPath)
 	CSecureRule* pRule = NULL;
 	unsigned int nRuleCount = 0;
 
+	// IP and IP range rules are added in bulk once the whole file has been read
+	QList<CSecureRule*> lAddressRules;
+
+	QElapsedTimer tProgress;
+	tProgress.start();
+
 	// For all rules do:
 	while ( !xmlDocument.atEnd() )
 	{
@@ -1472,13 +1402,18 @@ bool CSecurity::fromXML(const QString& sPath)
 
 			if ( pRule )
 			{
-				if ( !pRule->isExpired( tNow ) )
+				if ( pRule->isExpired( tNow ) )
 				{
-					add( pRule );
+					delete pRule;
+				}
+				else if ( pRule->type() == RuleType::IPAddress ||
+						  pRule->type() == RuleType::IPAddressRange )
+				{
+					lAddressRules.append( pRule );
 				}
 				else
 				{
-					delete pRule;
+					add( pRule );
 				}
 				pRule = NULL;
 				++nRuleCount;
@@ -1496,13 +1431,23 @@ bool CSecurity::fromXML(const QString& sPath)
 					 tr( "Unrecognized entry in XML file with name: " ) +
 					 xmlDocument.name().toString() );
 		}
-		qApp->processEvents(QEventLoop::AllEvents, 50);
+
+		if ( tProgress.elapsed() >= 50 )
+		{
+			emit updateLoadProgress( oFile.pos() );
+			qApp->processEvents( QEventLoop::ExcludeUserInputEvents, 50 );
+			tProgress.restart();
+		}
 	}
 
+	emit updateLoadProgress( oFile.size() );
+	addImported( lAddressRules );
+
 	m_bIsLoading = false;
 
 	qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
 	qSort(m_lIPRanges.begin(), m_lIPRanges.end(), IPRangeLessThan);
+	updateFilter();
 	sanityCheck();
 	save();
 
@@ -1512,61 +1457,134 @@ bool CSecurity::fromXML(const QString& sPath)
 	return nRuleCount != 0;
 }
 
+/**
+  * Imports a P2P format blocklist. The file is mapped and split at line boundaries; each part is
+  * parsed, sorted and merged by its own thread. The merged ranges are then added in bulk.
+  * Locking: RW
+  */
 bool CSecurity::fromP2P(const QString &sFile)
 {
-	QFile file(sFile);
+	QFile oFile( sFile );
 
-	if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+	if ( !oFile.open( QIODevice::ReadOnly ) )
 		return false;
-	emit updateLoadMax(file.size());
 
-	m_bIsLoading = true;
+	QByteArray baFile;
+	qint64 nLength = oFile.size();
+	const char* pFile = nLength ? (const char*)oFile.map( 0, nLength ) : NULL;
+
+	if ( !pFile )
+	{
+		baFile = oFile.readAll();
+		pFile = baFile.constData();
+		nLength = baFile.size();
+	}
+
+	systemLog.postLog( LogSeverity::Security,
+			 Components::Security, tr( "Importing security rules from file: " ) + sFile );
+	emit updateLoadMax( nLength );
+
+	// Split the file at line boundaries, one part per core but none smaller than MinPartSize
+	const int nParts = qBound( 1, int( nLength / CBlocklistParser::MinPartSize ) + 1,
+							   qMax( 1, QThread::idealThreadCount() ) );
+	QAtomicInt nProgress;
+	QList<CBlocklistParser*> lParsers;
+	const char* pBegin = pFile;
+	const char* pEnd = pFile + nLength;
+
+	for ( int i = 0; i < nParts; ++i )
+	{
+		const char* pSplit = ( i == nParts - 1 ) ? pEnd : pFile + nLength * ( i + 1 ) / nParts;
+
+		while ( pSplit > pBegin && pSplit < pEnd && pSplit[-1] != '\n' )
+			++pSplit;
 
-	int iGuiThrottle = 0;
-	QTextStream import(&file);
-	while (!import.atEnd()) {
-		QString line = import.readLine();
-		emit updateLoadProgress(import.pos());
+		CBlocklistParser* pParser = new CBlocklistParser( pFile, pBegin, pSplit, &nProgress );
+		lParsers.append( pParser );
+		pParser->start();
 
-		if(!line.isEmpty() && !line.startsWith("#") && line.contains(":"))
+		pBegin = pSplit;
+	}
+
+	// Progress is reported in batches while the parsers run
+	foreach ( CBlocklistParser* pParser, lParsers )
+	{
+		while ( !pParser->wait( 50 ) )
 		{
-			QStringList arguments = line.split(":");
-			QString comment = arguments.at(0);
-			QString rule = arguments.at(1);
-			CSecureRule* pRule;
+			emit updateLoadProgress( nProgress.loadAcquire() );
+			qApp->processEvents( QEventLoop::ExcludeUserInputEvents, 50 );
+		}
+	}
 
-			QStringList addresses = rule.split("-");
+	// The parts are sorted and follow each other in the file, merge them into one list
+	QVector<CBlocklistRange> lRanges;
+	quint32 nInvalid = 0;
 
-			if(addresses.at(0) == addresses.at(1)) {
-				rule = addresses.at(0);
-				pRule = new CIPRule();
-			} else {
-				pRule = new CIPRangeRule();
-			}
+	foreach ( CBlocklistParser* pParser, lParsers )
+	{
+		const int nMiddle = lRanges.size();
+		lRanges += pParser->m_lRanges;
+		std::inplace_merge( lRanges.begin(), lRanges.begin() + nMiddle, lRanges.end(),
+							CBlocklistParser::lessThan );
+		nInvalid += pParser->m_nInvalid;
+	}
+	qDeleteAll( lParsers );
 
-			if( !pRule->parseContent(rule) )
-				break;
+	CBlocklistParser::merge( lRanges );
+	emit updateLoadProgress( nLength );
 
-			pRule->m_sComment = comment;
+	// Ranges already denied by a single existing rule are skipped
+	QList<CSecureRule*> lRules;
+	lRules.reserve( lRanges.size() );
+	{
+		const CIPFilterRef pFilter( filter() );
+
+		for ( int i = 0; i < lRanges.size(); ++i )
+		{
+			const CBlocklistRange& oRange = lRanges.at( i );
+			const CIPFilterRule* pExisting = pFilter->find( oRange.nStart );
+
+			if ( pExisting && pExisting == pFilter->find( oRange.nEnd ) &&
+				 pExisting->nAction == RuleAction::Deny )
+				continue;
+
+			CSecureRule* pRule;
+			if ( oRange.nStart == oRange.nEnd )
+			{
+				CIPRule* pIPRule = new CIPRule();
+				pIPRule->setIP( CEndPoint( oRange.nStart ) );
+				pRule = pIPRule;
+			}
+			else
+			{
+				CIPRangeRule* pRangeRule = new CIPRangeRule();
+				pRangeRule->setRange( CEndPoint( oRange.nStart ), CEndPoint( oRange.nEnd ) );
+				pRule = pRangeRule;
+			}
+
+			pRule->m_sComment = QString::fromUtf8( pFile + oRange.nComment, oRange.nCommentLength );
 			pRule->m_nAction = RuleAction::Deny;
 			pRule->setForever(true);
 			pRule->m_bAutomatic = false;
 
-			add( pRule );
-		}
-		++iGuiThrottle;
-		if(iGuiThrottle == 50) {
-			qApp->processEvents(QEventLoop::AllEvents, 50);
-			iGuiThrottle = 0;
+			lRules.append( pRule );
 		}
 	}
+
+	m_bIsLoading = true;
+	const int nRuleCount = addImported( lRules );
 	m_bIsLoading = false;
 
 	qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
 	qSort(m_lIPRanges.begin(), m_lIPRanges.end(), IPRangeLessThan);
+	updateFilter();
 	sanityCheck();
 	save();
 
+	systemLog.postLog( LogSeverity::Security,
+			 Components::Security, tr( "%1 Rules imported, %2 invalid lines skipped." )
+			 .arg( nRuleCount ).arg( nInvalid ) );
+
 	return true;
 }
 
@@ -1708,6 +1726,8 @@ void CSecurity::expire()
 	const quint32 tNow = common::getTNowUTC();
 	quint16 nCount = 0;
 
+	collectFilterHits();
+
 	int j, i = 0;
 	while (  i < m_lRules.size() )
 	{
@@ -1728,19 +1748,11 @@ void CSecurity::expire()
 	if(nCount > 0)
 		systemLog.postLog( LogSeverity::Security,
 				 Components::Security, QString::number( nCount ) + " rules expired." );
-}
 
-/**
-  * Qt slot. Clears the miss cache.
-  * Locking: RW
-  */
-void CSecurity::missCacheClear()
-{
-	QMutexLocker locker(&m_pSection);
-	m_lsCache.clear();
-
-	if ( !m_bUseMissCache )
-		evaluateCacheUsage();
+	// Removed rules, like the expired ones above, leave the filter here
+	if ( !m_bIsLoading )
+		updateFilter();
+	reclaimFilters();
 }
 
 /**
@@ -1874,6 +1886,7 @@ void CSecurity::remove(CSecureRule* pRule)
 		{
 		case RuleType::IPAddress:
 		{
+			invalidateFilter();
 			for (int i = 0; i < m_lIPs.size(); ++i) {
 				if ( m_lIPs.at(i)->m_oUUID == pRule->m_oUUID ) {
 					m_lIPs.removeAt(i);
@@ -1885,15 +1898,13 @@ void CSecurity::remove(CSecureRule* pRule)
 
 		case RuleType::IPAddressRange:
 		{
+			invalidateFilter();
 			for (int i = 0; i < m_lIPRanges.size(); ++i) {
 			if ( m_lIPRanges.at(i)->m_oUUID == pRule->m_oUUID ) {
 					m_lIPRanges.removeAt(i);
 					break;
 				}
 			}
-
-			if ( m_bUseMissCache )
-				evaluateCacheUsage();
 		}
 		break;
 
@@ -1984,6 +1995,37 @@ void CSecurity::remove(CSecureRule* pRule)
 	}
 }
 
+/**
+  * Call this after changing the content, action or expiry time of a rule that has already been
+  * added.
+  * Locking: RW
+  */
+void CSecurity::update(CSecureRule* pRule)
+{
+	QMutexLocker locker(&m_pSection);
+
+	switch ( pRule->type() )
+	{
+	case RuleType::IPAddress:
+		invalidateFilter();
+		qSort(m_lIPs.begin(), m_lIPs.end(), IPLessThan);
+		break;
+
+	case RuleType::IPAddressRange:
+		invalidateFilter();
+		qSort(m_lIPRanges.begin(), m_lIPRanges.end(), IPRangeLessThan);
+		break;
+
+	default:
+		break;
+	}
+
+	if ( !m_bIsLoading )
+		updateFilter();
+
+	m_nUnsaved.fetchAndAddRelaxed( 1 );
+}
+
 bool CSecurity::isAgentDenied(const QString& sUserAgent)
 {
 	if ( sUserAgent.isEmpty() )
@@ -2010,53 +2052,249 @@ bool CSecurity::isAgentDenied(const QString& sUserAgent)
 	return false;
 }
 
-void CSecurity::missCacheAdd(const uint &nIP)
+/**
+  * Adds imported IP and IP range rules in batches, skipping the conflict checks of add() which are
+  * linear in the number of rules. A rule with the UUID of an existing rule replaces it unless both
+  * are the same; like in add(), a single IP rule also replaces an existing rule for its address.
+  * Unlike add(), range rules overlapping existing ranges are neither merged nor replaced; the
+  * compiled filter resolves the overlap by letting the range starting first win.
+  * The caller sets m_bIsLoading, sorts the lists and calls updateFilter() afterwards.
+  * Locking: RW (per batch)
+  */
+int CSecurity::addImported(const QList<CSecureRule*>& lRules)
 {
-	QMutexLocker locker(&m_pSection);
-	if ( m_bUseMissCache )
+	const int nBatch = 4096;
+	QHash<QUuid, CSecureRule*> lRulesByUUID;
+	QHash<CEndPoint, CIPRule*> lIPsByAddress;
+	int nAdded = 0;
+
+	m_pSection.lock();
+	lRulesByUUID.reserve( m_lRules.size() + lRules.size() );
+	foreach ( CSecureRule* pRule, m_lRules )
+	{
+		lRulesByUUID.insert( pRule->m_oUUID, pRule );
+	}
+	foreach ( CIPRule* pRule, m_lIPs )
 	{
-		m_lsCache.insert( nIP );
-		evaluateCacheUsage();
+		lIPsByAddress.insert( pRule->IP(), pRule );
 	}
+	m_pSection.unlock();
+
+	for ( int i = 0; i < lRules.size(); )
+	{
+		QMutexLocker locker(&m_pSection);
+		invalidateFilter();
+
+		for ( const int nEnd = qMin( i + nBatch, lRules.size() ); i < nEnd; ++i )
+		{
+			CSecureRule* pRule = lRules.at( i );
+			CSecureRule* pExRule = lRulesByUUID.value( pRule->m_oUUID );
+
+			if ( pExRule )
+			{
+				if ( pExRule->type() == pRule->type() &&
+					 pExRule->m_nAction == pRule->m_nAction &&
+					 pExRule->isForever() == pRule->isForever() &&
+					 pExRule->getExpiryTime() == pRule->getExpiryTime() &&
+					 pExRule->getContentString() == pRule->getContentString() )
+				{
+					delete pRule;
+					continue;
+				}
+
+				if ( pExRule->type() == RuleType::IPAddress &&
+					 lIPsByAddress.value( ((CIPRule*)pExRule)->IP() ) == pExRule )
+				{
+					lIPsByAddress.remove( ((CIPRule*)pExRule)->IP() );
+				}
+				remove( pExRule );
+			}
+
+			if ( pRule->type() == RuleType::IPAddress )
+			{
+				// the UUIDs differ at this point, so add() would replace the old rule as well
+				CIPRule* pOldRule = lIPsByAddress.value( ((CIPRule*)pRule)->IP() );
+				if ( pOldRule )
+				{
+					lRulesByUUID.remove( pOldRule->m_oUUID );
+					remove( pOldRule );
+				}
+				lIPsByAddress.insert( ((CIPRule*)pRule)->IP(), (CIPRule*)pRule );
+			}
+			lRulesByUUID.insert( pRule->m_oUUID, pRule );
+
+			if ( pRule->type() == RuleType::IPAddress )
+				m_lIPs.append( (CIPRule*)pRule );
+			else
+				m_lIPRanges.append( (CIPRangeRule*)pRule );
+
+			m_lRules.append( pRule );
+			m_lqNewAddressRules.enqueue( pRule->getCopy() );
+			m_nUnsaved.fetchAndAddRelaxed( 1 );
+
+			emit ruleAdded( pRule );
+			++nAdded;
+		}
+
+		locker.unlock();
+		qApp->processEvents( QEventLoop::ExcludeUserInputEvents, 50 );
+	}
+
+	return nAdded;
+}
+
+/**
+  * Marks the compiled filter as outdated. Call this before changing or removing IP and IP range
+  * rules: once the filter is dirty, its rule pointers are no longer dereferenced.
+  * Requires Locking: RW
+  */
+void CSecurity::invalidateFilter()
+{
+	if ( !m_bFilterDirty )
+	{
+		collectFilterHits();
+		m_bFilterDirty = true;
+	}
+}
+
+/**
+  * Returns a reference to the current filter. Never blocks, the caller is only counted in the
+  * current epoch of m_oFilterEpochs.
+  * Locking: /
+  */
+CIPFilterRef CSecurity::filter()
+{
+	return CIPFilterRef( &m_oFilterEpochs, m_pFilter );
 }
 
-void CSecurity::evaluateCacheUsage()
+/**
+  * Compiles and publishes a new filter if the IP or IP range rules have changed. Readers still
+  * holding the old filter keep using it until reclaimFilters() frees it.
+  * Locking: RW
+  */
+void CSecurity::updateFilter()
 {
-	double nCache		= m_lsCache.size();
-	double nIPMap		= m_lIPs.size();
+	QMutexLocker locker(&m_pSection);
 
-	static const double log2	= log( 2.0 );
+	if ( !m_bFilterDirty )
+		return;
 
-	static double s_nCache		= 0;
-	static double s_nLogCache	= 0;
+	CIPFilter* pFilter = new CIPFilter();
+	pFilter->compile( m_lIPRanges, m_lIPs );
 
-	static double s_nIPMap		= -1;
-	static double s_nLogMult	= 0;
+	m_bFilterDirty = false;
 
-	// Only do the heavy log operations if necessary.
-	if ( s_nCache != nCache )
+	CIPFilter* pOld = m_pFilter.fetchAndStoreOrdered( pFilter );
+	pOld->m_nRetired = m_oFilterEpochs.epoch();
+	m_lRetiredFilters.append( pOld );
+}
+
+/**
+  * Frees retired filters once the epoch has moved on far enough that no reader can still use them.
+  * Requires Locking: RW
+  */
+void CSecurity::reclaimFilters()
+{
+	if ( m_lRetiredFilters.isEmpty() )
+		return;
+
+	m_oFilterEpochs.advance();
+
+	for ( QList<CIPFilter*>::iterator itOld = m_lRetiredFilters.begin(); itOld != m_lRetiredFilters.end(); )
 	{
-		s_nCache    = nCache;
+		if ( m_oFilterEpochs.isSafe( (*itOld)->m_nRetired ) )
+		{
+			delete *itOld;
+			itOld = m_lRetiredFilters.erase( itOld );
+		}
+		else
+		{
+			++itOld;
+		}
+	}
+}
+
+/**
+  * Adds the hits counted by the filter to the rules. Hits on retired or dirty filters are lost, as
+  * their rules might have been deleted.
+  * Requires Locking: RW
+  */
+void CSecurity::collectFilterHits()
+{
+	if ( m_bFilterDirty || !m_nFilterHits.fetchAndStoreRelaxed( 0 ) )
+		return;
+
+	CIPFilter* pFilter = m_pFilter.loadAcquire();
 
-		if ( !nCache )
-			nCache = 1;
+	for ( int i = 0; i < pFilter->m_lEntries4.size(); ++i )
+	{
+		const CIPFilterRule& oRule = pFilter->m_lEntries4.at( i ).oRule;
+		const int nHits = oRule.nHits.fetchAndStoreRelaxed( 0 );
 
-		s_nLogCache = log( nCache );
+		if ( nHits && !oRule.pRule->isBeingRemoved() )
+			oRule.pRule->count( nHits );
 	}
 
-	// Only do the heavy log operations if necessary.
-	if ( s_nIPMap != nIPMap
-		 )
+	for ( int i = 0; i < pFilter->m_lEntries6.size(); ++i )
+	{
+		const CIPFilterRule& oRule = pFilter->m_lEntries6.at( i ).oRule;
+		const int nHits = oRule.nHits.fetchAndStoreRelaxed( 0 );
+
+		if ( nHits && !oRule.pRule->isBeingRemoved() )
+			oRule.pRule->count( nHits );
+	}
+
+	emit securityHit();
+}
+
+/**
+  * Checks an IP against the IP range and single IP rules, for the rules the compiled filter leaves
+  * to the live lists.
+  * Requires Locking: RW
+  */
+bool CSecurity::isDeniedByRules(const CEndPoint& oAddress)
+{
+	const quint32 tNow = common::getTNowUTC();
+
+	// First, check whether the IP is contained within one of the IP range rules
+	CIPRangeRule* pIPRangeRule = isInAddressRangeRules( oAddress );
+
+	if(pIPRangeRule)
 	{
-		s_nIPMap		= nIPMap;
+		hit( pIPRangeRule );
 
-		if ( !nIPMap )
-			nIPMap = 1;
+		if ( pIPRangeRule->m_nAction == RuleAction::Accept )
+			return false;
+		else if ( pIPRangeRule->m_nAction == RuleAction::Deny )
+			return true;
+		else
+			Q_ASSERT( pIPRangeRule->m_nAction == RuleAction::None );
+	}
+
+	// Second, check whether the IP is contained within one of the single IP rules
+	CIPRule* pIPRule = isInAddressRules( oAddress );
 
-		s_nLogMult	= log( nIPMap );
+	if ( pIPRule )
+	{
+		if(pIPRule->m_bAutomatic) {
+			if(pIPRule->getExpiryTime() != RuleTime::Special) // If rule isn't forever or session
+				ban(pIPRule->IP(), 10, false, pIPRule->m_sComment); // Add 30 seconds to the rule time for every hit.
+		} else {
+			if ( !pIPRule->isExpired( tNow ) && pIPRule->match( oAddress ) )
+			{
+				hit( pIPRule );
+
+				if ( pIPRule->m_nAction == RuleAction::Accept )
+					return false;
+				else if ( pIPRule->m_nAction == RuleAction::Deny )
+					return true;
+				else
+					Q_ASSERT( pIPRule->m_nAction == RuleAction::None );
+			}
+		}
 	}
 
-	m_bUseMissCache = ( s_nLogCache < s_nLogMult + m_lIPRanges.size() * log2 );
+	return m_bDenyPolicy;
 }
 
 bool CSecurity::isDenied(const QString& sContent)
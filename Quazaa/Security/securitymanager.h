@@ -25,8 +25,11 @@
 #ifndef SECURITYMANAGER_H
 #define SECURITYMANAGER_H
 
+#include <QAtomicPointer>
+#include <QBitArray>
 #include <QList>
 #include <QQueue>
+#include <QVector>
 #include <QTimer>
 
 // Increment this if there have been made changes to the way of storing security rules.
@@ -37,6 +40,7 @@
 #include "securerule.h"
 #include "contentrule.h"
 #include "hashrule.h"
+#include "ipfilter.h"
 #include "iprangerule.h"
 #include "iprule.h"
 #include "regexprule.h"
@@ -67,9 +71,13 @@ private:
 	QQueue<CSecureRule*>			m_lqNewAddressRules;
 	QList<CSecureRule*>				m_lLoadedHitRules;
 	QQueue<CSecureRule*>			m_lqNewHitRules;
-	QSet<uint>						m_lsCache;				// IP rule miss cache
 	QList<CIPRule*>					m_lIPs;					// single IP blocking rules
 	QList<CIPRangeRule*>			m_lIPRanges;			// multiple IP blocking rules
+	QAtomicPointer<CIPFilter>		m_pFilter;				// m_lIPs and m_lIPRanges compiled for lock free lookups
+	CEpochReclaimer					m_oFilterEpochs;		// readers of m_pFilter
+	QList<CIPFilter*>				m_lRetiredFilters;		// freed once no reader can hold them anymore
+	bool							m_bFilterDirty;			// address rules changed since m_pFilter was compiled
+	QAtomicInt						m_nFilterHits;			// hits counted by m_pFilter but not yet by the rules
 	QMultiMap<uint, CHashRule*>		m_lmmHashes;				// hash rules
 	// Note: Using a multimap eliminates eventual problems of hash
 	// collisions caused by weaker hashes like MD5 for example.
@@ -82,7 +90,6 @@ private:
 #ifdef _DEBUG // use failsafe to abort sanity check only in debug version
 	QUuid							m_idForceEoSC;			// The signalQueue ID (force end of sanity check)
 #endif
-	bool							m_bUseMissCache;
 	bool							m_bNewRulesLoaded;		// true if new rules for sanity check have been loaded.
 	unsigned short					m_nPendingOperations;	// Counts the number of program modules that still need to call back after having finished a requested sanity check operation.
 	quint16							m_nMaxUnsavedRules;		// maximal number of unsaved rules to tolerate before forcing save
@@ -103,12 +110,14 @@ public:
 	bool			check(const CSecureRule* const pRule) const;
 	bool			add(CSecureRule* pRule);
 	void			remove(CSecureRule* pRule);
+	void			update(CSecureRule* pRule);		// Call after modifying an existing rule.
 	void			clear();
 	void			ban(const CEndPoint &oAddress, quint32 nRuleTime, bool bMessage = true, const QString& sComment = "", bool bAutomatic = true, bool bForever = false);
 	// Methods used during sanity check
 	bool			isNewlyDenied(const CEndPoint& oAddress);
 	bool			isNewlyDenied(const CQueryHit* pHit, const QList<QString>& lQuery);
 	bool			isDenied(const CEndPoint& oAddress);
+	void			checkDenied(const QVector<CEndPoint>& lAddresses, QBitArray& oDenied);	// Sets bit i if lAddresses[i] is denied.
 	bool			isDenied(const CQueryHit* const pHit, const QList<QString>& lQuery);	// This does not check for the hit IP to avoid double checking.
 	bool			isPrivate(const CEndPoint &oAddress);
 	CIPRule*		isInAddressRules(const CEndPoint nIp);
@@ -148,7 +157,6 @@ public slots:
 	void			sanityCheckPerformed();		// This slot must be triggered by all listeners to performSanityCheck() once they have completed their work.
 	void			forceEndOfSanityCheck();	// Aborts all currently running sanity checks by clearing their rule lists.
 	void			expire();
-	void			missCacheClear();
 	void			settingsChanged();			// Trigger this slot to inform the security manager about changes in the security settings.
 
 private:	// Sanity check helper methods
@@ -158,8 +166,13 @@ private:	// Sanity check helper methods
 	CHashRule		*getHash(const QList< CHash >& hashes) const;	// this returns the first rule found. Note that there might be others, too.
 	CSecureRule		*getUUID(const QUuid& oUUID) const;
 	bool			isAgentDenied(const QString& sUserAgent);
-	void			missCacheAdd(const uint& nIP);
-	void			evaluateCacheUsage();				// determines whether it is logical to use the cache or not
+	int				addImported(const QList<CSecureRule*>& lRules);
+	void			invalidateFilter();
+	CIPFilterRef	filter();
+	void			updateFilter();
+	void			reclaimFilters();
+	void			collectFilterHits();
+	bool			isDeniedByRules(const CEndPoint& oAddress);
 	bool			isDenied(const QString& sContent);
 	bool			isDenied(const CQueryHit* const pHit);
 	bool			isDenied(const QList<QString>& lQuery, const QString& sContent);
@@ -313,6 +313,8 @@ void CDialogModifyRule::on_pushButtonOK_clicked()
 
 	if(bIsNewRule)
 		securityManager.add(m_pRule);
+	else
+		securityManager.update(m_pRule);
 
 	accept();
 }
@@ -452,6 +452,7 @@ void CWinMain::quazaaShutdown()
 	hostCache.m_pSection.lock();
 	hostCache.save( common::getTNowUTC() );
 	hostCache.m_pSection.unlock();
+	hostCache.waitForSave();
 
 	dlgSplash->updateProgress(30, tr("Removing Tray Icon..."));
 	qApp->processEvents();
@@ -243,6 +243,9 @@ int main(int argc, char *argv[])
 	qApp->processEvents();
 	quazaaSettings.loadProfile();
 
+	//initialize geoip list, the host cache looks up the country of its hosts
+	geoIP.loadGeoIP();
+
 	//Load Host Cache
 	dlgSplash->updateProgress( 30, QObject::tr( "Loading Host Cache..." ) );
 	qApp->processEvents();
@@ -250,9 +253,6 @@ int main(int argc, char *argv[])
 	hostCache.load();
 	hostCache.m_pSection.unlock();
 
-	//initialize geoip list
-	geoIP.loadGeoIP();
-
 	//Load the library
 	dlgSplash->updateProgress( 38, QObject::tr( "Loading Library..." ) );
 	qApp->processEvents();
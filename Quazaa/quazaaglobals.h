@@ -28,6 +28,7 @@
 #include <QObject>
 
 #define LOG_QUERY_HANDLING 0
+#define LOG_ROUTE_TABLE 0
 
 class CQuazaaGlobals : public QObject
 {
@@ -259,6 +259,16 @@ void CQuazaaSettings::saveSettings()
 	m_qSettings.setValue("UdpOutFrames", quazaaSettings.Gnutella2.UdpOutFrames);
 	m_qSettings.setValue("UdpMTU", quazaaSettings.Gnutella2.UdpMTU);
 	m_qSettings.setValue("UdpOutResend", quazaaSettings.Gnutella2.UdpOutResend);
+	m_qSettings.setValue("UdpBatch", quazaaSettings.Gnutella2.UdpBatch);
+	m_qSettings.setValue("UdpQueue", quazaaSettings.Gnutella2.UdpQueue);
+	m_qSettings.setValue("UdpDeflateLevel", quazaaSettings.Gnutella2.UdpDeflateLevel);
+	m_qSettings.setValue("UdpDeflateMemLevel", quazaaSettings.Gnutella2.UdpDeflateMemLevel);
+	m_qSettings.setValue("UdpDictionary", quazaaSettings.Gnutella2.UdpDictionary);
+	m_qSettings.setValue("TcpDeflateLevel", quazaaSettings.Gnutella2.TcpDeflateLevel);
+	m_qSettings.setValue("TcpDeflateMemLevel", quazaaSettings.Gnutella2.TcpDeflateMemLevel);
+	m_qSettings.setValue("RouteTableSize", quazaaSettings.Gnutella2.RouteTableSize);
+	m_qSettings.setValue("QueryRateLimit", quazaaSettings.Gnutella2.QueryRateLimit);
+	m_qSettings.setValue("QueryRouterThreads", quazaaSettings.Gnutella2.QueryRouterThreads);
 	m_qSettings.setValue("HubBalancePeriod", quazaaSettings.Gnutella2.HubBalancePeriod);
 	m_qSettings.setValue("HubBalanceGrace", quazaaSettings.Gnutella2.HubBalanceGrace);
 	m_qSettings.setValue("HubBalanceLow", quazaaSettings.Gnutella2.HubBalanceLow);
@@ -649,7 +659,7 @@ void CQuazaaSettings::loadSettings()
 	quazaaSettings.Gnutella2.HostCount = m_qSettings.value("HostCount", 15).toInt();
 	quazaaSettings.Gnutella2.HostCurrent = m_qSettings.value("HostCurrent", 600).toUInt();
 	quazaaSettings.Gnutella2.HostExpire = m_qSettings.value("HostExpire", 172800).toInt();
-	quazaaSettings.Gnutella2.HubHorizonSize = m_qSettings.value("HubHorizonSize", 128).toInt();
+	quazaaSettings.Gnutella2.HubHorizonSize = m_qSettings.value("HubHorizonSize", 4096).toInt();
 	quazaaSettings.Gnutella2.HubVerified = m_qSettings.value("HubVerified", false).toBool();
 	quazaaSettings.Gnutella2.KHLHubCount = m_qSettings.value("KHLHubCount", 50).toInt();
 	quazaaSettings.Gnutella2.KHLPeriod = m_qSettings.value("KHLPeriod", 60).toInt();
@@ -665,13 +675,23 @@ void CQuazaaSettings::loadSettings()
 	quazaaSettings.Gnutella2.QueryKeyTime = m_qSettings.value("QueryKeyTime", 7200).toUInt(); // 2h
 	quazaaSettings.Gnutella2.QueryLimit = m_qSettings.value("QueryLimit", 2400).toInt();
 	quazaaSettings.Gnutella2.RequeryDelay = m_qSettings.value("RequeryDelay", 1800).toInt();
-	quazaaSettings.Gnutella2.UdpBuffers = m_qSettings.value("UdpBuffers", 1024).toInt(); // fragmented packets use one buffer / fragment
+	quazaaSettings.Gnutella2.UdpBuffers = m_qSettings.value("UdpBuffers", 1024).toInt(); // outgoing packets use one buffer each, incoming fragments go to per-frame slabs
 	quazaaSettings.Gnutella2.UdpInExpire = m_qSettings.value("UdpInExpire", 30).toInt();
 	quazaaSettings.Gnutella2.UdpInFrames = m_qSettings.value("UdpInFrames", 256).toInt();
 	quazaaSettings.Gnutella2.UdpMTU = m_qSettings.value("UdpMTU", 500).toInt();
 	quazaaSettings.Gnutella2.UdpOutExpire = m_qSettings.value("UdpOutExpire", 26).toInt();
 	quazaaSettings.Gnutella2.UdpOutFrames = m_qSettings.value("UdpOutFrames", 512).toInt();
 	quazaaSettings.Gnutella2.UdpOutResend = m_qSettings.value("UdpOutResend", 6).toInt();
+	quazaaSettings.Gnutella2.UdpBatch = m_qSettings.value("UdpBatch", 32).toInt();
+	quazaaSettings.Gnutella2.UdpQueue = m_qSettings.value("UdpQueue", 1024).toInt();
+	quazaaSettings.Gnutella2.UdpDeflateLevel = m_qSettings.value("UdpDeflateLevel", 6).toInt();
+	quazaaSettings.Gnutella2.UdpDeflateMemLevel = m_qSettings.value("UdpDeflateMemLevel", 8).toInt();
+	quazaaSettings.Gnutella2.UdpDictionary = m_qSettings.value("UdpDictionary", false).toBool();
+	quazaaSettings.Gnutella2.TcpDeflateLevel = m_qSettings.value("TcpDeflateLevel", 6).toInt();
+	quazaaSettings.Gnutella2.TcpDeflateMemLevel = m_qSettings.value("TcpDeflateMemLevel", 8).toInt();
+	quazaaSettings.Gnutella2.RouteTableSize = m_qSettings.value("RouteTableSize", 50000).toInt();
+	quazaaSettings.Gnutella2.QueryRateLimit = m_qSettings.value("QueryRateLimit", 60).toInt();
+	quazaaSettings.Gnutella2.QueryRouterThreads = m_qSettings.value("QueryRouterThreads", 0).toInt();
 	quazaaSettings.Gnutella2.HubBalancePeriod = m_qSettings.value("HubBalancePeriod", 60).toUInt();
 	quazaaSettings.Gnutella2.HubBalanceGrace = m_qSettings.value("HubBalanceGrace", 3600).toUInt();
 	quazaaSettings.Gnutella2.HubBalanceLow = m_qSettings.value("HubBalanceLow", 50).toUInt();
@@ -300,7 +300,7 @@ namespace Settings
 		int			HostCount;								// Number of hosts in X-Try-Hubs
 		quint32		HostCurrent;							// Index of current host
 		int			HostExpire;								// Inactive time before a host expires
-		int			HubHorizonSize;
+		int			HubHorizonSize;							// Hubs known through neighbouring hubs (KHL), the pool is allocated at this size
 		bool		HubVerified;							// Verified we are operating as a hub
 		int			KHLHubCount;
 		int			KHLPeriod;
@@ -323,6 +323,16 @@ namespace Settings
 		quint32		UdpOutExpire;							// Time before dropping a UDP connection
 		int			UdpOutFrames;							// UDP protocol out frame size
 		quint32		UdpOutResend;							// Time before resending a UDP protocol packet
+		int			UdpBatch;								// Datagrams moved per system call where batched UDP I/O is available, 1 disables
+		int			UdpQueue;								// Reassembled UDP packets waiting for their handlers before new ones are dropped
+		int			UdpDeflateLevel;						// zlib level for UDP packets (-1 = zlib default, 0-9)
+		int			UdpDeflateMemLevel;						// zlib memLevel for UDP packets (1-9)
+		bool		UdpDictionary;							// Compress UDP packets with the preset G2 dictionary, only peers that know it can read them
+		int			TcpDeflateLevel;						// zlib level for compressed neighbour links and query hash tables
+		int			TcpDeflateMemLevel;						// zlib memLevel for compressed neighbour links and query hash tables
+		int			RouteTableSize;							// Maximum number of GUID routes kept by the network core
+		int			QueryRateLimit;							// Queries per minute routed for one return address, 0 = unlimited
+		int			QueryRouterThreads;						// Threads matching queries against leaf tables, 0 = cores - 1 (at most 4), -1 = none
 		quint32		HubBalancePeriod;
 		quint32		HubBalanceGrace;
 		quint32		HubBalanceLow;